@@ -0,0 +1,519 @@
+#include "art.h"
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "kvs.h"
+
+enum { ART_NODE4, ART_NODE16, ART_NODE48, ART_NODE256 };
+
+// Header of every inner node.
+typedef struct ArtNode {
+    uint8_t type;
+    uint16_t count;                       // children, the terminal apart
+    uint32_t prefix_len;                  // bytes folded into the node, may pass ART_MAX_PREFIX
+    unsigned char prefix[ART_MAX_PREFIX]; // the first of them
+    KeyNode *terminal;                    // key ending at the node, NULL for none
+} ArtNode;
+
+// Node4 and Node16 keep their bytes sorted, Node48 maps a byte to a slot
+// plus one, Node256 is indexed by the byte itself.
+typedef struct ArtNode4 {
+    ArtNode header;
+    unsigned char keys[4];
+    void *children[4];
+} ArtNode4;
+
+typedef struct ArtNode16 {
+    ArtNode header;
+    unsigned char keys[16];
+    void *children[16];
+} ArtNode16;
+
+typedef struct ArtNode48 {
+    ArtNode header;
+    unsigned char slots[256];
+    void *children[48];
+} ArtNode48;
+
+typedef struct ArtNode256 {
+    ArtNode header;
+    void *children[256];
+} ArtNode256;
+
+static int is_leaf(const void *ref) {
+    return ((uintptr_t)ref & 1) != 0;
+}
+
+static void *tag_leaf(const KeyNode *leaf) {
+    return (void *)((uintptr_t)leaf | 1);
+}
+
+static KeyNode *leaf_of(const void *ref) {
+    return (KeyNode *)((uintptr_t)ref & ~(uintptr_t)1);
+}
+
+static size_t min_size(size_t a, size_t b) {
+    return a < b ? a : b;
+}
+
+static int leaf_matches(const KeyNode *leaf, const char *key, size_t len) {
+    return leaf->key_len == len && memcmp(leaf->key, key, len) == 0;
+}
+
+static size_t node_size(uint8_t type) {
+    switch (type) {
+        case ART_NODE4: return sizeof(ArtNode4);
+        case ART_NODE16: return sizeof(ArtNode16);
+        case ART_NODE48: return sizeof(ArtNode48);
+        default: return sizeof(ArtNode256);
+    }
+}
+
+static ArtNode *new_node(ArtTree *tree, Region *region, uint8_t type) {
+    ArtNode *node = region_calloc(region, 1, node_size(type));
+    if (!node) return NULL;
+    node->type = type;
+    tree->memory += node_size(type);
+    tree->nodes++;
+    return node;
+}
+
+static void free_node(ArtTree *tree, Region *region, ArtNode *node) {
+    tree->memory -= node_size(node->type);
+    tree->nodes--;
+    region_free(region, node);
+}
+
+/// Moves the header of a node into a node of another size.
+static void copy_header(ArtNode *to, const ArtNode *from) {
+    to->count = from->count;
+    to->prefix_len = from->prefix_len;
+    memcpy(to->prefix, from->prefix, sizeof(to->prefix));
+    to->terminal = from->terminal;
+}
+
+/// Slot of the child a byte leads to, NULL if there is none.
+static void **find_child(ArtNode *node, unsigned char byte) {
+    switch (node->type) {
+        case ART_NODE4: {
+            ArtNode4 *n = (ArtNode4 *)node;
+            for (int i = 0; i < node->count; i++) {
+                if (n->keys[i] == byte) return &n->children[i];
+            }
+            return NULL;
+        }
+        case ART_NODE16: {
+            ArtNode16 *n = (ArtNode16 *)node;
+#if defined(__SSE2__)
+            // All sixteen bytes compared at once, the slots past count masked out
+            __m128i matches = _mm_cmpeq_epi8(_mm_set1_epi8((char)byte), _mm_loadu_si128((const __m128i *)n->keys));
+            unsigned int mask = (unsigned int)_mm_movemask_epi8(matches) & ((1U << node->count) - 1);
+            return mask != 0 ? &n->children[__builtin_ctz(mask)] : NULL;
+#else
+            for (int i = 0; i < node->count; i++) {
+                if (n->keys[i] == byte) return &n->children[i];
+            }
+            return NULL;
+#endif
+        }
+        case ART_NODE48: {
+            ArtNode48 *n = (ArtNode48 *)node;
+            return n->slots[byte] != 0 ? &n->children[n->slots[byte] - 1] : NULL;
+        }
+        default: {
+            ArtNode256 *n = (ArtNode256 *)node;
+            return n->children[byte] != NULL ? &n->children[byte] : NULL;
+        }
+    }
+}
+
+/// Leaf with the smallest key below a node. The terminal of a node is a
+/// prefix of every key below it.
+static const KeyNode *minimum(const void *ref) {
+    while (!is_leaf(ref)) {
+        const ArtNode *node = ref;
+        if (node->terminal != NULL) return node->terminal;
+        switch (node->type) {
+            case ART_NODE4:
+                ref = ((const ArtNode4 *)node)->children[0];
+                break;
+            case ART_NODE16:
+                ref = ((const ArtNode16 *)node)->children[0];
+                break;
+            case ART_NODE48: {
+                const ArtNode48 *n = (const ArtNode48 *)node;
+                int byte = 0;
+                while (n->slots[byte] == 0) byte++;
+                ref = n->children[n->slots[byte] - 1];
+                break;
+            }
+            default: {
+                const ArtNode256 *n = (const ArtNode256 *)node;
+                int byte = 0;
+                while (n->children[byte] == NULL) byte++;
+                ref = n->children[byte];
+                break;
+            }
+        }
+    }
+    return leaf_of(ref);
+}
+
+/// Number of bytes of the prefix of a node that a key matches from depth,
+/// reading the bytes not kept in the node from a leaf below it.
+static size_t prefix_match(const ArtNode *node, const char *key, size_t len, size_t depth) {
+    size_t limit = min_size(min_size(node->prefix_len, ART_MAX_PREFIX), len - depth);
+    size_t matched = 0;
+    while (matched < limit && node->prefix[matched] == (unsigned char)key[depth + matched]) matched++;
+    if (matched < ART_MAX_PREFIX || node->prefix_len <= ART_MAX_PREFIX) return matched;
+
+    const KeyNode *leaf = minimum(node);
+    limit = min_size(min_size(leaf->key_len, len) - depth, node->prefix_len);
+    while (matched < limit && leaf->key[depth + matched] == key[depth + matched]) matched++;
+    return matched;
+}
+
+/// Adds a child under a byte the node has no child for, moving the node to
+/// the next size when it is full.
+/// @param ref Slot holding the node, updated if it moves.
+/// @return 0 on success, 1 if a bigger node could not be allocated.
+static int add_child(ArtTree *tree, Region *region, void **ref, ArtNode *node, unsigned char byte, void *child) {
+    switch (node->type) {
+        case ART_NODE4:
+        case ART_NODE16: {
+            int capacity = node->type == ART_NODE4 ? 4 : 16;
+            unsigned char *keys = node->type == ART_NODE4 ? ((ArtNode4 *)node)->keys : ((ArtNode16 *)node)->keys;
+            void **children = node->type == ART_NODE4 ? ((ArtNode4 *)node)->children : ((ArtNode16 *)node)->children;
+            if (node->count < capacity) {
+                int position = 0;
+                while (position < node->count && keys[position] < byte) position++;
+                size_t after = (size_t)(node->count - position);
+                memmove(keys + position + 1, keys + position, after);
+                memmove(children + position + 1, children + position, after * sizeof(void *));
+                keys[position] = byte;
+                children[position] = child;
+                node->count++;
+                return 0;
+            }
+
+            if (node->type == ART_NODE4) {
+                ArtNode16 *grown = (ArtNode16 *)new_node(tree, region, ART_NODE16);
+                if (!grown) return 1;
+                copy_header(&grown->header, node);
+                memcpy(grown->keys, keys, 4);
+                memcpy(grown->children, children, 4 * sizeof(void *));
+                *ref = grown;
+            } else {
+                ArtNode48 *grown = (ArtNode48 *)new_node(tree, region, ART_NODE48);
+                if (!grown) return 1;
+                copy_header(&grown->header, node);
+                for (int i = 0; i < 16; i++) {
+                    grown->slots[keys[i]] = (unsigned char)(i + 1);
+                    grown->children[i] = children[i];
+                }
+                *ref = grown;
+            }
+            free_node(tree, region, node);
+            return add_child(tree, region, ref, *ref, byte, child);
+        }
+        case ART_NODE48: {
+            ArtNode48 *n = (ArtNode48 *)node;
+            if (node->count < 48) {
+                int slot = 0;
+                while (n->children[slot] != NULL) slot++;
+                n->children[slot] = child;
+                n->slots[byte] = (unsigned char)(slot + 1);
+                node->count++;
+                return 0;
+            }
+
+            ArtNode256 *grown = (ArtNode256 *)new_node(tree, region, ART_NODE256);
+            if (!grown) return 1;
+            copy_header(&grown->header, node);
+            for (int b = 0; b < 256; b++) {
+                if (n->slots[b] != 0) grown->children[b] = n->children[n->slots[b] - 1];
+            }
+            *ref = grown;
+            free_node(tree, region, node);
+            return add_child(tree, region, ref, *ref, byte, child);
+        }
+        default:
+            ((ArtNode256 *)node)->children[byte] = child;
+            node->count++;
+            return 0;
+    }
+}
+
+/// Hangs a leaf below a new Node4, as its terminal if its key ends at depth.
+static void place(ArtTree *tree, Region *region, void **ref, ArtNode *node, KeyNode *leaf, size_t depth) {
+    if (leaf->key_len == depth) {
+        node->terminal = leaf;
+    } else {
+        add_child(tree, region, ref, node, (unsigned char)leaf->key[depth], tag_leaf(leaf)); // cannot grow
+    }
+}
+
+static int insert_at(ArtTree *tree, Region *region, void **ref, KeyNode *leaf, size_t depth) {
+    const char *key = leaf->key;
+    size_t len = leaf->key_len;
+    if (*ref == NULL) {
+        *ref = tag_leaf(leaf);
+        return 0;
+    }
+
+    // Two keys: a node for the bytes they share, branching where they differ
+    if (is_leaf(*ref)) {
+        KeyNode *other = leaf_of(*ref);
+        size_t common = depth;
+        size_t limit = min_size(len, other->key_len);
+        while (common < limit && key[common] == other->key[common]) common++;
+
+        void *split = new_node(tree, region, ART_NODE4);
+        if (!split) return 1;
+        ArtNode *node = split;
+        node->prefix_len = (uint32_t)(common - depth);
+        memcpy(node->prefix, key + depth, min_size(node->prefix_len, ART_MAX_PREFIX));
+        place(tree, region, &split, node, other, common);
+        place(tree, region, &split, node, leaf, common);
+        *ref = split;
+        return 0;
+    }
+
+    ArtNode *node = *ref;
+    if (node->prefix_len > 0) {
+        size_t matched = prefix_match(node, key, len, depth);
+        if (matched < node->prefix_len) {
+            // The key leaves the folded run: split it where they part
+            void *split = new_node(tree, region, ART_NODE4);
+            if (!split) return 1;
+            ArtNode *parent = split;
+            parent->prefix_len = (uint32_t)matched;
+            memcpy(parent->prefix, node->prefix, min_size(matched, ART_MAX_PREFIX));
+
+            unsigned char byte;
+            if (node->prefix_len <= ART_MAX_PREFIX) {
+                byte = node->prefix[matched];
+                node->prefix_len -= (uint32_t)(matched + 1);
+                memmove(node->prefix, node->prefix + matched + 1, min_size(node->prefix_len, ART_MAX_PREFIX));
+            } else {
+                const KeyNode *below = minimum(node);
+                byte = (unsigned char)below->key[depth + matched];
+                node->prefix_len -= (uint32_t)(matched + 1);
+                memcpy(node->prefix, below->key + depth + matched + 1, min_size(node->prefix_len, ART_MAX_PREFIX));
+            }
+            add_child(tree, region, &split, parent, byte, node);
+            place(tree, region, &split, parent, leaf, depth + matched);
+            *ref = split;
+            return 0;
+        }
+        depth += node->prefix_len;
+    }
+
+    if (depth == len) {
+        node->terminal = leaf;
+        return 0;
+    }
+    void **child = find_child(node, (unsigned char)key[depth]);
+    if (child != NULL) return insert_at(tree, region, child, leaf, depth + 1);
+    return add_child(tree, region, ref, node, (unsigned char)key[depth], tag_leaf(leaf));
+}
+
+/// Replaces a node that lost children by a smaller one, or a Node4 left
+/// with a single way down by what it leads to. A node that cannot be
+/// allocated leaves the bigger one in place, which is still valid.
+static void shrink(ArtTree *tree, Region *region, void **ref, ArtNode *node) {
+    switch (node->type) {
+        case ART_NODE4: {
+            ArtNode4 *n = (ArtNode4 *)node;
+            if (node->count == 0) {
+                *ref = node->terminal != NULL ? tag_leaf(node->terminal) : NULL;
+            } else if (node->count == 1 && node->terminal == NULL) {
+                void *child = n->children[0];
+                if (!is_leaf(child)) {
+                    // The child takes over the run of the node and the byte between them
+                    ArtNode *below = child;
+                    unsigned char prefix[ART_MAX_PREFIX];
+                    size_t length = min_size(node->prefix_len, ART_MAX_PREFIX);
+                    memcpy(prefix, node->prefix, length);
+                    if (length < ART_MAX_PREFIX) prefix[length++] = n->keys[0];
+                    size_t taken = min_size(below->prefix_len, ART_MAX_PREFIX - length);
+                    memcpy(prefix + length, below->prefix, taken);
+                    memcpy(below->prefix, prefix, length + taken);
+                    below->prefix_len += node->prefix_len + 1;
+                }
+                *ref = child;
+            } else {
+                return;
+            }
+            free_node(tree, region, node);
+            return;
+        }
+        case ART_NODE16: {
+            if (node->count > 3) return;
+            ArtNode16 *n = (ArtNode16 *)node;
+            ArtNode4 *shrunk = (ArtNode4 *)new_node(tree, region, ART_NODE4);
+            if (!shrunk) return;
+            copy_header(&shrunk->header, node);
+            memcpy(shrunk->keys, n->keys, (size_t)node->count);
+            memcpy(shrunk->children, n->children, (size_t)node->count * sizeof(void *));
+            *ref = shrunk;
+            free_node(tree, region, node);
+            return;
+        }
+        case ART_NODE48: {
+            if (node->count > 12) return;
+            ArtNode48 *n = (ArtNode48 *)node;
+            ArtNode16 *shrunk = (ArtNode16 *)new_node(tree, region, ART_NODE16);
+            if (!shrunk) return;
+            copy_header(&shrunk->header, node);
+            int count = 0;
+            for (int b = 0; b < 256; b++) {
+                if (n->slots[b] == 0) continue;
+                shrunk->keys[count] = (unsigned char)b;
+                shrunk->children[count++] = n->children[n->slots[b] - 1];
+            }
+            *ref = shrunk;
+            free_node(tree, region, node);
+            return;
+        }
+        default: {
+            if (node->count > 37) return;
+            ArtNode256 *n = (ArtNode256 *)node;
+            ArtNode48 *shrunk = (ArtNode48 *)new_node(tree, region, ART_NODE48);
+            if (!shrunk) return;
+            copy_header(&shrunk->header, node);
+            int count = 0;
+            for (int b = 0; b < 256; b++) {
+                if (n->children[b] == NULL) continue;
+                shrunk->children[count] = n->children[b];
+                shrunk->slots[b] = (unsigned char)++count;
+            }
+            *ref = shrunk;
+            free_node(tree, region, node);
+            return;
+        }
+    }
+}
+
+/// Drops the child of a byte, found at child, and shrinks the node.
+static void remove_child(ArtTree *tree, Region *region, void **ref, ArtNode *node, unsigned char byte,
+                         void **child) {
+    switch (node->type) {
+        case ART_NODE4:
+        case ART_NODE16: {
+            unsigned char *keys = node->type == ART_NODE4 ? ((ArtNode4 *)node)->keys : ((ArtNode16 *)node)->keys;
+            void **children = node->type == ART_NODE4 ? ((ArtNode4 *)node)->children : ((ArtNode16 *)node)->children;
+            size_t position = (size_t)(child - children);
+            size_t after = (size_t)node->count - position - 1;
+            memmove(keys + position, keys + position + 1, after);
+            memmove(children + position, children + position + 1, after * sizeof(void *));
+            break;
+        }
+        case ART_NODE48:
+            *child = NULL;
+            ((ArtNode48 *)node)->slots[byte] = 0;
+            break;
+        default:
+            *child = NULL;
+            break;
+    }
+    node->count--;
+    shrink(tree, region, ref, node);
+}
+
+static void delete_at(ArtTree *tree, Region *region, void **ref, const KeyNode *leaf, size_t depth) {
+    if (is_leaf(*ref)) {
+        *ref = NULL; // the tree held this key alone
+        return;
+    }
+
+    ArtNode *node = *ref;
+    depth += node->prefix_len;
+    if (depth == leaf->key_len) {
+        node->terminal = NULL;
+        shrink(tree, region, ref, node);
+        return;
+    }
+
+    unsigned char byte = (unsigned char)leaf->key[depth];
+    void **child = find_child(node, byte);
+    if (child == NULL) return;
+    if (is_leaf(*child)) {
+        remove_child(tree, region, ref, node, byte, child);
+    } else {
+        delete_at(tree, region, child, leaf, depth + 1);
+    }
+}
+
+void art_init(ArtTree *tree) {
+    tree->root = NULL;
+    tree->memory = 0;
+    tree->nodes = 0;
+}
+
+KeyNode *art_lookup(const ArtTree *tree, const char *key, size_t len) {
+    void *ref = tree->root;
+    size_t depth = 0;
+    while (ref != NULL) {
+        if (is_leaf(ref)) {
+            KeyNode *leaf = leaf_of(ref);
+            return leaf_matches(leaf, key, len) ? leaf : NULL;
+        }
+
+        // Only the bytes kept in the node are compared, the leaf checks the rest
+        ArtNode *node = ref;
+        if (node->prefix_len > 0) {
+            if (node->prefix_len > len - depth ||
+                memcmp(node->prefix, key + depth, min_size(node->prefix_len, ART_MAX_PREFIX)) != 0) {
+                return NULL;
+            }
+            depth += node->prefix_len;
+        }
+        if (depth == len) {
+            return node->terminal != NULL && leaf_matches(node->terminal, key, len) ? node->terminal : NULL;
+        }
+
+        void **child = find_child(node, (unsigned char)key[depth]);
+        ref = child != NULL ? *child : NULL;
+        depth++;
+    }
+    return NULL;
+}
+
+int art_insert(ArtTree *tree, Region *region, KeyNode *leaf) {
+    return insert_at(tree, region, &tree->root, leaf, 0);
+}
+
+void art_delete(ArtTree *tree, Region *region, const KeyNode *leaf) {
+    if (tree->root != NULL) {
+        delete_at(tree, region, &tree->root, leaf, 0);
+    }
+}
+
+static void free_subtree(ArtTree *tree, Region *region, void *ref) {
+    if (ref == NULL || is_leaf(ref)) return;
+    ArtNode *node = ref;
+    switch (node->type) {
+        case ART_NODE4:
+            for (int i = 0; i < node->count; i++) free_subtree(tree, region, ((ArtNode4 *)node)->children[i]);
+            break;
+        case ART_NODE16:
+            for (int i = 0; i < node->count; i++) free_subtree(tree, region, ((ArtNode16 *)node)->children[i]);
+            break;
+        case ART_NODE48:
+            for (int i = 0; i < 48; i++) free_subtree(tree, region, ((ArtNode48 *)node)->children[i]);
+            break;
+        default:
+            for (int i = 0; i < 256; i++) free_subtree(tree, region, ((ArtNode256 *)node)->children[i]);
+            break;
+    }
+    free_node(tree, region, node);
+}
+
+void art_free(ArtTree *tree, Region *region) {
+    free_subtree(tree, region, tree->root);
+    tree->root = NULL;
+}
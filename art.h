@@ -0,0 +1,60 @@
+#ifndef KVS_ART_H
+#define KVS_ART_H
+
+#include <stddef.h>
+#include "region.h"
+
+// Adaptive radix tree over the keys of a table, the index of the ART engine
+// (see kvs.h). Inner nodes branch on one byte of the key and come in four
+// sizes, 4, 16, 48 and 256 children, each replaced by the next one when it
+// fills and by the previous one when it empties, so sparse levels stay
+// small. Runs of bytes with a single child are folded into the node below
+// (path compression): a node keeps the first ART_MAX_PREFIX bytes of its run
+// and the length of the whole run, the rest is checked against the key of
+// the leaf found. Keys sharing long prefixes therefore cost one node per
+// branching point, not one per byte.
+//
+// Leaves are the nodes of the table, tagged in the low bit of the child
+// pointer; a key that ends where a node branches is kept apart from its
+// children. The tree keeps no copy of a key.
+#define ART_MAX_PREFIX 8
+
+struct KeyNode;
+
+typedef struct ArtTree {
+    void *root;               // inner node or tagged leaf, NULL when empty
+    size_t memory;            // bytes allocated for inner nodes
+    size_t nodes;             // inner nodes
+} ArtTree;
+
+/// Initializes an empty tree.
+/// @param tree Tree to be initialized.
+void art_init(ArtTree *tree);
+
+/// Finds the node of a key.
+/// @param tree Tree to search.
+/// @param key Bytes of the key.
+/// @param len Length of the key.
+/// @return The node, NULL if the key is missing.
+struct KeyNode *art_lookup(const ArtTree *tree, const char *key, size_t len);
+
+/// Adds a node whose key is not in the tree yet.
+/// @param tree Tree to change.
+/// @param region Region the inner nodes live in, NULL for the heap.
+/// @param leaf Node to add, keyed by its key.
+/// @return 0 on success, 1 if an inner node could not be allocated (the tree
+///         is left unchanged).
+int art_insert(ArtTree *tree, Region *region, struct KeyNode *leaf);
+
+/// Removes a node from the tree.
+/// @param tree Tree to change.
+/// @param region Region the inner nodes live in, NULL for the heap.
+/// @param leaf Node to remove, which must be in the tree.
+void art_delete(ArtTree *tree, Region *region, const struct KeyNode *leaf);
+
+/// Frees the inner nodes, leaving the leaves to their owner.
+/// @param tree Tree to be emptied.
+/// @param region Region the inner nodes live in, NULL for the heap.
+void art_free(ArtTree *tree, Region *region);
+
+#endif  // KVS_ART_H
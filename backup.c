@@ -0,0 +1,260 @@
+#include "backup.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "crc32c.h"
+#include "lz.h"
+
+static void put_u32(unsigned char *data, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        data[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static void put_u64(unsigned char *data, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        data[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+uint32_t backup_read_u32(const unsigned char *data) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= (uint32_t)data[i] << (8 * i);
+    }
+    return value;
+}
+
+uint64_t backup_read_u64(const unsigned char *data) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value |= (uint64_t)data[i] << (8 * i);
+    }
+    return value;
+}
+
+// Writes all the bytes, retrying short writes.
+static int write_all(BackupWriter *writer, const void *data, size_t length) {
+    const char *bytes = data;
+    while (length > 0) {
+        ssize_t written = write(writer->fd, bytes, length);
+        if (written <= 0) return 1;
+        bytes += written;
+        length -= (size_t)written;
+        writer->written_bytes += (uint64_t)written;
+    }
+    return 0;
+}
+
+static int flush_block(BackupWriter *writer) {
+    if (writer->used == 0) return 0;
+
+    if (!writer->compress) {
+        int failed = write_all(writer, writer->block, writer->used);
+        writer->used = 0;
+        return failed;
+    }
+
+    if (writer->blocks == writer->index_capacity) {
+        size_t capacity = writer->index_capacity ? writer->index_capacity * 2 : 64;
+        uint64_t *index = realloc(writer->index, capacity * sizeof(uint64_t));
+        if (!index) return 1;
+        writer->index = index;
+        writer->index_capacity = capacity;
+    }
+    writer->index[writer->blocks++] = writer->written_bytes;
+
+    size_t stored = lz_compress(writer->block, writer->used, writer->scratch, lz_compress_bound(BACKUP_BLOCK_SIZE));
+    uint32_t stored_length = (uint32_t)stored;
+    const char *payload = writer->scratch;
+    if (stored == 0 || stored >= writer->used) {
+        // Incompressible, keep the raw bytes
+        stored = writer->used;
+        stored_length = (uint32_t)stored | BACKUP_STORED_RAW;
+        payload = writer->block;
+    }
+
+    unsigned char header[BACKUP_BLOCK_HEADER_SIZE];
+    put_u32(header, (uint32_t)writer->used);
+    put_u32(header + 4, stored_length);
+    put_u32(header + 8, crc32c(0, writer->block, writer->used));
+
+    int failed = write_all(writer, header, sizeof(header)) || write_all(writer, payload, stored);
+    writer->used = 0;
+    return failed;
+}
+
+int backup_writer_open(BackupWriter *writer, int fd, int compress) {
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = fd;
+    writer->compress = compress;
+    writer->block = malloc(BACKUP_BLOCK_SIZE);
+    if (compress) {
+        writer->scratch = malloc(lz_compress_bound(BACKUP_BLOCK_SIZE));
+    }
+    if (!writer->block || (compress && !writer->scratch)) {
+        free(writer->block);
+        free(writer->scratch);
+        return 1;
+    }
+
+    if (compress) {
+        unsigned char header[BACKUP_HEADER_SIZE];
+        memcpy(header, BACKUP_MAGIC, 4);
+        put_u32(header + 4, BACKUP_VERSION);
+        put_u32(header + 8, BACKUP_BLOCK_SIZE);
+        return write_all(writer, header, sizeof(header));
+    }
+    return 0;
+}
+
+int backup_writer_append(BackupWriter *writer, const char *data, size_t length) {
+    writer->raw_bytes += length;
+    while (length > 0) {
+        size_t room = BACKUP_BLOCK_SIZE - writer->used;
+        size_t chunk = length < room ? length : room;
+        memcpy(writer->block + writer->used, data, chunk);
+        writer->used += chunk;
+        data += chunk;
+        length -= chunk;
+
+        if (writer->used == BACKUP_BLOCK_SIZE && flush_block(writer) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int backup_writer_close(BackupWriter *writer) {
+    int failed = flush_block(writer);
+
+    if (!failed && writer->compress) {
+        // The footer is checksummed with the index, a torn tail shows up
+        // as a mismatch rather than as a shorter backup
+        uint64_t index_offset = writer->written_bytes;
+        uint32_t crc = 0;
+        unsigned char entry[8];
+        for (size_t i = 0; i < writer->blocks && !failed; i++) {
+            put_u64(entry, writer->index[i]);
+            crc = crc32c(crc, entry, sizeof(entry));
+            failed = write_all(writer, entry, sizeof(entry));
+        }
+
+        unsigned char footer[BACKUP_FOOTER_SIZE];
+        put_u64(footer, index_offset);
+        put_u32(footer + 8, (uint32_t)writer->blocks);
+        put_u64(footer + 12, writer->entries);
+        put_u32(footer + 20, crc32c(crc, footer, 20));
+        memcpy(footer + 24, BACKUP_INDEX_MAGIC, 4);
+        failed = failed || write_all(writer, footer, sizeof(footer));
+    }
+
+    free(writer->block);
+    free(writer->scratch);
+    free(writer->index);
+    writer->block = NULL;
+    writer->scratch = NULL;
+    writer->index = NULL;
+    return failed;
+}
+
+int backup_is_compressed(const unsigned char *data, size_t length) {
+    return length >= BACKUP_HEADER_SIZE && memcmp(data, BACKUP_MAGIC, 4) == 0;
+}
+
+int backup_decode_block(const unsigned char *data, size_t length, char *raw, size_t *raw_length, size_t *consumed) {
+    if (length < BACKUP_BLOCK_HEADER_SIZE) return -1;
+
+    uint32_t raw_size = backup_read_u32(data);
+    uint32_t stored_length = backup_read_u32(data + 4);
+    uint32_t checksum = backup_read_u32(data + 8);
+    size_t stored = stored_length & ~BACKUP_STORED_RAW;
+    if (raw_size > BACKUP_BLOCK_SIZE || stored > length - BACKUP_BLOCK_HEADER_SIZE) return -1;
+
+    const unsigned char *payload = data + BACKUP_BLOCK_HEADER_SIZE;
+    if (stored_length & BACKUP_STORED_RAW) {
+        if (stored != raw_size) return -1;
+        memcpy(raw, payload, stored);
+    } else if (lz_decompress((const char *)payload, stored, raw, raw_size) != 0) {
+        return -1;
+    }
+
+    if (crc32c(0, raw, raw_size) != checksum) return -1;
+
+    *raw_length = raw_size;
+    *consumed = BACKUP_BLOCK_HEADER_SIZE + stored;
+    return 0;
+}
+
+uint64_t backup_find_index(const unsigned char *data, size_t length, uint32_t *blocks, uint64_t *entries) {
+    if (length < BACKUP_HEADER_SIZE + BACKUP_V1_FOOTER_SIZE) return 0;
+
+    uint32_t version = backup_read_u32(data + 4);
+    size_t footer_size = version == 1 ? BACKUP_V1_FOOTER_SIZE : BACKUP_FOOTER_SIZE;
+    if (length < BACKUP_HEADER_SIZE + footer_size) return 0;
+
+    const unsigned char *footer = data + length - footer_size;
+    if (memcmp(footer + footer_size - 4, BACKUP_INDEX_MAGIC, 4) != 0) return 0;
+
+    uint64_t index_offset = backup_read_u64(footer);
+    *blocks = backup_read_u32(footer + 8);
+    if (index_offset < BACKUP_HEADER_SIZE || index_offset + (uint64_t)*blocks * 8 != length - footer_size) return 0;
+
+    *entries = BACKUP_UNKNOWN_ENTRIES;
+    if (version != 1) {
+        size_t checked = (size_t)*blocks * 8 + 20;
+        if (crc32c(0, data + index_offset, checked) != backup_read_u32(footer + 20)) return 0;
+        *entries = backup_read_u64(footer + 12);
+    }
+    return index_offset;
+}
+
+int backup_write_sums(int fd, const uint32_t *crcs, uint32_t blocks, uint64_t length, uint64_t entries) {
+    size_t size = BACKUP_HEADER_SIZE + BACKUP_SUMS_BODY_SIZE + (size_t)blocks * 4 + BACKUP_SUMS_TRAILER_SIZE;
+    unsigned char *sums = malloc(size);
+    if (!sums) return 1;
+
+    memcpy(sums, BACKUP_SUMS_MAGIC, 4);
+    put_u32(sums + 4, BACKUP_SUMS_VERSION);
+    put_u32(sums + 8, BACKUP_BLOCK_SIZE);
+    unsigned char *body = sums + BACKUP_HEADER_SIZE;
+    put_u64(body, length);
+    put_u64(body + 8, entries);
+    put_u32(body + 16, blocks);
+    for (uint32_t i = 0; i < blocks; i++) {
+        put_u32(body + BACKUP_SUMS_BODY_SIZE + (size_t)i * 4, crcs[i]);
+    }
+    unsigned char *trailer = sums + size - BACKUP_SUMS_TRAILER_SIZE;
+    put_u32(trailer, crc32c(0, sums, size - BACKUP_SUMS_TRAILER_SIZE));
+    memcpy(trailer + 4, BACKUP_SUMS_END_MAGIC, 4);
+
+    BackupWriter writer = {.fd = fd};
+    int failed = write_all(&writer, sums, size);
+    free(sums);
+    return failed;
+}
+
+int backup_read_sums(const unsigned char *data, size_t length, BackupSums *sums) {
+    if (length < BACKUP_HEADER_SIZE + BACKUP_SUMS_BODY_SIZE + BACKUP_SUMS_TRAILER_SIZE) return -1;
+    if (memcmp(data, BACKUP_SUMS_MAGIC, 4) != 0 || backup_read_u32(data + 4) != BACKUP_SUMS_VERSION) return -1;
+
+    const unsigned char *trailer = data + length - BACKUP_SUMS_TRAILER_SIZE;
+    if (memcmp(trailer + 4, BACKUP_SUMS_END_MAGIC, 4) != 0 ||
+        crc32c(0, data, length - BACKUP_SUMS_TRAILER_SIZE) != backup_read_u32(trailer)) {
+        return -1;
+    }
+
+    const unsigned char *body = data + BACKUP_HEADER_SIZE;
+    sums->block_size = backup_read_u32(data + 8);
+    sums->length = backup_read_u64(body);
+    sums->entries = backup_read_u64(body + 8);
+    sums->blocks = backup_read_u32(body + 16);
+    sums->crcs = body + BACKUP_SUMS_BODY_SIZE;
+    if (sums->block_size == 0 ||
+        BACKUP_HEADER_SIZE + BACKUP_SUMS_BODY_SIZE + (uint64_t)sums->blocks * 4 + BACKUP_SUMS_TRAILER_SIZE != length ||
+        (sums->length + sums->block_size - 1) / sums->block_size != sums->blocks) {
+        return -1;
+    }
+    return 0;
+}
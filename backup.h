@@ -0,0 +1,134 @@
+#ifndef KVS_BACKUP_H
+#define KVS_BACKUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Compressed backups are a header, a sequence of independently compressed
+// blocks and an index of block offsets so any block can be read directly:
+//
+//   header  "KVSZ" | u32 version | u32 block size
+//   block   u32 raw length | u32 stored length (top bit: stored raw) |
+//           u32 CRC32C of the raw bytes | stored bytes
+//   index   u64 offset of every block
+//   footer  u64 index offset | u32 block count | u64 entry count |
+//           u32 CRC32C of the index and the footer before it | "KVSI"
+//
+// Version 1 footers stop after the block count (16 bytes, no entry count).
+//
+// Plain backups keep the text format and get the same checks from a
+// "<backup>.sum" file, written once the backup itself is complete:
+//
+//   header  "KVSC" | u32 version | u32 block size
+//   body    u64 backup length | u64 entry count | u32 block count |
+//           u32 CRC32C of every block size bytes of the backup
+//   trailer u32 CRC32C of everything before it | "KVSE"
+//
+// All integers are little endian. A backup whose child was killed lacks
+// its footer or its .sum file.
+#define BACKUP_MAGIC "KVSZ"
+#define BACKUP_INDEX_MAGIC "KVSI"
+#define BACKUP_VERSION 2
+#define BACKUP_BLOCK_SIZE (64 * 1024)
+#define BACKUP_HEADER_SIZE 12
+#define BACKUP_BLOCK_HEADER_SIZE 12
+#define BACKUP_FOOTER_SIZE 28
+#define BACKUP_V1_FOOTER_SIZE 16
+#define BACKUP_STORED_RAW 0x80000000u
+#define BACKUP_UNKNOWN_ENTRIES UINT64_MAX
+
+#define BACKUP_SUMS_SUFFIX ".sum"
+#define BACKUP_SUMS_MAGIC "KVSC"
+#define BACKUP_SUMS_END_MAGIC "KVSE"
+#define BACKUP_SUMS_VERSION 1
+#define BACKUP_SUMS_BODY_SIZE 20
+#define BACKUP_SUMS_TRAILER_SIZE 8
+
+typedef struct BackupWriter {
+    int fd;
+    int compress;                 // 0 writes plain text, 1 the block format
+    char *block;                  // raw bytes not flushed yet
+    size_t used;
+    char *scratch;                // compressed copy of the block
+    uint64_t *index;              // file offset of every flushed block
+    size_t blocks;
+    size_t index_capacity;
+    uint64_t raw_bytes;           // bytes appended by the caller
+    uint64_t entries;             // pairs appended, counted by the caller
+    uint64_t written_bytes;       // bytes written to the file
+} BackupWriter;
+
+/// Starts a backup on an open, empty file.
+/// @param writer Writer to be initialized.
+/// @param fd File descriptor to write to, owned by the caller.
+/// @param compress Whether to use the compressed block format.
+/// @return 0 on success, 1 otherwise.
+int backup_writer_open(BackupWriter *writer, int fd, int compress);
+
+/// Appends bytes to the backup, flushing full blocks.
+/// @param writer Writer to append to.
+/// @param data Bytes to append.
+/// @param length Number of bytes to append.
+/// @return 0 on success, 1 if writing failed.
+int backup_writer_append(BackupWriter *writer, const char *data, size_t length);
+
+/// Flushes the last block, writes the index and releases the writer.
+/// @param writer Writer to be closed.
+/// @return 0 on success, 1 if writing failed.
+int backup_writer_close(BackupWriter *writer);
+
+/// Checks whether a file starts with the compressed backup header.
+/// @param data First bytes of the file.
+/// @param length Number of bytes available.
+/// @return 1 if the file is a compressed backup, 0 otherwise.
+int backup_is_compressed(const unsigned char *data, size_t length);
+
+/// Decodes and verifies one block.
+/// @param data Bytes starting at the block header.
+/// @param length Number of bytes available.
+/// @param raw Buffer of at least BACKUP_BLOCK_SIZE bytes for the raw bytes.
+/// @param raw_length Set to the number of raw bytes.
+/// @param consumed Set to the size of the block, header included.
+/// @return 0 on success, -1 if the block is truncated or corrupt.
+int backup_decode_block(const unsigned char *data, size_t length, char *raw, size_t *raw_length, size_t *consumed);
+
+/// Finds the block index of a compressed backup.
+/// @param data Whole file.
+/// @param length Size of the file.
+/// @param blocks Set to the number of blocks.
+/// @param entries Set to the number of pairs, BACKUP_UNKNOWN_ENTRIES for a
+///                version 1 backup.
+/// @return Offset of the index in the file, 0 if the footer is missing or
+///         does not match the index.
+uint64_t backup_find_index(const unsigned char *data, size_t length, uint32_t *blocks, uint64_t *entries);
+
+/// Checksums of a plain backup, read from its .sum file.
+typedef struct BackupSums {
+    uint32_t block_size;
+    uint64_t length;              // bytes of the backup
+    uint64_t entries;             // pairs in the backup
+    uint32_t blocks;
+    const unsigned char *crcs;    // u32 CRC32C of every block
+} BackupSums;
+
+/// Writes the .sum file of a plain backup.
+/// @param fd File descriptor to write to, owned by the caller.
+/// @param crcs Checksum of every BACKUP_BLOCK_SIZE bytes of the backup.
+/// @param blocks Number of checksums.
+/// @param length Bytes of the backup.
+/// @param entries Pairs in the backup.
+/// @return 0 on success, 1 if writing failed.
+int backup_write_sums(int fd, const uint32_t *crcs, uint32_t blocks, uint64_t length, uint64_t entries);
+
+/// Parses and checks a .sum file.
+/// @param data Whole file, which must outlive sums.
+/// @param length Size of the file.
+/// @param sums Set to its contents.
+/// @return 0 on success, -1 if the file is truncated or corrupt.
+int backup_read_sums(const unsigned char *data, size_t length, BackupSums *sums);
+
+/// Reads a little endian integer.
+uint32_t backup_read_u32(const unsigned char *data);
+uint64_t backup_read_u64(const unsigned char *data);
+
+#endif  // KVS_BACKUP_H
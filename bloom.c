@@ -0,0 +1,100 @@
+#include "bloom.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void bloom_init(BloomFilter *filter) {
+    memset(filter, 0, sizeof(*filter));
+}
+
+int bloom_reset(BloomFilter *filter, size_t capacity, Region *region) {
+    size_t needed = capacity * BLOOM_COUNTERS_PER_KEY / BLOOM_BLOCK_COUNTERS + 1;
+    size_t block_count = 1;
+    while (block_count < needed) {
+        block_count *= 2;
+    }
+
+    unsigned char *blocks = NULL;
+    if (block_count == filter->block_count) {
+        blocks = filter->blocks;
+        memset(blocks, 0, block_count * BLOOM_BLOCK_SIZE);
+    } else {
+        blocks = region_calloc(region, block_count, BLOOM_BLOCK_SIZE);
+        region_free(region, filter->blocks);
+    }
+
+    size_t skipped = filter->skipped;
+    bloom_init(filter);
+    filter->skipped = skipped;
+    if (!blocks) return 1;
+    filter->blocks = blocks;
+    filter->block_count = block_count;
+    filter->capacity = capacity;
+    return 0;
+}
+
+size_t bloom_size(const BloomFilter *filter) {
+    return filter->block_count * BLOOM_BLOCK_SIZE;
+}
+
+// Block of a key, from the high half of its hash (the index uses the low one).
+static unsigned char *key_block(const BloomFilter *filter, uint64_t hash) {
+    return filter->blocks + ((hash >> 32) & (filter->block_count - 1)) * BLOOM_BLOCK_SIZE;
+}
+
+// Counters of a key within its block, 7 bits each from a remix of the hash.
+static void key_counters(uint64_t hash, unsigned int counters[BLOOM_HASHES]) {
+    uint64_t mixed = hash * 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        counters[i] = (unsigned int)(mixed >> (64 - 7 * (i + 1))) & (BLOOM_BLOCK_COUNTERS - 1);
+    }
+}
+
+static unsigned int get_counter(const unsigned char *block, unsigned int counter) {
+    return (block[counter / 2] >> (counter % 2 * 4)) & 0xF;
+}
+
+static void set_counter(unsigned char *block, unsigned int counter, unsigned int value) {
+    unsigned int shift = counter % 2 * 4;
+    block[counter / 2] = (unsigned char)((block[counter / 2] & ~(0xFu << shift)) | (value << shift));
+}
+
+void bloom_add(BloomFilter *filter, uint64_t hash) {
+    if (filter->block_count == 0) return;
+    unsigned char *block = key_block(filter, hash);
+    unsigned int counters[BLOOM_HASHES];
+    key_counters(hash, counters);
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        unsigned int value = get_counter(block, counters[i]);
+        if (value < 0xF) set_counter(block, counters[i], value + 1);
+    }
+}
+
+void bloom_remove(BloomFilter *filter, uint64_t hash) {
+    if (filter->block_count == 0) return;
+    filter->removed++;
+    unsigned char *block = key_block(filter, hash);
+    unsigned int counters[BLOOM_HASHES];
+    key_counters(hash, counters);
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        unsigned int value = get_counter(block, counters[i]);
+        // a saturated counter no longer knows how many keys it counts
+        if (value > 0 && value < 0xF) set_counter(block, counters[i], value - 1);
+    }
+}
+
+int bloom_may_contain(const BloomFilter *filter, uint64_t hash) {
+    if (filter->block_count == 0) return 1;
+    const unsigned char *block = key_block(filter, hash);
+    unsigned int counters[BLOOM_HASHES];
+    key_counters(hash, counters);
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        if (get_counter(block, counters[i]) == 0) return 0;
+    }
+    return 1;
+}
+
+void bloom_free(BloomFilter *filter, Region *region) {
+    region_free(region, filter->blocks);
+    bloom_init(filter);
+}
@@ -0,0 +1,63 @@
+#ifndef KVS_BLOOM_H
+#define KVS_BLOOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "region.h"
+
+// Counting Bloom filter split in cache line sized blocks: every key maps to
+// one block and sets BLOOM_HASHES of its 4-bit counters, so a lookup touches
+// a single cache line. Counters stick at 15 instead of overflowing, which
+// only makes the filter answer "maybe" more often.
+#define BLOOM_BLOCK_SIZE 64
+#define BLOOM_BLOCK_COUNTERS (BLOOM_BLOCK_SIZE * 2)
+#define BLOOM_HASHES 4
+#define BLOOM_COUNTERS_PER_KEY 10   // ~1-2% false positives at capacity
+
+typedef struct BloomFilter {
+    unsigned char *blocks;
+    size_t block_count;       // power of two, 0 for a filter that lets everything through
+    size_t capacity;          // keys it was sized for
+    size_t removed;           // keys removed since the last reset
+    size_t absent;            // lookups of missing keys since the last rebuild
+    size_t false_positives;   // ...that the filter let through
+    size_t skipped;           // lookups answered by the filter, in total
+} BloomFilter;
+
+/// Initializes an empty filter that lets every lookup through.
+/// @param filter Filter to be initialized.
+void bloom_init(BloomFilter *filter);
+
+/// Replaces the counters with empty ones sized for a number of keys.
+/// @param filter Filter to be reset.
+/// @param capacity Number of keys to size the filter for.
+/// @param region Region the counters live in, NULL for the heap.
+/// @return 0 on success, 1 if the counters could not be allocated (the
+///         filter then lets everything through).
+int bloom_reset(BloomFilter *filter, size_t capacity, Region *region);
+
+/// Bytes allocated for the counters.
+size_t bloom_size(const BloomFilter *filter);
+
+/// Adds a key.
+/// @param filter Filter to be updated.
+/// @param hash 64-bit hash of the key.
+void bloom_add(BloomFilter *filter, uint64_t hash);
+
+/// Removes a key that was added.
+/// @param filter Filter to be updated.
+/// @param hash 64-bit hash of the key.
+void bloom_remove(BloomFilter *filter, uint64_t hash);
+
+/// Checks whether a key may have been added.
+/// @param filter Filter to be checked.
+/// @param hash 64-bit hash of the key.
+/// @return 0 if the key is surely missing, 1 otherwise.
+int bloom_may_contain(const BloomFilter *filter, uint64_t hash);
+
+/// Frees the counters.
+/// @param filter Filter to be freed.
+/// @param region Region the counters live in, NULL for the heap.
+void bloom_free(BloomFilter *filter, Region *region);
+
+#endif  // KVS_BLOOM_H
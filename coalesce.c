@@ -0,0 +1,288 @@
+#include "coalesce.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "constants.h"
+
+void write_batch_init(WriteBatch *batch) {
+    memset(batch, 0, sizeof(*batch));
+}
+
+// Grows a buffer owned by the batch to hold a string of len bytes, keeping
+// its contents.
+static int reserve_string(KvsString *dst, size_t len) {
+    if (len + 1 <= dst->cap) return 0;
+    char *data = realloc(dst->data, len + 1);
+    if (!data) return 1;
+    dst->data = data;
+    dst->cap = len + 1;
+    return 0;
+}
+
+static void copy_string(KvsString *dst, const KvsString *src) {
+    if (src->len > 0) {
+        memcpy(dst->data, src->data, src->len);
+    }
+    dst->data[src->len] = '\0';
+    dst->len = src->len;
+}
+
+static uint32_t batch_hash(const KvsString *key) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < key->len; i++) {
+        hash = (hash ^ (unsigned char)key->data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/// Points empty slots at every key of the batch.
+static void fill_slots(const WriteBatch *batch, size_t *slots, size_t capacity) {
+    for (size_t i = 0; i < batch->count; i++) {
+        size_t slot = batch_hash(&batch->keys[i]) & (capacity - 1);
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        slots[slot] = i + 1;
+    }
+}
+
+/// Rebuilds the slots with twice the capacity.
+static int grow_slots(WriteBatch *batch) {
+    size_t capacity = batch->slot_capacity ? batch->slot_capacity * 2 : 64;
+    size_t *slots = calloc(capacity, sizeof(size_t));
+    if (!slots) return 1;
+
+    fill_slots(batch, slots, capacity);
+    free(batch->slots);
+    batch->slots = slots;
+    batch->slot_capacity = capacity;
+    return 0;
+}
+
+/// Makes room for one more distinct key.
+static int reserve_key(WriteBatch *batch) {
+    if ((batch->count + 1) * 2 > batch->slot_capacity && grow_slots(batch) != 0) return 1;
+    if (batch->count < batch->cap) return 0;
+
+    size_t cap = batch->cap ? batch->cap * 2 : 64;
+    KvsString *keys = realloc(batch->keys, cap * sizeof(KvsString));
+    if (keys) batch->keys = keys;
+    KvsString *values = realloc(batch->values, cap * sizeof(KvsString));
+    if (values) batch->values = values;
+    unsigned long *ttls = realloc(batch->ttls, cap * sizeof(unsigned long));
+    if (ttls) batch->ttls = ttls;
+    BatchedKey *state = realloc(batch->state, cap * sizeof(BatchedKey));
+    if (state) batch->state = state;
+    if (!keys || !values || !ttls || !state) return 1;
+
+    memset(batch->keys + batch->cap, 0, (cap - batch->cap) * sizeof(KvsString));
+    memset(batch->values + batch->cap, 0, (cap - batch->cap) * sizeof(KvsString));
+    batch->cap = cap;
+    return 0;
+}
+
+/// Index of a key in the batch, adding it untouched if it is new.
+/// @return The index, or batch->cap if the batch could not grow.
+static size_t find_key(WriteBatch *batch, const KvsString *key) {
+    if (batch->slot_capacity > 0) {
+        size_t slot = batch_hash(key) & (batch->slot_capacity - 1);
+        while (batch->slots[slot] != 0) {
+            const KvsString *other = &batch->keys[batch->slots[slot] - 1];
+            if (other->len == key->len && memcmp(other->data, key->data, key->len) == 0) {
+                return batch->slots[slot] - 1;
+            }
+            slot = (slot + 1) & (batch->slot_capacity - 1);
+        }
+    }
+
+    if (reserve_key(batch) != 0) return batch->cap;
+    size_t index = batch->count;
+    if (reserve_string(&batch->keys[index], key->len) != 0) return batch->cap;
+    copy_string(&batch->keys[index], key);
+
+    size_t slot = batch_hash(key) & (batch->slot_capacity - 1);
+    while (batch->slots[slot] != 0) {
+        slot = (slot + 1) & (batch->slot_capacity - 1);
+    }
+    batch->slots[slot] = index + 1;
+    batch->values[index].len = 0;
+    batch->ttls[index] = 0;
+    batch->state[index] = (BatchedKey){0, 0, 0};
+    batch->count++;
+    return index;
+}
+
+/// Reserves the entries of a command's keys before any of them changes, so
+/// that a command is absorbed whole or not at all. Keys added for a command
+/// that is then refused stay untouched, which applies as a no-op.
+/// @param indexes Set to the index of each key.
+/// @param values Values the keys will take, NULL for a DELETE.
+static int reserve_command(WriteBatch *batch, size_t count, const KvsString keys[], const KvsString values[],
+                           size_t indexes[]) {
+    for (size_t i = 0; i < count; i++) {
+        indexes[i] = find_key(batch, &keys[i]);
+        if (indexes[i] == batch->cap) return 1;
+        if (values != NULL && reserve_string(&batch->values[indexes[i]], values[i].len) != 0) return 1;
+    }
+    return 0;
+}
+
+int write_batch_write(WriteBatch *batch, size_t count, const KvsString keys[], const KvsString values[],
+                      const unsigned long ttls_ms[]) {
+    size_t indexes[MAX_WRITE_SIZE];
+    if (count > MAX_WRITE_SIZE || reserve_command(batch, count, keys, values, indexes) != 0) return 1;
+
+    for (size_t i = 0; i < count; i++) {
+        copy_string(&batch->values[indexes[i]], &values[i]);
+        batch->ttls[indexes[i]] = ttls_ms != NULL ? ttls_ms[i] : 0;
+        BatchedKey *state = &batch->state[indexes[i]];
+        if (state->writes++ == 0) {
+            state->created = batch->writes;
+        }
+        batch->writes++;
+    }
+    batch->commands++;
+    return 0;
+}
+
+int write_batch_delete(WriteBatch *batch, size_t count, const KvsString keys[]) {
+    if (count > MAX_WRITE_SIZE) return 1;
+    if (batch->deleted_count + count > batch->deleted_cap) {
+        size_t cap = batch->deleted_cap ? batch->deleted_cap : 64;
+        while (batch->deleted_count + count > cap) {
+            cap *= 2;
+        }
+        size_t *deleted = realloc(batch->deleted, cap * sizeof(size_t));
+        if (deleted) batch->deleted = deleted;
+        DeleteOutcome *outcomes = realloc(batch->outcomes, cap * sizeof(DeleteOutcome));
+        if (outcomes) batch->outcomes = outcomes;
+        if (!deleted || !outcomes) return 1;
+        batch->deleted_cap = cap;
+    }
+    if (batch->delete_count == batch->delete_cap) {
+        size_t cap = batch->delete_cap ? batch->delete_cap * 2 : 16;
+        size_t *ends = realloc(batch->delete_ends, cap * sizeof(size_t));
+        if (!ends) return 1;
+        batch->delete_ends = ends;
+        batch->delete_cap = cap;
+    }
+
+    size_t *indexes = batch->deleted + batch->deleted_count;
+    if (reserve_command(batch, count, keys, NULL, indexes) != 0) return 1;
+
+    // In order, so that a key deleted twice by the command is missing the second time
+    for (size_t i = 0; i < count; i++) {
+        BatchedKey *state = &batch->state[indexes[i]];
+        DeleteOutcome outcome = DELETE_PROBED;
+        if (state->writes > 0) {
+            outcome = DELETE_FOUND;
+        } else if (state->replace) {
+            outcome = DELETE_MISSING;
+        }
+        batch->outcomes[batch->deleted_count++] = outcome;
+        state->writes = 0;
+        state->replace = 1;
+    }
+    batch->delete_ends[batch->delete_count++] = batch->deleted_count;
+    batch->commands++;
+    return 0;
+}
+
+int write_batch_full(const WriteBatch *batch) {
+    return batch->count + batch->deleted_count >= WRITE_BATCH_SIZE;
+}
+
+typedef struct CreatedKey {
+    size_t created;
+    size_t index;
+} CreatedKey;
+
+static int compare_created(const void *a, const void *b) {
+    size_t x = ((const CreatedKey *)a)->created, y = ((const CreatedKey *)b)->created;
+    return (x > y) - (x < y);
+}
+
+int write_batch_sort(WriteBatch *batch) {
+    // Usually already so: keys only move when first seen in a DELETE
+    size_t count = batch->count;
+    int ordered = 1;
+    for (size_t i = 1; i < count && ordered; i++) {
+        ordered = batch->state[i - 1].created <= batch->state[i].created;
+    }
+    if (ordered) return 0;
+
+    CreatedKey *sorted = malloc(count * sizeof(CreatedKey));
+    size_t *position = malloc(count * sizeof(size_t));
+    KvsString *strings = malloc(count * 2 * sizeof(KvsString));
+    unsigned long *ttls = malloc(count * sizeof(unsigned long));
+    BatchedKey *state = malloc(count * sizeof(BatchedKey));
+    if (!sorted || !position || !strings || !ttls || !state) {
+        free(sorted);
+        free(position);
+        free(strings);
+        free(ttls);
+        free(state);
+        return 1;
+    }
+
+    // keys that end deleted create nothing, where they go does not matter
+    for (size_t i = 0; i < count; i++) {
+        sorted[i] = (CreatedKey){batch->state[i].created, i};
+    }
+    qsort(sorted, count, sizeof(CreatedKey), compare_created);
+
+    // Moves every entry, buffers included, to its new place
+    for (size_t i = 0; i < count; i++) {
+        size_t from = sorted[i].index;
+        position[from] = i;
+        strings[i] = batch->keys[from];
+        strings[count + i] = batch->values[from];
+        ttls[i] = batch->ttls[from];
+        state[i] = batch->state[from];
+    }
+    memcpy(batch->keys, strings, count * sizeof(KvsString));
+    memcpy(batch->values, strings + count, count * sizeof(KvsString));
+    memcpy(batch->ttls, ttls, count * sizeof(unsigned long));
+    memcpy(batch->state, state, count * sizeof(BatchedKey));
+    for (size_t i = 0; i < batch->deleted_count; i++) {
+        batch->deleted[i] = position[batch->deleted[i]];
+    }
+
+    memset(batch->slots, 0, batch->slot_capacity * sizeof(size_t));
+    fill_slots(batch, batch->slots, batch->slot_capacity);
+
+    free(sorted);
+    free(position);
+    free(strings);
+    free(ttls);
+    free(state);
+    return 0;
+}
+
+void write_batch_clear(WriteBatch *batch) {
+    if (batch->slot_capacity > 0) {
+        memset(batch->slots, 0, batch->slot_capacity * sizeof(size_t));
+    }
+    batch->count = 0;
+    batch->deleted_count = 0;
+    batch->delete_count = 0;
+    batch->commands = 0;
+    batch->writes = 0;
+}
+
+void write_batch_free(WriteBatch *batch) {
+    for (size_t i = 0; i < batch->cap; i++) {
+        free(batch->keys[i].data);
+        free(batch->values[i].data);
+    }
+    free(batch->keys);
+    free(batch->values);
+    free(batch->ttls);
+    free(batch->state);
+    free(batch->slots);
+    free(batch->deleted);
+    free(batch->outcomes);
+    free(batch->delete_ends);
+    write_batch_init(batch);
+}
@@ -0,0 +1,93 @@
+#ifndef KVS_COALESCE_H
+#define KVS_COALESCE_H
+
+#include <stddef.h>
+#include "kvs.h"
+
+// Consecutive WRITE and DELETE commands of a job, collapsed per key until a
+// command that reads the KVS needs them applied. For every key the batch
+// keeps only what applying its commands in order would leave: the last
+// value and TTL, how many writes bump its version, and whether a DELETE
+// dropped the stored pair on the way. The only outcome that depends on the
+// table, whether the first DELETE of a key found it, is read back when the
+// batch is applied (see kvs_write_batch).
+
+/// Outcome of one key of a buffered DELETE.
+typedef enum {
+    DELETE_FOUND,       // written earlier in the batch
+    DELETE_MISSING,     // deleted earlier in the batch and not written since
+    DELETE_PROBED,      // first command on the key, the table decides
+} DeleteOutcome;
+
+/// What the batch does to one key.
+typedef struct BatchedKey {
+    unsigned long writes;   // writes since its last DELETE, 0 if it ends deleted
+    unsigned char replace;  // deleted in the batch, the stored pair goes first
+    size_t created;         // batch position of the first of those writes, the
+                            // one that creates the node if the key is missing
+} BatchedKey;
+
+typedef struct WriteBatch {
+    KvsString *keys;        // distinct keys in first-seen order, owned
+    KvsString *values;      // last value written to each key, owned
+    unsigned long *ttls;    // TTL of that write
+    BatchedKey *state;
+    size_t count;
+    size_t cap;
+    size_t *slots;          // linear probing over the keys: index + 1, 0 when free
+    size_t slot_capacity;   // power of two
+    size_t *deleted;        // keys of the buffered DELETEs, in job order
+    DeleteOutcome *outcomes;
+    size_t deleted_count;
+    size_t deleted_cap;
+    size_t *delete_ends;    // end in deleted of each buffered DELETE command
+    size_t delete_count;
+    size_t delete_cap;
+    size_t commands;        // WRITE and DELETE commands absorbed
+    size_t writes;          // pairs absorbed, numbering BatchedKey.created
+} WriteBatch;
+
+/// Initializes an empty batch.
+/// @param batch Batch to be initialized.
+void write_batch_init(WriteBatch *batch);
+
+/// Absorbs a WRITE command.
+/// @param batch Batch to be extended.
+/// @param count Number of pairs.
+/// @param keys Keys of the pairs.
+/// @param values Values of the pairs.
+/// @param ttls_ms TTLs of the pairs (0 for none), may be NULL.
+/// @return 0 on success, 1 if the batch could not grow (the command is then
+///         left out of it and must run on its own).
+int write_batch_write(WriteBatch *batch, size_t count, const KvsString keys[], const KvsString values[],
+                      const unsigned long ttls_ms[]);
+
+/// Absorbs a DELETE command.
+/// @param batch Batch to be extended.
+/// @param count Number of keys.
+/// @param keys Keys to delete.
+/// @return 0 on success, 1 if the batch could not grow (the command is then
+///         left out of it and must run on its own).
+int write_batch_delete(WriteBatch *batch, size_t count, const KvsString keys[]);
+
+/// Checks whether the batch reached WRITE_BATCH_SIZE keys and should be applied.
+/// @param batch Batch to be checked.
+/// @return 1 if it is full, 0 otherwise.
+int write_batch_full(const WriteBatch *batch);
+
+/// Reorders the keys of the batch as their nodes would be created by running
+/// its commands one by one, which fixes where SHOW lists them.
+/// @param batch Batch to be reordered.
+/// @return 0 on success, 1 if there was no memory to sort (the batch is then
+///         left in first-seen order).
+int write_batch_sort(WriteBatch *batch);
+
+/// Empties the batch, keeping its buffers for the next commands.
+/// @param batch Batch to be emptied.
+void write_batch_clear(WriteBatch *batch);
+
+/// Frees the buffers of a batch.
+/// @param batch Batch to be freed.
+void write_batch_free(WriteBatch *batch);
+
+#endif  // KVS_COALESCE_H
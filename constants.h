@@ -1,4 +1,71 @@
 #define MAX_WRITE_SIZE 256
-#define MAX_STRING_SIZE 40
 #define MAX_JOB_FILE_NAME_SIZE 256
 
+#define REAPER_BATCH_SIZE 32
+#define REAPER_INTERVAL_MS 10
+#define EVICTION_SCAN_LIMIT 128
+#define BLOOM_CHECK_INTERVAL 4096 // lookups of missing keys between filter checks
+#define BLOOM_MAX_FP_PERCENT 5    // false positive rate that triggers a rebuild
+#define INDEX_MIGRATE_STEP 16     // index slots every lookup moves while the index grows
+#define INDEX_IDLE_STEP 1024      // index slots an idle thread moves per lock
+#define INTERN_STRIPES 16         // independently locked parts of the value intern table
+#define INTERN_MIN_BUCKETS 64     // first bucket count of a stripe, doubled when full
+
+#define SHARD_RING_SIZE 64      // messages per SPSC ring, power of two
+#define SHARD_MAX_PRODUCERS 64  // rows of rings, the first shared by the rest
+#define SHARD_IDLE_SPINS 200    // polls of an empty ring before sleeping
+
+#define OUTPUT_RING_SIZE 64     // io_uring entries per job thread
+#define OUTPUT_BATCH_SIZE 16    // writes queued before they are submitted
+#define OUTPUT_CHUNK_SIZE 4096  // output bytes staged per write
+
+#define TRACE_FLUSH_SIZE (64 * 1024) // trace bytes buffered per thread
+
+#define LOG_RING_SIZE (64 * 1024)    // message bytes buffered per logging thread, power of two
+#define LOG_MAX_RECORD 4096          // larger messages are written by their own thread
+#define LOG_BUFFER_SIZE (16 * 1024)  // formatted bytes the writer thread writes at once
+#define LOG_FLUSH_INTERVAL_MS 10     // longest a message waits for the writer thread
+
+#define JOBQ_WEIGHT_INTERACTIVE 8   // default share of the job threads for each class
+#define JOBQ_WEIGHT_NORMAL 4
+#define JOBQ_WEIGHT_BULK 1
+#define JOBQ_MAX_WEIGHT 1024        // largest weight --class-weights takes
+#define JOBQ_AGING_MS 500           // wait at the head of its class that moves a job ahead of the others
+#define JOBQ_PASS_SHIFT 16          // fixed point bits of the service counted per class
+
+#define REPLICA_FLUSH_INTERVAL_MS 10           // longest a change waits to be shipped, and the heartbeat
+#define REPLICA_FRAME_SIZE (64 * 1024)         // logged bytes that get shipped early
+#define REPLICA_MAX_PENDING (64 * 1024 * 1024) // logged bytes that cut the replicas off, never waited for
+#define REPLICA_SEND_TIMEOUT_MS 1000           // longest a replica may take a frame before it is dropped
+#define REPLICA_MAX_REPLICAS 16                // replicas a primary serves
+#define REPLICA_MAX_STALENESS_MS 100           // default age of the changes a replica read may miss
+#define REPLICA_CONNECT_TIMEOUT_MS 5000        // how long a replica waits for its primary to listen
+#define REPLICA_CONNECT_RETRY_MS 20            // between its attempts
+
+#define JOB_WINDOW_SIZE 32      // parsed commands a job looks ahead over
+#define WRITE_BATCH_SIZE 1024   // keys a job coalesces before applying them
+
+#define LOAD_SEGMENT_SIZE (16 * 1024 * 1024) // bytes of a LOAD file parsed at a time
+#define LOAD_MIN_CHUNK_SIZE (256 * 1024)     // smallest chunk given to a parser thread
+#define LOAD_MAX_THREADS 8                   // parser threads of a LOAD
+#define LOAD_BATCH_SIZE 4096                 // pairs inserted per lock
+#define PREFETCH_DISTANCE 8                  // keys of a batch looked up ahead
+
+#define HOTKEY_SAMPLE_RATE 16                // one READ key in this many feeds the sketch
+#define HOTKEY_SKETCH_DEPTH 4                // rows of the Count-Min sketch
+#define HOTKEY_SKETCH_WIDTH 4096             // counters per row, power of two
+#define HOTKEY_TOP 16                        // heavy hitters tracked
+#define HOTKEY_DECAY_SAMPLES 65536           // samples between halvings of every count
+#define HOTKEY_MIN_PERCENT 1                 // share of the samples a hot key must hold
+#define HOTKEY_CACHE_SLOTS 64                // entries of each thread's read cache, power of two
+#define HOTKEY_CACHE_ENTRY_SIZE 256          // key and value bytes a cache entry holds
+
+#define DUMP_MAX_THREADS 8                   // threads formatting a SHOW or BACKUP
+#define DUMP_PARALLEL_PAIRS 16384            // smaller dumps are formatted by one thread
+
+#define REGION_BASE_ADDRESS 0x300000000000ULL    // where every run maps a persistent table
+#define REGION_RESERVE_SIZE (1ULL << 38)         // address space kept free for it to grow
+#define REGION_GROW_SIZE (16 * 1024 * 1024)      // smallest growth of its file
+#define REGION_HUGE_PAGE_SIZE (2 * 1024 * 1024)  // alignment of a table in anonymous memory
+
+#define PLACEMENT_MAX_NODES 64                   // NUMA nodes a table can be placed on
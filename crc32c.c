@@ -0,0 +1,101 @@
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM 1
+#endif
+
+// Slicing by 8: crc_tables[k][b] is the checksum of byte b followed by k zero
+// bytes, so eight input bytes are folded in with independent lookups.
+static uint32_t crc_tables[8][256];
+static pthread_once_t crc_init_once = PTHREAD_ONCE_INIT;
+
+// Implementation picked once for this CPU, works on the inverted checksum.
+static uint32_t (*crc_update)(uint32_t crc, const unsigned char *bytes, size_t length);
+
+static uint32_t update_table(uint32_t crc, const unsigned char *bytes, size_t length) {
+    while (length >= 8) {
+        uint32_t low = crc ^ ((uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 |
+                              (uint32_t)bytes[3] << 24);
+        crc = crc_tables[7][low & 0xFF] ^ crc_tables[6][(low >> 8) & 0xFF] ^ crc_tables[5][(low >> 16) & 0xFF] ^
+              crc_tables[4][low >> 24] ^ crc_tables[3][bytes[4]] ^ crc_tables[2][bytes[5]] ^
+              crc_tables[1][bytes[6]] ^ crc_tables[0][bytes[7]];
+        bytes += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = crc_tables[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CRC32C_SSE42
+__attribute__((target("sse4.2"))) static uint32_t update_sse42(uint32_t crc, const unsigned char *bytes,
+                                                                 size_t length) {
+    uint64_t wide = crc;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        wide = _mm_crc32_u64(wide, word);
+        bytes += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)wide;
+    while (length-- > 0) {
+        crc = _mm_crc32_u8(crc, *bytes++);
+    }
+    return crc;
+}
+#endif
+
+#ifdef CRC32C_ARM
+static uint32_t update_arm(uint32_t crc, const unsigned char *bytes, size_t length) {
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        crc = __crc32cd(crc, word);
+        bytes += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = __crc32cb(crc, *bytes++);
+    }
+    return crc;
+}
+#endif
+
+static void init_crc(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78u : crc >> 1;
+        }
+        crc_tables[0][i] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t previous = crc_tables[k - 1][i];
+            crc_tables[k][i] = (previous >> 8) ^ crc_tables[0][previous & 0xFF];
+        }
+    }
+
+    crc_update = update_table;
+#if defined(CRC32C_SSE42)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_update = update_sse42;
+    }
+#elif defined(CRC32C_ARM)
+    crc_update = update_arm;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+    pthread_once(&crc_init_once, init_crc);
+    return ~crc_update(~crc, data, length);
+}
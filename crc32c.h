@@ -0,0 +1,14 @@
+#ifndef KVS_CRC32C_H
+#define KVS_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Extends a CRC32C (Castagnoli) checksum with more bytes.
+/// @param crc Checksum of the previous bytes, 0 to start a new one.
+/// @param data Bytes to add.
+/// @param length Number of bytes to add.
+/// @return Checksum of all the bytes so far.
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+#endif  // KVS_CRC32C_H
@@ -0,0 +1,221 @@
+#define _GNU_SOURCE // fallocate, sysconf(_SC_NPROCESSORS_ONLN)
+#include "dump.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "constants.h"
+#include "crc32c.h"
+
+/// Grows the lines of a chain to hold extra more bytes.
+static int reserve_lines(KvsString *lines, size_t extra) {
+    if (lines->len + extra <= lines->cap) return 0;
+    size_t cap = lines->cap ? lines->cap * 2 : 4096;
+    while (cap < lines->len + extra) {
+        cap *= 2;
+    }
+    char *data = realloc(lines->data, cap);
+    if (!data) return 1;
+    lines->data = data;
+    lines->cap = cap;
+    return 0;
+}
+
+/// Formats the lines of a bucket, walking its chains once.
+static int format_chain(DumpChain *chain, unsigned long long now) {
+    KeyNode *keyNode;
+    while ((keyNode = bucket_next(chain->cursors, chain->tables)) != NULL) {
+        if (pair_expired(keyNode, now)) {
+            continue; // not reaped yet but already gone for readers
+        }
+        size_t line = keyNode->key_len + keyNode->value_len + 5; // "(", ", ", ")\n"
+        if (reserve_lines(&chain->lines, line) != 0) return 1;
+
+        char *out = chain->lines.data + chain->lines.len;
+        *out++ = '(';
+        memcpy(out, keyNode->key, keyNode->key_len);
+        out += keyNode->key_len;
+        *out++ = ',';
+        *out++ = ' ';
+        memcpy(out, keyNode->value, keyNode->value_len);
+        out += keyNode->value_len;
+        *out++ = ')';
+        *out++ = '\n';
+        chain->lines.len += line;
+        chain->entries++;
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, const char *data, size_t length, size_t offset) {
+    while (length > 0) {
+        ssize_t written = pwrite(fd, data, length, (off_t)offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        data += written;
+        length -= (size_t)written;
+        offset += (size_t)written;
+    }
+    return 0;
+}
+
+// Chains of a dump being processed, taken by the workers one at a time.
+typedef struct DumpJob {
+    DumpPlan *plan;
+    unsigned long long now;
+    atomic_size_t next;       // next chain to take
+    atomic_int failed;
+} DumpJob;
+
+static void *dump_worker(void *arg) {
+    DumpJob *job = arg;
+    while (!atomic_load(&job->failed)) {
+        size_t i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->plan->count) break;
+        if (format_chain(&job->plan->chains[i], job->now) != 0) {
+            atomic_store(&job->failed, 1);
+        }
+    }
+    return NULL;
+}
+
+/// Runs the workers formatting a dump, the calling thread being one of them.
+/// @param threads Workers wanted, at most DUMP_MAX_THREADS.
+static int run_dump(DumpPlan *plan, unsigned long long now, size_t threads) {
+    DumpJob job = {.plan = plan, .now = now};
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, 0);
+    if (threads > plan->count) threads = plan->count;
+
+    // A worker that cannot start leaves its chains to the others
+    pthread_t workers[DUMP_MAX_THREADS];
+    int started[DUMP_MAX_THREADS] = {0};
+    for (size_t i = 1; i < threads; i++) {
+        started[i] = pthread_create(&workers[i], NULL, dump_worker, &job) == 0;
+    }
+    dump_worker(&job);
+    for (size_t i = 1; i < threads; i++) {
+        if (started[i]) {
+            pthread_join(workers[i], NULL);
+        }
+    }
+    return atomic_load(&job.failed);
+}
+
+/// Workers for a dump of pairs pairs: small dumps are not worth the threads
+/// and run on the caller alone.
+static size_t dump_threads(size_t pairs) {
+    if (pairs < DUMP_PARALLEL_PAIRS) return 1;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus < 1 ? 1 : cpus > DUMP_MAX_THREADS ? DUMP_MAX_THREADS : (size_t)cpus;
+}
+
+int dump_format(DumpPlan *plan, HashTable **tables, size_t count, unsigned long long now) {
+    memset(plan, 0, sizeof(*plan));
+
+    size_t chains = 0, pairs = 0;
+    for (size_t t = 0; t < count; t++) {
+        pairs += tables[t]->count;
+        for (int i = 0; i < TABLE_SIZE; i++) {
+            chains += tables[t]->table[i] != NULL;
+        }
+    }
+    if (chains == 0) return 0;
+
+    // Each bucket gets the cursors of the tables it has nodes in
+    plan->chains = calloc(chains, sizeof(DumpChain));
+    plan->heads = malloc(chains * sizeof(KeyNode *));
+    if (!plan->chains || !plan->heads) {
+        dump_free(plan);
+        return 1;
+    }
+    size_t heads = 0;
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        size_t first = heads;
+        for (size_t t = 0; t < count; t++) {
+            if (tables[t]->table[i] != NULL) {
+                plan->heads[heads++] = tables[t]->table[i];
+            }
+        }
+        if (heads > first) {
+            plan->chains[plan->count].cursors = plan->heads + first;
+            plan->chains[plan->count++].tables = heads - first;
+        }
+    }
+
+    if (run_dump(plan, now, dump_threads(pairs)) != 0) {
+        dump_free(plan);
+        return 1;
+    }
+
+    // Every chain starts where the ones before it end
+    for (size_t i = 0; i < plan->count; i++) {
+        plan->chains[i].offset = plan->bytes;
+        plan->bytes += plan->chains[i].lines.len;
+        plan->entries += plan->chains[i].entries;
+    }
+    return 0;
+}
+
+void dump_to_buffer(const DumpPlan *plan, char *buffer) {
+    for (size_t i = 0; i < plan->count; i++) {
+        if (plan->chains[i].lines.len > 0) {
+            memcpy(buffer + plan->chains[i].offset, plan->chains[i].lines.data, plan->chains[i].lines.len);
+        }
+    }
+}
+
+int dump_to_file(const DumpPlan *plan, int fd) {
+    // Reserve the blocks up front, only running out of space is an error
+    if (plan->bytes > 0 && fallocate(fd, 0, 0, (off_t)plan->bytes) != 0 && errno == ENOSPC) {
+        return 1;
+    }
+
+    // Buffered writes to one file serialize on its inode anyway, so the
+    // chains are written by the caller, each at its own offset
+    for (size_t i = 0; i < plan->count; i++) {
+        const DumpChain *chain = &plan->chains[i];
+        if (pwrite_all(fd, chain->lines.data, chain->lines.len, chain->offset) != 0) return 1;
+    }
+    return 0;
+}
+
+uint32_t *dump_checksums(const DumpPlan *plan, size_t block_size, size_t *blocks) {
+    *blocks = (plan->bytes + block_size - 1) / block_size;
+    uint32_t *crcs = calloc(*blocks, sizeof(uint32_t));
+    if (!crcs) return NULL;
+
+    // Blocks cut across chains, each checksum is extended chain by chain
+    size_t block = 0, filled = 0;
+    for (size_t i = 0; i < plan->count; i++) {
+        const char *data = plan->chains[i].lines.data;
+        size_t left = plan->chains[i].lines.len;
+        while (left > 0) {
+            size_t chunk = left < block_size - filled ? left : block_size - filled;
+            crcs[block] = crc32c(crcs[block], data, chunk);
+            data += chunk;
+            left -= chunk;
+            filled += chunk;
+            if (filled == block_size) {
+                block++;
+                filled = 0;
+            }
+        }
+    }
+    return crcs;
+}
+
+void dump_free(DumpPlan *plan) {
+    for (size_t i = 0; i < plan->count; i++) {
+        free(plan->chains[i].lines.data);
+    }
+    free(plan->chains);
+    free(plan->heads);
+    memset(plan, 0, sizeof(*plan));
+}
@@ -0,0 +1,64 @@
+#ifndef KVS_DUMP_H
+#define KVS_DUMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kvs.h"
+
+// Parallel formatting of the "(key, value)\n" lines that SHOW and plain
+// backups list. Every non-empty bucket is a unit of work: worker threads
+// take the buckets and format each one into its own buffer, walking its
+// chains once, merged across the tables by bucket_next. A prefix sum over
+// the buckets, in output order, then gives every buffer its offset in the
+// output, which is byte for byte what a single thread walking the buckets
+// would produce.
+
+/// Lines of one bucket.
+typedef struct DumpChain {
+    KeyNode **cursors;        // chains of the bucket in each table, consumed
+    size_t tables;
+    KvsString lines;
+    size_t offset;            // where the lines start in the output
+    size_t entries;           // lines formatted
+} DumpChain;
+
+typedef struct DumpPlan {
+    DumpChain *chains;        // in output order
+    KeyNode **heads;          // cursors of every chain
+    size_t count;
+    size_t bytes;             // size of the whole output
+    size_t entries;           // lines of the whole output
+} DumpPlan;
+
+/// Formats the pairs of a set of tables, which must not change meanwhile.
+/// @param plan Filled with the lines of every chain and their offsets.
+/// @param tables Tables to dump.
+/// @param count Number of tables.
+/// @param now Current time from wheel_clock_ms(), pairs expired by then are skipped.
+/// @return 0 on success, 1 if the lines could not be allocated.
+int dump_format(DumpPlan *plan, HashTable **tables, size_t count, unsigned long long now);
+
+/// Copies the formatted lines into one buffer.
+/// @param plan Formatted dump.
+/// @param buffer At least plan->bytes bytes.
+void dump_to_buffer(const DumpPlan *plan, char *buffer);
+
+/// Writes the formatted lines at the start of a file, preallocating it first.
+/// @param plan Formatted dump.
+/// @param fd File to write to, owned by the caller.
+/// @return 0 on success, 1 if writing failed.
+int dump_to_file(const DumpPlan *plan, int fd);
+
+/// Checksums the output in blocks, as a plain backup's .sum file lists them.
+/// @param plan Formatted dump.
+/// @param block_size Bytes per block.
+/// @param blocks Set to the number of blocks.
+/// @return CRC32C of every block, to be freed by the caller, NULL if it
+///         could not be allocated (or for an empty output).
+uint32_t *dump_checksums(const DumpPlan *plan, size_t block_size, size_t *blocks);
+
+/// Frees the lines of a dump.
+/// @param plan Dump to be freed.
+void dump_free(DumpPlan *plan);
+
+#endif  // KVS_DUMP_H
@@ -0,0 +1,266 @@
+#include "hotkey.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "constants.h"
+
+/// Heap entry of a heavy hitter.
+typedef struct HeavyHitter {
+    char *key;                    // NUL-terminated copy
+    size_t key_len;
+    uint64_t hash;
+    uint32_t estimate;            // sampled reads, from the sketch
+} HeavyHitter;
+
+// Sketch and heap, shared by every thread behind hotkey_mutex
+static uint32_t sketch[HOTKEY_SKETCH_DEPTH][HOTKEY_SKETCH_WIDTH];
+static HeavyHitter heap[HOTKEY_TOP]; // min-heap on the estimate
+static size_t heap_size = 0;
+static uint32_t samples = 0;         // decayed together with the counters
+static pthread_mutex_t hotkey_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Hashes of the hot keys, read without the lock, 0 for an unused slot
+static _Atomic uint64_t hot_hashes[HOTKEY_TOP];
+static atomic_ulong write_epoch = 1; // cache entries of epoch 0 are empty
+static atomic_size_t cache_hits = 0;
+
+/// Entry of a thread's read cache.
+typedef struct CacheEntry {
+    uint64_t hash;
+    unsigned long epoch;
+    unsigned long long expires_at;
+    size_t key_len;
+    size_t value_len;
+    char data[HOTKEY_CACHE_ENTRY_SIZE]; // key, then value
+} CacheEntry;
+
+static _Thread_local CacheEntry cache[HOTKEY_CACHE_SLOTS];
+static _Thread_local unsigned int sample_countdown = 0; // reads until the next sample
+static _Thread_local uint32_t sample_random = 0;        // xorshift state, 0 until seeded
+static _Thread_local size_t pending_hits = 0; // added to cache_hits in batches
+
+uint64_t hotkey_hash(const KvsString *key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < key->len; i++) {
+        hash = (hash ^ (unsigned char)key->data[i]) * 1099511628211ULL;
+    }
+    // FNV-1a leaves the high bits weak, the sketch rows use them
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    return hash != 0 ? hash : 1;
+}
+
+static void swap_hitters(size_t a, size_t b) {
+    HeavyHitter temp = heap[a];
+    heap[a] = heap[b];
+    heap[b] = temp;
+}
+
+static void sift_up(size_t i) {
+    while (i > 0 && heap[(i - 1) / 2].estimate > heap[i].estimate) {
+        swap_hitters(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void sift_down(size_t i) {
+    for (;;) {
+        size_t smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < heap_size && heap[left].estimate < heap[smallest].estimate) smallest = left;
+        if (right < heap_size && heap[right].estimate < heap[smallest].estimate) smallest = right;
+        if (smallest == i) return;
+        swap_hitters(i, smallest);
+        i = smallest;
+    }
+}
+
+/// Counts one more sample of a key and returns its estimate, the smallest
+/// of its counters.
+static uint32_t count_sample(uint64_t hash) {
+    uint32_t first = (uint32_t)hash, step = (uint32_t)(hash >> 32) | 1;
+    uint32_t estimate = UINT32_MAX;
+    for (uint32_t row = 0; row < HOTKEY_SKETCH_DEPTH; row++) {
+        uint32_t *counter = &sketch[row][(first + row * step) & (HOTKEY_SKETCH_WIDTH - 1)];
+        if (*counter < UINT32_MAX) (*counter)++;
+        if (*counter < estimate) estimate = *counter;
+    }
+    return estimate;
+}
+
+/// Moves a key into the heap if its estimate beats the coldest one.
+static void offer_hitter(const KvsString *key, uint64_t hash, uint32_t estimate) {
+    for (size_t i = 0; i < heap_size; i++) {
+        if (heap[i].hash == hash && heap[i].key_len == key->len && memcmp(heap[i].key, key->data, key->len) == 0) {
+            heap[i].estimate = estimate; // estimates only grow between decays
+            sift_down(i);
+            return;
+        }
+    }
+    if (heap_size == HOTKEY_TOP && estimate <= heap[0].estimate) return;
+
+    char *copy = malloc(key->len + 1);
+    if (!copy) return;
+    memcpy(copy, key->data, key->len);
+    copy[key->len] = '\0';
+
+    HeavyHitter hitter = {.key = copy, .key_len = key->len, .hash = hash, .estimate = estimate};
+    if (heap_size < HOTKEY_TOP) {
+        heap[heap_size++] = hitter;
+        sift_up(heap_size - 1);
+    } else {
+        free(heap[0].key);
+        heap[0] = hitter;
+        sift_down(0);
+    }
+}
+
+/// Halves every count so that keys that cooled down leave the heap.
+static void decay(void) {
+    for (int row = 0; row < HOTKEY_SKETCH_DEPTH; row++) {
+        for (int i = 0; i < HOTKEY_SKETCH_WIDTH; i++) {
+            sketch[row][i] /= 2;
+        }
+    }
+    for (size_t i = 0; i < heap_size; i++) {
+        heap[i].estimate /= 2;
+    }
+    samples /= 2;
+}
+
+/// Publishes the hashes of the heap entries that are hot enough.
+static void publish_hot(void) {
+    for (size_t i = 0; i < HOTKEY_TOP; i++) {
+        uint64_t hash = 0;
+        // seen more than once and holding its share of the samples
+        if (i < heap_size && heap[i].estimate > 1 &&
+            (uint64_t)heap[i].estimate * 100 >= (uint64_t)samples * HOTKEY_MIN_PERCENT) {
+            hash = heap[i].hash;
+        }
+        if (atomic_load_explicit(&hot_hashes[i], memory_order_relaxed) != hash) {
+            atomic_store_explicit(&hot_hashes[i], hash, memory_order_relaxed);
+        }
+    }
+}
+
+/// Reads to skip before the next sample, HOTKEY_SAMPLE_RATE on average. A
+/// fixed interval would keep sampling the same key of a periodic pattern.
+static unsigned int next_countdown(void) {
+    if (sample_random == 0) {
+        sample_random = (uint32_t)(uintptr_t)&sample_random | 1;
+    }
+    sample_random ^= sample_random << 13;
+    sample_random ^= sample_random >> 17;
+    sample_random ^= sample_random << 5;
+    return 1 + sample_random % (2 * HOTKEY_SAMPLE_RATE - 1);
+}
+
+void hotkey_record(const KvsString *key, uint64_t hash) {
+    if (sample_countdown > 1) {
+        sample_countdown--;
+        return;
+    }
+    sample_countdown = next_countdown();
+
+    pthread_mutex_lock(&hotkey_mutex);
+    samples++;
+    offer_hitter(key, hash, count_sample(hash));
+    if (samples >= HOTKEY_DECAY_SAMPLES) {
+        decay();
+    }
+    publish_hot();
+    pthread_mutex_unlock(&hotkey_mutex);
+}
+
+int hotkey_is_hot(uint64_t hash) {
+    for (size_t i = 0; i < HOTKEY_TOP; i++) {
+        if (atomic_load_explicit(&hot_hashes[i], memory_order_relaxed) == hash) return 1;
+    }
+    return 0;
+}
+
+unsigned long hotkey_epoch(void) {
+    return atomic_load_explicit(&write_epoch, memory_order_acquire);
+}
+
+void hotkey_invalidate(void) {
+    atomic_fetch_add_explicit(&write_epoch, 1, memory_order_release);
+}
+
+char *hotkey_cache_get(const KvsString *key, uint64_t hash, unsigned long epoch, unsigned long long now,
+                       size_t *value_len) {
+    CacheEntry *entry = &cache[hash & (HOTKEY_CACHE_SLOTS - 1)];
+    if (entry->epoch != epoch || entry->hash != hash || entry->key_len != key->len ||
+        memcmp(entry->data, key->data, key->len) != 0) {
+        return NULL;
+    }
+    if (entry->expires_at != 0 && entry->expires_at <= now) return NULL;
+
+    char *value = malloc(entry->value_len + 1);
+    if (!value) return NULL;
+    memcpy(value, entry->data + entry->key_len, entry->value_len);
+    value[entry->value_len] = '\0';
+    *value_len = entry->value_len;
+
+    if (++pending_hits == HOTKEY_SAMPLE_RATE) {
+        atomic_fetch_add_explicit(&cache_hits, pending_hits, memory_order_relaxed);
+        pending_hits = 0;
+    }
+    return value;
+}
+
+void hotkey_cache_put(const KvsString *key, uint64_t hash, unsigned long epoch, unsigned long long expires_at,
+                      const char *value, size_t value_len) {
+    if (key->len + value_len > HOTKEY_CACHE_ENTRY_SIZE) return;
+
+    CacheEntry *entry = &cache[hash & (HOTKEY_CACHE_SLOTS - 1)];
+    entry->hash = hash;
+    entry->epoch = epoch;
+    entry->expires_at = expires_at;
+    entry->key_len = key->len;
+    entry->value_len = value_len;
+    memcpy(entry->data, key->data, key->len);
+    memcpy(entry->data + key->len, value, value_len);
+}
+
+static int compare_hot(const void *a, const void *b) {
+    const HotKey *x = a, *y = b;
+    return (x->reads < y->reads) - (x->reads > y->reads);
+}
+
+size_t hotkey_top(HotKey keys[], size_t *hits) {
+    pthread_mutex_lock(&hotkey_mutex);
+    size_t count = 0;
+    for (size_t i = 0; i < heap_size; i++) {
+        keys[count].key = malloc(heap[i].key_len + 1);
+        if (keys[count].key == NULL) continue;
+        memcpy(keys[count].key, heap[i].key, heap[i].key_len + 1);
+        keys[count].reads = (size_t)heap[i].estimate * HOTKEY_SAMPLE_RATE;
+        count++;
+    }
+    pthread_mutex_unlock(&hotkey_mutex);
+
+    qsort(keys, count, sizeof(HotKey), compare_hot);
+    *hits = atomic_load_explicit(&cache_hits, memory_order_relaxed);
+    return count;
+}
+
+void hotkey_free_top(HotKey keys[], size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(keys[i].key);
+    }
+}
+
+void hotkey_free(void) {
+    pthread_mutex_lock(&hotkey_mutex);
+    for (size_t i = 0; i < heap_size; i++) {
+        free(heap[i].key);
+    }
+    heap_size = 0;
+    samples = 0;
+    memset(sketch, 0, sizeof(sketch));
+    publish_hot();
+    pthread_mutex_unlock(&hotkey_mutex);
+}
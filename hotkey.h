@@ -0,0 +1,82 @@
+#ifndef KVS_HOTKEY_H
+#define KVS_HOTKEY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kvs.h"
+
+// Heavy hitter tracking for READs. One key in HOTKEY_SAMPLE_RATE is counted
+// in a Count-Min sketch, and a min-heap keeps the HOTKEY_TOP keys with the
+// highest estimates. The heap entries holding at least HOTKEY_MIN_PERCENT
+// of the samples are the hot keys. Every count is halved after
+// HOTKEY_DECAY_SAMPLES samples, so the hot set follows the current load.
+//
+// Every thread also keeps a small read cache of hot keys. Its entries are
+// tagged with the write epoch, a global counter bumped by every change to
+// the table, so they are only served while nothing was written since.
+// Entries of keys with a TTL also stop being served at its deadline.
+
+typedef struct HotKey {
+    char *key;                    // NUL-terminated copy
+    size_t reads;                 // estimated reads, sampling undone
+} HotKey;
+
+/// Hashes a key for hotkey_record and the cache.
+/// @param key Key to hash.
+/// @return Hash of the key.
+uint64_t hotkey_hash(const KvsString *key);
+
+/// Counts a READ of a key, one call in HOTKEY_SAMPLE_RATE of each thread
+/// being sampled.
+/// @param key Key read.
+/// @param hash Hash from hotkey_hash.
+void hotkey_record(const KvsString *key, uint64_t hash);
+
+/// Checks whether a key is one of the hot keys.
+/// @param hash Hash from hotkey_hash.
+/// @return 1 if it is, 0 otherwise.
+int hotkey_is_hot(uint64_t hash);
+
+/// Current write epoch.
+unsigned long hotkey_epoch(void);
+
+/// Bumps the write epoch, which drops every cached value. Must be called
+/// by writers before the change can be seen by a reader filling its cache.
+void hotkey_invalidate(void);
+
+/// Looks a key up in the calling thread's cache.
+/// @param key Key to read.
+/// @param hash Hash from hotkey_hash.
+/// @param epoch Write epoch the value must have been read at, the same for
+///              every key of a READ so that they agree with each other.
+/// @param now Current time from wheel_clock_ms().
+/// @param value_len Set to the length of the value when found.
+/// @return Newly allocated copy of the value, NULL if it is not cached.
+char *hotkey_cache_get(const KvsString *key, uint64_t hash, unsigned long epoch, unsigned long long now,
+                       size_t *value_len);
+
+/// Stores the value of a hot key in the calling thread's cache. Keys and
+/// values too long for an entry are not cached.
+/// @param key Key read.
+/// @param hash Hash from hotkey_hash.
+/// @param epoch Write epoch the value was read at.
+/// @param expires_at Deadline of the key's TTL, 0 for none.
+/// @param value Value read.
+/// @param value_len Length of the value.
+void hotkey_cache_put(const KvsString *key, uint64_t hash, unsigned long epoch, unsigned long long expires_at,
+                      const char *value, size_t value_len);
+
+/// Lists the heavy hitters, hottest first.
+/// @param keys Filled with up to HOTKEY_TOP keys, to be freed with
+///             hotkey_free_top.
+/// @param hits Set to the READs served by the caches so far.
+/// @return Number of keys listed.
+size_t hotkey_top(HotKey keys[], size_t *hits);
+
+/// Frees the keys listed by hotkey_top.
+void hotkey_free_top(HotKey keys[], size_t count);
+
+/// Frees the heavy hitters.
+void hotkey_free(void);
+
+#endif  // KVS_HOTKEY_H
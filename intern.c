@@ -0,0 +1,171 @@
+#include "intern.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "constants.h"
+
+typedef struct InternValue {
+    struct InternValue *next;   // next value of the bucket
+    uint64_t hash;
+    size_t references;
+    size_t len;
+    char data[];                // value, NUL-terminated
+} InternValue;
+
+typedef struct InternStripe {
+    pthread_mutex_t mutex;
+    InternValue **buckets;
+    size_t capacity;            // power of two, 0 until the first value
+    size_t values;
+    size_t references;
+    size_t logical_bytes;
+    size_t stored_bytes;
+} InternStripe;
+
+static InternStripe stripes[INTERN_STRIPES];
+static pthread_once_t stripes_once = PTHREAD_ONCE_INIT;
+
+static void init_stripes(void) {
+    for (size_t i = 0; i < INTERN_STRIPES; i++) {
+        pthread_mutex_init(&stripes[i].mutex, NULL);
+    }
+}
+
+/// Bytes malloc really uses for a request, rounded as in kvs.c.
+static size_t alloc_size(size_t bytes) {
+    size_t chunk = (bytes + sizeof(size_t) + 15) & ~(size_t)15;
+    return chunk < 32 ? 32 : chunk;
+}
+
+static uint64_t value_hash(const char *data, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Stripe of a value, from the high bits of its hash (the buckets use the low ones).
+static InternStripe *value_stripe(uint64_t hash) {
+    return &stripes[(hash >> 56) % INTERN_STRIPES];
+}
+
+/// Doubles the buckets of a stripe.
+/// @return 0 on success, 1 if they could not be allocated.
+static int grow_stripe(InternStripe *stripe) {
+    size_t capacity = stripe->capacity ? stripe->capacity * 2 : INTERN_MIN_BUCKETS;
+    InternValue **buckets = calloc(capacity, sizeof(InternValue *));
+    if (!buckets) return 1;
+
+    for (size_t i = 0; i < stripe->capacity; i++) {
+        InternValue *value = stripe->buckets[i];
+        while (value != NULL) {
+            InternValue *next = value->next;
+            size_t bucket = value->hash & (capacity - 1);
+            value->next = buckets[bucket];
+            buckets[bucket] = value;
+            value = next;
+        }
+    }
+
+    if (stripe->buckets != NULL) {
+        stripe->stored_bytes -= alloc_size(stripe->capacity * sizeof(InternValue *));
+        free(stripe->buckets);
+    }
+    stripe->stored_bytes += alloc_size(capacity * sizeof(InternValue *));
+    stripe->buckets = buckets;
+    stripe->capacity = capacity;
+    return 0;
+}
+
+const char *intern_acquire(const char *data, size_t len) {
+    pthread_once(&stripes_once, init_stripes);
+    uint64_t hash = value_hash(data, len);
+    InternStripe *stripe = value_stripe(hash);
+    pthread_mutex_lock(&stripe->mutex);
+
+    InternValue *value = NULL;
+    if (stripe->capacity > 0) {
+        value = stripe->buckets[hash & (stripe->capacity - 1)];
+        while (value != NULL && !(value->hash == hash && value->len == len && memcmp(value->data, data, len) == 0)) {
+            value = value->next;
+        }
+    }
+
+    if (value == NULL) {
+        if (stripe->values >= stripe->capacity && grow_stripe(stripe) != 0) {
+            pthread_mutex_unlock(&stripe->mutex);
+            return NULL;
+        }
+        value = malloc(sizeof(InternValue) + len + 1);
+        if (!value) {
+            pthread_mutex_unlock(&stripe->mutex);
+            return NULL;
+        }
+        memcpy(value->data, data, len);
+        value->data[len] = '\0';
+        value->hash = hash;
+        value->len = len;
+        value->references = 0;
+        size_t bucket = hash & (stripe->capacity - 1);
+        value->next = stripe->buckets[bucket];
+        stripe->buckets[bucket] = value;
+        stripe->values++;
+        stripe->stored_bytes += alloc_size(sizeof(InternValue) + len + 1);
+    }
+
+    value->references++;
+    stripe->references++;
+    stripe->logical_bytes += alloc_size(len + 1);
+    pthread_mutex_unlock(&stripe->mutex);
+    return value->data;
+}
+
+void intern_release(const char *data) {
+    InternValue *value = (InternValue *)(data - offsetof(InternValue, data));
+    InternStripe *stripe = value_stripe(value->hash);
+    pthread_mutex_lock(&stripe->mutex);
+
+    stripe->references--;
+    stripe->logical_bytes -= alloc_size(value->len + 1);
+    if (--value->references == 0) {
+        InternValue **link = &stripe->buckets[value->hash & (stripe->capacity - 1)];
+        while (*link != value) {
+            link = &(*link)->next;
+        }
+        *link = value->next;
+        stripe->values--;
+        stripe->stored_bytes -= alloc_size(sizeof(InternValue) + value->len + 1);
+        free(value);
+    }
+    pthread_mutex_unlock(&stripe->mutex);
+}
+
+void intern_stats(InternStats *stats) {
+    pthread_once(&stripes_once, init_stripes);
+    memset(stats, 0, sizeof(*stats));
+    for (size_t i = 0; i < INTERN_STRIPES; i++) {
+        pthread_mutex_lock(&stripes[i].mutex);
+        stats->values += stripes[i].values;
+        stats->references += stripes[i].references;
+        stats->logical_bytes += stripes[i].logical_bytes;
+        stats->stored_bytes += stripes[i].stored_bytes;
+        pthread_mutex_unlock(&stripes[i].mutex);
+    }
+}
+
+void intern_free(void) {
+    pthread_once(&stripes_once, init_stripes);
+    for (size_t i = 0; i < INTERN_STRIPES; i++) {
+        pthread_mutex_lock(&stripes[i].mutex);
+        if (stripes[i].values == 0) {
+            free(stripes[i].buckets);
+            stripes[i].buckets = NULL;
+            stripes[i].capacity = 0;
+            stripes[i].stored_bytes = 0;
+        }
+        pthread_mutex_unlock(&stripes[i].mutex);
+    }
+}
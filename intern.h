@@ -0,0 +1,36 @@
+#ifndef KVS_INTERN_H
+#define KVS_INTERN_H
+
+#include <stddef.h>
+
+// Process-wide table of reference-counted values, shared by every KVS table
+// (and shard) that has value interning on. Equal values are stored once and
+// every node holding one points at the same NUL-terminated bytes. The table
+// is split in INTERN_STRIPES independent hash tables, each behind its own
+// lock, so writers of different values rarely wait for each other.
+
+typedef struct InternStats {
+    size_t values;          // distinct values stored
+    size_t references;      // nodes pointing at them
+    size_t logical_bytes;   // what the references would take as private copies
+    size_t stored_bytes;    // what the shared values and buckets really take
+} InternStats;
+
+/// Takes a reference to the shared copy of a value, storing it on first use.
+/// @param data Bytes of the value.
+/// @param len Length of the value.
+/// @return The shared NUL-terminated value, NULL if it could not be allocated.
+const char *intern_acquire(const char *data, size_t len);
+
+/// Drops a reference taken by intern_acquire, freeing the value with the last.
+/// @param value Value returned by intern_acquire.
+void intern_release(const char *value);
+
+/// Adds up the counters of every stripe.
+/// @param stats Filled with the totals.
+void intern_stats(InternStats *stats);
+
+/// Frees the buckets left once every value was released.
+void intern_free(void);
+
+#endif  // KVS_INTERN_H
@@ -0,0 +1,398 @@
+#include "jobc.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "constants.h"
+#include "crc32c.h"
+#include "logger.h"
+
+#define JOBC_DIAGNOSTIC 0xFF // record of a message printed by the parser
+#define JOBC_FIXED_HEADER_SIZE 36 // header fields before the path
+
+static void put_bytes(JobcWriter *writer, const void *data, size_t length) {
+    if (writer->failed) return;
+
+    if (writer->len + length > writer->cap) {
+        size_t cap = writer->cap ? writer->cap : 4096;
+        while (writer->len + length > cap) {
+            cap *= 2;
+        }
+        unsigned char *grown = realloc(writer->data, cap);
+        if (!grown) {
+            writer->failed = 1;
+            return;
+        }
+        writer->data = grown;
+        writer->cap = cap;
+    }
+
+    memcpy(writer->data + writer->len, data, length);
+    writer->len += length;
+}
+
+static void put_u8(JobcWriter *writer, unsigned char value) {
+    put_bytes(writer, &value, 1);
+}
+
+static void put_u32(JobcWriter *writer, uint32_t value) {
+    unsigned char bytes[4];
+    for (int i = 0; i < 4; i++) {
+        bytes[i] = (unsigned char)(value >> (8 * i));
+    }
+    put_bytes(writer, bytes, sizeof(bytes));
+}
+
+static void put_u64(JobcWriter *writer, uint64_t value) {
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = (unsigned char)(value >> (8 * i));
+    }
+    put_bytes(writer, bytes, sizeof(bytes));
+}
+
+static void put_string(JobcWriter *writer, const char *data, size_t length) {
+    put_u32(writer, (uint32_t)length);
+    put_bytes(writer, data, length);
+    put_u8(writer, '\0');
+}
+
+static uint32_t get_u32(const unsigned char *data) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= (uint32_t)data[i] << (8 * i);
+    }
+    return value;
+}
+
+static uint64_t get_u64(const unsigned char *data) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value |= (uint64_t)data[i] << (8 * i);
+    }
+    return value;
+}
+
+// Path of the cache of a job file, NULL on allocation failure.
+static char *cache_path(const char *job_path) {
+    size_t length = strlen(job_path);
+    char *path = malloc(length + sizeof(JOBC_SUFFIX));
+    if (path) {
+        memcpy(path, job_path, length);
+        memcpy(path + length, JOBC_SUFFIX, sizeof(JOBC_SUFFIX));
+    }
+    return path;
+}
+
+// Header identifying the job the cache was compiled from.
+static void put_header(JobcWriter *writer, const char *job_path, const struct stat *job) {
+    put_bytes(writer, JOBC_MAGIC, 4);
+    put_u32(writer, JOBC_VERSION);
+    put_u64(writer, (uint64_t)job->st_size);
+    put_u64(writer, (uint64_t)job->st_mtim.tv_sec);
+    put_u64(writer, (uint64_t)job->st_mtim.tv_nsec);
+    put_u32(writer, (uint32_t)strlen(job_path));
+    put_bytes(writer, job_path, strlen(job_path));
+}
+
+int jobc_open(JobcReader *reader, const char *job_path, const struct stat *job) {
+    memset(reader, 0, sizeof(*reader));
+
+    char *path = cache_path(job_path);
+    if (!path) return 1;
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1) return 1;
+
+    struct stat cache;
+    if (fstat(fd, &cache) != 0 || cache.st_size < JOBC_FIXED_HEADER_SIZE) {
+        close(fd);
+        return 1;
+    }
+    reader->size = (size_t)cache.st_size;
+    reader->map = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (reader->map == MAP_FAILED) {
+        reader->map = NULL;
+        return 1;
+    }
+
+    // Compare the recorded header with the one the job would get now
+    JobcWriter expected = {0};
+    put_header(&expected, job_path, job);
+    size_t header = expected.len;
+    int valid = !expected.failed && reader->size >= header + 12 &&
+                memcmp(reader->map, expected.data, header) == 0 &&
+                get_u64(reader->map + header) == reader->size - header - 12 &&
+                get_u32(reader->map + header + 8) ==
+                    crc32c(0, reader->map + header + 12, reader->size - header - 12);
+    free(expected.data);
+
+    CommandArgs *args = &reader->args;
+    if (valid) {
+        args->keys = calloc(MAX_WRITE_SIZE, sizeof(KvsString));
+        args->values = calloc(MAX_WRITE_SIZE, sizeof(KvsString));
+        args->versions = calloc(MAX_WRITE_SIZE, sizeof(unsigned long));
+        args->deltas = calloc(MAX_WRITE_SIZE, sizeof(long));
+        args->ttls = calloc(MAX_WRITE_SIZE, sizeof(unsigned long));
+        valid = args->keys && args->values && args->versions && args->deltas && args->ttls;
+    }
+    if (!valid) {
+        jobc_close(reader);
+        return 1;
+    }
+
+    args->capacity = MAX_WRITE_SIZE;
+    reader->pos = header + 12;
+    return 0;
+}
+
+// Reads fixed-size fields, failing past the end of the mapping.
+static const unsigned char *take(JobcReader *reader, size_t length) {
+    if (reader->size - reader->pos < length) return NULL;
+    const unsigned char *data = reader->map + reader->pos;
+    reader->pos += length;
+    return data;
+}
+
+static int take_string(JobcReader *reader, KvsString *string) {
+    const unsigned char *length = take(reader, 4);
+    if (!length) return 1;
+    size_t len = get_u32(length);
+    const unsigned char *data = take(reader, len + 1);
+    if (!data || data[len] != '\0') return 1;
+
+    string->data = (char *)(uintptr_t)data; // read only, never freed
+    string->len = len;
+    string->cap = 0;
+    return 0;
+}
+
+static int take_number(JobcReader *reader, uint64_t *value) {
+    const unsigned char *data = take(reader, 8);
+    if (!data) return 1;
+    *value = get_u64(data);
+    return 0;
+}
+
+enum Command jobc_next(JobcReader *reader, size_t *count, unsigned int *delay) {
+    CommandArgs *args = &reader->args;
+
+    while (reader->pos < reader->size) {
+        const unsigned char *record = take(reader, 5);
+        if (!record) break;
+        unsigned char opcode = record[0];
+        size_t n = get_u32(record + 1);
+
+        if (opcode == JOBC_DIAGNOSTIC) {
+            KvsString message;
+            if (take_string(reader, &message) != 0) break;
+            parser_diagnostic(message.data);
+            continue;
+        }
+        if (opcode >= EOC || n >= MAX_WRITE_SIZE) break;
+
+        enum Command cmd = (enum Command)opcode;
+        int failed = 0;
+        uint64_t number = 0;
+        for (size_t i = 0; i < n && !failed; i++) {
+            switch (cmd) {
+                case CMD_WRITE:
+                    failed = take_string(reader, &args->keys[i]) || take_string(reader, &args->values[i]) ||
+                             take_number(reader, &number);
+                    args->ttls[i] = (unsigned long)number;
+                    break;
+                case CMD_READ:
+                case CMD_DELETE:
+                case CMD_LOAD:
+                    failed = take_string(reader, &args->keys[i]);
+                    break;
+                case CMD_CAS:
+                    failed = take_string(reader, &args->keys[i]) || take_number(reader, &number) ||
+                             take_string(reader, &args->values[i]);
+                    args->versions[i] = (unsigned long)number;
+                    break;
+                case CMD_INCR:
+                case CMD_EXPIRE:
+                    failed = take_string(reader, &args->keys[i]) || take_number(reader, &number);
+                    args->deltas[i] = (long)number;
+                    args->ttls[i] = (unsigned long)number;
+                    break;
+                case CMD_WAIT: {
+                    const unsigned char *data = take(reader, 4);
+                    failed = data == NULL;
+                    if (data) *delay = get_u32(data);
+                    break;
+                }
+                case CMD_SHOW:
+                case CMD_BACKUP:
+                case CMD_HELP:
+                case CMD_EMPTY:
+                case CMD_INVALID:
+                case EOC:
+                    failed = 1;
+                    break;
+            }
+        }
+        if (failed) break;
+
+        *count = n;
+        return cmd;
+    }
+
+    if (reader->pos < reader->size) {
+        log_error("Corrupted compiled job\n");
+    }
+    return EOC;
+}
+
+void jobc_close(JobcReader *reader) {
+    if (reader->map != NULL) {
+        munmap(reader->map, reader->size);
+    }
+    free(reader->args.keys);
+    free(reader->args.values);
+    free(reader->args.versions);
+    free(reader->args.deltas);
+    free(reader->args.ttls);
+    memset(reader, 0, sizeof(*reader));
+}
+
+int jobc_writer_open(JobcWriter *writer, const char *job_path, const struct stat *job) {
+    memset(writer, 0, sizeof(*writer));
+    writer->path = cache_path(job_path);
+    if (!writer->path) return 1;
+
+    put_header(writer, job_path, job);
+    put_u64(writer, 0); // body length and CRC, set on commit
+    put_u32(writer, 0);
+    writer->body_start = writer->len;
+    if (writer->failed) {
+        jobc_writer_discard(writer);
+        return 1;
+    }
+    return 0;
+}
+
+void jobc_record(JobcWriter *writer, enum Command cmd, size_t count, const CommandArgs *args, unsigned int delay) {
+    switch (cmd) {
+        case CMD_EMPTY:
+        case EOC:
+            return; // nothing to run
+        case CMD_WRITE:
+        case CMD_READ:
+        case CMD_DELETE:
+        case CMD_CAS:
+        case CMD_INCR:
+        case CMD_EXPIRE:
+        case CMD_LOAD:
+        case CMD_WAIT:
+        case CMD_SHOW:
+        case CMD_BACKUP:
+        case CMD_HELP:
+        case CMD_INVALID:
+            break;
+    }
+
+    put_u8(writer, (unsigned char)cmd);
+    put_u32(writer, (uint32_t)count);
+    for (size_t i = 0; i < count; i++) {
+        switch (cmd) {
+            case CMD_WRITE:
+                put_string(writer, args->keys[i].data, args->keys[i].len);
+                put_string(writer, args->values[i].data, args->values[i].len);
+                put_u64(writer, args->ttls[i]);
+                break;
+            case CMD_READ:
+            case CMD_DELETE:
+            case CMD_LOAD:
+                put_string(writer, args->keys[i].data, args->keys[i].len);
+                break;
+            case CMD_CAS:
+                put_string(writer, args->keys[i].data, args->keys[i].len);
+                put_u64(writer, args->versions[i]);
+                put_string(writer, args->values[i].data, args->values[i].len);
+                break;
+            case CMD_INCR:
+                put_string(writer, args->keys[i].data, args->keys[i].len);
+                put_u64(writer, (uint64_t)args->deltas[i]);
+                break;
+            case CMD_EXPIRE:
+                put_string(writer, args->keys[i].data, args->keys[i].len);
+                put_u64(writer, args->ttls[i]);
+                break;
+            case CMD_WAIT:
+                put_u32(writer, delay);
+                break;
+            case CMD_SHOW:
+            case CMD_BACKUP:
+            case CMD_HELP:
+            case CMD_EMPTY:
+            case CMD_INVALID:
+            case EOC:
+                break;
+        }
+    }
+}
+
+void jobc_record_diagnostic(JobcWriter *writer, const char *message) {
+    put_u8(writer, JOBC_DIAGNOSTIC);
+    put_u32(writer, 0);
+    put_string(writer, message, strlen(message));
+}
+
+int jobc_writer_commit(JobcWriter *writer) {
+    if (writer->failed) {
+        jobc_writer_discard(writer);
+        return 1;
+    }
+
+    size_t body = writer->len - writer->body_start;
+    uint32_t crc = crc32c(0, writer->data + writer->body_start, body);
+    for (int i = 0; i < 8; i++) {
+        writer->data[writer->body_start - 12 + (size_t)i] = (unsigned char)((uint64_t)body >> (8 * i));
+    }
+    for (int i = 0; i < 4; i++) {
+        writer->data[writer->body_start - 4 + (size_t)i] = (unsigned char)(crc >> (8 * i));
+    }
+
+    // Write a private file and rename it over the old cache, so concurrent
+    // runs never map a half written one
+    size_t temp_size = strlen(writer->path) + 32;
+    char *temp = malloc(temp_size);
+    if (!temp) {
+        jobc_writer_discard(writer);
+        return 1;
+    }
+    snprintf(temp, temp_size, "%s.%ld.tmp", writer->path, (long)getpid());
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int failed = fd == -1;
+    for (size_t done = 0; !failed && done < writer->len;) {
+        ssize_t written = write(fd, writer->data + done, writer->len - done);
+        if (written <= 0) {
+            failed = 1;
+        } else {
+            done += (size_t)written;
+        }
+    }
+    if (fd != -1 && close(fd) != 0) failed = 1;
+    if (!failed && rename(temp, writer->path) != 0) failed = 1;
+    if (failed) {
+        log_error("Failed to write job cache: %m\n");
+        unlink(temp);
+    }
+
+    free(temp);
+    jobc_writer_discard(writer);
+    return failed;
+}
+
+void jobc_writer_discard(JobcWriter *writer) {
+    free(writer->path);
+    free(writer->data);
+    memset(writer, 0, sizeof(*writer));
+}
@@ -0,0 +1,91 @@
+#ifndef KVS_JOBC_H
+#define KVS_JOBC_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include "parser.h"
+
+// A compiled job is the command stream of a .job file as parsed by the text
+// parser, cached next to it in a .jobc file so later runs skip the parsing:
+//
+//   header  "KVSJ" | u32 version | u64 job size | i64 mtime s | i64 mtime ns |
+//           u32 path length | path | u64 body length | u32 CRC32C of the body
+//   body    records: u8 opcode | u32 count | arguments
+//
+// Strings are a u32 length, the bytes and a NUL. WRITE pairs are key, value
+// and u64 TTL; READ/DELETE keys; CAS key, u64 version, value; INCR and
+// EXPIRE key and i64 number; LOAD its path; WAIT carries a u32 delay. A count of 0 records
+// a command the parser rejected, and diagnostic records replay the messages
+// the parser printed, so running the cache prints exactly what parsing did.
+// All integers are little endian.
+#define JOBC_MAGIC "KVSJ"
+#define JOBC_VERSION 2
+#define JOBC_SUFFIX "c" // x.job is cached in x.jobc
+
+typedef struct JobcWriter {
+    char *path;              // cache file being produced
+    unsigned char *data;     // header and body built in memory
+    size_t len;
+    size_t cap;
+    size_t body_start;
+    int failed;
+} JobcWriter;
+
+typedef struct JobcReader {
+    unsigned char *map;      // the mapped cache file
+    size_t size;
+    size_t pos;
+    CommandArgs args;        // strings point into the mapping
+} JobcReader;
+
+/// Maps the cache of a job file if it is valid for the job's current path,
+/// modification time and size.
+/// @param reader Reader to be initialized.
+/// @param job_path Path of the .job file.
+/// @param job Status of the .job file.
+/// @return 0 if the cache can be run, 1 otherwise.
+int jobc_open(JobcReader *reader, const char *job_path, const struct stat *job);
+
+/// Decodes the next command of a compiled job into reader->args, replaying
+/// the parser diagnostics recorded before it.
+/// @param reader Reader of the compiled job.
+/// @param count Set to the number of pairs or keys, 0 if the command was rejected.
+/// @param delay Set to the delay of a WAIT.
+/// @return The command, EOC at the end of the job.
+enum Command jobc_next(JobcReader *reader, size_t *count, unsigned int *delay);
+
+/// Unmaps a compiled job.
+/// @param reader Reader to be closed.
+void jobc_close(JobcReader *reader);
+
+/// Starts compiling a job file.
+/// @param writer Writer to be initialized.
+/// @param job_path Path of the .job file.
+/// @param job Status of the .job file.
+/// @return 0 on success, 1 otherwise.
+int jobc_writer_open(JobcWriter *writer, const char *job_path, const struct stat *job);
+
+/// Records a parsed command, before it is executed.
+/// @param writer Writer of the compiled job.
+/// @param cmd Command parsed.
+/// @param count Number of pairs or keys, 0 if the parser rejected the command.
+/// @param args Arguments of the command.
+/// @param delay Delay of a WAIT.
+void jobc_record(JobcWriter *writer, enum Command cmd, size_t count, const CommandArgs *args, unsigned int delay);
+
+/// Records a message printed by the parser.
+/// @param writer Writer of the compiled job.
+/// @param message Message printed.
+void jobc_record_diagnostic(JobcWriter *writer, const char *message);
+
+/// Writes the cache file, replacing any previous one atomically, and frees
+/// the writer.
+/// @param writer Writer of the compiled job.
+/// @return 0 on success, 1 otherwise.
+int jobc_writer_commit(JobcWriter *writer);
+
+/// Frees a writer without writing the cache file.
+/// @param writer Writer to be discarded.
+void jobc_writer_discard(JobcWriter *writer);
+
+#endif  // KVS_JOBC_H
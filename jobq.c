@@ -0,0 +1,230 @@
+#include "jobq.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "constants.h"
+#include "logger.h"
+
+typedef struct QueuedJob {
+    char *job_file;
+    uint64_t cost;                // size of the file in bytes, at least 1
+    unsigned long long queued_at; // microseconds
+    struct QueuedJob *next;
+} QueuedJob;
+
+typedef struct ClassQueue {
+    QueuedJob *head;
+    QueuedJob *tail;
+    unsigned long long head_since; // microseconds, when head became the head
+    uint64_t pass;                // service received, scaled by the weight
+    unsigned long weight;
+    size_t jobs;                  // jobs taken so far
+    unsigned long long wait_total;
+    unsigned long long wait_max;
+} ClassQueue;
+
+static const char *class_names[JOB_CLASSES] = {"interactive", "normal", "bulk"};
+
+static ClassQueue classes[JOB_CLASSES] = {
+    [JOB_CLASS_INTERACTIVE] = {.weight = JOBQ_WEIGHT_INTERACTIVE},
+    [JOB_CLASS_NORMAL] = {.weight = JOBQ_WEIGHT_NORMAL},
+    [JOB_CLASS_BULK] = {.weight = JOBQ_WEIGHT_BULK},
+};
+static uint64_t virtual_time = 0; // pass of the class served last
+static size_t reserved_workers = 0;
+static pthread_mutex_t jobq_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long long clock_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + (unsigned long long)ts.tv_nsec / 1000ULL;
+}
+
+int jobq_parse_class(const char *name, JobClass *job_class) {
+    for (int i = 0; i < JOB_CLASSES; i++) {
+        if (strcmp(name, class_names[i]) == 0) {
+            *job_class = (JobClass)i;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int jobq_set_weights(const char *spec) {
+    unsigned long weights[JOB_CLASSES];
+    const char *cursor = spec;
+    for (int i = 0; i < JOB_CLASSES; i++) {
+        char *end;
+        if (*cursor < '0' || *cursor > '9') return 1;
+        weights[i] = strtoul(cursor, &end, 10);
+        if (weights[i] == 0 || weights[i] > JOBQ_MAX_WEIGHT) return 1;
+        if (*end != (i + 1 < JOB_CLASSES ? ':' : '\0')) return 1;
+        cursor = end + 1;
+    }
+
+    pthread_mutex_lock(&jobq_mutex);
+    for (int i = 0; i < JOB_CLASSES; i++) {
+        classes[i].weight = weights[i];
+    }
+    pthread_mutex_unlock(&jobq_mutex);
+    return 0;
+}
+
+void jobq_reserve(size_t workers) {
+    pthread_mutex_lock(&jobq_mutex);
+    reserved_workers = workers;
+    pthread_mutex_unlock(&jobq_mutex);
+}
+
+/// Reads the class tag of a name like "load.bulk.job".
+static int class_from_name(const char *job_file, JobClass *job_class) {
+    const char *extension = strrchr(job_file, '.');
+    if (extension == NULL) return 1;
+
+    const char *tag = extension;
+    while (tag > job_file && tag[-1] != '.') tag--;
+    if (tag == job_file) return 1; // no tag, only the extension
+
+    char name[16];
+    size_t length = (size_t)(extension - tag);
+    if (length >= sizeof(name)) return 1;
+    memcpy(name, tag, length);
+    name[length] = '\0';
+    return jobq_parse_class(name, job_class);
+}
+
+/// Reads a "# priority <class>" first line.
+static int class_from_header(int fd, JobClass *job_class) {
+    char line[64];
+    ssize_t length = pread(fd, line, sizeof(line) - 1, 0);
+    if (length <= 0) return 1;
+    line[length] = '\0';
+    line[strcspn(line, "\n")] = '\0';
+
+    char name[16];
+    if (sscanf(line, "# priority %15s", name) != 1) return 1;
+    return jobq_parse_class(name, job_class);
+}
+
+int jobq_push(const char *directory, char *job_file) {
+    QueuedJob *job = malloc(sizeof(QueuedJob));
+    if (!job) {
+        log_error("Memory allocation failed for queue: %m\n");
+        free(job_file);
+        return 1;
+    }
+    job->job_file = job_file;
+    job->cost = 1;
+    job->next = NULL;
+
+    JobClass job_class = JOB_CLASS_NORMAL;
+    int named = class_from_name(job_file, &job_class) == 0;
+
+    char job_path[1024];
+    snprintf(job_path, sizeof(job_path), "%s/%s", directory, job_file);
+    int fd = open(job_path, O_RDONLY);
+    if (fd != -1) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 1) {
+            job->cost = (uint64_t)st.st_size;
+        }
+        if (!named) {
+            class_from_header(fd, &job_class);
+        }
+        close(fd);
+    }
+
+    pthread_mutex_lock(&jobq_mutex);
+    ClassQueue *queue = &classes[job_class];
+    if (queue->head == NULL) {
+        // An idle class starts level with the others instead of catching up
+        if (queue->pass < virtual_time) queue->pass = virtual_time;
+        queue->head = job;
+    } else {
+        queue->tail->next = job;
+    }
+    queue->tail = job;
+    job->queued_at = clock_us();
+    if (queue->head == job) queue->head_since = job->queued_at;
+    pthread_mutex_unlock(&jobq_mutex);
+    return 0;
+}
+
+char *jobq_pop(size_t worker) {
+    pthread_mutex_lock(&jobq_mutex);
+    unsigned long long now = clock_us();
+    int allowed = worker < reserved_workers ? 1 : JOB_CLASSES;
+
+    // Most aging periods waited at the head of a class first, then the least
+    // service for its weight. Jobs all queued at once only age while others
+    // are taken ahead of them.
+    ClassQueue *chosen = NULL;
+    unsigned long long chosen_periods = 0;
+    for (int i = 0; i < allowed; i++) {
+        ClassQueue *queue = &classes[i];
+        if (queue->head == NULL) continue;
+        unsigned long long periods = (now - queue->head_since) / (JOBQ_AGING_MS * 1000ULL);
+        if (chosen == NULL || periods > chosen_periods ||
+            (periods == chosen_periods && queue->pass < chosen->pass)) {
+            chosen = queue;
+            chosen_periods = periods;
+        }
+    }
+    if (chosen == NULL) {
+        pthread_mutex_unlock(&jobq_mutex);
+        return NULL;
+    }
+
+    QueuedJob *job = chosen->head;
+    chosen->head = job->next;
+    chosen->head_since = now;
+    if (chosen->head == NULL) chosen->tail = NULL;
+
+    virtual_time = chosen->pass;
+    chosen->pass += (job->cost << JOBQ_PASS_SHIFT) / chosen->weight;
+
+    unsigned long long wait = now - job->queued_at;
+    chosen->jobs++;
+    chosen->wait_total += wait;
+    if (wait > chosen->wait_max) chosen->wait_max = wait;
+    pthread_mutex_unlock(&jobq_mutex);
+
+    char *job_file = job->job_file;
+    free(job);
+    return job_file;
+}
+
+void jobq_report_metrics(int fd) {
+    pthread_mutex_lock(&jobq_mutex);
+    for (int i = 0; i < JOB_CLASSES; i++) {
+        const ClassQueue *queue = &classes[i];
+        dprintf(fd, "queue_%s_jobs %zu\n", class_names[i], queue->jobs);
+        dprintf(fd, "queue_%s_wait_avg_us %llu\n", class_names[i],
+                queue->jobs > 0 ? queue->wait_total / queue->jobs : 0);
+        dprintf(fd, "queue_%s_wait_max_us %llu\n", class_names[i], queue->wait_max);
+    }
+    pthread_mutex_unlock(&jobq_mutex);
+}
+
+void jobq_free(void) {
+    pthread_mutex_lock(&jobq_mutex);
+    for (int i = 0; i < JOB_CLASSES; i++) {
+        QueuedJob *job = classes[i].head;
+        while (job != NULL) {
+            QueuedJob *next = job->next;
+            free(job->job_file);
+            free(job);
+            job = next;
+        }
+        classes[i].head = NULL;
+        classes[i].tail = NULL;
+    }
+    pthread_mutex_unlock(&jobq_mutex);
+}
@@ -0,0 +1,63 @@
+#ifndef KVS_JOBQ_H
+#define KVS_JOBQ_H
+
+#include <stddef.h>
+
+// Queue of the job files waiting for a job thread. Every job belongs to a
+// priority class, named by a tag before its extension (report.interactive.job)
+// or by a "# priority <class>" first line, normal otherwise. Classes share
+// the job threads in proportion to their weights, a job costing its size in
+// bytes, and jobs of a class run in the order they were queued.
+//
+// A job waiting JOBQ_AGING_MS or longer at the head of its class goes ahead
+// of the heads that waited fewer such periods, whatever its class, so a
+// class far behind in its share still runs while the others are served.
+// Reserved workers only run interactive jobs.
+
+typedef enum {
+    JOB_CLASS_INTERACTIVE,
+    JOB_CLASS_NORMAL,
+    JOB_CLASS_BULK,
+} JobClass;
+
+#define JOB_CLASSES 3
+
+/// Reads a class name: interactive, normal or bulk.
+/// @param name Name to read.
+/// @param job_class Set to the class named.
+/// @return 0 on success, 1 if the name is not a class.
+int jobq_parse_class(const char *name, JobClass *job_class);
+
+/// Sets the weights of the classes from "interactive:normal:bulk", each
+/// at least 1. The defaults are JOBQ_WEIGHT_INTERACTIVE, JOBQ_WEIGHT_NORMAL
+/// and JOBQ_WEIGHT_BULK.
+/// @param spec Weights to read.
+/// @return 0 on success, 1 if the weights are invalid.
+int jobq_set_weights(const char *spec);
+
+/// Keeps the first workers for interactive jobs. A reserved worker stops
+/// once no interactive job is left.
+/// @param workers Number of reserved workers.
+void jobq_reserve(size_t workers);
+
+/// Queues a job file, reading its class and size.
+/// @param directory Directory of the job file.
+/// @param job_file Name of the job file, freed by the queue.
+/// @return 0 on success, 1 if it could not be queued (and was freed).
+int jobq_push(const char *directory, char *job_file);
+
+/// Takes the next job for a worker.
+/// @param worker Index of the calling worker, from 0.
+/// @return Name of the job file, to be freed by the caller, NULL when there
+///         is no job left for the worker.
+char *jobq_pop(size_t worker);
+
+/// Writes the number of jobs and the time they waited in the queue, per
+/// class, as "name value" lines.
+/// @param fd File descriptor to write to.
+void jobq_report_metrics(int fd);
+
+/// Frees the jobs left in the queue.
+void jobq_free(void);
+
+#endif  // KVS_JOBQ_H
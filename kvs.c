@@ -1,110 +1,795 @@
 #include "kvs.h"
+#include "constants.h"
+#include "intern.h"
+#include "logger.h"
 #include "string.h"
 #include <stdint.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
 
 
 int table_size = TABLE_SIZE; 
 
+static const char *engine_names[] = {"hash", "art"};
+static TableEngine default_engine = TABLE_ENGINE_HASH;
 
 
-int hash(const char *key) {
-    int firstLetter = tolower(key[0]);
+
+int hash(const KvsString *key) {
+    int firstLetter = key->len > 0 ? tolower((unsigned char)key->data[0]) : 0;
     if (firstLetter >= 'a' && firstLetter <= 'z') {
         return firstLetter - 'a';
     } else if (firstLetter >= '0' && firstLetter <= '9') {
         return firstLetter - '0';
     }
-    return -1; 
+    return 0; // any other key shares the first bucket
+}
+
+/// Bytes malloc really uses for a request: glibc rounds every chunk, header
+/// included, up to 16 bytes with a 32 byte minimum.
+static size_t alloc_size(size_t bytes) {
+    size_t chunk = (bytes + sizeof(size_t) + 15) & ~(size_t)15;
+    return chunk < 32 ? 32 : chunk;
+}
+
+static size_t node_size(size_t key_len) {
+    return offsetof(KeyNode, key) + key_len + 1 + KVS_INLINE_VALUE_SIZE + 1;
+}
+
+/// FNV-1a over the whole key. The index uses the low half and the filter
+/// the high one.
+static uint64_t key_hash(const KvsString *key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < key->len; i++) {
+        hash = (hash ^ (unsigned char)key->data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static int key_equals(const KeyNode *keyNode, const KvsString *key) {
+    return keyNode->key_len == key->len && memcmp(keyNode->key, key->data, key->len) == 0;
+}
+
+static char *inline_value(KeyNode *keyNode) {
+    return keyNode->key + keyNode->key_len + 1;
+}
+
+/// Frees the out of line value of a node, or drops its reference to a
+/// shared one.
+static void drop_value(HashTable *ht, KeyNode *keyNode) {
+    if (keyNode->value == inline_value(keyNode)) return;
+    ht->memory_used -= alloc_size(keyNode->value_len + 1);
+    if (keyNode->interned) {
+        intern_release(keyNode->value);
+    } else {
+        region_free(ht->region, keyNode->value);
+    }
+}
+
+/// Replaces the value of a node, keeping small values inside the node.
+/// @return 0 on success, 1 if the value could not be allocated.
+static int set_value(HashTable *ht, KeyNode *keyNode, const KvsString *value) {
+    char *storage = inline_value(keyNode);
+    int interned = 0;
+
+    if (value->len > KVS_INLINE_VALUE_SIZE && ht->intern_values) {
+        storage = (char *)intern_acquire(value->data, value->len);
+        if (!storage) return 1;
+        interned = 1;
+        ht->memory_used += alloc_size(value->len + 1);
+    } else if (value->len > KVS_INLINE_VALUE_SIZE) {
+        storage = region_malloc(ht->region, value->len + 1);
+        if (!storage) return 1;
+        ht->memory_used += alloc_size(value->len + 1);
+    }
+
+    drop_value(ht, keyNode);
+    if (!interned) {
+        memcpy(storage, value->data, value->len);
+        storage[value->len] = '\0';
+    }
+    keyNode->value = storage;
+    keyNode->value_len = value->len;
+    keyNode->interned = (unsigned char)interned;
+    return 0;
+}
+
+static void free_node(HashTable *ht, KeyNode *keyNode) {
+    if (keyNode->timer != NULL) {
+        wheel_cancel(&ht->wheel, keyNode->timer);
+        ht->memory_used -= alloc_size(sizeof(TimerEntry));
+        region_free(ht->region, keyNode->timer);
+    }
+    drop_value(ht, keyNode);
+    ht->memory_used -= alloc_size(node_size(keyNode->key_len));
+    ht->count--;
+    region_free(ht->region, keyNode);
+}
+
+/// Replaces the TTL of a node, 0 removing it.
+/// @return 0 on success, 1 if the timer could not be allocated.
+static int set_ttl(HashTable *ht, KeyNode *keyNode, unsigned long ttl_ms) {
+    if (ttl_ms == 0) {
+        if (keyNode->timer != NULL) {
+            wheel_cancel(&ht->wheel, keyNode->timer);
+            ht->memory_used -= alloc_size(sizeof(TimerEntry));
+            region_free(ht->region, keyNode->timer);
+            keyNode->timer = NULL;
+        }
+        return 0;
+    }
+
+    if (keyNode->timer == NULL) {
+        keyNode->timer = region_malloc(ht->region, sizeof(TimerEntry));
+        if (!keyNode->timer) return 1;
+        ht->memory_used += alloc_size(sizeof(TimerEntry));
+        keyNode->timer->next = NULL;
+        keyNode->timer->owner = keyNode;
+    } else {
+        wheel_cancel(&ht->wheel, keyNode->timer);
+    }
+    keyNode->timer->expires_at = wheel_clock_ms() + ttl_ms;
+    wheel_schedule(&ht->wheel, keyNode->timer);
+    return 0;
+}
+
+int pair_expired(const KeyNode *keyNode, unsigned long long now) {
+    return keyNode->timer != NULL && keyNode->timer->expires_at <= now;
+}
+
+KeyNode *bucket_next(KeyNode **cursors, size_t count) {
+    size_t newest = count;
+    for (size_t t = 0; t < count; t++) {
+        if (cursors[t] != NULL && (newest == count || cursors[t]->sequence > cursors[newest]->sequence)) {
+            newest = t;
+        }
+    }
+    if (newest == count) return NULL;
+
+    KeyNode *keyNode = cursors[newest];
+    cursors[newest] = keyNode->next;
+    return keyNode;
 }
 
-struct HashTable* create_hash_table() { 
-  HashTable *ht = malloc(sizeof(HashTable));
+/// Creates an empty table in a region, NULL for the heap.
+static HashTable *new_table(Region *region) {
+  HashTable *ht = region_malloc(region, sizeof(HashTable));
   if (!ht) return NULL;
+  ht->region = region;
+  ht->engine = default_engine;
+  art_init(&ht->tree);
   for (int i = 0; i < table_size; i++) {
       ht->table[i] = NULL;
   }
+  ht->index = NULL;
+  ht->index_capacity = 0;
+  bloom_init(&ht->filter);
+  ht->old_index = NULL;
+  ht->old_capacity = 0;
+  bloom_init(&ht->old_filter);
+  ht->migrate_slot = 0;
+  ht->migrate_left = 0;
+  wheel_init(&ht->wheel, wheel_clock_ms());
+  ht->count = 0;
+  ht->sequence = 0;
+  ht->memory_used = alloc_size(sizeof(HashTable));
+  ht->memory_limit = 0;
+  ht->evictions = 0;
+  ht->intern_values = 0;
+  ht->clock_bucket = 0;
+  ht->clock_position = 0;
   return ht;
 }
 
-int write_pair(HashTable *ht, const char *key, const char *value) { 
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-
-    // Search for the key node
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            free(keyNode->value);
-            keyNode->value = strdup(value);
+int parse_table_engine(const char *name, TableEngine *engine) {
+    for (size_t i = 0; i < sizeof(engine_names) / sizeof(engine_names[0]); i++) {
+        if (strcmp(name, engine_names[i]) == 0) {
+            *engine = (TableEngine)i;
             return 0;
         }
-        keyNode = keyNode->next; // Move to the next node
     }
+    return 1;
+}
 
-    // Key not found, create a new key node
-    keyNode = malloc(sizeof(KeyNode));
-    keyNode->key = strdup(key); // Allocate memory for the key
-    keyNode->value = strdup(value); // Allocate memory for the value
-    keyNode->next = ht->table[index]; // Link to existing nodes
-    ht->table[index] = keyNode; // Place new key node at the start of the list
+void use_table_engine(TableEngine engine) {
+    default_engine = engine;
+}
+
+struct HashTable* create_hash_table() {
+  return new_table(NULL);
+}
+
+HashTable *create_placed_table(PageMode pages, int node) {
+    Region *region = region_create(pages, node);
+    if (region == NULL) return NULL;
+
+    HashTable *ht = new_table(region);
+    if (ht == NULL) {
+        region_close(region);
+    }
+    return ht;
+}
+
+/// Fingerprint of the structures a persistent table keeps in its file.
+static uint64_t table_layout(void) {
+    return (uint64_t)sizeof(HashTable) << 32 | (uint64_t)sizeof(KeyNode) << 20 | (uint64_t)sizeof(TimerEntry) << 12 |
+           (uint64_t)KVS_INLINE_VALUE_SIZE << 6 | TABLE_SIZE;
+}
+
+HashTable *open_hash_table(const char *path) {
+    int created;
+    Region *region = region_open(path, table_layout(), &created);
+    if (region == NULL) return NULL;
+
+    HashTable *ht = region_root(region);
+    if (ht == NULL) {
+        ht = new_table(region);
+        if (ht == NULL) {
+            region_close(region);
+            return NULL;
+        }
+        region_set_root(region, ht);
+        return ht;
+    }
+
+    // The region handle is new, the deadlines of the TTLs come from a clock
+    // that may have restarted since
+    ht->region = region;
+    if (ht->engine != default_engine) {
+        log_warn("Table %s keeps the %s engine it was created with\n", path, engine_names[ht->engine]);
+    }
+    unsigned long long now = wheel_clock_ms();
+    wheel_rebase(&ht->wheel, region_clock_shift(region, now), now);
+    return ht;
+}
+
+int checkpoint_table(HashTable *ht) {
+    return ht->region != NULL ? region_checkpoint(ht->region) : -1;
+}
+
+int read_checkpoint(HashTable *ht, int fd) {
+    return region_map_checkpoint(ht->region, fd);
+}
+
+/// Empties the filter, sized for the keys the index holds before it grows
+/// again.
+static void reset_filter(HashTable *ht) {
+    size_t before = bloom_size(&ht->filter);
+    if (bloom_reset(&ht->filter, ht->index_capacity / 4 * 3, ht->region) != 0) {
+        log_error("Failed to allocate key filter: %m\n");
+    }
+    size_t after = bloom_size(&ht->filter);
+    if (before > 0) ht->memory_used -= alloc_size(before);
+    if (after > 0) ht->memory_used += alloc_size(after);
+}
+
+/// Refills the filter from the index. Also clears the counters stuck at
+/// their maximum.
+static void rebuild_filter(HashTable *ht) {
+    reset_filter(ht);
+    for (size_t i = 0; i < ht->index_capacity; i++) {
+        if (ht->index[i].node != NULL) {
+            bloom_add(&ht->filter, ht->index[i].hash);
+        }
+    }
+}
+
+/// Counts a lookup of a missing key and rebuilds the filter when, over the
+/// last BLOOM_CHECK_INTERVAL of them, it let too many through. Only removals
+/// leave counters a rebuild can clear, and rebuilds wait for a resize to
+/// end, which fills a new filter anyway.
+/// @param let_through Whether the filter let the lookup reach the index.
+static void filter_missed(HashTable *ht, int let_through) {
+    BloomFilter *filter = &ht->filter;
+    filter->absent++;
+    filter->false_positives += (size_t)let_through;
+    filter->skipped += (size_t)!let_through;
+    if (filter->absent < BLOOM_CHECK_INTERVAL) return;
+
+    if (filter->false_positives * 100 > filter->absent * BLOOM_MAX_FP_PERCENT && filter->removed > 0 &&
+        ht->old_index == NULL) {
+        rebuild_filter(ht);
+    } else {
+        filter->absent = 0;
+        filter->false_positives = 0;
+    }
+}
+
+/// Slot of an index holding a key, or the free slot where it would go.
+static size_t index_slot(const IndexEntry *index, size_t capacity, const KvsString *key, uint64_t hash) {
+    size_t mask = capacity - 1;
+    size_t slot = hash & mask;
+    while (index[slot].node != NULL) {
+        if (index[slot].hash == hash && key_equals(index[slot].node, key)) break;
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/// Places an entry in the first free slot of its probe sequence.
+static void index_insert(IndexEntry *index, size_t capacity, IndexEntry entry) {
+    size_t mask = capacity - 1;
+    size_t slot = entry.hash & mask;
+    while (index[slot].node != NULL) {
+        slot = (slot + 1) & mask;
+    }
+    index[slot] = entry;
+}
+
+/// Removes the entry of a node from an index, shifting back the entries
+/// that probed past it so that lookups never need tombstones.
+static void index_remove(IndexEntry *index, size_t capacity, const KeyNode *keyNode, uint64_t hash) {
+    size_t mask = capacity - 1;
+    size_t hole = hash & mask;
+    while (index[hole].node != keyNode) {
+        hole = (hole + 1) & mask;
+    }
+
+    size_t slot = hole;
+    while (1) {
+        slot = (slot + 1) & mask;
+        if (index[slot].node == NULL) break;
+        size_t home = index[slot].hash & mask;
+        // leave entries whose home lies cyclically in (hole, slot]
+        if (hole <= slot ? (home > hole && home <= slot) : (home > hole || home <= slot)) continue;
+        index[hole] = index[slot];
+        hole = slot;
+    }
+    index[hole].node = NULL;
+}
+
+/// Drops the old array and filter once every key left them.
+static void finish_resize(HashTable *ht) {
+    ht->memory_used -= alloc_size(ht->old_capacity * sizeof(IndexEntry));
+    if (bloom_size(&ht->old_filter) > 0) {
+        ht->memory_used -= alloc_size(bloom_size(&ht->old_filter));
+    }
+    region_free(ht->region, ht->old_index);
+    bloom_free(&ht->old_filter, ht->region);
+    ht->old_index = NULL;
+    ht->old_capacity = 0;
+}
+
+static size_t hash_migrate(HashTable *ht, size_t slots) {
+    if (ht->old_index == NULL) return 0;
+
+    // Stops only on a free slot, so that the keys left behind are whole probe
+    // clusters and still found, and removed, by probing the old array alone
+    size_t mask = ht->old_capacity - 1;
+    size_t visited = 0;
+    while (ht->migrate_left > 0 && (visited < slots || ht->old_index[ht->migrate_slot].node != NULL)) {
+        IndexEntry *entry = &ht->old_index[ht->migrate_slot];
+        if (entry->node != NULL) {
+            index_insert(ht->index, ht->index_capacity, *entry);
+            bloom_add(&ht->filter, entry->hash);
+            entry->node = NULL;
+        }
+        ht->migrate_slot = (ht->migrate_slot + 1) & mask;
+        ht->migrate_left--;
+        visited++;
+    }
+
+    if (ht->migrate_left == 0) {
+        finish_resize(ht);
+    }
+    return ht->migrate_left;
+}
+
+/// Moves the index to a new capacity, a power of two. The keys follow a few
+/// clusters at a time (see migrate_index), only a first index is filled at once.
+/// @return 0 on success, 1 if it could not be allocated.
+static int resize_index(HashTable *ht, size_t capacity) {
+    hash_migrate(ht, SIZE_MAX); // a resize still running ends first
+    IndexEntry *index = region_calloc(ht->region, capacity, sizeof(IndexEntry));
+    if (!index) return 1;
+    ht->memory_used += alloc_size(capacity * sizeof(IndexEntry));
+
+    if (ht->index == NULL) {
+        ht->index = index;
+        ht->index_capacity = capacity;
+        reset_filter(ht);
+        return 0;
+    }
+
+    // Moving starts on a free slot, there is one as the index is at most 3/4 full
+    size_t start = 0;
+    while (ht->index[start].node != NULL) {
+        start++;
+    }
+    ht->old_index = ht->index;
+    ht->old_capacity = ht->index_capacity;
+    ht->old_filter = ht->filter;
+    ht->migrate_slot = start;
+    ht->migrate_left = ht->index_capacity;
+    ht->index = index;
+    ht->index_capacity = capacity;
+    bloom_init(&ht->filter);
+    ht->filter.skipped = ht->old_filter.skipped;
+    reset_filter(ht);
     return 0;
 }
 
-char* read_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    char* value;
+static void hash_prefetch(const HashTable *ht, const KvsString *key) {
+    if (ht->index_capacity == 0) return;
+    uint64_t hash = key_hash(key);
+    __builtin_prefetch(&ht->index[hash & (ht->index_capacity - 1)]);
+    if (ht->filter.block_count > 0) {
+        __builtin_prefetch(&ht->filter.blocks[((hash >> 32) & (ht->filter.block_count - 1)) * BLOOM_BLOCK_SIZE]);
+    }
+}
 
-    while (keyNode != NULL) { // collision handling
-        if (strcmp(keyNode->key, key) == 0) {
-            value = strdup(keyNode->value);
-            return value; // Return copy of the value if found
+/// Grows the index, if needed, so that it can take more keys.
+static int grow_index(HashTable *ht, size_t keys) {
+    size_t needed = ht->count + keys;
+    size_t capacity = ht->index_capacity ? ht->index_capacity : KVS_INDEX_MIN_CAPACITY;
+    while (needed > capacity / 4 * 3) {
+        capacity *= 2;
+    }
+    return capacity == ht->index_capacity ? 0 : resize_index(ht, capacity);
+}
+
+static KeyNode *hash_find(HashTable *ht, const KvsString *key) {
+    if (ht->index_capacity == 0) return NULL;
+
+    if (ht->old_index != NULL) {
+        hash_migrate(ht, INDEX_MIGRATE_STEP);
+    }
+
+    uint64_t hash = key_hash(key);
+    KeyNode *keyNode = NULL;
+    int let_through = 0;
+    if (bloom_may_contain(&ht->filter, hash)) {
+        let_through = 1;
+        keyNode = ht->index[index_slot(ht->index, ht->index_capacity, key, hash)].node;
+    }
+    if (keyNode == NULL && ht->old_index != NULL && bloom_may_contain(&ht->old_filter, hash)) {
+        let_through = 1;
+        keyNode = ht->old_index[index_slot(ht->old_index, ht->old_capacity, key, hash)].node;
+    }
+    if (keyNode == NULL) {
+        filter_missed(ht, let_through);
+    }
+    return keyNode;
+}
+
+static int hash_insert(HashTable *ht, KeyNode *keyNode) {
+    KvsString key = {keyNode->key, keyNode->key_len, 0};
+    uint64_t hash_value = key_hash(&key);
+    index_insert(ht->index, ht->index_capacity, (IndexEntry){keyNode, hash_value});
+    bloom_add(&ht->filter, hash_value);
+    return 0;
+}
+
+static void hash_remove(HashTable *ht, KeyNode *keyNode) {
+    // Keys not moved by a resize yet are still in the old array
+    KvsString key = {keyNode->key, keyNode->key_len, 0};
+    uint64_t hash = key_hash(&key);
+    if (ht->old_index != NULL && ht->index[index_slot(ht->index, ht->index_capacity, &key, hash)].node != keyNode) {
+        index_remove(ht->old_index, ht->old_capacity, keyNode, hash);
+        bloom_remove(&ht->old_filter, hash);
+    } else {
+        index_remove(ht->index, ht->index_capacity, keyNode, hash);
+        bloom_remove(&ht->filter, hash);
+    }
+}
+
+static void hash_free(HashTable *ht) {
+    free(ht->index);
+    free(ht->old_index);
+    bloom_free(&ht->filter, NULL);
+    bloom_free(&ht->old_filter, NULL);
+}
+
+static KeyNode *tree_find(HashTable *ht, const KvsString *key) {
+    return art_lookup(&ht->tree, key->data, key->len);
+}
+
+static int tree_grow(HashTable *ht, size_t keys) {
+    (void)ht;
+    (void)keys;
+    return 0; // nodes are allocated as keys come
+}
+
+static int tree_insert(HashTable *ht, KeyNode *keyNode) {
+    size_t before = ht->tree.memory;
+    int failed = art_insert(&ht->tree, ht->region, keyNode);
+    ht->memory_used = ht->memory_used - before + ht->tree.memory;
+    return failed;
+}
+
+static void tree_remove(HashTable *ht, KeyNode *keyNode) {
+    size_t before = ht->tree.memory;
+    art_delete(&ht->tree, ht->region, keyNode);
+    ht->memory_used = ht->memory_used - before + ht->tree.memory;
+}
+
+static size_t tree_migrate(HashTable *ht, size_t slots) {
+    (void)ht;
+    (void)slots;
+    return 0;
+}
+
+static void tree_prefetch(const HashTable *ht, const KvsString *key) {
+    (void)ht;
+    (void)key;
+}
+
+static void tree_free(HashTable *ht) {
+    art_free(&ht->tree, NULL);
+}
+
+// Index operations of each engine. A table records its engine rather than
+// a pointer to them, which a table kept in a file could not trust after a
+// restart.
+typedef struct EngineOps {
+    KeyNode *(*find)(HashTable *ht, const KvsString *key); // node of a key, expired or not
+    int (*grow)(HashTable *ht, size_t keys);               // makes room for more keys
+    int (*insert)(HashTable *ht, KeyNode *keyNode);        // adds the node of a missing key
+    void (*remove)(HashTable *ht, KeyNode *keyNode);
+    size_t (*migrate)(HashTable *ht, size_t slots);        // see migrate_index
+    void (*prefetch)(const HashTable *ht, const KvsString *key);
+    void (*free)(HashTable *ht);                           // the index of a table on the heap
+} EngineOps;
+
+static const EngineOps engines[] = {
+    [TABLE_ENGINE_HASH] = {hash_find, grow_index, hash_insert, hash_remove, hash_migrate, hash_prefetch, hash_free},
+    [TABLE_ENGINE_ART] = {tree_find, tree_grow, tree_insert, tree_remove, tree_migrate, tree_prefetch, tree_free},
+};
+
+size_t migrate_index(HashTable *ht, size_t slots) {
+    return engines[ht->engine].migrate(ht, slots);
+}
+
+void prefetch_pair(const HashTable *ht, const KvsString *key) {
+    engines[ht->engine].prefetch(ht, key);
+}
+
+int reserve_pairs(HashTable *ht, size_t keys) {
+    // A bulk load is better off moving every key now than on each insert
+    if (engines[ht->engine].grow(ht, keys) != 0) return 1;
+    engines[ht->engine].migrate(ht, SIZE_MAX);
+    return 0;
+}
+
+/// Unlinks a node from its bucket and the index and frees it.
+static void remove_node(HashTable *ht, KeyNode *keyNode) {
+    KvsString key = {keyNode->key, keyNode->key_len, 0};
+    if (keyNode->prev != NULL) {
+        keyNode->prev->next = keyNode->next;
+    } else {
+        ht->table[hash(&key)] = keyNode->next;
+    }
+    if (keyNode->next != NULL) {
+        keyNode->next->prev = keyNode->prev;
+    }
+    engines[ht->engine].remove(ht, keyNode);
+    free_node(ht, keyNode);
+}
+
+/// Finds the node of a key, dropping it on the way if its TTL already ran out.
+/// @return The node, or NULL if the key is missing.
+static KeyNode *find_node(HashTable *ht, const KvsString *key) {
+    KeyNode *keyNode = engines[ht->engine].find(ht, key);
+    if (keyNode == NULL) return NULL;
+    if (keyNode->timer != NULL && pair_expired(keyNode, wheel_clock_ms())) {
+        remove_node(ht, keyNode); // lazy expiry
+        return NULL;
+    }
+    keyNode->referenced = 1;
+    return keyNode;
+}
+
+/// Advances the CLOCK hand until the table is back under its memory limit or
+/// EVICTION_SCAN_LIMIT nodes were looked at, so a single write never pays
+/// for a full sweep. Referenced nodes get a second chance, the others are
+/// deleted exactly as DELETE would.
+/// @param keep Node that was just written and must survive.
+static void evict(HashTable *ht, const KeyNode *keep) {
+    if (ht->memory_limit == 0 || ht->memory_used <= ht->memory_limit) {
+        return;
+    }
+
+    // Resume at the hand's position, which may have moved if nodes were deleted
+    KeyNode **link = &ht->table[ht->clock_bucket];
+    for (size_t i = 0; i < ht->clock_position && *link != NULL; i++) {
+        link = &(*link)->next;
+    }
+
+    for (int scanned = 0; scanned < EVICTION_SCAN_LIMIT && ht->memory_used > ht->memory_limit; scanned++) {
+        KeyNode *keyNode = *link;
+        if (keyNode == NULL) {
+            ht->clock_bucket = (ht->clock_bucket + 1) % TABLE_SIZE;
+            ht->clock_position = 0;
+            link = &ht->table[ht->clock_bucket];
+            continue;
+        }
+
+        if (keyNode->referenced || keyNode == keep) {
+            keyNode->referenced = 0;
+            link = &keyNode->next;
+            ht->clock_position++;
+            continue;
         }
-        keyNode = keyNode->next; // Move to the next node
+
+        remove_node(ht, keyNode); // *link now points at the next node
+        ht->evictions++;
     }
-    return NULL; // Key not found
 }
 
-int delete_pair(HashTable *ht, const char *key) {
+void set_memory_limit(HashTable *ht, size_t bytes) {
+    ht->memory_limit = bytes;
+}
+
+void set_value_interning(HashTable *ht, int enabled) {
+    ht->intern_values = enabled;
+}
+
+/// Writes a value, leaving the TTL of an existing key untouched.
+static KeyNode *upsert(HashTable *ht, const KvsString *key, const KvsString *value) {
+    KeyNode *keyNode = find_node(ht, key);
+    if (keyNode != NULL) {
+        if (set_value(ht, keyNode, value) != 0) return NULL;
+        keyNode->version++;
+        evict(ht, keyNode);
+        return keyNode;
+    }
+
+    // Key not found, create a new key node with room for the key and an inline value
+    if (engines[ht->engine].grow(ht, 1) != 0) return NULL;
     int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    KeyNode *prevNode = NULL;
-
-  
-    while (keyNode != NULL) { // collision handling
-        if (strcmp(keyNode->key, key) == 0) {
-            // Key found; delete this node
-            if (prevNode == NULL) {
-                // Node to delete is the first node in the list
-                ht->table[index] = keyNode->next; // Update the table to point to the next node
-            } else {
-               
-                prevNode->next = keyNode->next; // Link the previous node to the next node
-            }
-            // Free the memory allocated for the key and value
-            free(keyNode->key);
-            free(keyNode->value);
-            free(keyNode); // 
-            return 0; 
+    keyNode = region_malloc(ht->region, node_size(key->len));
+    if (!keyNode) return NULL;
+    memcpy(keyNode->key, key->data, key->len);
+    keyNode->key[key->len] = '\0';
+    keyNode->key_len = key->len;
+    keyNode->value = inline_value(keyNode);
+    keyNode->interned = 0;
+    keyNode->timer = NULL;
+    if (set_value(ht, keyNode, value) != 0) {
+        region_free(ht->region, keyNode);
+        return NULL;
+    }
+    keyNode->version = 1;
+    keyNode->sequence = ht->sequence++;
+    keyNode->referenced = 1;
+    if (engines[ht->engine].insert(ht, keyNode) != 0) {
+        drop_value(ht, keyNode);
+        region_free(ht->region, keyNode);
+        return NULL;
+    }
+    keyNode->prev = NULL;
+    keyNode->next = ht->table[index]; // Link to existing nodes
+    if (keyNode->next != NULL) {
+        keyNode->next->prev = keyNode;
+    }
+    ht->table[index] = keyNode; // Place new key node at the start of the list
+    ht->memory_used += alloc_size(node_size(key->len));
+    ht->count++;
+    evict(ht, keyNode);
+    return keyNode;
+}
+
+int write_pair(HashTable *ht, const KvsString *key, const KvsString *value, unsigned long ttl_ms) { 
+    return write_pair_repeated(ht, key, value, ttl_ms, 1);
+}
+
+int write_pair_repeated(HashTable *ht, const KvsString *key, const KvsString *value, unsigned long ttl_ms,
+                        unsigned long writes) {
+    KeyNode *keyNode = upsert(ht, key, value);
+    if (keyNode == NULL) return 1;
+    keyNode->version += writes - 1;
+    return set_ttl(ht, keyNode, ttl_ms);
+}
+
+int expire_pair(HashTable *ht, const KvsString *key, unsigned long ttl_ms) {
+    KeyNode *keyNode = find_node(ht, key);
+    if (keyNode == NULL) return 1;
+    return set_ttl(ht, keyNode, ttl_ms);
+}
+
+int cas_pair(HashTable *ht, const KvsString *key, unsigned long expected_version, const KvsString *value, unsigned long *version) {
+    KeyNode *keyNode = find_node(ht, key);
+    unsigned long current = keyNode != NULL ? keyNode->version : 0;
+
+    if (current != expected_version) {
+        *version = current;
+        return 1;
+    }
+
+    keyNode = upsert(ht, key, value);
+    if (keyNode == NULL) return 1;
+    *version = keyNode->version;
+    return 0;
+}
+
+int incr_pair(HashTable *ht, const KvsString *key, long delta, long *result) {
+    KeyNode *keyNode = find_node(ht, key);
+    long current = 0;
+
+    if (keyNode != NULL) {
+        char *end;
+        errno = 0;
+        current = strtol(keyNode->value, &end, 10);
+        if (errno != 0 || end == keyNode->value || end != keyNode->value + keyNode->value_len) {
+            return 1; // not an integer
         }
-        prevNode = keyNode; 
-        keyNode = keyNode->next; 
     }
-    
-    return 1;
+
+    if ((delta > 0 && current > LONG_MAX - delta) || (delta < 0 && current < LONG_MIN - delta)) {
+        return 1; // would overflow
+    }
+    current += delta;
+
+    char buffer[24];
+    int length = snprintf(buffer, sizeof(buffer), "%ld", current);
+    KvsString value = {buffer, (size_t)length, sizeof(buffer)};
+    if (upsert(ht, key, &value) == NULL) return 1;
+    *result = current;
+    return 0;
+}
+
+char* read_pair(HashTable *ht, const KvsString *key, size_t *value_len, unsigned long long *expires_at) {
+    KeyNode *keyNode = find_node(ht, key);
+    if (keyNode == NULL) {
+        return NULL; // Key not found
+    }
+
+    char *value = malloc(keyNode->value_len + 1);
+    if (!value) return NULL;
+    memcpy(value, keyNode->value, keyNode->value_len + 1);
+    *value_len = keyNode->value_len;
+    if (expires_at != NULL) {
+        *expires_at = keyNode->timer != NULL ? keyNode->timer->expires_at : 0;
+    }
+    return value; // Return copy of the value if found
+}
+
+int delete_pair(HashTable *ht, const KvsString *key) {
+    KeyNode *keyNode = find_node(ht, key);
+    if (keyNode == NULL) {
+        return 1;
+    }
+
+    // Unlink the node and free it together with an out of line value
+    remove_node(ht, keyNode);
+    return 0;
+}
+
+size_t reap_expired(HashTable *ht, size_t max) {
+    TimerEntry *expired[64];
+    if (max > 64) max = 64;
+
+    size_t found = wheel_expire(&ht->wheel, wheel_clock_ms(), expired, max);
+    for (size_t i = 0; i < found; i++) {
+        remove_node(ht, expired[i]->owner); // the timer is already off the wheel
+    }
+    return found;
 }
 
 void free_table(HashTable *ht) {
+    if (ht->region != NULL) {
+        // Only interned values live outside the region, a table in a file
+        // has none and stays there
+        for (int i = 0; ht->intern_values && i < table_size; i++) {
+            for (KeyNode *keyNode = ht->table[i]; keyNode != NULL; keyNode = keyNode->next) {
+                if (keyNode->interned) intern_release(keyNode->value);
+            }
+        }
+        region_close(ht->region);
+        return;
+    }
+
     for (int i = 0; i < table_size; i++) {
         KeyNode *keyNode = ht->table[i];
         while (keyNode != NULL) {
             KeyNode *temp = keyNode;
             keyNode = keyNode->next;
-            free(temp->key);
-            free(temp->value);
-            free(temp);
+            free_node(ht, temp);
         }
     }
+    engines[ht->engine].free(ht);
     free(ht);
-}
\ No newline at end of file
+}
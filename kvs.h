@@ -3,44 +3,251 @@
 
 #define TABLE_SIZE 26
 
-#include <stddef.h>
+// Values up to this many bytes are stored inside the node itself
+#define KVS_INLINE_VALUE_SIZE 15
+
+// Smallest key index, which doubles whenever it would pass 3/4 full
+#define KVS_INDEX_MIN_CAPACITY 16
 
+#include <stddef.h>
+#include "art.h"
+#include "bloom.h"
+#include "wheel.h"
 
+/// Length-prefixed string. data is also NUL-terminated so it can be printed.
+typedef struct KvsString {
+    char *data;
+    size_t len;
+    size_t cap; // bytes allocated for data, grown on demand by its owner
+} KvsString;
 
 typedef struct KeyNode {
-    char *key;
-    char *value;
     struct KeyNode *next;
+    struct KeyNode *prev;   // previous node of the bucket, NULL for the first
+    char *value;            // points at the inline area or a separate allocation
+    size_t value_len;
+    size_t key_len;
+    unsigned long version;  // bumped on every successful write, starts at 1
+    unsigned long long sequence; // creation order, merges a bucket across tables
+    TimerEntry *timer;      // expiry timer, NULL unless the key has a TTL
+    unsigned char referenced; // CLOCK bit, set on access and cleared by the hand
+    unsigned char interned; // value is shared through the intern table
+    char key[];             // key, NUL, then KVS_INLINE_VALUE_SIZE + 1 inline bytes
 } KeyNode;
 
+/// Slot of the key index. The hash is kept next to the node so that probing
+/// only touches the nodes whose hash matches.
+typedef struct IndexEntry {
+    KeyNode *node;          // NULL for a free slot
+    uint64_t hash;          // hash of the whole key
+} IndexEntry;
+
+/// Index a table finds its keys through, chosen when it is created.
+typedef enum {
+    TABLE_ENGINE_HASH,      // open addressing over the hash of the key, behind a Bloom filter
+    TABLE_ENGINE_ART,       // adaptive radix tree (see art.h), ordered and sharing prefixes
+} TableEngine;
+
+// Keys live in TABLE_SIZE buckets by first letter, which fixes the order SHOW
+// and BACKUP list them in whatever the engine. Lookups go through the index
+// of the engine instead of walking the buckets.
+//
+// The hash engine uses an open addressing index over the hash of the whole
+// key. It grows incrementally: while it is resized the old array stays next
+// to the new one and keeps the keys not moved yet, whole probe clusters at
+// a time, so lookups check both. The ART engine has nothing to resize.
 typedef struct HashTable {
     KeyNode *table[TABLE_SIZE];
+    TableEngine engine;
+    ArtTree tree;           // ART engine
+    IndexEntry *index;      // hash engine, linear probing
+    size_t index_capacity;  // power of two, 0 until the first write
+    BloomFilter filter;     // keys of the index, checked before probing it
+    IndexEntry *old_index;  // index being moved away from, NULL unless resizing
+    size_t old_capacity;
+    BloomFilter old_filter; // keys of old_index
+    size_t migrate_slot;    // next slot of old_index to move
+    size_t migrate_left;    // slots of old_index still to visit
+    TimerWheel wheel;       // expiry timers of the keys with a TTL
+    size_t count;           // number of keys stored
+    unsigned long long sequence; // given to the next node created
+    size_t memory_used;     // bytes allocated for the table and its entries
+    size_t memory_limit;    // eviction starts above this, 0 for no limit
+    size_t evictions;       // keys evicted to stay under the limit
+    int intern_values;      // share equal out of line values (see intern.h)
+    int clock_bucket;       // CLOCK hand: bucket and position in its chain
+    size_t clock_position;
+    Region *region;         // memory the table lives in, NULL for the heap
 } HashTable;
 
+/// Bucket of a key: its first letter or digit, 0 for anything else.
+/// @param key Key to place.
+/// @return Index of the bucket, below TABLE_SIZE.
+int hash(const KvsString *key);
+
+/// Reads an engine name: hash or art.
+/// @param name Name to read.
+/// @param engine Set to the engine named.
+/// @return 0 on success, 1 if the name is not an engine.
+int parse_table_engine(const char *name, TableEngine *engine);
+
+/// Selects the engine of the tables created from now on, TABLE_ENGINE_HASH
+/// until then. A table kept in a file keeps the engine it was created with.
+/// @param engine Engine to use.
+void use_table_engine(TableEngine engine);
+
 /// Creates a new event hash table.
 /// @return Newly created hash table, NULL on failure
 struct HashTable *create_hash_table();
 
+/// Creates a new table in anonymous memory of its own, backed by huge pages
+/// or placed on NUMA nodes (see placement.h).
+/// @param pages Pages backing the table.
+/// @param node Node for its memory, PLACEMENT_INTERLEAVE or PLACEMENT_ANY_NODE.
+/// @return The table, NULL on failure.
+HashTable *create_placed_table(PageMode pages, int node);
+
+/// Opens a table kept in a file across restarts, creating it empty if the
+/// file does not exist (see region.h). The TTLs left keep counting down
+/// from where they were when it was closed.
+/// @param path File of the table.
+/// @return The table, NULL on failure.
+HashTable *open_hash_table(const char *path);
+
+/// Takes a checkpoint of a table opened by open_hash_table. The table must
+/// not change meanwhile.
+/// @param ht Hash table to checkpoint.
+/// @return A descriptor for read_checkpoint, -1 on failure or for a table
+///         on the heap.
+int checkpoint_table(HashTable *ht);
+
+/// Makes a forked child see the table as it was at the checkpoint, whatever
+/// the parent changes afterwards.
+/// @param ht Hash table inherited from the parent.
+/// @param fd Descriptor returned by checkpoint_table, closed by the call.
+/// @return 0 on success, 1 otherwise.
+int read_checkpoint(HashTable *ht, int fd);
+
 /// Appends a new key value pair to the hash table.
 /// @param ht Hash table to be modified.
 /// @param key Key of the pair to be written.
 /// @param value Value of the pair to be written.
+/// @param ttl_ms Time to live in milliseconds, 0 for a key that never expires.
 /// @return 0 if the node was appended successfully, 1 otherwise.
-int write_pair(HashTable *ht, const char *key, const char *value);
+int write_pair(HashTable *ht, const KvsString *key, const KvsString *value, unsigned long ttl_ms);
+
+/// Stores the outcome of several consecutive writes of a key at once: the
+/// last value and TTL, with the version bumped once per write.
+/// @param ht Hash table to be modified.
+/// @param key Key of the pair to be written.
+/// @param value Value of the last write.
+/// @param ttl_ms Time to live of the last write, 0 for none.
+/// @param writes Number of writes collapsed, at least 1.
+/// @return 0 if the node was written successfully, 1 otherwise.
+int write_pair_repeated(HashTable *ht, const KvsString *key, const KvsString *value, unsigned long ttl_ms,
+                        unsigned long writes);
+
+/// Grows the key index ahead of a bulk load so that it does not rehash while
+/// the keys are inserted.
+/// @param ht Hash table to be grown.
+/// @param keys Number of keys about to be added.
+/// @return 0 on success, 1 if the index could not be allocated.
+int reserve_pairs(HashTable *ht, size_t keys);
+
+/// Moves part of the hash index to its new array while it is being resized. Every
+/// lookup already moves INDEX_MIGRATE_STEP slots, this lets an idle thread
+/// finish the resize early.
+/// @param ht Hash table being resized.
+/// @param slots Number of slots of the old array to visit.
+/// @return Number of slots still to visit, 0 once the resize is over.
+size_t migrate_index(HashTable *ht, size_t slots);
+
+/// Starts fetching the index slot of a key, so that a batch can look it up a
+/// few keys later without waiting for memory. Does nothing on the ART
+/// engine, where each node read decides the next one.
+/// @param ht Hash table the key will be looked up in.
+/// @param key Key to prefetch.
+void prefetch_pair(const HashTable *ht, const KvsString *key);
+
+/// Reads the value of given key.
+/// @param ht Hash table to read from.
+/// @param key Key of the pair to read.
+/// @param value_len Set to the length of the value when found.
+/// @param expires_at If not NULL, set to the deadline of the key's TTL when
+///                   found, 0 if it has none.
+/// @return Newly allocated copy of the value, NULL if the key is missing.
+char* read_pair(HashTable *ht, const KvsString *key, size_t *value_len, unsigned long long *expires_at);
 
 /// Deletes the value of given key.
 /// @param ht Hash table to delete from.
 /// @param key Key of the pair to be deleted.
 /// @return 0 if the node was deleted successfully, 1 otherwise.
-char* read_pair(HashTable *ht, const char *key);
+int delete_pair(HashTable *ht, const KvsString *key);
 
-/// Appends a new node to the list.
-/// @param list Event list to be modified.
-/// @param key Key of the pair to read.
-/// @return 0 if the node was appended successfully, 1 otherwise.
-int delete_pair(HashTable *ht, const char *key);
+/// Replaces the value of a key only if its version matches.
+/// @param ht Hash table to be modified.
+/// @param key Key of the pair to be written.
+/// @param expected_version Version the key must have, 0 if it must not exist.
+/// @param value Value to be written.
+/// @param version Set to the new version on success, to the current one
+///                (0 if the key is missing) on mismatch.
+/// @return 0 if the value was swapped, 1 on version mismatch.
+int cas_pair(HashTable *ht, const KvsString *key, unsigned long expected_version, const KvsString *value, unsigned long *version);
+
+/// Adds a delta to the integer value of a key. Missing keys count as 0.
+/// @param ht Hash table to be modified.
+/// @param key Key of the pair to be incremented.
+/// @param delta Amount to add.
+/// @param result Set to the new value on success.
+/// @return 0 if the value was incremented, 1 if it is not an integer or
+///         the result would overflow.
+int incr_pair(HashTable *ht, const KvsString *key, long delta, long *result);
+
+/// Sets or clears the time to live of a key.
+/// @param ht Hash table to be modified.
+/// @param key Key of the pair to expire.
+/// @param ttl_ms Time to live in milliseconds from now, 0 to never expire.
+/// @return 0 if the key exists, 1 otherwise.
+int expire_pair(HashTable *ht, const KvsString *key, unsigned long ttl_ms);
+
+/// Checks whether a node's TTL has run out. Expired nodes must be treated
+/// as missing even before they are reaped.
+/// @param keyNode Node to be checked.
+/// @param now Current time from wheel_clock_ms().
+/// @return 1 if the node expired, 0 otherwise.
+int pair_expired(const KeyNode *keyNode, unsigned long long now);
+
+/// Takes the next node of a bucket split across several tables, as the
+/// bucket of one table holding all of them would list it: newest first.
+/// @param cursors Nodes of the bucket still to list in each table, starting
+///                at its head; the cursor of the node taken is advanced.
+/// @param count Number of tables.
+/// @return The node, NULL once every cursor reached the end of its chain.
+KeyNode *bucket_next(KeyNode **cursors, size_t count);
+
+/// Deletes a batch of expired keys.
+/// @param ht Hash table to reap.
+/// @param max Maximum number of keys to delete.
+/// @return Number of keys deleted.
+size_t reap_expired(HashTable *ht, size_t max);
+
+/// Sets the memory budget of the table. Writes that go over it evict the
+/// least recently used keys (CLOCK approximation) a few at a time.
+/// @param ht Hash table to be limited.
+/// @param bytes Budget in bytes, 0 for no limit.
+void set_memory_limit(HashTable *ht, size_t bytes);
+
+/// Turns value interning on or off for the values written from now on.
+/// Values longer than KVS_INLINE_VALUE_SIZE are then shared with every
+/// other node holding the same bytes instead of being copied. Memory used
+/// still counts each of them at its full size, so eviction does not depend
+/// on how much is shared.
+/// @param ht Hash table to be changed.
+/// @param enabled 1 to intern values, 0 to copy them.
+void set_value_interning(HashTable *ht, int enabled);
 
-/// Frees the hashtable.
+/// Frees the hashtable. A table opened by open_hash_table is written out to
+/// its file instead.
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
 
@@ -0,0 +1,544 @@
+#define _GNU_SOURCE // sched_setaffinity
+#include <linux/perf_event.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "constants.h"
+#include "kvs.h"
+#include "logger.h"
+#include "operations.h"
+
+// Microbenchmark of the table (write_pair, read_pair, delete_pair on a
+// private table per thread, no locking) or of the KVS operations
+// (kvs_write, kvs_read, kvs_delete on the shared table or the shards). The
+// keys and operations of every thread are drawn before the run, so the
+// measured loop only calls into the KVS. Each thread is pinned to a CPU,
+// or to the CPUs of its node when the tables are partitioned across NUMA
+// nodes, runs its warmup, then all threads start the measured part together.
+//
+// The result is one line of key=value fields, to be appended to a trend
+// file. Hardware counters come from perf_event_open and each is left out
+// when the kernel does not give it.
+
+typedef enum {
+    DIST_UNIFORM,
+    DIST_ZIPF,
+    DIST_SEQUENTIAL,
+    DIST_PREFIX,
+} Distribution;
+
+typedef enum {
+    OP_READ,
+    OP_WRITE,
+    OP_DELETE,
+} BenchOp;
+
+typedef enum {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CACHE_MISSES,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_DTLB_MISSES,
+    COUNTERS,
+} Counter;
+
+static const char *const distribution_names[] = {"uniform", "zipf", "sequential", "prefix"};
+static const char *const counter_names[] = {"cycles", "instructions", "cache_misses", "branch_misses",
+                                            "dtlb_misses"};
+static const uint32_t counter_types[] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                                         PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE};
+static const unsigned long long counter_configs[] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+    PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16};
+
+typedef struct BenchThread {
+    pthread_t thread;
+    size_t id;
+    HashTable *table;             // table layer only
+    uint32_t *keys;               // key of every operation, warmup first
+    unsigned char *ops;           // operation of every call
+    uint64_t elapsed_ns;
+    uint64_t counts[COUNTERS];
+    unsigned int counted;         // bit c set if counter c could be read
+} BenchThread;
+
+// Settings
+static size_t thread_count = 1;
+static size_t key_count = 100000;
+static size_t op_count = 1000000;      // measured operations per thread
+static size_t warmup_count = 100000;   // per thread
+static size_t batch_size = 1;          // keys per kvs_* call
+static size_t value_size = 16;
+static Distribution distribution = DIST_UNIFORM;
+static double zipf_theta = 0.99;
+static unsigned int mix[3] = {90, 10, 0}; // percent of reads, writes and deletes
+static int table_layer = 1;
+static const char *engine_name = "hash"; // as given to -e, -H and -N, for the report
+static const char *pages_name = "small";
+static const char *numa_name = "off";
+
+static KvsString *key_strings = NULL;
+static KvsString value = {0};
+static pthread_barrier_t start_barrier;
+
+static uint64_t clock_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+// xorshift64*, one state per thread so the draws do not depend on timing.
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static double random_unit(uint64_t *state) {
+    return (double)(next_random(state) >> 11) / (double)(1ULL << 53);
+}
+
+// Zipfian ranks as drawn by YCSB (Gray et al., "Quickly generating
+// billion-record synthetic databases").
+typedef struct Zipf {
+    double theta, alpha, zetan, eta, half_pow;
+} Zipf;
+
+static void zipf_init(Zipf *zipf, size_t n, double theta) {
+    double zetan = 0, zeta2 = 1 + pow(0.5, theta);
+    for (size_t i = 1; i <= n; i++) {
+        zetan += 1 / pow((double)i, theta);
+    }
+    zipf->theta = theta;
+    zipf->alpha = 1 / (1 - theta);
+    zipf->zetan = zetan;
+    zipf->eta = (1 - pow(2.0 / (double)n, 1 - theta)) / (1 - zeta2 / zetan);
+    zipf->half_pow = pow(0.5, theta);
+}
+
+static size_t zipf_next(const Zipf *zipf, size_t n, uint64_t *state) {
+    double u = random_unit(state);
+    double uz = u * zipf->zetan;
+    if (uz < 1) return 0;
+    if (uz < 1 + zipf->half_pow) return 1;
+    size_t rank = (size_t)((double)n * pow(zipf->eta * u - zipf->eta + 1, zipf->alpha));
+    return rank < n ? rank : n - 1;
+}
+
+/// Draws the keys and operations of a thread.
+/// @return 0 on success, 1 if they could not be allocated.
+static int draw_thread(BenchThread *thread, const Zipf *zipf) {
+    size_t total = warmup_count + op_count;
+    size_t calls = (total + batch_size - 1) / batch_size;
+    thread->keys = malloc(calls * batch_size * sizeof(uint32_t));
+    thread->ops = malloc(calls);
+    if (!thread->keys || !thread->ops) return 1;
+
+    uint64_t state = 0x9E3779B97F4A7C15ULL * (thread->id + 1);
+    size_t sequence = thread->id * (key_count / thread_count);
+    for (size_t i = 0; i < calls * batch_size; i++) {
+        size_t key;
+        switch (distribution) {
+            case DIST_ZIPF:
+                // Scatter the ranks so that hot keys are not neighbours
+                key = (size_t)((zipf_next(zipf, key_count, &state) * 0x9E3779B97F4A7C15ULL) % key_count);
+                break;
+            case DIST_SEQUENTIAL:
+                key = sequence++ % key_count;
+                break;
+            case DIST_UNIFORM:
+            case DIST_PREFIX:
+            default:
+                key = (size_t)(next_random(&state) % key_count);
+                break;
+        }
+        thread->keys[i] = (uint32_t)key;
+    }
+    for (size_t call = 0; call < calls; call++) {
+        unsigned int draw = (unsigned int)(next_random(&state) % 100);
+        thread->ops[call] = draw < mix[0] ? OP_READ : draw < mix[0] + mix[1] ? OP_WRITE : OP_DELETE;
+    }
+    return 0;
+}
+
+static int make_keys(void) {
+    // Shared-prefix keys differ only in their last bytes, the worst case for
+    // hashing and comparing them
+    const char *prefix = distribution == DIST_PREFIX ? "tenant/0001/region/eu-west/bucket/objects/" : "key";
+    key_strings = calloc(key_count, sizeof(KvsString));
+    value.data = malloc(value_size + 1);
+    if (!key_strings || !value.data) return 1;
+    memset(value.data, 'v', value_size);
+    value.data[value_size] = '\0';
+    value.len = value_size;
+    value.cap = value_size + 1;
+
+    for (size_t i = 0; i < key_count; i++) {
+        char buffer[128];
+        int len = snprintf(buffer, sizeof(buffer), "%s%08zu", prefix, i);
+        key_strings[i].data = malloc((size_t)len + 1);
+        if (!key_strings[i].data) return 1;
+        memcpy(key_strings[i].data, buffer, (size_t)len + 1);
+        key_strings[i].len = (size_t)len;
+        key_strings[i].cap = (size_t)len + 1;
+    }
+    return 0;
+}
+
+// --- Counters --------------------------------------------------------------
+
+static void open_counters(int fds[COUNTERS]) {
+    for (int c = 0; c < COUNTERS; c++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = counter_types[c];
+        attr.size = sizeof(attr);
+        attr.config = counter_configs[c];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[c] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+}
+
+static void start_counters(const int fds[COUNTERS]) {
+    for (int c = 0; c < COUNTERS; c++) {
+        if (fds[c] == -1) continue;
+        ioctl(fds[c], PERF_EVENT_IOC_RESET, 0);
+        ioctl(fds[c], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+/// Stops and reads the counters, scaled up when the kernel multiplexed them.
+/// @return Bit c set if counter c was read.
+static unsigned int read_counters(const int fds[COUNTERS], uint64_t counts[COUNTERS]) {
+    unsigned int counted = 0;
+    for (int c = 0; c < COUNTERS; c++) {
+        uint64_t values[3] = {0}; // value, time enabled, time running
+        if (fds[c] == -1) continue;
+        ioctl(fds[c], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fds[c], values, sizeof(values)) == (ssize_t)sizeof(values) && values[2] != 0) {
+            counts[c] = (uint64_t)((double)values[0] * (double)values[1] / (double)values[2]);
+            counted |= 1U << c;
+        }
+        close(fds[c]);
+    }
+    return counted;
+}
+
+// --- Runs ------------------------------------------------------------------
+
+static void run_table(BenchThread *thread, size_t from, size_t to) {
+    for (size_t call = from; call < to; call++) {
+        const KvsString *key = &key_strings[thread->keys[call]];
+        switch ((BenchOp)thread->ops[call]) {
+            case OP_READ: {
+                size_t len;
+                free(read_pair(thread->table, key, &len, NULL));
+                break;
+            }
+            case OP_WRITE:
+                write_pair(thread->table, key, &value, 0);
+                break;
+            case OP_DELETE:
+                delete_pair(thread->table, key);
+                break;
+        }
+    }
+}
+
+static void run_kvs(BenchThread *thread, size_t from, size_t to) {
+    KvsString keys[MAX_WRITE_SIZE];
+    KvsString values[MAX_WRITE_SIZE];
+    for (size_t i = 0; i < batch_size; i++) {
+        values[i] = value;
+    }
+    for (size_t call = from; call < to; call++) {
+        for (size_t i = 0; i < batch_size; i++) {
+            keys[i] = key_strings[thread->keys[call * batch_size + i]];
+        }
+        switch ((BenchOp)thread->ops[call]) {
+            case OP_READ:
+                kvs_read(batch_size, keys, NULL);
+                break;
+            case OP_WRITE:
+                kvs_write(batch_size, keys, values, NULL);
+                break;
+            case OP_DELETE:
+                kvs_delete(batch_size, keys, NULL);
+                break;
+        }
+    }
+}
+
+static void pin_thread(size_t id) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(id % (size_t)(cpus > 0 ? cpus : 1), &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0 && id == 0) {
+        perror("Failed to pin benchmark thread");
+    }
+}
+
+static void *bench_mission(void *arg) {
+    BenchThread *thread = arg;
+    int node = placement_nodes() > 1 ? placement_node_of(table_numa, thread->id) : PLACEMENT_ANY_NODE;
+    if (table_numa != NUMA_PARTITION || node < 0 || placement_pin(node) != 0) {
+        pin_thread(thread->id);
+    }
+    void (*run)(BenchThread *, size_t, size_t) = table_layer ? run_table : run_kvs;
+
+    size_t warmup_calls = warmup_count / batch_size;
+    size_t calls = (warmup_count + op_count + batch_size - 1) / batch_size;
+    run(thread, 0, warmup_calls);
+
+    int fds[COUNTERS];
+    open_counters(fds);
+    pthread_barrier_wait(&start_barrier);
+
+    uint64_t start = clock_ns();
+    start_counters(fds);
+    run(thread, warmup_calls, calls);
+    thread->counted = read_counters(fds, thread->counts);
+    thread->elapsed_ns = clock_ns() - start;
+    return NULL;
+}
+
+/// Fills a thread's private table, or the KVS once, with every key.
+static int populate(HashTable *table) {
+    if (table != NULL) {
+        if (reserve_pairs(table, key_count) != 0) return 1;
+        for (size_t i = 0; i < key_count; i++) {
+            if (write_pair(table, &key_strings[i], &value, 0) != 0) return 1;
+        }
+        return 0;
+    }
+    KvsString values[MAX_WRITE_SIZE];
+    for (size_t i = 0; i < MAX_WRITE_SIZE; i++) {
+        values[i] = value;
+    }
+    for (size_t i = 0; i < key_count; i += MAX_WRITE_SIZE) {
+        size_t count = key_count - i < MAX_WRITE_SIZE ? key_count - i : MAX_WRITE_SIZE;
+        if (kvs_write(count, &key_strings[i], values, NULL) != 0) return 1;
+    }
+    return 0;
+}
+
+static void report(BenchThread *threads, uint64_t wall_ns) {
+    size_t total_ops = 0;
+    uint64_t thread_ns = 0, counts[COUNTERS] = {0};
+    unsigned int counted = ~0U;
+    for (size_t t = 0; t < thread_count; t++) {
+        size_t calls = (warmup_count + op_count + batch_size - 1) / batch_size - warmup_count / batch_size;
+        total_ops += calls * batch_size;
+        thread_ns += threads[t].elapsed_ns;
+        counted &= threads[t].counted;
+        for (int c = 0; c < COUNTERS; c++) {
+            counts[c] += threads[t].counts[c];
+        }
+    }
+
+    printf("layer=%s dist=%s", table_layer ? "table" : "kvs", distribution_names[distribution]);
+    if (distribution == DIST_ZIPF) printf(" theta=%.2f", zipf_theta);
+    printf(" threads=%zu shards=%d keys=%zu batch=%zu value=%zu mix=%u:%u:%u ops=%zu", thread_count, shard_count,
+           key_count, batch_size, value_size, mix[0], mix[1], mix[2], total_ops);
+    printf(" engine=%s pages=%s numa=%s", engine_name, pages_name, numa_name);
+    printf(" ns_per_op=%.1f ops_per_s=%.0f", (double)thread_ns / (double)total_ops,
+           wall_ns ? (double)total_ops * 1e9 / (double)wall_ns : 0.0);
+    if (table_layer) {
+        // What each key costs in its table, index included, after the run
+        size_t memory = 0, keys = 0;
+        for (size_t t = 0; t < thread_count; t++) {
+            memory += threads[t].table->memory_used;
+            keys += threads[t].table->count;
+        }
+        printf(" bytes_per_key=%.1f", keys ? (double)memory / (double)keys : 0.0);
+    }
+    for (int c = 0; c < COUNTERS; c++) {
+        if (counted >> c & 1) {
+            printf(" %s_per_op=%.3f", counter_names[c], (double)counts[c] / (double)total_ops);
+        }
+    }
+    printf("\n");
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Options:\n"
+        "  -l table|kvs        call write_pair/read_pair/delete_pair on a table per thread (default),\n"
+        "                      or kvs_write/kvs_read/kvs_delete on the shared KVS\n"
+        "  -t <n>              threads, each pinned to a CPU (default 1)\n"
+        "  -k <n>              distinct keys, all written before the run (default 100000)\n"
+        "  -n <n>              measured operations per thread (default 1000000)\n"
+        "  -w <n>              warmup operations per thread (default 100000)\n"
+        "  -d <distribution>   uniform, zipf, sequential or prefix (uniform keys sharing a long prefix)\n"
+        "  -z <theta>          skew of zipf (default 0.99)\n"
+        "  -m <r:w:d>          percent of reads, writes and deletes (default 90:10:0)\n"
+        "  -b <n>              keys per kvs_* call (default 1, at most %d)\n"
+        "  -v <bytes>          value size (default 16)\n"
+        "  -s <n>              run the kvs layer on n shards\n"
+        "  -e <engine>         index the keys with a hash table (hash, default) or a radix tree (art)\n"
+        "  -H <pages>          back the tables with small (default), thp or explicit huge pages\n"
+        "  -N <numa>           off (default), interleave the tables or partition them and the threads\n"
+        "                      across NUMA nodes\n",
+        program, MAX_WRITE_SIZE);
+}
+
+static int parse_mix(const char *text) {
+    unsigned int reads, writes, deletes;
+    if (sscanf(text, "%u:%u:%u", &reads, &writes, &deletes) != 3 || reads + writes + deletes != 100) return 1;
+    mix[0] = reads;
+    mix[1] = writes;
+    mix[2] = deletes;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        const char *option = argv[i];
+        const char *arg = argv[++i];
+        int bad = 0;
+        if (strcmp(option, "-l") == 0) {
+            bad = strcmp(arg, "table") != 0 && strcmp(arg, "kvs") != 0;
+            table_layer = strcmp(arg, "table") == 0;
+        } else if (strcmp(option, "-t") == 0) {
+            thread_count = (size_t)strtoull(arg, NULL, 10);
+            bad = thread_count == 0;
+        } else if (strcmp(option, "-k") == 0) {
+            key_count = (size_t)strtoull(arg, NULL, 10);
+            bad = key_count == 0 || key_count > UINT32_MAX;
+        } else if (strcmp(option, "-n") == 0) {
+            op_count = (size_t)strtoull(arg, NULL, 10);
+            bad = op_count == 0;
+        } else if (strcmp(option, "-w") == 0) {
+            warmup_count = (size_t)strtoull(arg, NULL, 10);
+        } else if (strcmp(option, "-d") == 0) {
+            bad = 1;
+            for (int d = 0; d <= DIST_PREFIX; d++) {
+                if (strcmp(arg, distribution_names[d]) == 0) {
+                    distribution = (Distribution)d;
+                    bad = 0;
+                }
+            }
+        } else if (strcmp(option, "-z") == 0) {
+            zipf_theta = strtod(arg, NULL);
+            bad = !(zipf_theta > 0 && zipf_theta < 1);
+        } else if (strcmp(option, "-m") == 0) {
+            bad = parse_mix(arg);
+        } else if (strcmp(option, "-b") == 0) {
+            batch_size = (size_t)strtoull(arg, NULL, 10);
+            bad = batch_size == 0 || batch_size > MAX_WRITE_SIZE;
+        } else if (strcmp(option, "-v") == 0) {
+            value_size = (size_t)strtoull(arg, NULL, 10);
+        } else if (strcmp(option, "-s") == 0) {
+            shard_count = atoi(arg);
+            bad = shard_count <= 0;
+        } else if (strcmp(option, "-e") == 0) {
+            TableEngine engine;
+            bad = parse_table_engine(arg, &engine);
+            if (!bad) use_table_engine(engine);
+            engine_name = arg;
+        } else if (strcmp(option, "-H") == 0) {
+            bad = placement_parse_pages(arg, &table_pages);
+            pages_name = arg;
+        } else if (strcmp(option, "-N") == 0) {
+            bad = placement_parse_numa(arg, &table_numa);
+            numa_name = arg;
+        } else {
+            bad = 1;
+        }
+        if (bad) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (table_layer) batch_size = 1;
+
+    if (make_keys() != 0) {
+        perror("Failed to allocate keys");
+        return 1;
+    }
+    Zipf zipf = {0};
+    if (distribution == DIST_ZIPF) zipf_init(&zipf, key_count, zipf_theta);
+
+    BenchThread *threads = calloc(thread_count, sizeof(BenchThread));
+    if (!threads) {
+        perror("Failed to allocate threads");
+        return 1;
+    }
+    for (size_t t = 0; t < thread_count; t++) {
+        threads[t].id = t;
+        if (draw_thread(&threads[t], &zipf) != 0) {
+            perror("Failed to draw operations");
+            return 1;
+        }
+    }
+
+    // DELETE reports missing keys on stdout, which is kept for the result
+    log_set_level(LOG_LEVEL_ERROR);
+    max_backups = 1;
+    if (table_layer) {
+        for (size_t t = 0; t < thread_count; t++) {
+            threads[t].table = table_pages != PAGES_SMALL || table_numa != NUMA_OFF
+                                   ? create_placed_table(table_pages, placement_node_of(table_numa, t))
+                                   : create_hash_table();
+            if (threads[t].table == NULL || populate(threads[t].table) != 0) {
+                fprintf(stderr, "Failed to fill the tables\n");
+                return 1;
+            }
+        }
+    } else if (kvs_init() != 0 || populate(NULL) != 0) {
+        fprintf(stderr, "Failed to fill the KVS\n");
+        return 1;
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, (unsigned int)thread_count + 1);
+    for (size_t t = 0; t < thread_count; t++) {
+        if (pthread_create(&threads[t].thread, NULL, bench_mission, &threads[t]) != 0) {
+            perror("Failed to create benchmark thread");
+            return 1;
+        }
+    }
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = clock_ns();
+    for (size_t t = 0; t < thread_count; t++) {
+        pthread_join(threads[t].thread, NULL);
+    }
+    uint64_t wall_ns = clock_ns() - start;
+    pthread_barrier_destroy(&start_barrier);
+
+    report(threads, wall_ns);
+    if (threads[0].counted == 0) {
+        fprintf(stderr, "Hardware counters are not available (perf_event_paranoid, or no PMU)\n");
+    }
+
+    for (size_t t = 0; t < thread_count; t++) {
+        if (threads[t].table != NULL) free_table(threads[t].table);
+        free(threads[t].keys);
+        free(threads[t].ops);
+    }
+    if (!table_layer) kvs_terminate();
+    for (size_t i = 0; i < key_count; i++) {
+        free(key_strings[i].data);
+    }
+    free(key_strings);
+    free(value.data);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "backup.h"
+
+// Prints a backup file, decompressing it if needed.
+// @param only_block Block to print, -1 for the whole file.
+// @return 0 on success, 1 if the file is unreadable or corrupt.
+static int cat_file(const char *path, long only_block) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror(path);
+        close(fd);
+        return 1;
+    }
+    size_t length = (size_t)st.st_size;
+    if (length == 0) {
+        close(fd);
+        return 0;
+    }
+
+    unsigned char *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(path);
+        return 1;
+    }
+
+    int failed = 0;
+    if (!backup_is_compressed(data, length)) {
+        fwrite(data, 1, length, stdout); // plain text backup
+        munmap(data, length);
+        return 0;
+    }
+
+    char *raw = malloc(BACKUP_BLOCK_SIZE);
+    if (!raw) {
+        perror(path);
+        munmap(data, length);
+        return 1;
+    }
+    uint32_t blocks = 0;
+    uint64_t entries;
+    uint64_t index_offset = backup_find_index(data, length, &blocks, &entries);
+    size_t end = index_offset ? (size_t)index_offset : length;
+    if (!index_offset) {
+        fprintf(stderr, "%s: missing block index, backup may be truncated\n", path);
+        failed = 1;
+    }
+
+    size_t offset = BACKUP_HEADER_SIZE;
+    if (only_block >= 0) {
+        if (!index_offset || (uint64_t)only_block >= blocks) {
+            fprintf(stderr, "%s: no block %ld\n", path, only_block);
+            free(raw);
+            munmap(data, length);
+            return 1;
+        }
+        offset = (size_t)backup_read_u64(data + index_offset + (uint64_t)only_block * 8);
+        end = offset < end ? end : offset;
+    }
+
+    while (offset < end) {
+        size_t raw_length, consumed;
+        if (backup_decode_block(data + offset, end - offset, raw, &raw_length, &consumed) != 0) {
+            fprintf(stderr, "%s: corrupt block at offset %zu\n", path, offset);
+            failed = 1;
+            break;
+        }
+        fwrite(raw, 1, raw_length, stdout);
+        offset += consumed;
+        if (only_block >= 0) break;
+    }
+
+    free(raw);
+    munmap(data, length);
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    long only_block = -1;
+    int first = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-b") == 0) {
+        only_block = strtol(argv[2], NULL, 10);
+        first = 3;
+    }
+    if (first >= argc) {
+        fprintf(stderr, "Usage: %s [-b <block>] <backup file>...\n", argv[0]);
+        return 1;
+    }
+
+    int failed = 0;
+    for (int i = first; i < argc; i++) {
+        failed |= cat_file(argv[i], only_block);
+    }
+    return failed;
+}
@@ -0,0 +1,397 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "operations.h"
+#include "trace.h"
+
+typedef struct Op {
+    TraceOp op;
+    uint32_t thread;
+    uint64_t sequence;
+    uint64_t start_ns;      // recorded start, relative to the trace start
+    uint64_t duration_ns;   // recorded latency
+    uint64_t replay_ns;     // latency measured by the replay
+    size_t count;
+    KvsString *keys;        // strings point into the mapped trace
+    KvsString *values;
+    unsigned long *numbers;
+} Op;
+
+typedef struct ReplayThread {
+    pthread_t thread;
+    size_t *ops;            // positions in the sequence order
+    size_t count;
+    size_t capacity;
+} ReplayThread;
+
+static Op *ops = NULL;
+static size_t op_total = 0;
+static int paced = 0;
+static uint64_t replay_start_ns = 0;
+static atomic_size_t next_op; // position of the next operation allowed to start
+
+static uint32_t get_u32(const unsigned char *data) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= (uint32_t)data[i] << (8 * i);
+    }
+    return value;
+}
+
+static uint64_t get_u64(const unsigned char *data) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value |= (uint64_t)data[i] << (8 * i);
+    }
+    return value;
+}
+
+// Reads fixed-size fields, failing past the end of the trace.
+static const unsigned char *take(const unsigned char *data, size_t size, size_t *pos, size_t length) {
+    if (size - *pos < length) return NULL;
+    const unsigned char *field = data + *pos;
+    *pos += length;
+    return field;
+}
+
+static int take_string(const unsigned char *data, size_t size, size_t *pos, KvsString *string) {
+    const unsigned char *length = take(data, size, pos, 4);
+    if (!length) return 1;
+    size_t len = get_u32(length);
+    const unsigned char *bytes = take(data, size, pos, len + 1);
+    if (!bytes || bytes[len] != '\0') return 1;
+
+    string->data = (char *)(uintptr_t)bytes; // read only, never freed
+    string->len = len;
+    string->cap = 0;
+    return 0;
+}
+
+static int take_number(const unsigned char *data, size_t size, size_t *pos, unsigned long *number) {
+    const unsigned char *field = take(data, size, pos, 8);
+    if (!field) return 1;
+    *number = (unsigned long)get_u64(field);
+    return 0;
+}
+
+// Decodes one record of the trace.
+static int load_op(const unsigned char *data, size_t size, size_t *pos, Op *op) {
+    const unsigned char *header = take(data, size, pos, TRACE_RECORD_HEADER_SIZE);
+    if (!header || header[0] >= TRACE_OPS) return 1;
+
+    memset(op, 0, sizeof(*op));
+    op->op = (TraceOp)header[0];
+    op->thread = get_u32(header + 1);
+    op->sequence = get_u64(header + 5);
+    op->start_ns = get_u64(header + 13);
+    op->duration_ns = get_u64(header + 21);
+    op->count = get_u32(header + 29);
+    if (op->count > size) return 1; // every key takes bytes
+
+    size_t slots = op->count ? op->count : 1;
+    op->keys = calloc(slots, sizeof(KvsString));
+    op->values = calloc(slots, sizeof(KvsString));
+    op->numbers = calloc(slots, sizeof(unsigned long));
+    if (!op->keys || !op->values || !op->numbers) return 1;
+
+    for (size_t i = 0; i < op->count; i++) {
+        if (take_string(data, size, pos, &op->keys[i])) return 1;
+        int failed = 0;
+        switch (op->op) {
+            case TRACE_WRITE:
+                failed = take_string(data, size, pos, &op->values[i]) || take_number(data, size, pos, &op->numbers[i]);
+                break;
+            case TRACE_CAS:
+                failed = take_number(data, size, pos, &op->numbers[i]) || take_string(data, size, pos, &op->values[i]);
+                break;
+            case TRACE_INCR:
+            case TRACE_EXPIRE:
+                failed = take_number(data, size, pos, &op->numbers[i]);
+                break;
+            case TRACE_READ:
+            case TRACE_DELETE:
+                break;
+            case TRACE_SHOW:
+            case TRACE_BACKUP:
+            case TRACE_OPS:
+                failed = 1;
+                break;
+        }
+        if (failed) return 1;
+    }
+    return 0;
+}
+
+static int compare_sequence(const void *a, const void *b) {
+    const Op *opA = a;
+    const Op *opB = b;
+    return (opA->sequence > opB->sequence) - (opA->sequence < opB->sequence);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void run_op(Op *op) {
+    switch (op->op) {
+        case TRACE_WRITE:
+            kvs_write(op->count, op->keys, op->values, op->numbers);
+            break;
+        case TRACE_READ:
+            kvs_read(op->count, op->keys, NULL);
+            break;
+        case TRACE_DELETE:
+            kvs_delete(op->count, op->keys, NULL);
+            break;
+        case TRACE_CAS:
+            kvs_cas(op->count, op->keys, op->numbers, op->values, NULL);
+            break;
+        case TRACE_INCR:
+            kvs_incr(op->count, op->keys, (long *)op->numbers, NULL);
+            break;
+        case TRACE_EXPIRE:
+            kvs_expire(op->count, op->keys, op->numbers, NULL);
+            break;
+        case TRACE_SHOW:
+            kvs_show(NULL);
+            break;
+        case TRACE_BACKUP: {
+            int fd = open("/dev/null", O_WRONLY);
+            if (fd != -1) {
+                kvs_backup("/dev/null", fd);
+            }
+            break;
+        }
+        case TRACE_OPS:
+            break;
+    }
+}
+
+// Replays the operations of one recorded thread, each starting only after
+// every operation recorded before it has started.
+static void *replay_mission(void *arg) {
+    ReplayThread *thread = arg;
+
+    for (size_t i = 0; i < thread->count; i++) {
+        size_t position = thread->ops[i];
+        Op *op = &ops[position];
+
+        while (atomic_load_explicit(&next_op, memory_order_acquire) != position) {
+            sched_yield();
+        }
+        if (paced) {
+            uint64_t due = replay_start_ns + op->start_ns;
+            uint64_t now = trace_clock_ns();
+            if (now < due) {
+                struct timespec delay = {(time_t)((due - now) / 1000000000ULL), (long)((due - now) % 1000000000ULL)};
+                nanosleep(&delay, NULL);
+            }
+        }
+
+        uint64_t start = trace_clock_ns();
+        atomic_store_explicit(&next_op, position + 1, memory_order_release);
+        run_op(op);
+        op->replay_ns = trace_clock_ns() - start;
+    }
+    return NULL;
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t count, double q) {
+    if (count == 0) return 0;
+    return sorted[(size_t)(q * (double)(count - 1))];
+}
+
+static void report_row(FILE *out, const char *name, uint64_t *replayed, uint64_t *recorded, size_t count) {
+    if (count == 0) return;
+    qsort(replayed, count, sizeof(uint64_t), compare_u64);
+    qsort(recorded, count, sizeof(uint64_t), compare_u64);
+    fprintf(out, "%-8s %9zu %9.1f %9.1f %9.1f %9.1f %12.1f %12.1f\n", name, count,
+            (double)percentile(replayed, count, 0.50) / 1e3, (double)percentile(replayed, count, 0.99) / 1e3,
+            (double)percentile(replayed, count, 0.999) / 1e3, (double)replayed[count - 1] / 1e3,
+            (double)percentile(recorded, count, 0.50) / 1e3, (double)percentile(recorded, count, 0.99) / 1e3);
+}
+
+static void report(FILE *out, size_t threads, uint64_t elapsed_ns) {
+    uint64_t span_ns = op_total ? ops[op_total - 1].start_ns + ops[op_total - 1].duration_ns : 0;
+    fprintf(out, "%zu operations from %zu threads, recorded over %.1f ms\n", op_total, threads, (double)span_ns / 1e6);
+    fprintf(out, "replayed %s in %.1f ms: %.0f ops/s\n", paced ? "at recorded pace" : "as fast as possible",
+            (double)elapsed_ns / 1e6, elapsed_ns ? (double)op_total * 1e9 / (double)elapsed_ns : 0.0);
+    fprintf(out, "%-8s %9s %9s %9s %9s %9s %12s %12s\n", "op", "count", "p50_us", "p99_us", "p999_us", "max_us",
+            "rec_p50_us", "rec_p99_us");
+
+    uint64_t *replayed = malloc((op_total ? op_total : 1) * sizeof(uint64_t));
+    uint64_t *recorded = malloc((op_total ? op_total : 1) * sizeof(uint64_t));
+    if (!replayed || !recorded) {
+        free(replayed);
+        free(recorded);
+        return;
+    }
+    for (int kind = 0; kind <= TRACE_OPS; kind++) {
+        size_t count = 0;
+        for (size_t i = 0; i < op_total; i++) {
+            if (kind == TRACE_OPS || ops[i].op == (TraceOp)kind) {
+                replayed[count] = ops[i].replay_ns;
+                recorded[count++] = ops[i].duration_ns;
+            }
+        }
+        report_row(out, kind == TRACE_OPS ? "all" : trace_op_name((TraceOp)kind), replayed, recorded, count);
+    }
+    free(replayed);
+    free(recorded);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+        "Usage: %s [options] <trace file>\n"
+        "Options:\n"
+        "  -p          replay at the recorded pace instead of as fast as possible\n"
+        "  -s <n>      replay against n shards instead of one shared table\n"
+        "  -m <bytes>  memory budget of the KVS\n"
+        "  -e <engine> index of the tables, hash (default) or art\n",
+        program);
+}
+
+int main(int argc, char *argv[]) {
+    size_t max_memory = 0;
+    int i = 1;
+    for (; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-p") == 0) {
+            paced = 1;
+        } else if (strcmp(argv[i], "-s") == 0 && i + 2 < argc) {
+            shard_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0 && i + 2 < argc) {
+            max_memory = (size_t)strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-e") == 0 && i + 2 < argc) {
+            TableEngine engine;
+            if (parse_table_engine(argv[++i], &engine)) break;
+            use_table_engine(engine);
+        } else {
+            break;
+        }
+    }
+    if (i != argc - 1 || shard_count < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *path = argv[i];
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        return 1;
+    }
+    size_t size = (size_t)st.st_size;
+    unsigned char *data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED || size < TRACE_HEADER_SIZE || memcmp(data, TRACE_MAGIC, 4) != 0 ||
+        get_u32(data + 4) != TRACE_VERSION) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        return 1;
+    }
+
+    // Load every record, then order them as they committed
+    size_t capacity = 1024;
+    ops = malloc(capacity * sizeof(Op));
+    size_t pos = TRACE_HEADER_SIZE;
+    while (ops != NULL && pos < size) {
+        if (op_total == capacity) {
+            Op *grown = realloc(ops, 2 * capacity * sizeof(Op));
+            if (!grown) break;
+            ops = grown;
+            capacity *= 2;
+        }
+        if (load_op(data, size, &pos, &ops[op_total]) != 0) {
+            fprintf(stderr, "%s: corrupt record at offset %zu\n", path, pos);
+            return 1;
+        }
+        op_total++;
+    }
+    if (ops == NULL || pos < size) {
+        perror("Failed to load trace");
+        return 1;
+    }
+    qsort(ops, op_total, sizeof(Op), compare_sequence);
+
+    uint32_t thread_count = 0;
+    for (size_t j = 0; j < op_total; j++) {
+        if (ops[j].thread >= thread_count) thread_count = ops[j].thread + 1;
+    }
+    ReplayThread *threads = calloc(thread_count ? thread_count : 1, sizeof(ReplayThread));
+    for (size_t j = 0; threads != NULL && j < op_total; j++) {
+        ReplayThread *thread = &threads[ops[j].thread];
+        if (thread->count == thread->capacity) {
+            thread->capacity = thread->capacity ? thread->capacity * 2 : 64;
+            size_t *grown = realloc(thread->ops, thread->capacity * sizeof(size_t));
+            if (!grown) {
+                perror("Failed to load trace");
+                return 1;
+            }
+            thread->ops = grown;
+        }
+        thread->ops[thread->count++] = j;
+    }
+    if (threads == NULL) {
+        perror("Failed to load trace");
+        return 1;
+    }
+
+    // Commands print to stdout; keep it for the report only
+    fflush(stdout);
+    int report_fd = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (report_fd == -1 || null_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1) {
+        perror("Failed to redirect stdout");
+        return 1;
+    }
+    close(null_fd);
+    FILE *out = fdopen(report_fd, "w");
+
+    max_backups = 1;
+    if (kvs_init()) {
+        fprintf(stderr, "Failed to initialize KVS\n");
+        return 1;
+    }
+    kvs_set_memory_limit(max_memory);
+
+    replay_start_ns = trace_clock_ns();
+    for (uint32_t t = 0; t < thread_count; t++) {
+        if (pthread_create(&threads[t].thread, NULL, replay_mission, &threads[t]) != 0) {
+            perror("Failed to create replay thread");
+            return 1;
+        }
+    }
+    for (uint32_t t = 0; t < thread_count; t++) {
+        pthread_join(threads[t].thread, NULL);
+    }
+    uint64_t elapsed_ns = trace_clock_ns() - replay_start_ns;
+
+    kvs_finish_backups();
+    kvs_terminate();
+
+    report(out, thread_count, elapsed_ns);
+    fclose(out);
+
+    for (size_t j = 0; j < op_total; j++) {
+        free(ops[j].keys);
+        free(ops[j].values);
+        free(ops[j].numbers);
+    }
+    for (uint32_t t = 0; t < thread_count; t++) {
+        free(threads[t].ops);
+    }
+    free(threads);
+    free(ops);
+    munmap(data, size);
+    return 0;
+}
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE // sysconf(_SC_NPROCESSORS_ONLN)
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "backup.h"
+#include "crc32c.h"
+
+// Checks backups against their checksums: the CRC32C of every block, the
+// entry count and the completion marker (the footer of a compressed backup,
+// the .sum file of a plain one). The blocks of all the files are checked by
+// a pool of threads, so a large backup set is read at disk speed rather
+// than at the speed of one core.
+
+#define VERIFY_MAX_THREADS 64
+
+// A backup mapped in memory.
+typedef struct VerifyFile {
+    const char *path;
+    unsigned char *data;
+    size_t length;
+    unsigned char *sums_data;     // mapped .sum file of a plain backup
+    size_t sums_length;
+    int compressed;
+    BackupSums sums;              // plain backups
+    uint64_t index_offset;        // compressed backups
+    uint32_t blocks;
+    uint64_t entries;             // expected, BACKUP_UNKNOWN_ENTRIES if not recorded
+    const char *error;            // why the file cannot be checked block by block
+    atomic_ullong lines;          // entries found in the blocks checked
+    atomic_llong bad_block;       // first corrupt block found, -1 for none
+} VerifyFile;
+
+// One block to check.
+typedef struct VerifyTask {
+    VerifyFile *file;
+    uint32_t block;
+} VerifyTask;
+
+typedef struct VerifyJob {
+    VerifyTask *tasks;
+    size_t count;
+    atomic_size_t next;
+} VerifyJob;
+
+static unsigned long long count_lines(const char *data, size_t length) {
+    unsigned long long lines = 0;
+    const char *end = data + length;
+    while ((data = memchr(data, '\n', (size_t)(end - data))) != NULL) {
+        lines++;
+        data++;
+    }
+    return lines;
+}
+
+static void mark_bad(VerifyFile *file, uint32_t block) {
+    long long expected = -1;
+    while (!atomic_compare_exchange_weak(&file->bad_block, &expected, (long long)block)) {
+        if (expected != -1 && expected <= (long long)block) return;
+    }
+}
+
+// Checks one block of a plain backup against its .sum entry.
+static void check_plain_block(VerifyFile *file, uint32_t block) {
+    size_t offset = (size_t)block * file->sums.block_size;
+    size_t length = file->length - offset < file->sums.block_size ? file->length - offset : file->sums.block_size;
+    const char *data = (const char *)file->data + offset;
+    if (crc32c(0, data, length) != backup_read_u32(file->sums.crcs + (size_t)block * 4)) {
+        mark_bad(file, block);
+        return;
+    }
+    atomic_fetch_add(&file->lines, count_lines(data, length));
+}
+
+// Decodes one block of a compressed backup, which checks its CRC32C.
+// @param raw Buffer of BACKUP_BLOCK_SIZE bytes.
+static void check_compressed_block(VerifyFile *file, uint32_t block, char *raw) {
+    const unsigned char *index = file->data + file->index_offset;
+    uint64_t offset = backup_read_u64(index + (size_t)block * 8);
+    uint64_t end = block + 1 < file->blocks ? backup_read_u64(index + (size_t)(block + 1) * 8) : file->index_offset;
+
+    size_t raw_length, consumed;
+    if (offset < BACKUP_HEADER_SIZE || offset > end || end > file->index_offset ||
+        backup_decode_block(file->data + offset, (size_t)(end - offset), raw, &raw_length, &consumed) != 0 ||
+        consumed != end - offset) {
+        mark_bad(file, block);
+        return;
+    }
+    atomic_fetch_add(&file->lines, count_lines(raw, raw_length));
+}
+
+static void *verify_worker(void *arg) {
+    VerifyJob *job = arg;
+    char raw[BACKUP_BLOCK_SIZE];
+    size_t i;
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->count) {
+        VerifyTask *task = &job->tasks[i];
+        if (task->file->compressed) {
+            check_compressed_block(task->file, task->block, raw);
+        } else {
+            check_plain_block(task->file, task->block);
+        }
+    }
+    return NULL;
+}
+
+// Maps a file read-only.
+// @return 0 on success, 1 if it cannot be read.
+static int map_file(const char *path, unsigned char **data, size_t *length) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return 1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return 1;
+    }
+    *length = (size_t)st.st_size;
+    *data = NULL;
+    if (*length > 0) {
+        *data = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (*data == MAP_FAILED) {
+            close(fd);
+            return 1;
+        }
+        madvise(*data, *length, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    return 0;
+}
+
+// Maps a backup and reads what its blocks are checked against.
+static void open_backup(VerifyFile *file) {
+    if (map_file(file->path, &file->data, &file->length) != 0) {
+        file->error = "cannot be read";
+        return;
+    }
+
+    if (backup_is_compressed(file->data, file->length)) {
+        file->compressed = 1;
+        file->index_offset = backup_find_index(file->data, file->length, &file->blocks, &file->entries);
+        if (file->index_offset == 0) {
+            file->error = "incomplete, missing or corrupt block index";
+        }
+        return;
+    }
+
+    char sums_path[4096];
+    if (snprintf(sums_path, sizeof(sums_path), "%s%s", file->path, BACKUP_SUMS_SUFFIX) >= (int)sizeof(sums_path) ||
+        map_file(sums_path, &file->sums_data, &file->sums_length) != 0) {
+        file->error = "incomplete, no " BACKUP_SUMS_SUFFIX " file";
+        return;
+    }
+    if (backup_read_sums(file->sums_data, file->sums_length, &file->sums) != 0) {
+        file->error = "incomplete, corrupt " BACKUP_SUMS_SUFFIX " file";
+        return;
+    }
+    if (file->sums.length != file->length) {
+        file->error = file->length < file->sums.length ? "truncated" : "longer than its checksums";
+        return;
+    }
+    file->blocks = file->sums.blocks;
+    file->entries = file->sums.entries;
+}
+
+// Prints the outcome for one backup.
+// @return 0 if the backup is intact, 1 otherwise.
+static int report_file(VerifyFile *file) {
+    long long bad_block = atomic_load(&file->bad_block);
+    unsigned long long lines = atomic_load(&file->lines);
+    if (file->error != NULL) {
+        printf("%s: FAILED, %s\n", file->path, file->error);
+    } else if (bad_block >= 0) {
+        printf("%s: FAILED, corrupt block %lld\n", file->path, bad_block);
+    } else if (file->entries != BACKUP_UNKNOWN_ENTRIES && lines != file->entries) {
+        printf("%s: FAILED, %llu entries instead of %llu\n", file->path, lines, (unsigned long long)file->entries);
+    } else {
+        printf("%s: OK, %llu entries in %u blocks\n", file->path, lines, file->blocks);
+        return 0;
+    }
+    return 1;
+}
+
+static size_t default_threads(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus < 1 ? 1 : cpus > VERIFY_MAX_THREADS ? VERIFY_MAX_THREADS : (size_t)cpus;
+}
+
+int main(int argc, char *argv[]) {
+    size_t threads = default_threads();
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+        long wanted = strtol(argv[2], NULL, 10);
+        threads = wanted < 1 ? 1 : wanted > VERIFY_MAX_THREADS ? VERIFY_MAX_THREADS : (size_t)wanted;
+        first = 3;
+    }
+    if (first >= argc) {
+        fprintf(stderr, "Usage: %s [-j <threads>] <backup file>...\n", argv[0]);
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t file_count = (size_t)(argc - first);
+    VerifyFile *files = calloc(file_count, sizeof(VerifyFile));
+    if (!files) {
+        perror("Failed to allocate");
+        return 1;
+    }
+    size_t task_count = 0, bytes = 0;
+    for (size_t f = 0; f < file_count; f++) {
+        files[f].path = argv[first + (int)f];
+        atomic_init(&files[f].lines, 0);
+        atomic_init(&files[f].bad_block, -1);
+        open_backup(&files[f]);
+        if (files[f].error == NULL) {
+            task_count += files[f].blocks;
+            bytes += files[f].length;
+        }
+    }
+
+    VerifyJob job = {.tasks = calloc(task_count ? task_count : 1, sizeof(VerifyTask)), .count = task_count};
+    atomic_init(&job.next, 0);
+    if (!job.tasks) {
+        perror("Failed to allocate");
+        return 1;
+    }
+    size_t t = 0;
+    for (size_t f = 0; f < file_count; f++) {
+        for (uint32_t b = 0; files[f].error == NULL && b < files[f].blocks; b++) {
+            job.tasks[t++] = (VerifyTask){.file = &files[f], .block = b};
+        }
+    }
+
+    // A worker that cannot start leaves its blocks to the others
+    if (threads > task_count) threads = task_count ? task_count : 1;
+    pthread_t workers[VERIFY_MAX_THREADS];
+    int started[VERIFY_MAX_THREADS] = {0};
+    for (size_t i = 1; i < threads; i++) {
+        started[i] = pthread_create(&workers[i], NULL, verify_worker, &job) == 0;
+    }
+    verify_worker(&job);
+    for (size_t i = 1; i < threads; i++) {
+        if (started[i]) {
+            pthread_join(workers[i], NULL);
+        }
+    }
+    int failed = 0;
+    for (size_t f = 0; f < file_count; f++) {
+        failed |= report_file(&files[f]);
+        if (files[f].data != NULL) munmap(files[f].data, files[f].length);
+        if (files[f].sums_data != NULL) munmap(files[f].sums_data, files[f].sums_length);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%zu files, %.1f MB in %.3f s (%.0f MB/s, %zu threads)\n", file_count, (double)bytes / 1e6,
+            elapsed, elapsed > 0 ? (double)bytes / 1e6 / elapsed : 0.0, threads);
+
+    free(job.tasks);
+    free(files);
+    return failed;
+}
@@ -0,0 +1,179 @@
+#define _GNU_SOURCE // sysconf(_SC_NPROCESSORS_ONLN)
+#include "load.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "constants.h"
+#include "logger.h"
+
+int load_open(LoadFile *file, const char *path) {
+    memset(file, 0, sizeof(*file));
+    file->path = path;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        log_error("Failed to open load file: %m\n");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        log_error("Failed to stat load file: %m\n");
+        close(fd);
+        return 1;
+    }
+
+    file->size = (size_t)st.st_size;
+    if (file->size > 0) {
+        file->map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file->map == MAP_FAILED) {
+            log_error("Failed to map load file: %m\n");
+            file->map = NULL;
+            close(fd);
+            return 1;
+        }
+        posix_madvise(file->map, file->size, POSIX_MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    file->threads = cpus < 1 ? 1 : cpus > LOAD_MAX_THREADS ? LOAD_MAX_THREADS : (size_t)cpus;
+    file->chunks = calloc(file->threads, sizeof(LoadChunk));
+    if (!file->chunks) {
+        log_error("Failed to allocate load chunks: %m\n");
+        load_close(file);
+        return 1;
+    }
+    return 0;
+}
+
+static int add_pair(LoadChunk *chunk, const char *key, size_t key_len, const char *value, size_t value_len) {
+    if (chunk->count == chunk->cap) {
+        size_t cap = chunk->cap ? chunk->cap * 2 : 1024;
+        KvsString *keys = realloc(chunk->keys, cap * sizeof(KvsString));
+        if (keys) chunk->keys = keys;
+        KvsString *values = realloc(chunk->values, cap * sizeof(KvsString));
+        if (values) chunk->values = values;
+        if (!keys || !values) return 1;
+        chunk->cap = cap;
+    }
+    chunk->keys[chunk->count] = (KvsString){(char *)key, key_len, 0};
+    chunk->values[chunk->count] = (KvsString){(char *)value, value_len, 0};
+    chunk->count++;
+    return 0;
+}
+
+/// Whether a key or value could have been given to WRITE, whose parser ends
+/// them at these characters.
+static int valid_string(const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == ' ' || data[i] == ',' || data[i] == ')' || data[i] == ']') return 0;
+    }
+    return 1;
+}
+
+/// Parses the lines of a chunk into its pairs.
+static void *parse_chunk(void *arg) {
+    LoadChunk *chunk = arg;
+    chunk->count = 0;
+    chunk->lines = 0;
+    chunk->invalid = 0;
+    chunk->first_invalid = 0;
+
+    const char *line = chunk->start;
+    while (line < chunk->end) {
+        const char *newline = memchr(line, '\n', (size_t)(chunk->end - line));
+        const char *end = newline != NULL ? newline : chunk->end;
+        const char *next = end + 1;
+        chunk->lines++;
+
+        if (end > line && end[-1] == '\r') end--; // CRLF line
+        if (end > line) {
+            const char *comma = memchr(line, ',', (size_t)(end - line));
+            if (comma == NULL || comma == line || !valid_string(line, (size_t)(comma - line)) ||
+                !valid_string(comma + 1, (size_t)(end - comma - 1)) ||
+                add_pair(chunk, line, (size_t)(comma - line), comma + 1, (size_t)(end - comma - 1)) != 0) {
+                if (chunk->invalid++ == 0) chunk->first_invalid = chunk->lines;
+            }
+        }
+        line = next;
+    }
+    return NULL;
+}
+
+// Start of the line after the one holding `at`, or the end of the file.
+static size_t next_line(const LoadFile *file, size_t at) {
+    if (at >= file->size) return file->size;
+    const char *newline = memchr(file->map + at, '\n', file->size - at);
+    return newline != NULL ? (size_t)(newline - file->map) + 1 : file->size;
+}
+
+size_t load_next(LoadFile *file) {
+    if (file->pos >= file->size) return 0;
+
+    // Whole lines up to LOAD_SEGMENT_SIZE, split into one chunk per thread
+    size_t end = file->size - file->pos > LOAD_SEGMENT_SIZE ? next_line(file, file->pos + LOAD_SEGMENT_SIZE - 1)
+                                                           : file->size;
+    size_t chunks = file->threads;
+    if (end - file->pos < LOAD_MIN_CHUNK_SIZE * chunks) {
+        chunks = (end - file->pos) / LOAD_MIN_CHUNK_SIZE + 1;
+    }
+
+    size_t start = file->pos;
+    for (size_t i = 0; i < chunks; i++) {
+        size_t stop = i + 1 == chunks ? end : next_line(file, start + (end - file->pos) / chunks);
+        if (stop > end) stop = end;
+        file->chunks[i].start = file->map + start;
+        file->chunks[i].end = file->map + stop;
+        start = stop;
+    }
+
+    pthread_t threads[LOAD_MAX_THREADS];
+    int started[LOAD_MAX_THREADS] = {0};
+    for (size_t i = 1; i < chunks; i++) {
+        started[i] = pthread_create(&threads[i], NULL, parse_chunk, &file->chunks[i]) == 0;
+    }
+    parse_chunk(&file->chunks[0]);
+    for (size_t i = 1; i < chunks; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            parse_chunk(&file->chunks[i]); // no thread, parse it here
+        }
+    }
+
+    for (size_t i = 0; i < chunks; i++) {
+        LoadChunk *chunk = &file->chunks[i];
+        if (chunk->invalid > 0 && file->first_invalid == 0) {
+            file->first_invalid = file->lines + chunk->first_invalid;
+        }
+        file->invalid += chunk->invalid;
+        file->lines += chunk->lines;
+        file->pairs += chunk->count;
+    }
+    file->pos = end;
+    return chunks;
+}
+
+size_t load_estimate(const LoadFile *file) {
+    if (file->pos == 0) return 0;
+    return (size_t)((double)file->pairs * ((double)file->size / (double)file->pos));
+}
+
+void load_close(LoadFile *file) {
+    if (file->map != NULL) {
+        munmap(file->map, file->size);
+    }
+    if (file->chunks != NULL) {
+        for (size_t i = 0; i < file->threads; i++) {
+            free(file->chunks[i].keys);
+            free(file->chunks[i].values);
+        }
+        free(file->chunks);
+    }
+    memset(file, 0, sizeof(*file));
+}
@@ -0,0 +1,65 @@
+#ifndef KVS_LOAD_H
+#define KVS_LOAD_H
+
+#include <stddef.h>
+#include "kvs.h"
+
+// Flat files read by LOAD, one pair per line:
+//
+//   key,value
+//
+// The key ends at the first comma and the value is the rest of the line, a
+// trailing carriage return left out. Empty lines are skipped. Lines without
+// a comma, with an empty key, or with a key or value WRITE could not take
+// (holding a space, comma, ')' or ']') are counted as invalid and skipped. The file is mapped and parsed a segment of
+// LOAD_SEGMENT_SIZE bytes at a time, each segment split into chunks that are
+// parsed in parallel. Parsed keys and values point into the mapping and are
+// not NUL-terminated.
+
+/// Pairs parsed from one chunk of a segment.
+typedef struct LoadChunk {
+    KvsString *keys;
+    KvsString *values;
+    size_t count;
+    size_t cap;
+    size_t lines;            // lines of the chunk, valid or not
+    size_t invalid;          // malformed lines
+    size_t first_invalid;    // line of the first one within the chunk, from 1
+    const char *start;       // bytes of the chunk, whole lines
+    const char *end;
+} LoadChunk;
+
+typedef struct LoadFile {
+    const char *path;
+    char *map;
+    size_t size;
+    size_t pos;              // offset of the next segment
+    size_t lines;            // lines before the next segment
+    size_t pairs;            // pairs parsed so far
+    size_t invalid;          // malformed lines so far
+    size_t first_invalid;    // line of the first one, 0 if none
+    LoadChunk *chunks;       // chunks of the last segment, in file order
+    size_t threads;          // chunks per segment
+} LoadFile;
+
+/// Maps a load file.
+/// @param file File to fill.
+/// @param path Path of the file.
+/// @return 0 on success, 1 otherwise.
+int load_open(LoadFile *file, const char *path);
+
+/// Parses the next segment of the file into file->chunks.
+/// @param file File being loaded.
+/// @return Number of chunks parsed, 0 at the end of the file.
+size_t load_next(LoadFile *file);
+
+/// Estimates the pairs of the whole file from the part parsed so far.
+/// @param file File being loaded.
+/// @return Estimated number of pairs.
+size_t load_estimate(const LoadFile *file);
+
+/// Unmaps a load file and frees its chunks.
+/// @param file File to close.
+void load_close(LoadFile *file);
+
+#endif  // KVS_LOAD_H
@@ -0,0 +1,647 @@
+#include "logger.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "constants.h"
+
+// Record of a message: this header, then the arguments in the order of the
+// format's conversions. Numbers take 8 bytes. Strings are a u64 length then
+// either their bytes, NUL terminated and padded to 8 bytes, or, in a
+// borrowed record formatted before the call returns, a pointer to them.
+typedef struct LogRecord {
+    uint32_t size;                // bytes of the record, 0 skips to the start of the ring
+    uint16_t level;
+    uint16_t borrowed;
+    int saved_errno;              // for %m
+    const char *format;
+} LogRecord;
+
+// Messages of one thread, read by the writer thread.
+typedef struct LogRing {
+    struct LogRing *next;
+    atomic_int owned;             // 0 once its thread exited, free for another
+    _Alignas(64) atomic_size_t head;     // bytes read by the writer
+    _Alignas(64) atomic_size_t tail;     // bytes appended by the owner
+    _Alignas(64) unsigned char data[LOG_RING_SIZE];
+} LogRing;
+
+// Formatted bytes waiting for a write.
+typedef struct LogOutput {
+    int fd;
+    size_t len;
+    char data[LOG_BUFFER_SIZE];
+} LogOutput;
+
+static atomic_int log_level = LOG_LEVEL_INFO;
+static atomic_int writer_running = 0;
+static _Atomic(LogRing *) rings = NULL;   // never freed, a late thread may still hold one
+static _Thread_local LogRing *own_ring = NULL;
+
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;           // releases the ring of an exiting thread
+static pthread_t writer;
+static pthread_mutex_t wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static int wake_pending = 0;
+static int stopping = 0;
+static LogOutput writer_outputs[2];      // stdout and stderr of the writer thread
+
+int log_parse_level(const char *name, LogLevel *level) {
+    static const char *const names[] = {"error", "warn", "info", "debug"};
+    for (int i = 0; i <= LOG_LEVEL_DEBUG; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *level = (LogLevel)i;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void log_set_level(LogLevel level) {
+    atomic_store_explicit(&log_level, (int)level, memory_order_relaxed);
+}
+
+int log_enabled(LogLevel level) {
+    return (int)level <= atomic_load_explicit(&log_level, memory_order_relaxed);
+}
+
+// --- Conversions -----------------------------------------------------------
+
+/// Conversion of a format, as parsed by both the logging and the writer
+/// thread so that they agree on the arguments recorded.
+typedef struct Conversion {
+    char flags[8];
+    int width;                    // -1 for none
+    int width_star;
+    int precision;                // -1 for none
+    int precision_star;
+    char length[3];               // hh, h, l, ll, z, j, t, L or empty
+    char conversion;              // 0 if the format ends inside the conversion
+} Conversion;
+
+/// Parses the conversion starting at a '%'.
+/// @return Format after the conversion.
+static const char *parse_conversion(const char *p, Conversion *c) {
+    memset(c, 0, sizeof(*c));
+    c->width = -1;
+    c->precision = -1;
+    p++;
+
+    size_t flags = 0;
+    while (*p != '\0' && strchr("-+ #0", *p) != NULL) {
+        if (flags < sizeof(c->flags) - 1) c->flags[flags++] = *p;
+        p++;
+    }
+    if (*p == '*') {
+        c->width_star = 1;
+        p++;
+    } else {
+        for (c->width = *p >= '0' && *p <= '9' ? 0 : -1; *p >= '0' && *p <= '9'; p++) {
+            c->width = c->width * 10 + (*p - '0');
+        }
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            c->precision_star = 1;
+            p++;
+        } else {
+            for (c->precision = 0; *p >= '0' && *p <= '9'; p++) {
+                c->precision = c->precision * 10 + (*p - '0');
+            }
+        }
+    }
+
+    size_t length = 0;
+    while (*p != '\0' && strchr("hljztL", *p) != NULL && length < sizeof(c->length) - 1) {
+        c->length[length++] = *p++;
+    }
+    c->conversion = *p;
+    return *p != '\0' ? p + 1 : p;
+}
+
+// --- Recording (logging thread) --------------------------------------------
+
+typedef struct Encoder {
+    unsigned char *data;
+    size_t capacity;
+    size_t len;                   // may exceed the capacity, nothing is stored past it
+    int borrow;
+} Encoder;
+
+static void put_bytes(Encoder *encoder, const void *bytes, size_t len) {
+    if (encoder->len <= encoder->capacity && len <= encoder->capacity - encoder->len) {
+        memcpy(encoder->data + encoder->len, bytes, len);
+    }
+    encoder->len += len;
+}
+
+static void put_u64(Encoder *encoder, uint64_t value) {
+    put_bytes(encoder, &value, sizeof(value));
+}
+
+static void put_i64(Encoder *encoder, int64_t value) {
+    put_bytes(encoder, &value, sizeof(value));
+}
+
+static void put_string(Encoder *encoder, const char *string, size_t len) {
+    put_u64(encoder, len);
+    if (encoder->borrow) {
+        put_bytes(encoder, &string, sizeof(string));
+        return;
+    }
+    static const unsigned char zeros[8] = {0};
+    put_bytes(encoder, string, len);
+    put_bytes(encoder, zeros, 8 - len % 8); // NUL, then padding
+}
+
+static int64_t signed_argument(const char *length, va_list *args) {
+    if (strcmp(length, "hh") == 0) return (signed char)va_arg(*args, int);
+    if (strcmp(length, "h") == 0) return (short)va_arg(*args, int);
+    if (strcmp(length, "l") == 0) return va_arg(*args, long);
+    if (strcmp(length, "ll") == 0) return va_arg(*args, long long);
+    if (strcmp(length, "z") == 0) return va_arg(*args, ssize_t);
+    if (strcmp(length, "j") == 0) return va_arg(*args, intmax_t);
+    if (strcmp(length, "t") == 0) return va_arg(*args, ptrdiff_t);
+    return va_arg(*args, int);
+}
+
+static uint64_t unsigned_argument(const char *length, va_list *args) {
+    if (strcmp(length, "hh") == 0) return (unsigned char)va_arg(*args, unsigned int);
+    if (strcmp(length, "h") == 0) return (unsigned short)va_arg(*args, unsigned int);
+    if (strcmp(length, "l") == 0) return va_arg(*args, unsigned long);
+    if (strcmp(length, "ll") == 0) return va_arg(*args, unsigned long long);
+    if (strcmp(length, "z") == 0) return va_arg(*args, size_t);
+    if (strcmp(length, "j") == 0) return va_arg(*args, uintmax_t);
+    if (strcmp(length, "t") == 0) return (uint64_t)va_arg(*args, ptrdiff_t);
+    return va_arg(*args, unsigned int);
+}
+
+/// Records a message and its arguments.
+/// @return Size of the record, larger than the capacity if it did not fit.
+static size_t encode_record(Encoder *encoder, LogLevel level, int saved_errno, const char *format, va_list *args) {
+    LogRecord header = {.level = (uint16_t)level, .borrowed = (uint16_t)encoder->borrow,
+                        .saved_errno = saved_errno, .format = format};
+    put_bytes(encoder, &header, sizeof(header));
+
+    for (const char *p = strchr(format, '%'); p != NULL; p = strchr(p, '%')) {
+        Conversion c;
+        p = parse_conversion(p, &c);
+        int precision = c.precision;
+        if (c.width_star) put_i64(encoder, va_arg(*args, int));
+        if (c.precision_star) put_i64(encoder, precision = va_arg(*args, int));
+
+        switch (c.conversion) {
+            case 'd': case 'i':
+                put_i64(encoder, signed_argument(c.length, args));
+                break;
+            case 'u': case 'o': case 'x': case 'X':
+                put_u64(encoder, unsigned_argument(c.length, args));
+                break;
+            case 'c':
+                put_i64(encoder, va_arg(*args, int));
+                break;
+            case 's': {
+                const char *string = va_arg(*args, const char *);
+                if (string == NULL) string = "(null)";
+                put_string(encoder, string, precision >= 0 ? strnlen(string, (size_t)precision) : strlen(string));
+                break;
+            }
+            case 'p':
+                put_u64(encoder, (uintptr_t)va_arg(*args, void *));
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+                double value = strcmp(c.length, "L") == 0 ? (double)va_arg(*args, long double) : va_arg(*args, double);
+                put_bytes(encoder, &value, sizeof(value));
+                break;
+            }
+            case 'n':
+                (void)va_arg(*args, void *); // nothing to count into later
+                break;
+            default: // %%, %m and anything unknown take no argument
+                break;
+        }
+    }
+
+    size_t size = (encoder->len + 7) & ~(size_t)7;
+    if (size <= encoder->capacity) {
+        memset(encoder->data + encoder->len, 0, size - encoder->len);
+        uint32_t stored = (uint32_t)size;
+        memcpy(encoder->data + offsetof(LogRecord, size), &stored, sizeof(stored));
+    }
+    return size;
+}
+
+// --- Formatting (writer thread) --------------------------------------------
+
+static void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return; // nowhere left to report it
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+}
+
+static void flush_output(LogOutput *output) {
+    write_all(output->fd, output->data, output->len);
+    output->len = 0;
+}
+
+static void append_output(LogOutput *output, const char *bytes, size_t len) {
+    if (len > sizeof(output->data) - output->len) {
+        flush_output(output);
+        if (len > sizeof(output->data)) {
+            write_all(output->fd, bytes, len);
+            return;
+        }
+    }
+    memcpy(output->data + output->len, bytes, len);
+    output->len += len;
+}
+
+// The formats below are rebuilt from the recorded conversions
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+
+static void append_formatted(LogOutput *output, const char *spec, ...) {
+    char piece[128];
+    va_list args, retry;
+    va_start(args, spec);
+    va_copy(retry, args);
+    int len = vsnprintf(piece, sizeof(piece), spec, args);
+    if (len >= 0 && (size_t)len < sizeof(piece)) {
+        append_output(output, piece, (size_t)len);
+    } else if (len >= 0) {
+        char *large = malloc((size_t)len + 1);
+        if (large != NULL) {
+            vsnprintf(large, (size_t)len + 1, spec, retry);
+            append_output(output, large, (size_t)len);
+            free(large);
+        }
+    }
+    va_end(retry);
+    va_end(args);
+}
+
+#pragma GCC diagnostic pop
+
+typedef struct Decoder {
+    const unsigned char *data;
+    size_t pos;
+} Decoder;
+
+static uint64_t get_u64(Decoder *decoder) {
+    uint64_t value;
+    memcpy(&value, decoder->data + decoder->pos, sizeof(value));
+    decoder->pos += sizeof(value);
+    return value;
+}
+
+static int64_t get_i64(Decoder *decoder) {
+    int64_t value;
+    memcpy(&value, decoder->data + decoder->pos, sizeof(value));
+    decoder->pos += sizeof(value);
+    return value;
+}
+
+static const char *get_string(Decoder *decoder, int borrowed, size_t *len) {
+    *len = (size_t)get_u64(decoder);
+    if (borrowed) {
+        const char *string;
+        memcpy(&string, decoder->data + decoder->pos, sizeof(string));
+        decoder->pos += sizeof(string);
+        return string;
+    }
+    const char *string = (const char *)decoder->data + decoder->pos;
+    decoder->pos += *len + 8 - *len % 8;
+    return string;
+}
+
+/// Writes out a string conversion, whose precision already cut the string.
+static void append_string(LogOutput *output, const Conversion *c, int width, const char *string, size_t len) {
+    if (c->flags[0] == '\0' && width < 0) {
+        append_output(output, string, len);
+        return;
+    }
+    char spec[32];
+    if (width < 0) {
+        snprintf(spec, sizeof(spec), "%%%s.*s", c->flags);
+    } else {
+        snprintf(spec, sizeof(spec), "%%%s%d.*s", c->flags, width);
+    }
+    append_formatted(output, spec, len > INT32_MAX ? INT32_MAX : (int)len, string);
+}
+
+/// Formats a record into an output.
+static void format_record(LogOutput *output, const unsigned char *record) {
+    LogRecord header;
+    memcpy(&header, record, sizeof(header));
+    Decoder decoder = {.data = record, .pos = sizeof(header)};
+
+    const char *p = header.format;
+    for (const char *percent = strchr(p, '%'); percent != NULL; percent = strchr(p, '%')) {
+        append_output(output, p, (size_t)(percent - p));
+
+        Conversion c;
+        p = parse_conversion(percent, &c);
+        int width = c.width_star ? (int)get_i64(&decoder) : c.width;
+        int precision = c.precision_star ? (int)get_i64(&decoder) : c.precision;
+
+        // Every integer was widened to 64 bits when recorded
+        char spec[48];
+        int spec_len = snprintf(spec, sizeof(spec), "%%%s", c.flags);
+        if (width >= 0 || c.width_star) spec_len += snprintf(spec + spec_len, sizeof(spec) - (size_t)spec_len, "%d", width);
+        if (precision >= 0) spec_len += snprintf(spec + spec_len, sizeof(spec) - (size_t)spec_len, ".%d", precision);
+
+        switch (c.conversion) {
+            case 'd': case 'i':
+                snprintf(spec + spec_len, sizeof(spec) - (size_t)spec_len, "ll%c", c.conversion);
+                append_formatted(output, spec, (long long)get_i64(&decoder));
+                break;
+            case 'u': case 'o': case 'x': case 'X':
+                snprintf(spec + spec_len, sizeof(spec) - (size_t)spec_len, "ll%c", c.conversion);
+                append_formatted(output, spec, (unsigned long long)get_u64(&decoder));
+                break;
+            case 'c':
+                snprintf(spec + spec_len, sizeof(spec) - (size_t)spec_len, "c");
+                append_formatted(output, spec, (int)get_i64(&decoder));
+                break;
+            case 's': {
+                size_t len;
+                const char *string = get_string(&decoder, header.borrowed, &len);
+                append_string(output, &c, width, string, len);
+                break;
+            }
+            case 'm': {
+                char message[256];
+                if (strerror_r(header.saved_errno, message, sizeof(message)) != 0) {
+                    snprintf(message, sizeof(message), "Unknown error %d", header.saved_errno);
+                }
+                size_t len = strlen(message);
+                append_string(output, &c, width, message, precision >= 0 && (size_t)precision < len ? (size_t)precision : len);
+                break;
+            }
+            case 'p':
+                snprintf(spec + spec_len, sizeof(spec) - (size_t)spec_len, "p");
+                append_formatted(output, spec, (void *)(uintptr_t)get_u64(&decoder));
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+                double value;
+                memcpy(&value, record + decoder.pos, sizeof(value));
+                decoder.pos += sizeof(value);
+                snprintf(spec + spec_len, sizeof(spec) - (size_t)spec_len, "%c", c.conversion);
+                append_formatted(output, spec, value);
+                break;
+            }
+            case '%':
+                append_output(output, "%", 1);
+                break;
+            case 'n':
+                break;
+            default:
+                append_output(output, percent, (size_t)(p - percent));
+                break;
+        }
+    }
+    append_output(output, p, strlen(p));
+}
+
+static int level_fd(unsigned int level) {
+    return level <= LOG_LEVEL_WARN ? STDERR_FILENO : STDOUT_FILENO;
+}
+
+/// Formats the messages of one ring.
+static void drain_ring(LogRing *ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    while (head != tail) {
+        size_t offset = head & (LOG_RING_SIZE - 1);
+        uint32_t size;
+        memcpy(&size, ring->data + offset, sizeof(size));
+        if (size == 0) {
+            head += LOG_RING_SIZE - offset;
+        } else {
+            uint16_t level;
+            memcpy(&level, ring->data + offset + offsetof(LogRecord, level), sizeof(level));
+            format_record(&writer_outputs[level_fd(level) == STDERR_FILENO], ring->data + offset);
+            head += size;
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+    }
+}
+
+static void drain_rings(void) {
+    for (LogRing *ring = atomic_load_explicit(&rings, memory_order_acquire); ring != NULL; ring = ring->next) {
+        drain_ring(ring);
+    }
+    flush_output(&writer_outputs[0]);
+    flush_output(&writer_outputs[1]);
+}
+
+static void *writer_mission(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&wake_mutex);
+    while (!stopping) {
+        wake_pending = 0;
+        pthread_mutex_unlock(&wake_mutex);
+        drain_rings();
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&wake_mutex);
+        if (!wake_pending && !stopping) {
+            pthread_cond_timedwait(&wake_cond, &wake_mutex, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&wake_mutex);
+    drain_rings();
+    return NULL;
+}
+
+// --- Rings (logging thread) ------------------------------------------------
+
+static void wake_writer(void) {
+    pthread_mutex_lock(&wake_mutex);
+    wake_pending = 1;
+    pthread_cond_signal(&wake_cond);
+    pthread_mutex_unlock(&wake_mutex);
+}
+
+/// Lets the writer thread catch up with a full or draining ring.
+static void wait_for_writer(void) {
+    wake_writer();
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 100000};
+    nanosleep(&pause, NULL);
+}
+
+static void release_ring(void *ring) {
+    atomic_store_explicit(&((LogRing *)ring)->owned, 0, memory_order_release);
+}
+
+/// Ring of the calling thread, taken over from an exited thread if possible.
+/// @return The ring, NULL if none could be allocated.
+static LogRing *get_own_ring(void) {
+    if (own_ring != NULL) return own_ring;
+
+    for (LogRing *ring = atomic_load_explicit(&rings, memory_order_acquire); ring != NULL; ring = ring->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong_explicit(&ring->owned, &expected, 1, memory_order_acq_rel,
+                                                    memory_order_relaxed)) {
+            own_ring = ring;
+            break;
+        }
+    }
+    if (own_ring == NULL) {
+        LogRing *ring = aligned_alloc(_Alignof(LogRing), sizeof(LogRing));
+        if (ring == NULL) return NULL;
+        atomic_init(&ring->owned, 1);
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        ring->next = atomic_load_explicit(&rings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&rings, &ring->next, ring, memory_order_release,
+                                                      memory_order_relaxed)) {
+        }
+        own_ring = ring;
+    }
+    pthread_setspecific(ring_key, own_ring);
+    return own_ring;
+}
+
+/// Appends a record to a ring, waiting for room if it is full.
+static void push_record(LogRing *ring, const unsigned char *record, size_t size) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t offset = tail & (LOG_RING_SIZE - 1);
+    size_t skip = LOG_RING_SIZE - offset < size ? LOG_RING_SIZE - offset : 0;
+    while (tail + skip + size - atomic_load_explicit(&ring->head, memory_order_acquire) > LOG_RING_SIZE) {
+        if (!atomic_load_explicit(&writer_running, memory_order_relaxed)) return; // stopped under us
+        wait_for_writer();
+    }
+    if (skip > 0) {
+        memset(ring->data + offset, 0, sizeof(uint32_t));
+        tail += skip;
+        offset = 0;
+    }
+    memcpy(ring->data + offset, record, size);
+    atomic_store_explicit(&ring->tail, tail + size, memory_order_release);
+
+    if (tail + size - atomic_load_explicit(&ring->head, memory_order_relaxed) > LOG_RING_SIZE / 2) {
+        wake_writer();
+    }
+}
+
+/// Waits for the writer thread to format every message of the calling
+/// thread, before the thread writes one itself.
+static void drain_own_ring(void) {
+    if (own_ring == NULL) return;
+    while (atomic_load_explicit(&own_ring->head, memory_order_acquire) !=
+           atomic_load_explicit(&own_ring->tail, memory_order_relaxed) &&
+           atomic_load_explicit(&writer_running, memory_order_relaxed)) {
+        wait_for_writer();
+    }
+}
+
+/// Formats and writes a message from the calling thread.
+static void write_message(LogLevel level, int saved_errno, const char *format, va_list *args) {
+    uint64_t record[LOG_MAX_RECORD / sizeof(uint64_t)];
+    Encoder encoder = {.data = (unsigned char *)record, .capacity = sizeof(record), .borrow = 1};
+    static _Thread_local LogOutput output;
+    output.fd = level_fd(level);
+    output.len = 0;
+    if (encode_record(&encoder, level, saved_errno, format, args) <= sizeof(record)) {
+        format_record(&output, (const unsigned char *)record);
+    } else {
+        append_output(&output, format, strlen(format)); // more arguments than a record holds
+    }
+    flush_output(&output);
+}
+
+void log_message(LogLevel level, const char *format, ...) {
+    int saved_errno = errno;
+    if (!log_enabled(level)) return;
+
+    va_list args;
+    va_start(args, format);
+    if (atomic_load_explicit(&writer_running, memory_order_acquire)) {
+        LogRing *ring = get_own_ring();
+        uint64_t record[LOG_MAX_RECORD / sizeof(uint64_t)];
+        Encoder encoder = {.data = (unsigned char *)record, .capacity = sizeof(record)};
+        va_list copy;
+        va_copy(copy, args);
+        size_t size = encode_record(&encoder, level, saved_errno, format, &copy);
+        va_end(copy);
+
+        if (ring != NULL && size <= sizeof(record)) {
+            push_record(ring, (const unsigned char *)record, size);
+            va_end(args);
+            errno = saved_errno;
+            return;
+        }
+        drain_own_ring(); // keeps this thread's messages in order
+    }
+    write_message(level, saved_errno, format, &args);
+    va_end(args);
+    errno = saved_errno;
+}
+
+// --- Writer thread ---------------------------------------------------------
+
+/// Messages logged before a fork come out before the child's.
+static void before_fork(void) {
+    if (atomic_load_explicit(&writer_running, memory_order_acquire)) {
+        drain_own_ring();
+    }
+}
+
+/// A forked child has no writer thread, its messages are written directly.
+static void after_fork_child(void) {
+    atomic_store_explicit(&writer_running, 0, memory_order_relaxed);
+}
+
+static void init_log(void) {
+    pthread_key_create(&ring_key, release_ring);
+    pthread_atfork(before_fork, NULL, after_fork_child);
+}
+
+int log_start(void) {
+    pthread_once(&log_once, init_log);
+    writer_outputs[0].fd = STDOUT_FILENO;
+    writer_outputs[1].fd = STDERR_FILENO;
+    stopping = 0;
+    if (pthread_create(&writer, NULL, writer_mission, NULL) != 0) {
+        log_error("Failed to start the log writer: %m");
+        return 1;
+    }
+    atomic_store_explicit(&writer_running, 1, memory_order_release);
+    return 0;
+}
+
+void log_stop(void) {
+    if (!atomic_load_explicit(&writer_running, memory_order_relaxed)) return;
+    atomic_store_explicit(&writer_running, 0, memory_order_release); // new messages are written directly
+
+    pthread_mutex_lock(&wake_mutex);
+    stopping = 1;
+    pthread_cond_signal(&wake_cond);
+    pthread_mutex_unlock(&wake_mutex);
+    pthread_join(writer, NULL);
+}
@@ -0,0 +1,54 @@
+#ifndef KVS_LOGGER_H
+#define KVS_LOGGER_H
+
+// Leveled logging off the command path. Every thread appends its messages
+// to its own ring, lock free, as the format and a copy of its arguments;
+// one writer thread formats them and writes them out. Errors and warnings
+// go to stderr, the rest to stdout. Messages of one thread keep their
+// order, messages of different threads may interleave.
+//
+// Before log_start, after log_stop, in a forked child and for messages
+// larger than LOG_MAX_RECORD, the calling thread formats and writes the
+// message itself. Formats take the printf conversions plus %m, the message
+// of errno at the call.
+
+typedef enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+} LogLevel;
+
+/// Reads a level name: error, warn, info or debug.
+/// @param name Name to read.
+/// @param level Set to the level named.
+/// @return 0 on success, 1 if the name is not a level.
+int log_parse_level(const char *name, LogLevel *level);
+
+/// Sets the most verbose level written, LOG_LEVEL_INFO by default.
+/// LOG_LEVEL_ERROR leaves stdout alone.
+void log_set_level(LogLevel level);
+
+/// Checks whether messages of a level are written, for callers that would
+/// otherwise build a message for nothing.
+int log_enabled(LogLevel level);
+
+/// Starts the writer thread.
+/// @return 0 on success, 1 if messages stay written by their threads.
+int log_start(void);
+
+/// Writes the pending messages and stops the writer thread. Other threads
+/// must have stopped logging.
+void log_stop(void);
+
+/// Logs a message if its level is enabled.
+/// @param level Level of the message.
+/// @param format printf format, which must outlive the writer thread.
+void log_message(LogLevel level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#define log_error(...) log_message(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) log_message(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) log_message(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_message(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#endif  // KVS_LOGGER_H
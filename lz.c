@@ -0,0 +1,157 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// Limits of the LZ4 block format: the last match must start at least
+// MF_LIMIT bytes before the end and the last LAST_LITERALS bytes are literals.
+#define MIN_MATCH 4
+#define MF_LIMIT 12
+#define LAST_LITERALS 5
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static size_t hash4(uint32_t sequence) {
+    return (size_t)((sequence * 2654435761u) >> (32 - HASH_BITS));
+}
+
+// Writes the bytes of a length that did not fit in its 4 bit token field.
+static unsigned char *write_length(unsigned char *op, size_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (unsigned char)length;
+    return op;
+}
+
+size_t lz_compress_bound(size_t length) {
+    return length + length / 255 + 16;
+}
+
+size_t lz_compress(const char *source, size_t length, char *dest, size_t capacity) {
+    const unsigned char *src = (const unsigned char *)source;
+    const unsigned char *ip = src;
+    const unsigned char *anchor = src;
+    const unsigned char *end = src + length;
+    unsigned char *op = (unsigned char *)dest;
+    unsigned char *oend = op + capacity;
+    uint32_t table[1 << HASH_BITS];
+
+    memset(table, 0, sizeof(table));
+
+    if (length > MF_LIMIT) {
+        const unsigned char *match_limit = end - MF_LIMIT;
+        const unsigned char *copy_limit = end - LAST_LITERALS;
+
+        while (ip < match_limit) {
+            uint32_t sequence = read32(ip);
+            size_t h = hash4(sequence);
+            const unsigned char *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != sequence) {
+                // Step faster through data that keeps failing to match
+                ip += 1 + (size_t)((ip - anchor) >> 6);
+                continue;
+            }
+
+            const unsigned char *mp = ip + MIN_MATCH;
+            const unsigned char *rp = ref + MIN_MATCH;
+            while (mp < copy_limit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            size_t literals = (size_t)(ip - anchor);
+            size_t match = (size_t)(mp - ip) - MIN_MATCH;
+            if ((size_t)(oend - op) < 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1) {
+                return 0;
+            }
+
+            unsigned char *token = op++;
+            *token = (unsigned char)((literals >= 15 ? 15 : literals) << 4);
+            if (literals >= 15) op = write_length(op, literals - 15);
+            memcpy(op, anchor, literals);
+            op += literals;
+
+            size_t offset = (size_t)(ip - ref);
+            *op++ = (unsigned char)(offset & 0xFF);
+            *op++ = (unsigned char)(offset >> 8);
+
+            *token |= (unsigned char)(match >= 15 ? 15 : match);
+            if (match >= 15) op = write_length(op, match - 15);
+
+            ip = mp;
+            anchor = ip;
+        }
+    }
+
+    size_t literals = (size_t)(end - anchor);
+    if ((size_t)(oend - op) < 1 + literals / 255 + 1 + literals) {
+        return 0;
+    }
+    unsigned char *token = op++;
+    *token = (unsigned char)((literals >= 15 ? 15 : literals) << 4);
+    if (literals >= 15) op = write_length(op, literals - 15);
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    return (size_t)(op - (unsigned char *)dest);
+}
+
+// Reads the extra bytes of a length whose token field was saturated.
+static int read_length(const unsigned char **ip, const unsigned char *iend, size_t *length) {
+    unsigned char byte;
+    do {
+        if (*ip >= iend) return -1;
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+int lz_decompress(const char *source, size_t length, char *dest, size_t raw_length) {
+    const unsigned char *ip = (const unsigned char *)source;
+    const unsigned char *iend = ip + length;
+    unsigned char *op = (unsigned char *)dest;
+    unsigned char *oend = op + raw_length;
+
+    while (ip < iend) {
+        unsigned char token = *ip++;
+
+        size_t literals = token >> 4;
+        if (literals == 15 && read_length(&ip, iend, &literals) != 0) return -1;
+        if ((size_t)(iend - ip) < literals || (size_t)(oend - op) < literals) return -1;
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+
+        if (ip == iend) break; // the last sequence has no match
+
+        if (iend - ip < 2) return -1;
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (unsigned char *)dest)) return -1;
+
+        size_t match = token & 15;
+        if (match == 15 && read_length(&ip, iend, &match) != 0) return -1;
+        match += MIN_MATCH;
+        if ((size_t)(oend - op) < match) return -1;
+
+        // Byte by byte since the match may overlap the bytes it produces
+        const unsigned char *ref = op - offset;
+        for (size_t i = 0; i < match; i++) {
+            op[i] = ref[i];
+        }
+        op += match;
+    }
+
+    return op == oend ? 0 : -1;
+}
@@ -0,0 +1,27 @@
+#ifndef KVS_LZ_H
+#define KVS_LZ_H
+
+#include <stddef.h>
+
+/// Largest output lz_compress can produce for an input of the given size.
+/// @param length Size of the input in bytes.
+/// @return Worst case compressed size.
+size_t lz_compress_bound(size_t length);
+
+/// Compresses a block in the LZ4 block format (greedy, 4 KiB hash table).
+/// @param source Bytes to compress.
+/// @param length Number of bytes to compress.
+/// @param dest Buffer to store the compressed block in.
+/// @param capacity Size of dest.
+/// @return Size of the compressed block, 0 if it does not fit in dest.
+size_t lz_compress(const char *source, size_t length, char *dest, size_t capacity);
+
+/// Decompresses a block produced by lz_compress.
+/// @param source Compressed block.
+/// @param length Size of the compressed block.
+/// @param dest Buffer to store the original bytes in.
+/// @param raw_length Exact size of the original bytes.
+/// @return 0 on success, -1 if the block is corrupt.
+int lz_decompress(const char *source, size_t length, char *dest, size_t raw_length);
+
+#endif  // KVS_LZ_H
@@ -1,4 +1,5 @@
 #include <limits.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -11,86 +12,41 @@
 #include "parser.h"
 #include <sys/wait.h> // For wait
 #include "operations.h"
+#include "output.h"
+#include "jobc.h"
+#include "logger.h"
+#include "trace.h"
+#include "pool.h"
+#include "coalesce.h"
+#include "jobq.h"
+#include "replica.h"
 #include <pthread.h>
+#include <stdint.h>
 
 const char *DIRECTORY;
-
-static char **queue = NULL; // Pointer to the queue
-static int queueSize = 0;   // Number of elements in the queue
-
-// Mutex for queue operations
-static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int job_cache = 0; // run jobs from their compiled .jobc caches
+static int coalesce_writes = 0; // collapse consecutive WRITE and DELETE commands of a job
 
 void process_job_file(const char *job_file);
 
-void enqueue(char *element) {
-    pthread_mutex_lock(&queue_mutex);
-    char **temp = realloc(queue, (size_t)(queueSize + 1) * sizeof(char *));
-    if (!temp) {
-        perror("Memory allocation failed for queue");
-        pthread_mutex_unlock(&queue_mutex);
-        exit(1);
-    }
-    queue = temp;
-    queue[queueSize++] = element;
-    pthread_mutex_unlock(&queue_mutex);
-}
-
-char *dequeue() {
-    pthread_mutex_lock(&queue_mutex);
-    if (queueSize == 0) {
-        pthread_mutex_unlock(&queue_mutex);
-        return NULL;
-    }
-
-    char *firstElement = queue[0];
-
-    // Shift pointers to the left
-    for (int i = 1; i < queueSize; i++) {
-        queue[i - 1] = queue[i];
-    }
-
-    queueSize--;
-
-    char **temp = realloc(queue, (size_t)queueSize * sizeof(char *));
-    if (queueSize > 0 && !temp) {
-        perror("Memory reallocation failed for queue");
-        pthread_mutex_unlock(&queue_mutex);
-        exit(1);
-    }
-    queue = temp;
-    pthread_mutex_unlock(&queue_mutex);
-
-    return firstElement;
-}
-
-void freeQueue() {
-    pthread_mutex_lock(&queue_mutex);
-    for (int i = 0; i < queueSize; i++) {
-        free(queue[i]); // Free each string in the queue
-    }
-    free(queue); // Free the queue itself
-    queue = NULL;
-    queueSize = 0;
-    pthread_mutex_unlock(&queue_mutex);
-}
-
-void *thread_mission() {
+void *thread_mission(void *arg) {
+    size_t worker = (size_t)(uintptr_t)arg;
     while (1) {
-        char *job = dequeue();
+        char *job = jobq_pop(worker);
         if (job == NULL) { 
-            // Queue is empty; thread exits
+            // No job left for this thread; thread exits
             break;
         }
         process_job_file(job);
         free(job);
     }
+    output_thread_release();
     return NULL;
 }
 char **collect_jobs(size_t *file_count) {
     DIR *dir = opendir(DIRECTORY);
     if (!dir) {
-        perror("Failed to open DIRECTORY");
+        log_error("Failed to open DIRECTORY: %m\n");
         return NULL;
     }
 
@@ -99,10 +55,12 @@ char **collect_jobs(size_t *file_count) {
     size_t count = 0;
 
     while ((entry = readdir(dir)) != NULL) {
-        if (strstr(entry->d_name, ".job")) {
+        // Only names ending in .job, not the .jobc caches next to them
+        size_t length = strlen(entry->d_name);
+        if (length > 4 && strcmp(entry->d_name + length - 4, ".job") == 0) {
             char **temp = realloc(job_files, (count + 1) * sizeof(char *));
             if (!temp) {
-                perror("Memory allocation failed");
+                log_error("Memory allocation failed: %m\n");
                 for (size_t i = 0; i < count; i++) {
                     free(job_files[i]);
                 }
@@ -114,7 +72,7 @@ char **collect_jobs(size_t *file_count) {
 
             job_files[count] = strdup(entry->d_name);
             if (!job_files[count]) {
-                perror("Memory allocation failed");
+                log_error("Memory allocation failed: %m\n");
                 for (size_t i = 0; i < count; i++) {
                     free(job_files[i]);
                 }
@@ -144,8 +102,8 @@ void process_queue(int MAX_THREADS) {
 
     // Create up to MAX_THREADS threads
     for (int i = 0; i < MAX_THREADS; i++) {
-        if (pthread_create(&tid_array[i], NULL, thread_mission, NULL) != 0) {
-            perror("Failed to create thread");
+        if (pthread_create(&tid_array[i], NULL, thread_mission, (void *)(uintptr_t)(size_t)i) != 0) {
+            log_error("Failed to create thread: %m\n");
             // If failed, no thread to join at this index
             continue;
         }
@@ -201,15 +159,13 @@ int handleBackup(const char *job_file) {
     //printf("Creating backup file: %s\n", out_path);
     int fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     if (fd == -1) {
-        perror("Failed to create .bck file");
+        log_error("Failed to create .bck file: %m\n");
         return 1;
-    } else {
-        close(fd); // Close after creation
     }
 
-    // Now call kvs_backup with the chosen output_file
-    if (kvs_backup(out_path) != 0) {
-        fprintf(stderr, "Failed to perform backup on file: %s\n", out_path);
+    // Now call kvs_backup with the chosen output_file, the child writes to fd
+    if (kvs_backup(out_path, fd) != 0) {
+        log_error("Failed to perform backup on file: %s\n", out_path);
         return 1;
     }
 
@@ -218,146 +174,558 @@ int handleBackup(const char *job_file) {
 
 
 
-void parse_job_file(const char *job_file,const char *output_file) {
-
-    int fh;
-    struct stat v;
-
-    // Open the job file in read-only mode
-    fh = open(job_file, O_RDONLY);
-    if (fh == -1) {
-        perror("Error opening the .job file");
-        return;
-    }
+/// Parses the next command of a job file.
+/// @param fd File descriptor of the job file.
+/// @param args Buffers to store the arguments in.
+/// @param num_pairs Set to the number of pairs or keys, 0 if the command is invalid.
+/// @param delay Set to the delay of a WAIT.
+/// @return The command read.
+static enum Command parse_command(int fd, CommandArgs *args, size_t *num_pairs, unsigned int *delay) {
+    enum Command cmd = get_next(fd);
+    *num_pairs = 0;
 
-    // Use stat() to find the size of the file
-    if (stat(job_file, &v) == -1) {
-        perror("Error getting file size");
-        close(fh);
-        return;
+    switch (cmd) {
+        case CMD_WRITE:
+            *num_pairs = parse_write(fd, args, MAX_WRITE_SIZE);
+            break;
+        case CMD_READ:
+        case CMD_DELETE:
+            *num_pairs = parse_read_delete(fd, args, MAX_WRITE_SIZE);
+            break;
+        case CMD_CAS:
+            *num_pairs = parse_cas(fd, args, MAX_WRITE_SIZE);
+            break;
+        case CMD_INCR:
+            *num_pairs = parse_incr(fd, args, MAX_WRITE_SIZE);
+            break;
+        case CMD_EXPIRE:
+            *num_pairs = parse_expire(fd, args, MAX_WRITE_SIZE);
+            break;
+        case CMD_LOAD:
+            *num_pairs = parse_load(fd, args);
+            break;
+        case CMD_WAIT:
+            *num_pairs = parse_wait(fd, delay, NULL) != -1;
+            break;
+        case CMD_SHOW:
+        case CMD_BACKUP:
+        case CMD_HELP:
+        case CMD_EMPTY:
+        case CMD_INVALID:
+        case EOC:
+            break;
     }
+    return cmd;
+}
 
-    // Check if file size is negative
-    if (v.st_size < 0) {
-        fprintf(stderr, "Invalid file size: %ld\n", v.st_size);
-        close(fh);
-        return;
-    }
-      
+/// Executes a parsed command of a job.
+/// @param cmd Command to execute.
+/// @param num_pairs Number of pairs or keys, 0 if the command is invalid.
+/// @param delay Delay of a WAIT.
+/// @param args Arguments of the command.
+/// @param job_file Path of the job file, for error messages.
+/// @param output_file File to write the output to.
+static void execute_command(enum Command cmd, size_t num_pairs, unsigned int delay, CommandArgs *args,
+                            const char *job_file, OutputFile *output_file) {
+    switch (cmd) {
+        case CMD_WRITE:
+            if (num_pairs == 0) {
+                log_error("Invalid WRITE command in file: %s\n", job_file);
+                break;
+            }
 
-    // Start processing commands from the file
-    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    unsigned int delay;
-    size_t num_pairs;
+            if (kvs_write(num_pairs, args->keys, args->values, args->ttls)) {
+                log_error("Failed to write pairs in file: %s\n", job_file);
+            }
+            break;
 
+        case CMD_READ:
+            if (num_pairs == 0) {
+                log_error("Invalid READ command in file: %s\n", job_file);
+                break;
+            }
 
+            if (kvs_read(num_pairs, args->keys, output_file)) {
+                log_error("Failed to read keys in file: %s\n", job_file);
+            }
+            break;
 
-    while (1) {
-        // Fetch the next command from the file
-        enum Command cmd = get_next(fh);
-      
-
-        switch (cmd) {
-            case CMD_WRITE:
-          
-                num_pairs = parse_write(fh, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-                if (num_pairs == 0) {
-                    fprintf(stderr, "Invalid WRITE command in file: %s\n", job_file);
-                    continue;
-                }
-               
-                if (kvs_write(num_pairs, keys, values)) {
-                    fprintf(stderr, "Failed to write pairs in file: %s\n", job_file);
-                }
+        case CMD_DELETE:
+            if (num_pairs == 0) {
+                log_error("Invalid DELETE command in file: %s\n", job_file);
                 break;
+            }
 
-            case CMD_READ:
-             
-                num_pairs = parse_read_delete(fh, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-                if (num_pairs == 0) {
-                    fprintf(stderr, "Invalid READ command in file: %s\n", job_file);
-                    continue;
-                }
-               
-                if (kvs_read(num_pairs, keys,output_file)) {
-                    fprintf(stderr, "Failed to read keys in file: %s\n", job_file);
-                }
+            if (kvs_delete(num_pairs, args->keys, output_file)) {
+                log_error("Failed to delete keys in file: %s\n", job_file);
+            }
+            break;
+
+        case CMD_CAS:
+            if (num_pairs == 0) {
+                log_error("Invalid CAS command in file: %s\n", job_file);
                 break;
+            }
 
-            case CMD_DELETE:
-            
-                num_pairs = parse_read_delete(fh, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-                if (num_pairs == 0) {
-                    fprintf(stderr, "Invalid DELETE command in file: %s\n", job_file);
-                    continue;
-                }
-                
-                if (kvs_delete(num_pairs, keys,output_file)) {
-                    fprintf(stderr, "Failed to delete keys in file: %s\n", job_file);
-                }
+            if (kvs_cas(num_pairs, args->keys, args->versions, args->values, output_file)) {
+                log_error("Failed to swap pairs in file: %s\n", job_file);
+            }
+            break;
+
+        case CMD_INCR:
+            if (num_pairs == 0) {
+                log_error("Invalid INCR command in file: %s\n", job_file);
                 break;
+            }
 
-            case CMD_SHOW:
-                
-                kvs_show(output_file);
+            if (kvs_incr(num_pairs, args->keys, args->deltas, output_file)) {
+                log_error("Failed to increment keys in file: %s\n", job_file);
+            }
+            break;
+
+        case CMD_EXPIRE:
+            if (num_pairs == 0) {
+                log_error("Invalid EXPIRE command in file: %s\n", job_file);
                 break;
+            }
 
-            case CMD_WAIT:
-            
-                if (parse_wait(fh, &delay, NULL) == -1) {
-                    fprintf(stderr, "Invalid WAIT command in file: %s\n", job_file);
-                    continue;
-                }
+            if (kvs_expire(num_pairs, args->keys, args->ttls, output_file)) {
+                log_error("Failed to expire keys in file: %s\n", job_file);
+            }
+            break;
 
-                printf("\nWaiting for %u ms.\n", delay);
-                kvs_wait(delay, output_file);
+        case CMD_LOAD: {
+            if (num_pairs == 0) {
+                log_error("Invalid LOAD command in file: %s\n", job_file);
                 break;
+            }
 
-            case CMD_BACKUP:
-                if(handleBackup(job_file)){
-                    fprintf(stderr, "Failed to perform backup in file: %s\n", job_file);
+            // Relative paths are taken from the job directory
+            const char *path = args->keys[0].data;
+            char load_path[PATH_MAX];
+            if (path[0] != '/') {
+                if (snprintf(load_path, sizeof(load_path), "%s/%s", DIRECTORY, path) >= (int)sizeof(load_path)) {
+                    log_error("LOAD path too long in file: %s\n", job_file);
+                    break;
                 }
-                
-            
-                break;
+                path = load_path;
+            }
+            if (kvs_load(path)) {
+                log_error("Failed to load pairs in file: %s\n", job_file);
+            }
+            break;
+        }
 
-            case CMD_HELP:
-                
-                printf(
-                    "Available commands:\n"
-                    "  WRITE [(key,value)(key2,value2),...]\n"
-                    "  READ [key,key2,...]\n"
-                    "  DELETE [key,key2,...]\n"
-                    "  SHOW\n"
-                    "  WAIT <delay_ms>\n"
-                    "  BACKUP\n"
-                    "  HELP\n"
-                );
-                break;
+        case CMD_SHOW:
+            kvs_show(output_file);
+            break;
 
-            case CMD_INVALID:
-                fprintf(stderr, "Invalid command in file: %s\n", job_file);
+        case CMD_WAIT:
+            if (num_pairs == 0) {
+                log_error("Invalid WAIT command in file: %s\n", job_file);
                 break;
+            }
 
-            case CMD_EMPTY:
-                break;
+            log_info("\nWaiting for %u ms.\n", delay);
+            kvs_wait(delay, output_file);
+            break;
+
+        case CMD_BACKUP:
+            if (handleBackup(job_file)) {
+                log_error("Failed to perform backup in file: %s\n", job_file);
+            }
+            break;
 
-            case EOC:
-                close(fh); // Clean up resources
-                return;
+        case CMD_HELP:
+            log_info(
+                "Available commands:\n"
+                "  WRITE [(key,value)(key2,value2,ttl_ms),...]\n"
+                "  READ [key,key2,...]\n"
+                "  DELETE [key,key2,...]\n"
+                "  CAS [(key,expected_version,value)(key2,expected_version2,value2),...]\n"
+                "  INCR [(key,delta)(key2,delta2),...]\n"
+                "  EXPIRE [(key,ttl_ms)(key2,ttl_ms2),...]   (0 removes the TTL)\n"
+                "  LOAD <file>   (one key,value pair per line)\n"
+                "  SHOW\n"
+                "  WAIT <delay_ms>\n"
+                "  BACKUP\n"
+                "  HELP\n"
+            );
+            break;
 
-            default:
-                fprintf(stderr, "Unknown command in file: %s\n", job_file);
-                break;
+        case CMD_INVALID:
+            log_error("Invalid command in file: %s\n", job_file);
+            break;
+
+        case CMD_EMPTY:
+        case EOC:
+            break;
+
+        default:
+            log_error("Unknown command in file: %s\n", job_file);
+            break;
+    }
+}
+
+// Applies the commands collapsed in a job's write batch.
+static void flush_writes(WriteBatch *batch, const char *job_file, OutputFile *output_file) {
+    if (kvs_write_batch(batch, output_file)) {
+        log_error("Failed to write pairs in file: %s\n", job_file);
+    }
+}
+
+/// Executes a command of a job that runs in order. With a batch, WRITE and
+/// DELETE commands are collapsed into it and any other command applies the
+/// batch first, so every command still sees the effect of the earlier ones.
+/// @param batch Write batch of the job, NULL to execute every command as is.
+static void run_command(WriteBatch *batch, enum Command cmd, size_t num_pairs, unsigned int delay,
+                        CommandArgs *args, const char *job_file, OutputFile *output_file) {
+    if (batch != NULL && (cmd == CMD_WRITE || cmd == CMD_DELETE) && num_pairs > 0) {
+        int absorbed = cmd == CMD_WRITE
+                           ? write_batch_write(batch, num_pairs, args->keys, args->values, args->ttls) == 0
+                           : write_batch_delete(batch, num_pairs, args->keys) == 0;
+        if (absorbed) {
+            if (write_batch_full(batch)) {
+                flush_writes(batch, job_file, output_file);
+            }
+            return;
         }
     }
-    
 
+    if (batch != NULL && cmd != CMD_EMPTY) {
+        flush_writes(batch, job_file, output_file);
+    }
+    execute_command(cmd, num_pairs, delay, args, job_file, output_file);
+}
+
+// Where the commands of a job come from when it runs through a window.
+typedef struct JobSource {
+    int fd;                 // text job file, when reader is NULL
+    JobcReader *reader;     // compiled job, NULL to parse the text
+    JobcWriter *writer;     // cache compiled from the text, NULL if none
+} JobSource;
+
+typedef enum { SLOT_PENDING, SLOT_RUNNING, SLOT_DONE } SlotState;
+
+// A parsed command waiting in the window of its job.
+typedef struct JobSlot {
+    enum Command cmd;
+    size_t num_pairs;
+    unsigned int delay;
+    CommandArgs args;        // owned by the slot, reused by later commands
+    size_t key_count;        // keys the command touches
+    uint64_t key_mask;       // one bit per key hash, rules most conflicts out
+    uint32_t bucket_mask;    // buckets it may add keys to, 0 unless it creates keys
+    int writes;              // the command changes its keys (all but READ)
+    int barrier;             // SHOW, BACKUP, WAIT and LOAD run alone, on the job thread
+    SlotState state;
+    OutputFile *output;      // output buffered until the command is committed
+    struct JobWindow *window;
+} JobSlot;
+
+// Commands of a job parsed ahead of execution. Commands whose keys do not
+// conflict with any earlier unfinished command run concurrently on the pool,
+// their output is committed to the .out file in job order.
+typedef struct JobWindow {
+    JobSlot slots[JOB_WINDOW_SIZE];
+    size_t head;             // oldest uncommitted command
+    size_t count;
+    size_t finished;         // commands completed by the pool
+    const char *job_file;
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+} JobWindow;
+
+static int has_keys(enum Command cmd) {
+    return cmd == CMD_WRITE || cmd == CMD_READ || cmd == CMD_DELETE || cmd == CMD_CAS ||
+           cmd == CMD_INCR || cmd == CMD_EXPIRE;
+}
+
+static uint64_t key_bit(const KvsString *key) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < key->len; i++) {
+        hash = (hash ^ (unsigned char)key->data[i]) * 16777619u;
+    }
+    return 1ULL << (hash & 63);
+}
+
+// Whether two commands must run one after the other.
+static int slots_conflict(const JobSlot *a, const JobSlot *b) {
+    if (a->barrier || b->barrier) return 1;
+    // New keys go first in their bucket, so SHOW lists them in creation order
+    if ((a->bucket_mask & b->bucket_mask) != 0) return 1;
+    if (!a->writes && !b->writes) return 0;
+    if ((a->key_mask & b->key_mask) == 0) return 0;
+
+    for (size_t i = 0; i < a->key_count; i++) {
+        const KvsString *key = &a->args.keys[i];
+        if ((key_bit(key) & b->key_mask) == 0) continue;
+        for (size_t j = 0; j < b->key_count; j++) {
+            const KvsString *other = &b->args.keys[j];
+            if (key->len == other->len && memcmp(key->data, other->data, key->len) == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Reads the next command of a job into the arguments of a slot.
+static enum Command next_command(JobSource *source, CommandArgs *args, size_t *num_pairs, unsigned int *delay) {
+    enum Command cmd;
+    if (source->reader != NULL) {
+        cmd = jobc_next(source->reader, num_pairs, delay);
+        // the reader reuses its arguments for the next command
+        if ((has_keys(cmd) || cmd == CMD_LOAD) && copy_command_args(args, &source->reader->args, *num_pairs) != 0) {
+            log_error("Failed to copy command: %m\n");
+            *num_pairs = 0;
+        }
+        return cmd;
+    }
+
+    cmd = parse_command(source->fd, args, num_pairs, delay);
+    if (source->writer != NULL && cmd != EOC) {
+        jobc_record(source->writer, cmd, *num_pairs, args, *delay);
+    }
+    return cmd;
+}
+
+static void prepare_slot(JobWindow *window, JobSlot *slot, enum Command cmd) {
+    // READ sorts its keys: do it now, while no other thread looks at them,
+    // so that the command leaves the slot as it is when it runs
+    if (cmd == CMD_READ) {
+        kvs_sort_keys(slot->num_pairs, slot->args.keys);
+    }
+    slot->cmd = cmd;
+    slot->window = window;
+    slot->state = SLOT_PENDING;
+    slot->writes = cmd != CMD_READ;
+    slot->barrier = cmd == CMD_SHOW || cmd == CMD_BACKUP || cmd == CMD_WAIT || cmd == CMD_LOAD;
+    slot->key_count = has_keys(cmd) ? slot->num_pairs : 0;
+    slot->key_mask = 0;
+    slot->bucket_mask = 0;
+    int creates = cmd == CMD_WRITE || cmd == CMD_CAS || cmd == CMD_INCR;
+    for (size_t i = 0; i < slot->key_count; i++) {
+        slot->key_mask |= key_bit(&slot->args.keys[i]);
+        if (creates) slot->bucket_mask |= 1u << hash(&slot->args.keys[i]);
+    }
+
+    slot->output = NULL;
+    if (!slot->barrier) {
+        slot->output = output_open_buffer();
+        if (slot->output == NULL) {
+            // without a buffer it runs alone, straight into the file
+            slot->barrier = 1;
+        }
+    }
+}
+
+static void run_slot(void *context) {
+    JobSlot *slot = context;
+    JobWindow *window = slot->window;
+    execute_command(slot->cmd, slot->num_pairs, slot->delay, &slot->args, window->job_file, slot->output);
+
+    pthread_mutex_lock(&window->mutex);
+    slot->state = SLOT_DONE;
+    window->finished++;
+    pthread_cond_signal(&window->done);
+    pthread_mutex_unlock(&window->mutex);
+}
+
+// Commits finished commands from the head of the window, in job order, and
+// runs a barrier once every command before it is committed.
+static void commit_slots(JobWindow *window, OutputFile *output_file) {
+    while (window->count > 0) {
+        JobSlot *slot = &window->slots[window->head];
+        pthread_mutex_lock(&window->mutex);
+        SlotState state = slot->state;
+        pthread_mutex_unlock(&window->mutex);
+
+        if (state == SLOT_DONE) {
+            if (output_append(output_file, slot->output) != 0) {
+                log_error("Failed to write output of file: %s\n", window->job_file);
+            }
+            slot->output = NULL;
+        } else if (state == SLOT_PENDING && slot->barrier) {
+            execute_command(slot->cmd, slot->num_pairs, slot->delay, &slot->args, window->job_file, output_file);
+        } else {
+            break;
+        }
+        window->head = (window->head + 1) % JOB_WINDOW_SIZE;
+        window->count--;
+    }
+}
+
+// Hands the pool every pending command that conflicts with no earlier
+// unfinished command.
+static void start_slots(JobWindow *window) {
+    pthread_mutex_lock(&window->mutex);
+    for (size_t i = 0; i < window->count; i++) {
+        JobSlot *slot = &window->slots[(window->head + i) % JOB_WINDOW_SIZE];
+        if (slot->state != SLOT_PENDING || slot->barrier) continue;
+
+        int blocked = 0;
+        for (size_t j = 0; j < i && !blocked; j++) {
+            const JobSlot *earlier = &window->slots[(window->head + j) % JOB_WINDOW_SIZE];
+            blocked = earlier->state != SLOT_DONE && slots_conflict(earlier, slot);
+        }
+        if (blocked) continue;
+
+        slot->state = SLOT_RUNNING;
+        if (pool_submit(run_slot, slot) != 0) {
+            // the pool is out of memory, run it here
+            execute_command(slot->cmd, slot->num_pairs, slot->delay, &slot->args, window->job_file, slot->output);
+            slot->state = SLOT_DONE;
+            window->finished++;
+        }
+    }
+    pthread_mutex_unlock(&window->mutex);
+}
+
+// Runs a job through a window of JOB_WINDOW_SIZE commands on the pool.
+static void run_window(JobSource *source, const char *job_file, OutputFile *output_file) {
+    JobWindow *window = calloc(1, sizeof(JobWindow));
+    if (!window) {
+        log_error("Failed to allocate job window: %m\n");
+        return;
+    }
+    window->job_file = job_file;
+    pthread_mutex_init(&window->mutex, NULL);
+    pthread_cond_init(&window->done, NULL);
+
+    int eof = 0;
+    while (!eof || window->count > 0) {
+        pthread_mutex_lock(&window->mutex);
+        size_t seen = window->finished;
+        pthread_mutex_unlock(&window->mutex);
+
+        commit_slots(window, output_file);
+        start_slots(window);
+
+        if (!eof && window->count < JOB_WINDOW_SIZE) {
+            JobSlot *slot = &window->slots[(window->head + window->count) % JOB_WINDOW_SIZE];
+            enum Command cmd = next_command(source, &slot->args, &slot->num_pairs, &slot->delay);
+            if (cmd == EOC) {
+                eof = 1;
+            } else if (cmd != CMD_EMPTY) {
+                prepare_slot(window, slot, cmd);
+                window->count++;
+            }
+            continue;
+        }
+        if (window->count == 0) break;
+
+        // Nothing else can start or commit until a running command finishes
+        pthread_mutex_lock(&window->mutex);
+        while (window->finished == seen) {
+            pthread_cond_wait(&window->done, &window->mutex);
+        }
+        pthread_mutex_unlock(&window->mutex);
+    }
+
+    for (size_t i = 0; i < JOB_WINDOW_SIZE; i++) {
+        free_command_args(&window->slots[i].args);
+    }
+    pthread_cond_destroy(&window->done);
+    pthread_mutex_destroy(&window->mutex);
+    free(window);
+}
+
+// Prints a parser message and records it in the job being compiled.
+static void record_diagnostic(const char *message, void *context) {
+    log_info("%s", message);
+    jobc_record_diagnostic(context, message);
+}
+
+void parse_job_file(const char *job_file, OutputFile *output_file) {
+
+    int fh;
+    struct stat v;
+
+    // Open the job file in read-only mode
+    fh = open(job_file, O_RDONLY);
+    if (fh == -1) {
+        log_error("Error opening the .job file: %m\n");
+        return;
+    }
+
+    // Use fstat() to find the size (and version, for the cache) of the file
+    if (fstat(fh, &v) == -1) {
+        log_error("Error getting file size: %m\n");
+        close(fh);
+        return;
+    }
+
+    // Check if file size is negative
+    if (v.st_size < 0) {
+        log_error("Invalid file size: %ld\n", v.st_size);
+        close(fh);
+        return;
+    }
+
+    enum Command cmd;
+    unsigned int delay = 0;
+    size_t num_pairs;
+
+    // Run the compiled job when its cache is still valid
+    int windowed = pool_size() > 0 && output_file != NULL;
+    WriteBatch write_batch;
+    write_batch_init(&write_batch);
+    WriteBatch *batch = coalesce_writes && !windowed ? &write_batch : NULL;
+
+    JobcReader reader;
+    if (job_cache && jobc_open(&reader, job_file, &v) == 0) {
+        close(fh);
+        if (windowed) {
+            JobSource source = {-1, &reader, NULL};
+            run_window(&source, job_file, output_file);
+        } else {
+            while ((cmd = jobc_next(&reader, &num_pairs, &delay)) != EOC) {
+                run_command(batch, cmd, num_pairs, delay, &reader.args, job_file, output_file);
+            }
+            if (batch != NULL) {
+                flush_writes(batch, job_file, output_file);
+            }
+        }
+        jobc_close(&reader);
+        write_batch_free(&write_batch);
+        return;
+    }
+
+    // Otherwise parse the text, compiling it on the way if caching is on
+    JobcWriter writer;
+    int compiling = job_cache && jobc_writer_open(&writer, job_file, &v) == 0;
+    if (compiling) {
+        parser_set_diagnostics(record_diagnostic, &writer);
+    }
+
+    CommandArgs args = {0};
+    if (windowed) {
+        JobSource source = {fh, NULL, compiling ? &writer : NULL};
+        run_window(&source, job_file, output_file);
+    }
+    while (!windowed && (cmd = parse_command(fh, &args, &num_pairs, &delay)) != EOC) {
+        if (compiling) {
+            // before executing, READ sorts its keys in place
+            jobc_record(&writer, cmd, num_pairs, &args, delay);
+        }
+        run_command(batch, cmd, num_pairs, delay, &args, job_file, output_file);
+    }
+    if (batch != NULL) {
+        flush_writes(batch, job_file, output_file);
+    }
+
+    if (compiling) {
+        parser_set_diagnostics(NULL, NULL);
+        jobc_writer_commit(&writer);
+    }
+    free_command_args(&args);
+    write_batch_free(&write_batch);
+    close(fh); // Clean up resources
 }
 
 void process_job_file(const char *job_file) {
-    printf("Processing job file: %s\n", job_file);
+    log_info("Processing job file: %s\n", job_file);
 
     char job_path[1024], out_path[1024];
     snprintf(job_path, sizeof(job_path), "%s/%s", DIRECTORY, job_file);
@@ -371,25 +739,77 @@ void process_job_file(const char *job_file) {
         strcat(out_path, ".out"); // Fallback if no extension found
     }
 
-    // Create empty .out file
-    int fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd == -1) {
-        perror("Failed to create .out file");
-    } else {
-        close(fd); // Close the file immediately after creating it
+    // Create empty .out file, kept open while the job runs
+    OutputFile *output = output_open(out_path);
+    if (output == NULL) {
+        log_error("Failed to create .out file: %m\n");
     }
 
     // Process the job file
-    parse_job_file(job_path, out_path);
+    parse_job_file(job_path, output);
+    if (output != NULL && output_close(output) != 0) {
+        log_error("Failed to write output file: %s\n", out_path);
+    }
     return;
 }
 
 
 
 
+static void usage(const char *program) {
+    fprintf(stderr,
+        "Usage: %s <DIRECTORY> <max backups> <max threads> [options]\n"
+        "Options:\n"
+        "  --max-memory <bytes>[K|M|G]  evict keys to keep the table under this size\n"
+        "  --metrics                    print the KVS metrics to stderr on exit\n"
+        "  --compress-backups           write .bck files compressed (see kvs-cat)\n"
+        "  --shards <n>                 partition the keys across n shard threads\n"
+        "  --pin-shards                 pin each shard thread to its own CPU\n"
+        "  --sync-io                    write output with blocking writes instead of io_uring\n"
+        "  --job-cache                  compile job files into .jobc caches and run those\n"
+        "  --trace <file>               record every KVS operation for kvs-replay\n"
+        "  --job-parallelism <n>        run independent commands of a job on n workers\n"
+        "  --load <file>                load key,value lines into the KVS before the jobs\n"
+        "  --intern-values              store equal values once, shared by their keys\n"
+        "  --persist <file>             keep the KVS in a file across restarts\n"
+        "  --engine <engine>            index the keys with a hash table (hash, default) or a radix tree (art)\n"
+        "  --huge-pages <mode>          back the tables with small (default), thp or explicit huge pages (no BACKUP)\n"
+        "  --numa <mode>                off (default), interleave the tables or partition the shards across nodes\n"
+        "  --log-level <level>          error, warn, info (default) or debug; error keeps stdout quiet\n"
+        "  --class-weights <i:n:b>      shares of the job threads for interactive, normal and bulk jobs\n"
+        "  --reserved-workers <n>       keep n job threads for interactive jobs\n"
+        "  --replicate <socket>         ship every change to replicas connecting on this socket\n"
+        "  --replicas <n>               replicas to wait for before running the jobs (default 1)\n"
+        "  --replica-of <socket>        follow the primary on this socket, serving reads only\n"
+        "  --max-staleness <ms>         age of the changes a replica read may miss (default %d)\n",
+        program, REPLICA_MAX_STALENESS_MS);
+}
+
+// Parses a byte count with an optional K, M or G suffix.
+static int parse_size(const char *text, size_t *bytes) {
+    if (*text < '0' || *text > '9') return 1;
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno == ERANGE || value > SIZE_MAX) return 1;
+
+    unsigned shift = 0;
+    switch (*end) {
+        case 'K': case 'k': shift = 10; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'G': case 'g': shift = 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0') return 1;
+    if (value > (SIZE_MAX >> shift)) return 1; // the budget would wrap
+
+    *bytes = (size_t)value << shift;
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <DIRECTORY> <max backups> <max threads>\n", argv[0]);
+    if (argc < 4) {
+        usage(argv[0]);
         return 1;
     }
 
@@ -397,6 +817,138 @@ int main(int argc, char *argv[]) {
     max_backups = atoi(argv[2]);
     int MAX_THREADS = atoi(argv[3]);
 
+    size_t max_memory = 0;
+    const char *trace_path = NULL;
+    int job_parallelism = 0;
+    const char *load_path = NULL;
+    int intern_values = 0;
+    int reserved_workers = 0;
+    const char *replicate_path = NULL;
+    int replicas = 1;
+    const char *primary_path = NULL;
+    long max_staleness = REPLICA_MAX_STALENESS_MS;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--max-memory") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &max_memory)) {
+                fprintf(stderr, "Invalid memory size: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            report_metrics = 1;
+        } else if (strcmp(argv[i], "--compress-backups") == 0) {
+            backup_compression = 1;
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            shard_count = atoi(argv[++i]);
+            if (shard_count <= 0) {
+                fprintf(stderr, "Invalid shard count: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--pin-shards") == 0) {
+            shard_pinning = 1;
+        } else if (strcmp(argv[i], "--sync-io") == 0) {
+            output_use_uring(0);
+        } else if (strcmp(argv[i], "--job-cache") == 0) {
+            job_cache = 1;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            load_path = argv[++i];
+        } else if (strcmp(argv[i], "--intern-values") == 0) {
+            intern_values = 1;
+        } else if (strcmp(argv[i], "--persist") == 0 && i + 1 < argc) {
+            table_path = argv[++i];
+        } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            TableEngine engine;
+            if (parse_table_engine(argv[++i], &engine)) {
+                fprintf(stderr, "Invalid engine: %s\n", argv[i]);
+                return 1;
+            }
+            use_table_engine(engine);
+        } else if (strcmp(argv[i], "--huge-pages") == 0 && i + 1 < argc) {
+            if (placement_parse_pages(argv[++i], &table_pages)) {
+                fprintf(stderr, "Invalid huge page mode: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--numa") == 0 && i + 1 < argc) {
+            if (placement_parse_numa(argv[++i], &table_numa)) {
+                fprintf(stderr, "Invalid NUMA mode: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            LogLevel level;
+            if (log_parse_level(argv[++i], &level)) {
+                fprintf(stderr, "Invalid log level: %s\n", argv[i]);
+                return 1;
+            }
+            log_set_level(level);
+        } else if (strcmp(argv[i], "--class-weights") == 0 && i + 1 < argc) {
+            if (jobq_set_weights(argv[++i])) {
+                fprintf(stderr, "Invalid class weights: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--reserved-workers") == 0 && i + 1 < argc) {
+            reserved_workers = atoi(argv[++i]);
+            if (reserved_workers <= 0) {
+                fprintf(stderr, "Invalid reserved workers: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--replicate") == 0 && i + 1 < argc) {
+            replicate_path = argv[++i];
+        } else if (strcmp(argv[i], "--replicas") == 0 && i + 1 < argc) {
+            replicas = atoi(argv[++i]);
+            if (replicas <= 0 || replicas > REPLICA_MAX_REPLICAS) {
+                fprintf(stderr, "Invalid replica count: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--replica-of") == 0 && i + 1 < argc) {
+            primary_path = argv[++i];
+        } else if (strcmp(argv[i], "--max-staleness") == 0 && i + 1 < argc) {
+            max_staleness = atol(argv[++i]);
+            if (max_staleness < 0) {
+                fprintf(stderr, "Invalid staleness: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--job-parallelism") == 0 && i + 1 < argc) {
+            job_parallelism = atoi(argv[++i]);
+            if (job_parallelism <= 0) {
+                fprintf(stderr, "Invalid job parallelism: %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Shard tables and interned values live on the heap, not in the file
+    if (table_path != NULL && (shard_count > 0 || intern_values)) {
+        fprintf(stderr, "--persist cannot be combined with --shards or --intern-values\n");
+        return 1;
+    }
+
+    // A table in a file is mapped from the page cache
+    if (table_path != NULL && (table_pages != PAGES_SMALL || table_numa != NUMA_OFF)) {
+        fprintf(stderr, "--persist cannot be combined with --huge-pages or --numa\n");
+        return 1;
+    }
+
+    // Replicas do not see what a primary evicts, and only change through it
+    if ((replicate_path != NULL || primary_path != NULL) && max_memory > 0) {
+        fprintf(stderr, "--max-memory cannot be combined with --replicate or --replica-of\n");
+        return 1;
+    }
+    if (primary_path != NULL && (replicate_path != NULL || load_path != NULL || table_path != NULL)) {
+        fprintf(stderr, "--replica-of cannot be combined with --replicate, --load or --persist\n");
+        return 1;
+    }
+
+    // The other classes need a thread of their own
+    if (reserved_workers > 0 && reserved_workers >= MAX_THREADS) {
+        fprintf(stderr, "--reserved-workers must be less than the max threads\n");
+        return 1;
+    }
+    jobq_reserve((size_t)reserved_workers);
+
     DIR *dir = opendir(DIRECTORY);
     if (!dir) {
         perror("Error opening DIRECTORY");
@@ -409,36 +961,83 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     closedir(dir);
+    kvs_set_memory_limit(max_memory);
+    kvs_set_value_interning(intern_values);
+
+    if (load_path != NULL && kvs_load(load_path) != 0) {
+        fprintf(stderr, "Failed to load pairs from: %s\n", load_path);
+        kvs_terminate();
+        return 1;
+    }
+
+    // Replicas start from the pairs loaded so far, then follow the jobs
+    if (replicate_path != NULL) {
+        if (replica_serve(replicate_path, (size_t)replicas) != 0) {
+            fprintf(stderr, "Failed to serve replicas on: %s\n", replicate_path);
+            kvs_terminate();
+            return 1;
+        }
+        kvs_replicate_snapshot();
+    }
+    if (primary_path != NULL && replica_follow(primary_path, (unsigned long)max_staleness) != 0) {
+        fprintf(stderr, "Failed to follow the primary on: %s\n", primary_path);
+        kvs_terminate();
+        return 1;
+    }
 
     size_t file_count = 0;
     char **jobs = collect_jobs(&file_count);
     if (!jobs) {
         fprintf(stderr, "Failed to fill the queue with jobs\n");
         // If collect_jobs() returned NULL, no jobs were allocated, so no leak here.
+        replica_stop();
         kvs_terminate();
         return 1;
     }
 
-    // Enqueue all collected jobs
+    // Enqueue all collected jobs, by priority class
     for (size_t i = 0; i < file_count; i++) {
-        enqueue(jobs[i]);
+        jobq_push(DIRECTORY, jobs[i]);
     }
     // Free the jobs array of pointers now that they've been enqueued
     free(jobs);
 
+    if (trace_path != NULL && trace_open(trace_path) != 0) {
+        trace_path = NULL;
+    }
+
+    // Collapsed writes would change which keys eviction picks and what is traced
+    coalesce_writes = max_memory == 0 && trace_path == NULL;
+
+    // From here on the job threads log through the writer thread
+    log_start();
+
+    if (job_parallelism > 0 && pool_start((size_t)job_parallelism) != 0) {
+        log_warn("Running the commands of each job in order\n");
+    }
+
     // Process queue with MAX_THREADS threads
     process_queue(MAX_THREADS);
+    pool_stop();
 
-    // Wait for all backups to finish (if you're using current_backups)
-    while (current_backups > 0) {
-        wait(NULL);
-        current_backups--;
+    if (trace_path != NULL) {
+        trace_close();
     }
+    replica_stop();
 
+    // Wait for all backups to finish, reporting the ones that failed
+    kvs_finish_backups();
+    log_stop();
+
+    if (report_metrics) {
+        kvs_report_metrics(STDERR_FILENO);
+        jobq_report_metrics(STDERR_FILENO);
+        replica_report_metrics(STDERR_FILENO);
+    }
     kvs_terminate();
     
 
-    freeQueue();
+    jobq_free();
 
     return 0;
 }
\ No newline at end of file
@@ -1,23 +1,64 @@
 #include <stdio.h>
+#include <sys/stat.h>
 #include <sys/wait.h> // ADDED for wait
+#include <limits.h>
 #include <stdlib.h>
 #include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include "kvs.h"
+#include "backup.h"
+#include "coalesce.h"
+#include "dump.h"
+#include "hotkey.h"
+#include "intern.h"
+#include "load.h"
+#include "logger.h"
+#include "output.h"
+#include "replica.h"
+#include "shard.h"
+#include "trace.h"
 #include "constants.h"
 
 
 // Global variables
 int max_backups = 0;
 int current_backups = 0;
+int backup_compression = 0;
+int report_metrics = 0;
+int shard_count = 0;
+int shard_pinning = 0;
+const char *table_path = NULL;
+PageMode table_pages = PAGES_SMALL;
+NumaMode table_numa = NUMA_OFF;
 static struct HashTable* kvs_table = NULL;
 
 // Mutex for kvs_table access
 static pthread_mutex_t kvs_table_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Creation sequence of the next batch run on the shards
+static atomic_ullong shard_sequence;
+
+// Backup children still running, to name the file of one that fails
+typedef struct BackupChild {
+    pid_t pid;
+    char *output_file;
+} BackupChild;
+
+static BackupChild *backup_children = NULL;
+static size_t backup_children_count = 0;
+static size_t failed_backups = 0;
+static pthread_mutex_t backup_children_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Background thread deleting expired keys
+static pthread_t reaper_thread;
+static int reaper_running = 0;
+static pthread_mutex_t reaper_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reaper_cond = PTHREAD_COND_INITIALIZER;
+
 /// Calculates a timespec from a delay in milliseconds.
 static struct timespec delay_to_timespec(unsigned int delay_ms) {
     return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
@@ -25,227 +66,1257 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
 
 
 
-int write_to_file(const char *output_file, char output[MAX_STRING_SIZE]){
-    int fd = open(output_file, O_WRONLY | O_APPEND | O_CREAT, 0644);
-    if (fd == -1) {
-        perror("Failed to open output file");
+/// Writes one line of command output, adding the trailing newline.
+/// @return 1 on success, 0 otherwise.
+static int write_to_file(OutputFile *output, const char *data, size_t length) {
+    if (output_write(output, data, length) != 0 || output_write(output, "\n", 1) != 0) {
         return 0;
     }
-
-    write(fd, output, strlen(output));
-    write(fd,"\n",1);
-    close(fd);
     return 1;
 }
 
+/// Appends bytes to a growable output buffer, keeping it NUL-terminated.
+static void append_output(KvsString *output, const char *data, size_t length) {
+    if (output->len + length + 1 > output->cap) {
+        size_t cap = output->cap ? output->cap : 64;
+        while (output->len + length + 1 > cap) {
+            cap *= 2;
+        }
+        char *grown = realloc(output->data, cap);
+        if (!grown) {
+            log_error("Failed to grow output buffer: %m\n");
+            return;
+        }
+        output->data = grown;
+        output->cap = cap;
+    }
+
+    memcpy(output->data + output->len, data, length);
+    output->len += length;
+    output->data[output->len] = '\0';
+}
+
+static void append_text(KvsString *output, const char *text) {
+    append_output(output, text, strlen(text));
+}
+
+/// Deletes expired keys in small batches, releasing the table lock between
+/// batches so that reaping never stalls the workers for long. Also finishes
+/// a resize of the key index, only taking the lock when no worker holds it.
+static void *reaper_mission() {
+    pthread_mutex_lock(&reaper_mutex);
+    while (reaper_running) {
+        pthread_mutex_unlock(&reaper_mutex);
+
+        size_t reaped;
+        do {
+            pthread_mutex_lock(&kvs_table_mutex);
+            reaped = reap_expired(kvs_table, REAPER_BATCH_SIZE);
+            pthread_mutex_unlock(&kvs_table_mutex);
+        } while (reaped == REAPER_BATCH_SIZE);
+
+        while (pthread_mutex_trylock(&kvs_table_mutex) == 0) {
+            size_t left = migrate_index(kvs_table, INDEX_IDLE_STEP);
+            pthread_mutex_unlock(&kvs_table_mutex);
+            if (left == 0) break;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += REAPER_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&reaper_mutex);
+        if (reaper_running) {
+            pthread_cond_timedwait(&reaper_cond, &reaper_mutex, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&reaper_mutex);
+    return NULL;
+}
+
+/// Operation applied to each key of a batch.
+typedef enum {
+    KEY_WRITE,
+    KEY_READ,
+    KEY_DELETE,
+    KEY_EXPIRE,
+    KEY_CAS,
+    KEY_INCR,
+    KEY_APPLY,   // the collapsed commands of a WriteBatch
+    KEY_REPLICATE, // changes shipped by the primary
+} KeyOp;
+
+/// Outcome of one key of a batch, filled by whoever owns the key's table.
+typedef struct KeyResult {
+    int status;            // return code of the table operation
+    char *value;           // READ: copy of the value
+    size_t value_len;
+    unsigned long version; // CAS: new or current version
+    long number;           // INCR: resulting value
+    int stored;            // APPLY: return code of the final write
+    uint64_t hash;         // READ: hotkey_hash of the key
+    unsigned long long expires_at; // READ: deadline of the key's TTL, 0 for none
+    int cached;            // READ: answered by the hot key cache
+} KeyResult;
+
+typedef struct Batch {
+    KeyOp op;
+    const KvsString *keys;
+    const KvsString *values;       // WRITE, CAS
+    const unsigned long *numbers;  // WRITE and EXPIRE TTLs, CAS versions
+    const long *deltas;            // INCR
+    const BatchedKey *plans;       // APPLY
+    const ReplicaRecord *records;  // REPLICATE
+    KeyResult *results;
+    size_t cached;                 // READ: keys already answered by the hot key cache
+    unsigned long cached_epoch;    // READ: write epoch they were cached at
+    unsigned long epoch;           // write epoch the shared table was left at
+    unsigned long long sequence;   // sharded: creation sequence of key 0
+    TraceTicket *ticket;           // traced operation the batch runs, NULL for none
+    atomic_int traced;             // sharded: ticket committed by a shard
+} Batch;
+
+/// Deadline of a TTL starting now, 0 for none.
+static unsigned long long ttl_deadline(unsigned long ttl_ms) {
+    return ttl_ms != 0 ? wheel_clock_ms() + ttl_ms : 0;
+}
+
+/// Logs the value a key was left with, its TTL untouched, for the replicas.
+static void log_stored(HashTable *table, const KvsString *key) {
+    size_t value_len;
+    unsigned long long expires_at;
+    char *value = read_pair(table, key, &value_len, &expires_at);
+    if (value != NULL) {
+        replica_log_put(key, value, value_len, 1, expires_at);
+        free(value);
+    }
+}
+
+/// Logs what key i of a batch left in the table for the replicas, while the
+/// table is still held so that changes of a key are logged in order.
+static void log_change(HashTable *table, const Batch *batch, size_t i) {
+    const KvsString *key = &batch->keys[i];
+    const KeyResult *result = &batch->results[i];
+
+    switch (batch->op) {
+        case KEY_WRITE:
+            if (result->status == 0) {
+                replica_log_put(key, batch->values[i].data, batch->values[i].len, 1,
+                                ttl_deadline(batch->numbers != NULL ? batch->numbers[i] : 0));
+            }
+            break;
+        case KEY_DELETE:
+            if (result->status == 0) replica_log_delete(key);
+            break;
+        case KEY_EXPIRE:
+            if (result->status == 0) replica_log_expire(key, ttl_deadline(batch->numbers[i]));
+            break;
+        case KEY_CAS:
+        case KEY_INCR:
+            if (result->status == 0) log_stored(table, key);
+            break;
+        case KEY_APPLY:
+            if (batch->plans[i].replace && result->status == 0) {
+                replica_log_delete(key);
+            }
+            if (batch->plans[i].writes > 0 && result->stored == 0) {
+                replica_log_put(key, batch->values[i].data, batch->values[i].len, batch->plans[i].writes,
+                                ttl_deadline(batch->numbers[i]));
+            }
+            break;
+        case KEY_READ:
+        case KEY_REPLICATE:
+            break;
+    }
+}
+
+/// Applies a change shipped by the primary, turning its deadline back into
+/// a TTL. Changes of keys whose deadline passed delete them.
+static int apply_record(HashTable *table, const ReplicaRecord *record) {
+    unsigned long long now = wheel_clock_ms();
+    int expired = record->expires_at != 0 && record->expires_at <= now;
+    unsigned long ttl_ms = record->expires_at != 0 && !expired ? (unsigned long)(record->expires_at - now) : 0;
+
+    if (record->op == REPLICA_DELETE || expired) {
+        delete_pair(table, &record->key);
+        return 0;
+    }
+    if (record->op == REPLICA_EXPIRE) {
+        expire_pair(table, &record->key, ttl_ms);
+        return 0;
+    }
+    return write_pair_repeated(table, &record->key, &record->value, ttl_ms, record->writes);
+}
+
+/// Applies the batch operation to key i on the table owning it.
+static void apply_key(HashTable *table, void *context, size_t i) {
+    Batch *batch = context;
+    const KvsString *key = &batch->keys[i];
+    KeyResult *result = &batch->results[i];
+
+    switch (batch->op) {
+        case KEY_WRITE:
+            result->status = write_pair(table, key, &batch->values[i], batch->numbers != NULL ? batch->numbers[i] : 0);
+            break;
+        case KEY_READ:
+            if (result->cached) break;
+            result->value = read_pair(table, key, &result->value_len, &result->expires_at);
+            result->status = result->value == NULL;
+            break;
+        case KEY_DELETE:
+            result->status = delete_pair(table, key);
+            break;
+        case KEY_EXPIRE:
+            result->status = expire_pair(table, key, batch->numbers[i]);
+            break;
+        case KEY_CAS:
+            result->status = cas_pair(table, key, batch->numbers[i], &batch->values[i], &result->version);
+            break;
+        case KEY_INCR:
+            result->status = incr_pair(table, key, batch->deltas[i], &result->number);
+            break;
+        case KEY_APPLY:
+            if (batch->plans[i].replace) {
+                result->status = delete_pair(table, key);
+            }
+            if (batch->plans[i].writes > 0) {
+                result->stored = write_pair_repeated(table, key, &batch->values[i], batch->numbers[i],
+                                                     batch->plans[i].writes);
+            }
+            break;
+        case KEY_REPLICATE:
+            result->status = apply_record(table, &batch->records[i]);
+            break;
+    }
+
+    if (batch->op != KEY_READ && replica_logging()) {
+        log_change(table, batch, i);
+    }
+}
+
+/// Runs apply_key on a shard. A node the key creates is sequenced by its
+/// place in the batch, so that buckets split across the shards list their
+/// nodes as the shared table would (see bucket_next).
+static void apply_shard_key(HashTable *table, void *context, size_t i) {
+    Batch *batch = context;
+    table->sequence = batch->sequence + i;
+    if (batch->ticket != NULL && batch->ticket->active && atomic_exchange(&batch->traced, 1) == 0) {
+        trace_commit(batch->ticket);
+    }
+    apply_key(table, context, i);
+}
+
+/// Frees the results of a batch that failed, with the values already read.
+static void free_results(Batch *batch, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(batch->results[i].value);
+    }
+    free(batch->results);
+}
+
+/// Forgets the keys of a READ answered by the hot key cache, which are then
+/// read from the table with the others.
+static void drop_cached(Batch *batch, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        KeyResult *result = &batch->results[i];
+        if (!result->cached) continue;
+        free(result->value);
+        result->value = NULL;
+        result->cached = 0;
+    }
+    batch->cached = 0;
+}
+
+/// Runs a batch, either on the shards owning its keys or on the shared table
+/// under its lock, and fills batch->results (allocated here unless the
+/// caller already did).
+/// @return 0 on success, 1 otherwise (results are then freed).
+static int run_batch(Batch *batch, size_t count) {
+    // A replica only changes through the records of its primary
+    if (batch->op != KEY_READ && batch->op != KEY_REPLICATE && replica_following()) {
+        log_error("The KVS is a read only replica\n");
+        return 1;
+    }
+
+    if (batch->results == NULL) {
+        batch->results = calloc(count > 0 ? count : 1, sizeof(KeyResult));
+    }
+    if (!batch->results) {
+        log_error("Failed to allocate batch results: %m\n");
+        return 1;
+    }
+
+    if (shards_count() > 0) {
+        batch->sequence = atomic_fetch_add(&shard_sequence, count);
+        if (shards_run(apply_shard_key, batch, batch->keys, count) != 0) {
+            log_error("Failed to dispatch batch to the shards\n");
+            free_results(batch, count);
+            return 1;
+        }
+        if (batch->ticket != NULL) trace_commit(batch->ticket); // a batch without keys
+        return 0;
+    }
+
+    if (batch->cached == count) {
+        if (batch->ticket != NULL) trace_commit(batch->ticket);
+        return 0; // every key came from the hot key cache
+    }
+
+    pthread_mutex_lock(&kvs_table_mutex);
+    if (kvs_table == NULL) {
+        pthread_mutex_unlock(&kvs_table_mutex);
+        log_error("KVS state must be initialized\n");
+        free_results(batch, count);
+        return 1;
+    }
+    // A change since the keys were cached would mix their values with newer
+    // ones of the keys read here
+    if (batch->cached > 0 && hotkey_epoch() != batch->cached_epoch) {
+        drop_cached(batch, count);
+    }
+    if (batch->ticket != NULL) trace_commit(batch->ticket);
+    for (size_t i = 0; i < count; i++) {
+        if (i + PREFETCH_DISTANCE < count) {
+            prefetch_pair(kvs_table, &batch->keys[i + PREFETCH_DISTANCE]);
+        }
+        apply_key(kvs_table, batch, i);
+    }
+    // Cached reads of the keys just changed must not be served any more
+    if (batch->op != KEY_READ) {
+        hotkey_invalidate();
+    }
+    batch->epoch = hotkey_epoch();
+    pthread_mutex_unlock(&kvs_table_mutex);
+    return 0;
+}
+
+/// Gives exclusive access to every table: the shared one under its lock, or
+/// the shard tables with the shard threads parked. Must be followed by
+/// release_tables when it succeeds.
+/// @param count Set to the number of tables.
+/// @return The tables, NULL if the KVS is not initialized.
+static HashTable **acquire_tables(size_t *count) {
+    if (shards_count() > 0) {
+        return shards_pause(count);
+    }
+
+    pthread_mutex_lock(&kvs_table_mutex);
+    if (kvs_table == NULL) {
+        pthread_mutex_unlock(&kvs_table_mutex);
+        log_error("KVS state must be initialized\n");
+        return NULL;
+    }
+    *count = 1;
+    return &kvs_table;
+}
+
+static void release_tables(void) {
+    if (shards_count() > 0) {
+        shards_resume();
+    } else {
+        hotkey_invalidate(); // the caller may have changed the table
+        pthread_mutex_unlock(&kvs_table_mutex);
+    }
+}
+
 int kvs_init() {
-    if (kvs_table != NULL) {
-        fprintf(stderr, "KVS state has already been initialized\n");
+    if (kvs_table != NULL || shards_count() > 0) {
+        log_error("KVS state has already been initialized\n");
         return 1;
     }
 
-    kvs_table = create_hash_table();
-    return kvs_table == NULL;
+    if (shard_count > 0) {
+        // Each shard thread reaps its own table, no reaper needed
+        return shards_start((size_t)shard_count, shard_pinning, table_pages, table_numa);
+    }
+
+    if (table_path != NULL) {
+        kvs_table = open_hash_table(table_path);
+    } else if (table_pages != PAGES_SMALL || table_numa != NUMA_OFF) {
+        // One table for every thread: spread over the nodes whatever the mode
+        kvs_table = create_placed_table(table_pages, placement_node_of(NUMA_INTERLEAVE, 0));
+    } else {
+        kvs_table = create_hash_table();
+    }
+    if (kvs_table == NULL) {
+        return 1;
+    }
+
+    reaper_running = 1;
+    if (pthread_create(&reaper_thread, NULL, reaper_mission, NULL) != 0) {
+        log_error("Failed to create reaper thread: %m\n");
+        reaper_running = 0;
+    }
+    return 0;
 }
 
 int kvs_terminate() {
+    if (shards_count() > 0) {
+        shards_stop();
+        intern_free();
+        hotkey_free();
+        return 0;
+    }
+
+    pthread_mutex_lock(&reaper_mutex);
+    int was_running = reaper_running;
+    reaper_running = 0;
+    pthread_cond_signal(&reaper_cond);
+    pthread_mutex_unlock(&reaper_mutex);
+    if (was_running) {
+        pthread_join(reaper_thread, NULL);
+    }
+
     pthread_mutex_lock(&kvs_table_mutex);
     if (kvs_table == NULL) {
         pthread_mutex_unlock(&kvs_table_mutex);
-        fprintf(stderr, "KVS state must be initialized\n");
+        log_error("KVS state must be initialized\n");
         return 1;
     }
 
     free_table(kvs_table);
     kvs_table = NULL;
     pthread_mutex_unlock(&kvs_table_mutex);
+    intern_free();
+    hotkey_free();
 
     return 0;
 }
 
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
-    pthread_mutex_lock(&kvs_table_mutex);
+void kvs_set_memory_limit(size_t bytes) {
+    size_t count;
+    HashTable **tables = acquire_tables(&count);
+    if (tables == NULL) {
+        return;
+    }
 
-    if (kvs_table == NULL) {
-        pthread_mutex_unlock(&kvs_table_mutex);
-        fprintf(stderr, "KVS state must be initialized\n");
+    // Shards split the budget evenly, as they split the keys
+    for (size_t i = 0; i < count; i++) {
+        set_memory_limit(tables[i], bytes > 0 && bytes < count ? 1 : bytes / count);
+    }
+    release_tables();
+}
+
+void kvs_set_value_interning(int enabled) {
+    size_t count;
+    HashTable **tables = acquire_tables(&count);
+    if (tables == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        set_value_interning(tables[i], enabled);
+    }
+    release_tables();
+}
+
+/// Resident set size of the process, 0 if it cannot be read.
+static size_t resident_bytes(void) {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL) {
+        return 0;
+    }
+    unsigned long pages = 0, resident = 0;
+    if (fscanf(statm, "%lu %lu", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(statm);
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+void kvs_report_metrics(int fd) {
+    size_t count;
+    HashTable **tables = acquire_tables(&count);
+    if (tables == NULL) {
+        return;
+    }
+
+    size_t keys = 0, memory_used = 0, memory_limit = 0, evictions = 0, ttl_keys = 0, filtered = 0;
+    int interning = 0;
+    for (size_t i = 0; i < count; i++) {
+        keys += tables[i]->count;
+        memory_used += tables[i]->memory_used;
+        memory_limit += tables[i]->memory_limit;
+        evictions += tables[i]->evictions;
+        ttl_keys += tables[i]->wheel.count;
+        filtered += tables[i]->filter.skipped;
+        interning |= tables[i]->intern_values;
+    }
+    release_tables();
+
+    dprintf(fd, "keys %zu\n", keys);
+    dprintf(fd, "memory_used_bytes %zu\n", memory_used);
+    dprintf(fd, "memory_limit_bytes %zu\n", memory_limit);
+    dprintf(fd, "evictions %zu\n", evictions);
+    dprintf(fd, "ttl_keys %zu\n", ttl_keys);
+    dprintf(fd, "filtered_lookups %zu\n", filtered);
+    dprintf(fd, "resident_bytes %zu\n", resident_bytes());
+    dprintf(fd, "failed_backups %zu\n", failed_backups);
+    if (interning) {
+        // logical bytes are what the shared values would take as private copies
+        InternStats stats;
+        intern_stats(&stats);
+        dprintf(fd, "interned_values %zu\n", stats.values);
+        dprintf(fd, "interned_references %zu\n", stats.references);
+        dprintf(fd, "intern_dedup_ratio %.2f\n",
+                stats.values > 0 ? (double)stats.references / (double)stats.values : 0.0);
+        dprintf(fd, "intern_saved_bytes %zd\n", (ssize_t)stats.logical_bytes - (ssize_t)stats.stored_bytes);
+    }
+    if (count > 1) {
+        dprintf(fd, "shards %zu\n", count);
+    }
+
+    // Estimated READs of the heaviest keys, hottest first
+    HotKey hot[HOTKEY_TOP];
+    size_t cache_hits;
+    size_t hot_count = hotkey_top(hot, &cache_hits);
+    dprintf(fd, "hot_cache_hits %zu\n", cache_hits);
+    for (size_t i = 0; i < hot_count; i++) {
+        dprintf(fd, "hot_key %s %zu\n", hot[i].key, hot[i].reads);
+    }
+    hotkey_free_top(hot, hot_count);
+}
+
+int kvs_write(size_t num_pairs, KvsString keys[], KvsString values[], unsigned long ttls_ms[]) {
+    TraceTicket ticket = trace_begin();
+    Batch batch = {.op = KEY_WRITE, .keys = keys, .values = values, .numbers = ttls_ms, .ticket = &ticket};
+    if (run_batch(&batch, num_pairs) != 0) {
         return 1;
     }
+    trace_end(&ticket, TRACE_WRITE, num_pairs, keys, values, ttls_ms);
 
     for (size_t i = 0; i < num_pairs; i++) {
-        if (write_pair(kvs_table, keys[i], values[i]) != 0) {
-            fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[i], values[i]);
+        if (batch.results[i].status != 0) {
+            log_error("Failed to write keypair (%s,%s)\n", keys[i].data, values[i].data);
         }
     }
 
-    pthread_mutex_unlock(&kvs_table_mutex);
+    free(batch.results);
     return 0;
 }
 
-int compare_keys(const void *a, const void *b) {
-    const char *keyA = (const char *)a;
-    const char *keyB = (const char *)b;
-    return strcmp(keyA, keyB);
+/// Writes one batch of loaded pairs, taking the table lock (or dispatching to
+/// the shards) once for the whole batch.
+static int load_batch(size_t count, const KvsString keys[], const KvsString values[]) {
+    TraceTicket ticket = trace_begin();
+    Batch batch = {.op = KEY_WRITE, .keys = keys, .values = values, .ticket = &ticket};
+    if (run_batch(&batch, count) != 0) {
+        return 1;
+    }
+    trace_end(&ticket, TRACE_WRITE, count, keys, values, NULL);
+
+    int failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (batch.results[i].status != 0) {
+            log_error("Failed to write keypair (%.*s,%.*s)\n", (int)keys[i].len, keys[i].data,
+                      (int)values[i].len, values[i].data);
+            failed = 1;
+        }
+    }
+    free(batch.results);
+    return failed;
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], const char *output_file) {
-    pthread_mutex_lock(&kvs_table_mutex);
+/// Grows the index of every table ahead of a load.
+static void reserve_tables(size_t pairs) {
+    size_t count;
+    HashTable **tables = acquire_tables(&count);
+    if (tables == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (reserve_pairs(tables[i], pairs / count + 1) != 0) {
+            log_error("Failed to presize the table for %zu pairs\n", pairs);
+        }
+    }
+    release_tables();
+}
 
-    if (kvs_table == NULL) {
-        pthread_mutex_unlock(&kvs_table_mutex);
-        fprintf(stderr, "KVS state must be initialized\n");
+int kvs_load(const char *path) {
+    LoadFile file;
+    if (load_open(&file, path) != 0) {
         return 1;
     }
 
+    int failed = 0, presized = 0;
+    size_t chunks;
+    while (!failed && (chunks = load_next(&file)) > 0) {
+        if (!presized) {
+            // the first segment tells how many pairs the whole file holds
+            reserve_tables(load_estimate(&file));
+            presized = 1;
+        }
+        for (size_t c = 0; c < chunks && !failed; c++) {
+            const LoadChunk *chunk = &file.chunks[c];
+            for (size_t done = 0; done < chunk->count && !failed; done += LOAD_BATCH_SIZE) {
+                size_t count = chunk->count - done < LOAD_BATCH_SIZE ? chunk->count - done : LOAD_BATCH_SIZE;
+                failed = load_batch(count, chunk->keys + done, chunk->values + done);
+            }
+        }
+    }
+
+    if (file.invalid > 0) {
+        log_warn("Skipped %zu invalid lines of %s, the first at line %zu\n", file.invalid, path,
+                 file.first_invalid);
+    }
+    load_close(&file);
+    return failed;
+}
+
+int compare_keys(const void *a, const void *b) {
+    const KvsString *keyA = (const KvsString *)a;
+    const KvsString *keyB = (const KvsString *)b;
+    size_t common = keyA->len < keyB->len ? keyA->len : keyB->len;
+    int order = memcmp(keyA->data, keyB->data, common);
+    if (order != 0) return order;
+    return (keyA->len > keyB->len) - (keyA->len < keyB->len);
+}
+
+void kvs_sort_keys(size_t count, KvsString keys[]) {
+    for (size_t i = 1; i < count; i++) {
+        if (compare_keys(&keys[i - 1], &keys[i]) > 0) {
+            qsort(keys, count, sizeof(KvsString), compare_keys);
+            return;
+        }
+    }
+}
+
+int kvs_read(size_t num_pairs, KvsString keys[], OutputFile *output_file) {
+    replica_wait_fresh();
+    TraceTicket ticket = trace_begin();
+
     // Sort the keys alphabetically before processing
-    qsort(keys, num_pairs, MAX_STRING_SIZE, compare_keys);
+    kvs_sort_keys(num_pairs, keys);
 
-    size_t buffer_size = num_pairs * (2 * MAX_STRING_SIZE + 5) + 3; 
-    char *read_output = malloc(buffer_size);
-    strcpy(read_output, "[");
+    Batch batch = {.op = KEY_READ, .keys = keys, .ticket = &ticket};
+    batch.results = calloc(num_pairs > 0 ? num_pairs : 1, sizeof(KeyResult));
+    if (!batch.results) {
+        log_error("Failed to allocate batch results: %m\n");
+        return 1;
+    }
 
+    // Hot keys are served from this thread's cache without taking the lock
+    // of the shared table. Shard tables have no lock to spare.
+    int caching = shards_count() == 0;
+    unsigned long long now = caching ? wheel_clock_ms() : 0;
+    batch.cached_epoch = hotkey_epoch();
     for (size_t i = 0; i < num_pairs; i++) {
-        char temp[MAX_STRING_SIZE];
-        char *result = read_pair(kvs_table, keys[i]);
+        KeyResult *result = &batch.results[i];
+        result->hash = hotkey_hash(&keys[i]);
+        hotkey_record(&keys[i], result->hash);
+        if (caching && (result->value = hotkey_cache_get(&keys[i], result->hash, batch.cached_epoch, now,
+                                                         &result->value_len)) != NULL) {
+            result->cached = 1;
+            batch.cached++;
+        }
+    }
 
-        if (result == NULL) {
-            snprintf(temp, sizeof(temp), "(%s,KVSERROR)", keys[i]);
-        } else {
-            snprintf(temp, sizeof(temp), "(%s,%s)", keys[i], result);
-            free(result);
+    if (run_batch(&batch, num_pairs) != 0) {
+        return 1;
+    }
+    trace_end(&ticket, TRACE_READ, num_pairs, keys, NULL, NULL);
+
+    for (size_t i = 0; caching && i < num_pairs; i++) {
+        KeyResult *result = &batch.results[i];
+        if (!result->cached && result->value != NULL && hotkey_is_hot(result->hash)) {
+            hotkey_cache_put(&keys[i], result->hash, batch.epoch, result->expires_at, result->value,
+                             result->value_len);
         }
-        strcat(read_output, temp);
     }
 
-    strcat(read_output, "]");
+    KvsString read_output = {0};
+    append_text(&read_output, "[");
 
-    pthread_mutex_unlock(&kvs_table_mutex);
+    for (size_t i = 0; i < num_pairs; i++) {
+        KeyResult *result = &batch.results[i];
 
-    if (output_file != NULL) {
-        write_to_file(output_file, read_output);
+        append_text(&read_output, "(");
+        append_output(&read_output, keys[i].data, keys[i].len);
+        if (result->value == NULL) {
+            append_text(&read_output, ",KVSERROR)");
+        } else {
+            append_text(&read_output, ",");
+            append_output(&read_output, result->value, result->value_len);
+            append_text(&read_output, ")");
+            free(result->value);
+        }
     }
 
-   
-    free(read_output);
-    return 0;
-}
-
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], const char *output_file) {
-    pthread_mutex_lock(&kvs_table_mutex);
+    append_text(&read_output, "]");
 
-    if (kvs_table == NULL) {
-        pthread_mutex_unlock(&kvs_table_mutex);
-        fprintf(stderr, "KVS state must be initialized\n");
-        return 1;
+    if (output_file != NULL && read_output.data != NULL) {
+        write_to_file(output_file, read_output.data, read_output.len);
     }
 
+    free(batch.results);
+    free(read_output.data);
+    return 0;
+}
+
+/// Formats "[(key,KVSMISSING)...]" for the keys whose operation failed.
+static void append_missing(KvsString *output, const KvsString keys[], const KeyResult results[], size_t count) {
     int aux = 0;
-    size_t buffer_size = num_pairs * (2 * MAX_STRING_SIZE + 5) + 3; 
-    char *output = malloc(buffer_size);
-    strcpy(output, "");
 
-    for (size_t i = 0; i < num_pairs; i++) {
-        if (delete_pair(kvs_table, keys[i]) != 0) {
+    for (size_t i = 0; i < count; i++) {
+        if (results[i].status != 0) {
             if (!aux) {
-                strcat(output,"[");
+                append_text(output, "[");
                 aux = 1;
             }
-            char temp[MAX_STRING_SIZE];
-            snprintf(temp,sizeof(temp),"(%s,KVSMISSING)", keys[i]);
-            strcat(output,temp);
+            append_text(output, "(");
+            append_output(output, keys[i].data, keys[i].len);
+            append_text(output, ",KVSMISSING)");
         }
     }
 
     if (aux) {
-        strcat(output,"]");
+        append_text(output, "]");
     }
+}
 
-    pthread_mutex_unlock(&kvs_table_mutex);
+int kvs_delete(size_t num_pairs, KvsString keys[], OutputFile *output_file) {
+    TraceTicket ticket = trace_begin();
+    Batch batch = {.op = KEY_DELETE, .keys = keys, .ticket = &ticket};
+    if (run_batch(&batch, num_pairs) != 0) {
+        return 1;
+    }
+    trace_end(&ticket, TRACE_DELETE, num_pairs, keys, NULL, NULL);
+
+    KvsString output = {0};
+    append_missing(&output, keys, batch.results, num_pairs);
 
-    printf("%s", output); 
-    if (output_file != NULL && strlen(output) > 0) {
-        write_to_file(output_file, output);
+    if (output.len > 0) {
+        log_info("%s", output.data);
+        if (output_file != NULL) {
+            write_to_file(output_file, output.data, output.len);
+        }
     }
 
-    free(output);
+    free(batch.results);
+    free(output.data);
     return 0;
 }
 
-void kvs_show(const char *output_file) {
-    pthread_mutex_lock(&kvs_table_mutex);
+int kvs_write_batch(WriteBatch *write_batch, OutputFile *output_file) {
+    size_t count = write_batch->count;
+    if (write_batch->commands == 0) {
+        return 0;
+    }
 
-    if (kvs_table == NULL) {
-        pthread_mutex_unlock(&kvs_table_mutex);
-        fprintf(stderr, "KVS state must be initialized\n");
+    if (write_batch_sort(write_batch) != 0) {
+        log_error("Failed to order write batch: %m\n"); // SHOW may list its new keys out of order
+    }
+    Batch batch = {.op = KEY_APPLY, .keys = write_batch->keys, .values = write_batch->values,
+                   .numbers = write_batch->ttls, .plans = write_batch->state};
+    if (run_batch(&batch, count) != 0) {
+        write_batch_clear(write_batch);
+        return 1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (batch.results[i].stored != 0) {
+            log_error("Failed to write keypair (%s,%s)\n", write_batch->keys[i].data,
+                      write_batch->values[i].data);
+        }
+    }
+
+    // The KVSMISSING line of each DELETE, as if the commands had run one by one
+    KvsString output = {0};
+    KeyResult results[MAX_WRITE_SIZE];
+    KvsString keys[MAX_WRITE_SIZE];
+    size_t start = 0;
+    for (size_t command = 0; command < write_batch->delete_count; command++) {
+        size_t end = write_batch->delete_ends[command];
+        for (size_t i = start; i < end; i++) {
+            size_t index = write_batch->deleted[i];
+            keys[i - start] = write_batch->keys[index];
+            results[i - start].status = write_batch->outcomes[i] == DELETE_PROBED ? batch.results[index].status
+                                                                                  : write_batch->outcomes[i] == DELETE_MISSING;
+        }
+
+        output.len = 0;
+        append_missing(&output, keys, results, end - start);
+        if (output.len > 0) {
+            log_info("%s", output.data);
+            if (output_file != NULL) {
+                write_to_file(output_file, output.data, output.len);
+            }
+        }
+        start = end;
+    }
+
+    free(batch.results);
+    free(output.data);
+    write_batch_clear(write_batch);
+    return 0;
+}
+
+int kvs_replicate(const ReplicaRecord records[], size_t count) {
+    KvsString *keys = malloc(count * sizeof(KvsString));
+    if (!keys) {
+        log_error("Failed to allocate replicated keys: %m\n");
+        return 1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = records[i].key;
+    }
+
+    Batch batch = {.op = KEY_REPLICATE, .keys = keys, .records = records};
+    if (run_batch(&batch, count) != 0) {
+        free(keys);
+        return 1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (batch.results[i].status != 0) {
+            log_error("Failed to apply replicated change of key %s\n", keys[i].data);
+        }
+    }
+    free(batch.results);
+    free(keys);
+    return 0;
+}
+
+void kvs_replicate_snapshot(void) {
+    size_t count;
+    HashTable **tables = acquire_tables(&count);
+    if (tables == NULL) {
+        return;
+    }
+
+    // Nodes are pushed at the head of their bucket: replay each bucket from
+    // its oldest node so that the replica lists them in the same order
+    size_t pairs = 0;
+    for (size_t t = 0; t < count; t++) {
+        pairs += tables[t]->count;
+    }
+    KeyNode **cursors = malloc(count * sizeof(KeyNode *));
+    KeyNode **bucket = malloc((pairs > 0 ? pairs : 1) * sizeof(KeyNode *));
+    if (!cursors || !bucket) {
+        log_error("Failed to snapshot the KVS for the replicas: %m\n");
+        free(cursors);
+        free(bucket);
+        release_tables();
         return;
     }
 
-    char temp[MAX_STRING_SIZE];
+    unsigned long long now = wheel_clock_ms();
     for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode *keyNode = kvs_table->table[i];
-        while (keyNode != NULL) {
-            snprintf(temp,sizeof(temp),"(%s, %s)", keyNode->key, keyNode->value);
+        for (size_t t = 0; t < count; t++) {
+            cursors[t] = tables[t]->table[i];
+        }
+        size_t nodes = 0;
+        KeyNode *keyNode;
+        while ((keyNode = bucket_next(cursors, count)) != NULL) {
+            bucket[nodes++] = keyNode;
+        }
+        while (nodes-- > 0) {
+            keyNode = bucket[nodes];
+            if (keyNode->timer != NULL && pair_expired(keyNode, now)) continue;
+            KvsString key = {keyNode->key, keyNode->key_len, 0};
+            replica_log_put(&key, keyNode->value, keyNode->value_len, keyNode->version,
+                            keyNode->timer != NULL ? keyNode->timer->expires_at : 0);
+        }
+    }
+    release_tables();
+    free(cursors);
+    free(bucket);
+}
 
-            if(output_file != NULL && strlen(temp)>0){
-                write_to_file(output_file,temp);
-            }
+int kvs_expire(size_t num_pairs, KvsString keys[], unsigned long ttls_ms[], OutputFile *output_file) {
+    TraceTicket ticket = trace_begin();
+    Batch batch = {.op = KEY_EXPIRE, .keys = keys, .numbers = ttls_ms, .ticket = &ticket};
+    if (run_batch(&batch, num_pairs) != 0) {
+        return 1;
+    }
+    trace_end(&ticket, TRACE_EXPIRE, num_pairs, keys, NULL, ttls_ms);
+
+    KvsString output = {0};
+    append_missing(&output, keys, batch.results, num_pairs);
+
+    if (output_file != NULL && output.len > 0) {
+        write_to_file(output_file, output.data, output.len);
+    }
 
-            printf("(%s, %s)\n", keyNode->key, keyNode->value);
-            keyNode = keyNode->next;
+    free(batch.results);
+    free(output.data);
+    return 0;
+}
+
+int kvs_cas(size_t num_triples, KvsString keys[], unsigned long versions[], KvsString values[], OutputFile *output_file) {
+    TraceTicket ticket = trace_begin();
+    Batch batch = {.op = KEY_CAS, .keys = keys, .values = values, .numbers = versions, .ticket = &ticket};
+    if (run_batch(&batch, num_triples) != 0) {
+        return 1;
+    }
+    trace_end(&ticket, TRACE_CAS, num_triples, keys, values, versions);
+
+    KvsString output = {0};
+    append_text(&output, "[");
+
+    for (size_t i = 0; i < num_triples; i++) {
+        char temp[40];
+
+        if (batch.results[i].status != 0) {
+            snprintf(temp, sizeof(temp), ",KVSMISMATCH,%lu)", batch.results[i].version);
+        } else {
+            snprintf(temp, sizeof(temp), ",%lu)", batch.results[i].version);
         }
+        append_text(&output, "(");
+        append_output(&output, keys[i].data, keys[i].len);
+        append_text(&output, temp);
     }
 
-    pthread_mutex_unlock(&kvs_table_mutex);
+    append_text(&output, "]");
+
+    if (output_file != NULL && output.data != NULL) {
+        write_to_file(output_file, output.data, output.len);
+    }
+
+    free(batch.results);
+    free(output.data);
+    return 0;
+}
+
+int kvs_incr(size_t num_pairs, KvsString keys[], long deltas[], OutputFile *output_file) {
+    TraceTicket ticket = trace_begin();
+    Batch batch = {.op = KEY_INCR, .keys = keys, .deltas = deltas, .ticket = &ticket};
+    if (run_batch(&batch, num_pairs) != 0) {
+        return 1;
+    }
+    trace_end(&ticket, TRACE_INCR, num_pairs, keys, NULL, (const unsigned long *)deltas);
+
+    KvsString output = {0};
+    append_text(&output, "[");
+
+    for (size_t i = 0; i < num_pairs; i++) {
+        char temp[40];
+
+        if (batch.results[i].status != 0) {
+            snprintf(temp, sizeof(temp), ",KVSNAN)");
+        } else {
+            snprintf(temp, sizeof(temp), ",%ld)", batch.results[i].number);
+        }
+        append_text(&output, "(");
+        append_output(&output, keys[i].data, keys[i].len);
+        append_text(&output, temp);
+    }
+
+    append_text(&output, "]");
+
+    if (output_file != NULL && output.data != NULL) {
+        write_to_file(output_file, output.data, output.len);
+    }
+
+    free(batch.results);
+    free(output.data);
+    return 0;
+}
+
+void kvs_show(OutputFile *output_file) {
+    replica_wait_fresh();
+    TraceTicket ticket = trace_begin();
+    size_t count;
+    HashTable **tables = acquire_tables(&count);
+    if (tables == NULL) {
+        return;
+    }
+    trace_commit(&ticket);
+
+    // Format every entry into one buffer so the output file is written once,
+    // large tables on several threads (see dump.h). The chains a bucket has
+    // in each shard are merged by creation sequence, so that sharding keeps
+    // the output of the shared table.
+    DumpPlan plan;
+    KvsString output = {0};
+    if (dump_format(&plan, tables, count, wheel_clock_ms()) != 0) {
+        log_error("Failed to format SHOW: %m\n");
+    } else {
+        output.data = malloc(plan.bytes + 1);
+        if (output.data == NULL) {
+            log_error("Failed to format SHOW: %m\n");
+        } else {
+            dump_to_buffer(&plan, output.data);
+            output.len = plan.bytes;
+            output.data[output.len] = '\0';
+        }
+        dump_free(&plan);
+    }
+
+    release_tables();
+    trace_end(&ticket, TRACE_SHOW, 0, NULL, NULL, NULL);
+
+    if (output.len > 0) {
+        if (output_file != NULL) {
+            // write_to_file adds the trailing newline back
+            write_to_file(output_file, output.data, output.len - 1);
+        }
+        log_info("%s", output.data);
+    }
+
+    free(output.data);
+}
+
+/// Prints how long a backup took, with --metrics.
+static void report_backup(const char *output_file, uint64_t raw_bytes, uint64_t written_bytes,
+                          const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (report_metrics) {
+        double elapsed_ms = (double)(end.tv_sec - start->tv_sec) * 1e3 + (double)(end.tv_nsec - start->tv_nsec) / 1e6;
+        log_info("backup %s: %llu bytes in, %llu bytes written (%s) in %.2f ms\n", output_file,
+                 (unsigned long long)raw_bytes, (unsigned long long)written_bytes,
+                 backup_compression ? "compressed" : "plain", elapsed_ms);
+    }
+}
+
+/// Writes the .sum file of a plain backup next to it.
+/// @return 0 on success, 1 otherwise.
+static int write_backup_sums(const char *output_file, const uint32_t *crcs, size_t blocks, uint64_t bytes,
+                             uint64_t entries) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s%s", output_file, BACKUP_SUMS_SUFFIX) >= (int)sizeof(path)) {
+        return 1;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return 1;
+    int failed = backup_write_sums(fd, crcs, (uint32_t)blocks, bytes, entries);
+    return close(fd) != 0 || failed;
+}
+
+/// Writes a plain backup with the parallel dump: the chains are formatted by
+/// several workers and written at their precomputed offsets.
+/// @return 0 on success, 1 otherwise.
+static int write_plain_backup(HashTable **tables, size_t count, const char *output_file, int fd,
+                              const struct timespec *start) {
+    // Only a real file gets checksums, not a backup sent to /dev/null
+    struct stat st;
+    int checksummed = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+
+    DumpPlan plan;
+    int failed = dump_format(&plan, tables, count, wheel_clock_ms()) != 0;
+    uint64_t bytes = plan.bytes;
+    uint32_t *crcs = NULL;
+    size_t blocks = 0;
+    if (!failed) {
+        failed = dump_to_file(&plan, fd) != 0;
+        if (checksummed) {
+            crcs = dump_checksums(&plan, BACKUP_BLOCK_SIZE, &blocks);
+            failed = failed || (crcs == NULL && blocks > 0);
+        }
+    }
+    if (close(fd) != 0) {
+        failed = 1;
+    }
+
+    // The .sum file comes last, it is what tells a complete backup apart
+    if (!failed && checksummed) {
+        failed = write_backup_sums(output_file, crcs, blocks, bytes, plan.entries) != 0;
+    }
+    free(crcs);
+    dump_free(&plan);
+    if (failed) {
+        log_error("Failed to write backup: %m\n");
+    }
+
+    report_backup(output_file, bytes, failed ? 0 : bytes, start);
+    return failed;
+}
+
+/// Streams the tables to a backup file through a BackupWriter. Runs in the
+/// forked child, which owns a private copy of the tables.
+/// @return 0 on success, 1 otherwise.
+static int write_backup(HashTable **tables, size_t count, const char *output_file, int fd) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (!backup_compression) {
+        return write_plain_backup(tables, count, output_file, fd, &start);
+    }
+
+    BackupWriter writer;
+    if (backup_writer_open(&writer, fd, backup_compression) != 0) {
+        log_error("Failed to start backup: %m\n");
+        close(fd);
+        return 1;
+    }
+
+    KeyNode **cursors = malloc(count * sizeof(KeyNode *));
+    int failed = cursors == NULL;
+    unsigned long long now = wheel_clock_ms();
+    for (int i = 0; i < TABLE_SIZE && !failed; i++) {
+        for (size_t t = 0; t < count; t++) {
+            cursors[t] = tables[t]->table[i];
+        }
+        KeyNode *keyNode;
+        while (!failed && (keyNode = bucket_next(cursors, count)) != NULL) {
+            if (pair_expired(keyNode, now)) {
+                continue;
+            }
+            writer.entries++;
+            failed = backup_writer_append(&writer, "(", 1) ||
+                     backup_writer_append(&writer, keyNode->key, keyNode->key_len) ||
+                     backup_writer_append(&writer, ", ", 2) ||
+                     backup_writer_append(&writer, keyNode->value, keyNode->value_len) ||
+                     backup_writer_append(&writer, ")\n", 2);
+        }
+    }
+    free(cursors);
+
+    uint64_t raw_bytes = writer.raw_bytes;
+    failed = backup_writer_close(&writer) || failed;
+    if (close(fd) != 0) {
+        failed = 1;
+    }
+    if (failed) {
+        log_error("Failed to write backup: %m\n");
+    }
+
+    report_backup(output_file, raw_bytes, writer.written_bytes, &start);
+    return failed;
+}
+
+/// Remembers a backup child until it is reaped. Called with
+/// backup_children_mutex held since the fork, so that the thread reaping the
+/// child always finds it.
+static void track_backup(pid_t pid, const char *output_file) {
+    BackupChild *children = realloc(backup_children, (backup_children_count + 1) * sizeof(BackupChild));
+    if (children != NULL) {
+        backup_children = children;
+        backup_children[backup_children_count].pid = pid;
+        backup_children[backup_children_count].output_file = strdup(output_file);
+        backup_children_count++;
+    }
+}
+
+/// Waits for one backup child and reports it if it did not complete.
+static void reap_backup(void) {
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0) return;
+
+    pthread_mutex_lock(&backup_children_mutex);
+    char *output_file = NULL;
+    for (size_t i = 0; i < backup_children_count; i++) {
+        if (backup_children[i].pid == pid) {
+            output_file = backup_children[i].output_file;
+            backup_children[i] = backup_children[--backup_children_count];
+            break;
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        failed_backups++;
+        if (WIFSIGNALED(status)) {
+            log_error("Backup %s killed by signal %d\n", output_file ? output_file : "?", WTERMSIG(status));
+        } else {
+            log_error("Backup %s failed with status %d\n", output_file ? output_file : "?",
+                      WEXITSTATUS(status));
+        }
+    }
+    pthread_mutex_unlock(&backup_children_mutex);
+    free(output_file);
 }
 
 void kvs_wait_backup() {
-    
     while (current_backups >= max_backups) {
-        wait(NULL);   
+        reap_backup();
+        current_backups--;
+    }
+}
+
+void kvs_finish_backups() {
+    while (current_backups > 0) {
+        reap_backup();
         current_backups--;
     }
+    free(backup_children);
+    backup_children = NULL;
 }
 
-int kvs_backup(const char *output_file) {
+int kvs_backup(const char *output_file, int fd) {
+    // The child only shares explicit huge pages until the parent writes to
+    // them, and dies of SIGBUS when the pool has none left to copy them to
+    if (table_pages == PAGES_EXPLICIT) {
+        close(fd);
+        log_error("BACKUP cannot snapshot tables in explicit huge pages, use --huge-pages thp\n");
+        return 1;
+    }
+
     kvs_wait_backup();
+    replica_wait_fresh();
 
-    pthread_mutex_lock(&kvs_table_mutex);
-    if (kvs_table == NULL) {
-        pthread_mutex_unlock(&kvs_table_mutex);
-        fprintf(stderr, "KVS state must be initialized\n");
+    TraceTicket ticket = trace_begin();
+    size_t count;
+    HashTable **tables = acquire_tables(&count);
+    if (tables == NULL) {
+        close(fd);
         return 1;
     }
+    trace_commit(&ticket);
 
+    // A table kept in a file is shared with the child rather than copied,
+    // the child reads a checkpoint of it instead
+    int checkpoint = -1;
+    if (table_path != NULL && (checkpoint = checkpoint_table(tables[0])) < 0) {
+        release_tables();
+        close(fd);
+        log_error("Failed to checkpoint %s\n", table_path);
+        return 1;
+    }
+
+    pthread_mutex_lock(&backup_children_mutex);
     pid_t pid = fork();
+    if (pid > 0) {
+        track_backup(pid, output_file);
+    }
+    pthread_mutex_unlock(&backup_children_mutex);
     if (pid < 0) {
-        pthread_mutex_unlock(&kvs_table_mutex);
-        perror("Fork failed");
+        release_tables();
+        close(fd);
+        if (checkpoint >= 0) close(checkpoint);
+        log_error("Fork failed: %m\n");
         return 1;
     }
 
     if (pid == 0) {
-    
-    pthread_mutex_unlock(&kvs_table_mutex);
-    kvs_show(output_file);
-    exit(0); 
-    }else {
-        
+        // Only the forking thread survives in the child, the tables are a
+        // private snapshot that nothing else touches. _exit leaves the
+        // parent's stdio buffers and exit handlers alone.
+        if (checkpoint >= 0 && read_checkpoint(tables[0], checkpoint) != 0) {
+            log_error("Failed to map checkpoint: %m\n");
+            _exit(1);
+        }
+        _exit(write_backup(tables, count, output_file, fd));
+    } else {
         current_backups++;
-        pthread_mutex_unlock(&kvs_table_mutex);
+        release_tables();
+        close(fd); // the child writes through its own copy
+        if (checkpoint >= 0) close(checkpoint);
+        trace_end(&ticket, TRACE_BACKUP, 0, NULL, NULL, NULL);
     }
 
     return 0;
 }
 
-void kvs_wait(unsigned int delay_ms, const char* output_file) {
-    
-    pthread_mutex_lock(&kvs_table_mutex);
+void kvs_wait(unsigned int delay_ms, OutputFile *output_file) {
+    // Let the output written so far drain while this thread sleeps
+    if (output_file != NULL) {
+        output_flush(output_file);
+    }
+
+    size_t count;
+    HashTable **tables = acquire_tables(&count);
     struct timespec delay = delay_to_timespec(delay_ms);
     nanosleep(&delay, NULL);
-    char output[MAX_STRING_SIZE] = "waited for "; 
-    char delay_str[20];
-    sprintf(delay_str, "%d ms", delay_ms); 
-    strcat(output, delay_str); 
-    write_to_file(output_file,output);
-    pthread_mutex_unlock(&kvs_table_mutex);
+    char output[40];
+    int length = snprintf(output, sizeof(output), "waited for %u ms", delay_ms);
+    if (output_file != NULL) {
+        write_to_file(output_file, output, (size_t)length);
+    }
+    if (tables != NULL) {
+        release_tables();
+    }
 }
@@ -2,9 +2,20 @@
 #define KVS_OPERATIONS_H
 
 #include <stddef.h>
+#include "coalesce.h"
+#include "kvs.h"
+#include "output.h"
+#include "replica.h"
 
 extern int max_backups;
 extern int current_backups;
+extern int backup_compression; // write backups in the compressed block format
+extern int report_metrics;     // print metrics and backup statistics to stderr
+extern int shard_count;        // partition the keys across this many shard threads, 0 for one shared table
+extern int shard_pinning;      // pin each shard thread to its own CPU
+extern const char *table_path; // keep the shared table in this file across restarts, NULL for memory only
+extern PageMode table_pages;   // pages backing the tables not kept in a file
+extern NumaMode table_numa;    // NUMA nodes of the tables not kept in a file
 /// Initializes the KVS state.
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
 int kvs_init();
@@ -13,40 +24,121 @@ int kvs_init();
 /// @return 0 if the KVS state was terminated successfully, 1 otherwise.
 int kvs_terminate();
 
+/// Bounds the memory used by the KVS table, evicting keys when it is exceeded.
+/// @param bytes Budget in bytes, 0 for no limit.
+void kvs_set_memory_limit(size_t bytes);
+
+/// Turns value interning (see intern.h) on or off for every KVS table.
+/// @param enabled 1 to share equal values, 0 to copy them.
+void kvs_set_value_interning(int enabled);
+
+/// Writes "name value" lines with the KVS counters (keys, memory footprint,
+/// evictions, ...) to a file descriptor.
+/// @param fd File descriptor to write the metrics to.
+void kvs_report_metrics(int fd);
+
 /// Writes a key value pair to the KVS. If key already exists it is updated.
 /// @param num_pairs Number of pairs being written.
 /// @param keys Array of keys' strings.
 /// @param values Array of values' strings.
+/// @param ttls_ms Array of TTLs in milliseconds (0 for none), may be NULL.
 /// @return 0 if the pairs were written successfully, 1 otherwise.
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
+int kvs_write(size_t num_pairs, KvsString keys[], KvsString values[], unsigned long ttls_ms[]);
+
+/// Writes every pair of a load file (see load.h) to the KVS, in file order.
+/// The table is presized from the first segment and pairs are written in
+/// batches of LOAD_BATCH_SIZE, each taking the table lock once.
+/// @param path Path of the load file.
+/// @return 0 if every pair was written, 1 otherwise.
+int kvs_load(const char *path);
 
-/// Reads values from the KVS.
+/// Sorts keys in the order READ lists them. Keys already in order are not
+/// written to, so other threads may keep reading them meanwhile.
+/// @param count Number of keys.
+/// @param keys Keys to sort.
+void kvs_sort_keys(size_t count, KvsString keys[]);
+
+/// Reads values from the KVS. The keys are sorted in place first (see
+/// kvs_sort_keys).
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
-/// @param fd File descriptor to write the (successful) output.
+/// @param output_file File to write the (successful) output.
 /// @return 0 if the key reading, 1 otherwise.
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE],const char *output_file);
+int kvs_read(size_t num_pairs, KvsString keys[], OutputFile *output_file);
 
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
+/// @param output_file File to write the missing keys to.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE],const char *output_file);
+int kvs_delete(size_t num_pairs, KvsString keys[], OutputFile *output_file);
+
+/// Applies the WRITE and DELETE commands collapsed in a batch, taking the
+/// table lock (or dispatching to the shards) once, and writes the output of
+/// its DELETEs in order. The batch is emptied. The commands are not traced.
+/// @param write_batch Batch to be applied.
+/// @param output_file File to write the missing keys to.
+/// @return 0 if the batch was applied, 1 otherwise.
+int kvs_write_batch(WriteBatch *write_batch, OutputFile *output_file);
+
+/// Applies changes shipped by a primary (see replica.h), taking the table
+/// lock (or dispatching to the shards) once. They are not traced.
+/// @param records Changes in the order the primary made them.
+/// @param count Number of changes.
+/// @return 0 if the changes were applied, 1 otherwise.
+int kvs_replicate(const ReplicaRecord records[], size_t count);
+
+/// Logs every pair of the KVS for the replicas, as the first changes of
+/// their stream.
+void kvs_replicate_snapshot(void);
+
+/// Sets or clears the TTL of keys in the KVS.
+/// @param num_pairs Number of keys being expired.
+/// @param keys Array of keys' strings.
+/// @param ttls_ms Array of TTLs in milliseconds from now, 0 to never expire.
+/// @param output_file File to write the missing keys to.
+/// @return 0 if the command was executed, 1 otherwise.
+int kvs_expire(size_t num_pairs, KvsString keys[], unsigned long ttls_ms[], OutputFile *output_file);
+
+/// Swaps the values of keys whose version matches the expected one.
+/// @param num_triples Number of triples being swapped.
+/// @param keys Array of keys' strings.
+/// @param versions Array of expected versions, 0 meaning the key must not exist.
+/// @param values Array of values' strings.
+/// @param output_file File to write the new versions or mismatches to.
+/// @return 0 if the command was executed, 1 otherwise.
+int kvs_cas(size_t num_triples, KvsString keys[], unsigned long versions[], KvsString values[], OutputFile *output_file);
+
+/// Atomically adds deltas to integer values in the KVS.
+/// @param num_pairs Number of pairs being incremented.
+/// @param keys Array of keys' strings.
+/// @param deltas Array of amounts to add.
+/// @param output_file File to write the resulting values to.
+/// @return 0 if the command was executed, 1 otherwise.
+int kvs_incr(size_t num_pairs, KvsString keys[], long deltas[], OutputFile *output_file);
 
 /// Writes the state of the KVS.
-/// @param fd File descriptor to write the output.
-void kvs_show(const char *output_file);
+/// @param output_file File to write the output.
+void kvs_show(OutputFile *output_file);
 
 /// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
+/// backup file. Refused for tables in explicit huge pages, which a forked
+/// child may lose.
+/// @param output_file Path of the backup file.
+/// @param fd Descriptor of the backup file, closed by the call.
 /// @return 0 if the backup was successful, 1 otherwise.
-int kvs_backup(char *output_file);
+int kvs_backup(const char *output_file, int fd);
 
-/// Waits for the last backup to be called.
+/// Waits for backups to finish until fewer than max_backups are running.
+/// A backup whose child failed or was killed is reported on stderr.
 void kvs_wait_backup();
 
+/// Waits for every running backup, reporting the ones that failed.
+void kvs_finish_backups();
+
 /// Waits for a given amount of time.
 /// @param delay_us Delay in milliseconds.
-void kvs_wait(unsigned int delay_ms,const char *output_file);
+/// @param output_file File to write the output.
+void kvs_wait(unsigned int delay_ms, OutputFile *output_file);
 
 #endif  // KVS_OPERATIONS_H
@@ -0,0 +1,383 @@
+#define _GNU_SOURCE // syscall, MAP_POPULATE
+#include "output.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "constants.h"
+#include "logger.h"
+
+// Bytes of an output file written by a single write request
+typedef struct Chunk {
+    OutputFile *file;
+    off_t offset;      // position of data[0] in the file
+    size_t length;     // bytes staged
+    size_t written;    // bytes the kernel already wrote
+    size_t capacity;
+    char data[];
+} Chunk;
+
+struct OutputFile {
+    int fd;            // -1 for an in-memory buffer
+    int uring;         // chunks go through the thread's io_uring
+    off_t offset;      // where the next chunk starts
+    Chunk *staging;    // chunk being filled
+    size_t in_flight;  // chunks handed to the ring and not completed yet
+    int failed;
+};
+
+// io_uring of one thread, driven with the raw syscalls
+typedef struct Ring {
+    int fd;
+    unsigned entries;
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_size;
+    size_t cq_map_size;
+    size_t sqes_size;
+    unsigned queued;             // SQEs filled but not submitted
+    unsigned in_flight;          // SQEs submitted but not completed
+    struct io_uring_sqe *last;   // last SQE filled, linked to the next one of the same file
+    OutputFile *last_file;
+} Ring;
+
+static int uring_enabled = 1;
+static _Thread_local Ring *thread_ring = NULL;
+static _Thread_local int thread_ring_failed = 0;
+
+void output_use_uring(int enabled) {
+    uring_enabled = enabled;
+}
+
+static void *field(void *map, unsigned offset) {
+    return (char *)map + offset;
+}
+
+static void ring_free(Ring *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != NULL && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map != NULL && ring->sq_map != MAP_FAILED) munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+    free(ring);
+}
+
+/// Sets up an io_uring and maps its queues.
+/// @return The ring, NULL if io_uring is unavailable.
+static Ring *ring_create(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, OUTPUT_RING_SIZE, &params);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    Ring *ring = calloc(1, sizeof(Ring));
+    if (!ring) {
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size) ring->sq_map_size = ring->cq_map_size;
+        ring->cq_map_size = ring->sq_map_size;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        ring_free(ring);
+        return NULL;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            ring_free(ring);
+            return NULL;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring_free(ring);
+        return NULL;
+    }
+
+    ring->sq_head = field(ring->sq_map, params.sq_off.head);
+    ring->sq_tail = field(ring->sq_map, params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)field(ring->sq_map, params.sq_off.ring_mask);
+    ring->sq_array = field(ring->sq_map, params.sq_off.array);
+    ring->cq_head = field(ring->cq_map, params.cq_off.head);
+    ring->cq_tail = field(ring->cq_map, params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)field(ring->cq_map, params.cq_off.ring_mask);
+    ring->cqes = field(ring->cq_map, params.cq_off.cqes);
+    return ring;
+}
+
+// Writes what is left of a chunk with blocking pwrite calls.
+static int write_chunk(int fd, Chunk *chunk) {
+    while (chunk->written < chunk->length) {
+        ssize_t written = pwrite(fd, chunk->data + chunk->written, chunk->length - chunk->written,
+                                 chunk->offset + (off_t)chunk->written);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return 1;
+        chunk->written += (size_t)written;
+    }
+    return 0;
+}
+
+static void complete(Ring *ring, Chunk *chunk, int res) {
+    OutputFile *file = chunk->file;
+    ring->in_flight--;
+
+    if (res < 0 && res != -ECANCELED && res != -EINTR && res != -EAGAIN) {
+        log_error("Failed to write output: %s\n", strerror(-res));
+        file->failed = 1;
+    } else {
+        // A short write breaks the chain and cancels the chunks linked after
+        // it; finish those rare leftovers synchronously
+        if (res > 0) chunk->written += (size_t)res;
+        if (chunk->written < chunk->length && write_chunk(file->fd, chunk) != 0) {
+            log_error("Failed to write output: %m\n");
+            file->failed = 1;
+        }
+    }
+
+    file->in_flight--;
+    free(chunk);
+}
+
+/// Submits the queued SQEs and handles the completions posted so far.
+/// @param ring Ring of the calling thread.
+/// @param min_complete Completions to wait for.
+/// @return 0 on success, 1 if the ring failed.
+static int ring_submit(Ring *ring, unsigned min_complete) {
+    while (ring->queued > 0 || min_complete > 0) {
+        unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+        long submitted = syscall(__NR_io_uring_enter, ring->fd, ring->queued, min_complete, flags, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            log_error("Failed to submit output: %m\n");
+            return 1;
+        }
+        ring->queued -= (unsigned)submitted;
+        ring->in_flight += (unsigned)submitted;
+        if (ring->queued == 0 || min_complete > 0) break;
+    }
+    ring->last = NULL;
+    ring->last_file = NULL;
+
+    unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        Chunk *chunk = (Chunk *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        atomic_store_explicit(ring->cq_head, head + 1, memory_order_release);
+        complete(ring, chunk, res);
+    }
+    return 0;
+}
+
+/// Fills an SQE writing a chunk, linked to the previous SQE when it writes
+/// the same file so the kernel writes the file in order.
+static int ring_queue(Ring *ring, Chunk *chunk) {
+    // Every SQE in flight must have room for its CQE
+    while (ring->queued + ring->in_flight >= ring->entries) {
+        if (ring_submit(ring, 1) != 0) return 1;
+    }
+
+    if (ring->last != NULL && ring->last_file == chunk->file) {
+        ring->last->flags |= IOSQE_IO_LINK;
+    }
+
+    unsigned tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = chunk->file->fd;
+    sqe->addr = (uint64_t)(uintptr_t)chunk->data;
+    sqe->len = (uint32_t)chunk->length;
+    sqe->off = (uint64_t)chunk->offset;
+    sqe->user_data = (uint64_t)(uintptr_t)chunk;
+    ring->sq_array[index] = index;
+    atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+
+    ring->queued++;
+    ring->last = sqe;
+    ring->last_file = chunk->file;
+    chunk->file->in_flight++;
+    return 0;
+}
+
+// Hands the staging chunk of a file to the kernel.
+static void queue_staging(OutputFile *file) {
+    Chunk *chunk = file->staging;
+    file->staging = NULL;
+    if (chunk == NULL) return;
+
+    chunk->offset = file->offset;
+    file->offset += (off_t)chunk->length;
+
+    if (file->uring && ring_queue(thread_ring, chunk) == 0) {
+        if (thread_ring->queued >= OUTPUT_BATCH_SIZE) {
+            ring_submit(thread_ring, 0);
+        }
+        return;
+    }
+
+    if (write_chunk(file->fd, chunk) != 0) {
+        log_error("Failed to write output: %m\n");
+        file->failed = 1;
+    }
+    free(chunk);
+}
+
+OutputFile *output_open(const char *path) {
+    OutputFile *file = calloc(1, sizeof(OutputFile));
+    if (!file) {
+        return NULL;
+    }
+
+    file->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file->fd == -1) {
+        free(file);
+        return NULL;
+    }
+
+    if (uring_enabled && thread_ring == NULL && !thread_ring_failed) {
+        thread_ring = ring_create();
+        thread_ring_failed = thread_ring == NULL; // blocking writes from now on
+    }
+    file->uring = thread_ring != NULL;
+    return file;
+}
+
+OutputFile *output_open_buffer(void) {
+    OutputFile *file = calloc(1, sizeof(OutputFile));
+    if (file) {
+        file->fd = -1;
+    }
+    return file;
+}
+
+int output_write(OutputFile *file, const char *data, size_t length) {
+    Chunk *chunk = file->staging;
+    if (chunk != NULL && chunk->capacity - chunk->length < length) {
+        if (file->fd == -1) {
+            // Buffers keep everything in a single growing chunk
+            size_t capacity = chunk->capacity * 2;
+            while (capacity - chunk->length < length) {
+                capacity *= 2;
+            }
+            Chunk *grown = realloc(chunk, sizeof(Chunk) + capacity);
+            if (!grown) {
+                log_error("Failed to allocate output: %m\n");
+                file->failed = 1;
+                return 1;
+            }
+            grown->capacity = capacity;
+            file->staging = grown;
+            chunk = grown;
+        } else {
+            queue_staging(file);
+            chunk = NULL;
+        }
+    }
+
+    if (chunk == NULL) {
+        size_t capacity = length > OUTPUT_CHUNK_SIZE ? length : OUTPUT_CHUNK_SIZE;
+        chunk = malloc(sizeof(Chunk) + capacity);
+        if (!chunk) {
+            log_error("Failed to allocate output: %m\n");
+            file->failed = 1;
+            return 1;
+        }
+        chunk->file = file;
+        chunk->length = 0;
+        chunk->written = 0;
+        chunk->capacity = capacity;
+        file->staging = chunk;
+    }
+
+    memcpy(chunk->data + chunk->length, data, length);
+    chunk->length += length;
+    return 0;
+}
+
+int output_append(OutputFile *file, OutputFile *buffer) {
+    int failed = buffer->failed;
+    if (buffer->staging != NULL) {
+        failed |= output_write(file, buffer->staging->data, buffer->staging->length);
+        free(buffer->staging);
+    }
+    free(buffer);
+    return failed;
+}
+
+void output_flush(OutputFile *file) {
+    if (file->fd == -1) return;
+    queue_staging(file);
+    if (file->uring) {
+        ring_submit(thread_ring, 0);
+    }
+}
+
+int output_close(OutputFile *file) {
+    if (file->fd == -1) {
+        int failed = file->failed;
+        free(file->staging);
+        free(file);
+        return failed;
+    }
+
+    output_flush(file);
+    while (file->in_flight > 0) {
+        if (ring_submit(thread_ring, 1) != 0) {
+            // the ring still points at the file, leak it rather than free it
+            log_error("Failed to drain output\n");
+            return 1;
+        }
+    }
+
+    int failed = file->failed;
+    if (close(file->fd) != 0) {
+        log_error("Failed to close output: %m\n");
+        failed = 1;
+    }
+    free(file);
+    return failed;
+}
+
+void output_thread_release(void) {
+    if (thread_ring != NULL) {
+        ring_free(thread_ring);
+        thread_ring = NULL;
+    }
+    thread_ring_failed = 0;
+}
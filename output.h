@@ -0,0 +1,53 @@
+#ifndef KVS_OUTPUT_H
+#define KVS_OUTPUT_H
+
+#include <stddef.h>
+
+// Output files written by the job threads. Writes are staged in memory and
+// handed to the kernel in chunks through a per-thread io_uring, so a thread
+// goes on executing commands while earlier output is still being written.
+// When io_uring is unavailable (or disabled) chunks are written with write().
+typedef struct OutputFile OutputFile;
+
+/// Whether files opened from now on may use io_uring (default) or must use
+/// blocking writes.
+/// @param enabled 1 to use io_uring when the kernel supports it, 0 otherwise.
+void output_use_uring(int enabled);
+
+/// Creates (or truncates) an output file.
+/// @param path Path of the file.
+/// @return The file, NULL on error.
+OutputFile *output_open(const char *path);
+
+/// Creates an in-memory output buffer, to be appended to a file later.
+/// Unlike files, buffers may be written by any thread.
+/// @return The buffer, NULL on error.
+OutputFile *output_open_buffer(void);
+
+/// Appends the contents of a buffer to an output file and frees the buffer.
+/// @param file File to write to.
+/// @param buffer Buffer created by output_open_buffer.
+/// @return 0 on success, 1 otherwise.
+int output_append(OutputFile *file, OutputFile *buffer);
+
+/// Appends bytes to an output file.
+/// @param file File to write to.
+/// @param data Bytes to write, copied before returning.
+/// @param length Number of bytes.
+/// @return 0 on success, 1 otherwise.
+int output_write(OutputFile *file, const char *data, size_t length);
+
+/// Hands the staged bytes of a file to the kernel without waiting for them.
+/// @param file File to flush.
+void output_flush(OutputFile *file);
+
+/// Waits for every write of a file to complete and closes it.
+/// @param file File to close.
+/// @return 0 if all the output was written, 1 otherwise.
+int output_close(OutputFile *file);
+
+/// Frees the io_uring of the calling thread. Every file it wrote must have
+/// been closed.
+void output_thread_release(void);
+
+#endif  // KVS_OUTPUT_H
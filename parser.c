@@ -1,19 +1,56 @@
 #include "parser.h"
 
+#include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <stdio.h>
 #include "constants.h"
+#include "logger.h"
 
-static int read_string(int fd, char *buffer, size_t max) {
+static _Thread_local ParserDiagnostic diagnostic_hook = NULL;
+static _Thread_local void *diagnostic_context = NULL;
+
+void parser_set_diagnostics(ParserDiagnostic hook, void *context) {
+  diagnostic_hook = hook;
+  diagnostic_context = context;
+}
+
+void parser_diagnostic(const char *message) {
+  if (diagnostic_hook != NULL) {
+    diagnostic_hook(message, diagnostic_context);
+  } else {
+    log_info("%s", message);
+  }
+}
+
+// Makes room for one more byte, doubling the string's buffer as needed.
+static int grow_string(KvsString *string) {
+  if (string->len + 1 < string->cap) {
+    return 0;
+  }
+
+  size_t cap = string->cap ? string->cap * 2 : 32;
+  char *data = realloc(string->data, cap);
+  if (!data) {
+    return -1;
+  }
+  string->data = data;
+  string->cap = cap;
+  return 0;
+}
+
+static int read_string(int fd, KvsString *buffer) {
   ssize_t bytes_read;
   char ch;
-  size_t i = 0;
   int value = -1;
 
-  while (i < max) {
+  buffer->len = 0;
+  while (1) {
+    if (grow_string(buffer) != 0) {
+      return -1;
+    }
+
     bytes_read = read(fd, &ch, 1);
 
     if (bytes_read <= 0) {
@@ -37,14 +74,96 @@ static int read_string(int fd, char *buffer, size_t max) {
       break;
     }
 
-    buffer[i++] = ch;
+    buffer->data[buffer->len++] = ch;
   }
 
-  buffer[i] = '\0';
+  buffer->data[buffer->len] = '\0';
 
   return value;
 }
 
+// Makes sure the arguments have at least `count` slots.
+static int reserve_args(CommandArgs *args, size_t count) {
+  if (count <= args->capacity) {
+    return 0;
+  }
+
+  size_t capacity = args->capacity ? args->capacity * 2 : 16;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+
+  KvsString *keys = realloc(args->keys, capacity * sizeof(KvsString));
+  if (keys) args->keys = keys;
+  KvsString *values = realloc(args->values, capacity * sizeof(KvsString));
+  if (values) args->values = values;
+  unsigned long *versions = realloc(args->versions, capacity * sizeof(unsigned long));
+  if (versions) args->versions = versions;
+  long *deltas = realloc(args->deltas, capacity * sizeof(long));
+  if (deltas) args->deltas = deltas;
+  unsigned long *ttls = realloc(args->ttls, capacity * sizeof(unsigned long));
+  if (ttls) args->ttls = ttls;
+  if (!keys || !values || !versions || !deltas || !ttls) {
+    return -1;
+  }
+
+  memset(args->keys + args->capacity, 0, (capacity - args->capacity) * sizeof(KvsString));
+  memset(args->values + args->capacity, 0, (capacity - args->capacity) * sizeof(KvsString));
+  args->capacity = capacity;
+  return 0;
+}
+
+void free_command_args(CommandArgs *args) {
+  for (size_t i = 0; i < args->capacity; i++) {
+    free(args->keys[i].data);
+    free(args->values[i].data);
+  }
+  free(args->keys);
+  free(args->values);
+  free(args->versions);
+  free(args->deltas);
+  free(args->ttls);
+  free(args->scratch.data);
+  *args = (CommandArgs){0};
+}
+
+// Copies a string into a buffer owned by the arguments.
+static int copy_string(KvsString *dst, const KvsString *src) {
+  if (src->len + 1 > dst->cap) {
+    char *data = realloc(dst->data, src->len + 1);
+    if (!data) {
+      return -1;
+    }
+    dst->data = data;
+    dst->cap = src->len + 1;
+  }
+  if (src->len > 0) {
+    memcpy(dst->data, src->data, src->len);
+  }
+  dst->data[src->len] = '\0';
+  dst->len = src->len;
+  return 0;
+}
+
+int copy_command_args(CommandArgs *dst, const CommandArgs *src, size_t count) {
+  if (reserve_args(dst, count) != 0) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (copy_string(&dst->keys[i], &src->keys[i]) != 0) {
+      return -1;
+    }
+    if (src->values[i].data != NULL && copy_string(&dst->values[i], &src->values[i]) != 0) {
+      return -1;
+    }
+  }
+  memcpy(dst->versions, src->versions, count * sizeof(unsigned long));
+  memcpy(dst->deltas, src->deltas, count * sizeof(long));
+  memcpy(dst->ttls, src->ttls, count * sizeof(unsigned long));
+  return 0;
+}
+
 static int read_uint(int fd, unsigned int *value, char *next) {
   char buf[16];
 
@@ -93,7 +212,7 @@ enum Command get_next(int fd) {
       if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
         if (read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
           cleanup(fd);
-          printf("Write or wait invalid\n");
+          parser_diagnostic("Write or wait invalid\n");
           return CMD_INVALID;
         }
         return CMD_WRITE;
@@ -104,7 +223,7 @@ enum Command get_next(int fd) {
     case 'R':
       if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
         cleanup(fd);
-        printf("Read invalid\n");
+        parser_diagnostic("Read invalid\n");
         return CMD_INVALID;
       }
 
@@ -113,7 +232,7 @@ enum Command get_next(int fd) {
     case 'D':
       if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
         cleanup(fd);
-        printf("Delete invalid\n");
+        parser_diagnostic("Delete invalid\n");
         return CMD_INVALID;
       }
 
@@ -123,7 +242,7 @@ enum Command get_next(int fd) {
       if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
         
           cleanup(fd);
-          printf("Show invalid\n");
+          parser_diagnostic("Show invalid\n");
           return CMD_INVALID;
         
       
@@ -132,7 +251,7 @@ enum Command get_next(int fd) {
       if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
         if (fd == STDIN_FILENO){
           cleanup(fd);
-          printf("Show invalid\n");
+          parser_diagnostic("Show invalid\n");
           return CMD_INVALID;
         }
         
@@ -143,14 +262,14 @@ enum Command get_next(int fd) {
     case 'B':
       if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
         cleanup(fd);
-        printf("Backup invalid\n");
+        parser_diagnostic("Backup invalid\n");
         return CMD_INVALID;
       }
 
       if (read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
         if (fd == STDIN_FILENO){
           cleanup(fd);
-          printf("Backup invalid\n");
+          parser_diagnostic("Backup invalid\n");
           return CMD_INVALID;
         }
         
@@ -158,16 +277,52 @@ enum Command get_next(int fd) {
 
       return CMD_BACKUP;
 
+    case 'C':
+      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "CAS ", 4) != 0) {
+        cleanup(fd);
+        parser_diagnostic("Cas invalid\n");
+        return CMD_INVALID;
+      }
+
+      return CMD_CAS;
+
+    case 'I':
+      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "INCR ", 5) != 0) {
+        cleanup(fd);
+        parser_diagnostic("Incr invalid\n");
+        return CMD_INVALID;
+      }
+
+      return CMD_INCR;
+
+    case 'E':
+      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "EXPIRE ", 7) != 0) {
+        cleanup(fd);
+        parser_diagnostic("Expire invalid\n");
+        return CMD_INVALID;
+      }
+
+      return CMD_EXPIRE;
+
+    case 'L':
+      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "LOAD ", 5) != 0) {
+        cleanup(fd);
+        parser_diagnostic("Load invalid\n");
+        return CMD_INVALID;
+      }
+
+      return CMD_LOAD;
+
     case 'H':
       if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
         cleanup(fd);
-        printf("H invalid");
+        parser_diagnostic("H invalid");
         return CMD_INVALID;
       }
 
       if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
         cleanup(fd);
-        printf("H invalid");
+        parser_diagnostic("H invalid");
         return CMD_INVALID;
       }
 
@@ -189,13 +344,31 @@ enum Command get_next(int fd) {
   }
 }
 
-int parse_pair(int fd, char *key, char *value) {
-  if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
+// Parses a whole field as a decimal number, rejecting empty or partial input.
+static int parse_number(const KvsString *field, long *value) {
+  char *end;
+  errno = 0;
+  *value = strtol(field->data, &end, 10);
+  return errno != 0 || end == field->data || end != field->data + field->len;
+}
+
+int parse_pair(int fd, CommandArgs *args, size_t index) {
+  if (read_string(fd, &args->keys[index]) != 0) {
     cleanup(fd);
     return 0;
   }
 
-  if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
+  int output = read_string(fd, &args->values[index]);
+  args->ttls[index] = 0;
+  if (output == 0) {
+    // Optional third field with the TTL of the pair
+    long ttl;
+    if (read_string(fd, &args->scratch) != 1 || parse_number(&args->scratch, &ttl) || ttl < 0) {
+      cleanup(fd);
+      return 0;
+    }
+    args->ttls[index] = (unsigned long)ttl;
+  } else if (output != 1) {
     cleanup(fd);
     return 0;
   }
@@ -203,7 +376,7 @@ int parse_pair(int fd, char *key, char *value) {
   return 1;
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+size_t parse_write(int fd, CommandArgs *args, size_t max_pairs) {
     char ch;
     if (read(fd, &ch, 1) != 1 || ch != '[') {
         
@@ -218,18 +391,15 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
     }
 
     size_t num_pairs = 0;
-    char key[max_string_size];
-    char value[max_string_size];
     while (num_pairs < max_pairs) {
-        if (parse_pair(fd, key, value) == 0) {
+        if (reserve_args(args, num_pairs + 1) != 0 ||
+            parse_pair(fd, args, num_pairs) == 0) {
            
             cleanup(fd);
             return 0;
         }
 
-     
-        strcpy(keys[num_pairs], key);
-        strcpy(values[num_pairs++], value);
+        num_pairs++;
 
         if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
         
@@ -261,7 +431,7 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
     return num_pairs;
 }
 
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
+size_t parse_read_delete(int fd, CommandArgs *args, size_t max_keys) {
   char ch;
 
   if (read(fd, &ch, 1) != 1 || ch != '[') {
@@ -270,15 +440,19 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
   }
 
   size_t num_keys = 0;
-  char key[max_string_size];
   while (num_keys < max_keys) {
-    int output = read_string(fd, key, max_string_size);
+    if (reserve_args(args, num_keys + 1) != 0) {
+      cleanup(fd);
+      return 0;
+    }
+
+    int output = read_string(fd, &args->keys[num_keys]);
     if(output < 0 || output == 1) {
       cleanup(fd);
       return 0;
     }
 
-    strcpy(keys[num_keys++], key);
+    num_keys++;
 
     if (output == 2){
       break;
@@ -301,7 +475,142 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
   return num_keys;
 }
 
+size_t parse_cas(int fd, CommandArgs *args, size_t max_triples) {
+  char ch;
+  if (read(fd, &ch, 1) != 1 || ch != '[') {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read(fd, &ch, 1) != 1 || ch != '(') {
+    cleanup(fd);
+    return 0;
+  }
+
+  size_t num_triples = 0;
+  long version;
+  while (num_triples < max_triples) {
+    if (reserve_args(args, num_triples + 1) != 0 ||
+        read_string(fd, &args->keys[num_triples]) != 0 ||
+        read_string(fd, &args->scratch) != 0 ||
+        parse_number(&args->scratch, &version) || version < 0 ||
+        read_string(fd, &args->values[num_triples]) != 1) {
+      cleanup(fd);
+      return 0;
+    }
+    args->versions[num_triples++] = (unsigned long)version;
+
+    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+      cleanup(fd);
+      return 0;
+    }
+
+    if (ch == ']') {
+      break;
+    }
+  }
+
+  if (num_triples == max_triples) {
+    cleanup(fd);
+    return 0;
+  }
 
+  if (fd == STDIN_FILENO) {
+    if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+      cleanup(fd);
+      return 0;
+    }
+  }
+
+  return num_triples;
+}
+
+// Parses [(key,number)(key2,number2),...] storing the numbers in args->deltas.
+static size_t parse_key_numbers(int fd, CommandArgs *args, size_t max_pairs) {
+  char ch;
+  if (read(fd, &ch, 1) != 1 || ch != '[') {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read(fd, &ch, 1) != 1 || ch != '(') {
+    cleanup(fd);
+    return 0;
+  }
+
+  size_t num_pairs = 0;
+  while (num_pairs < max_pairs) {
+    if (reserve_args(args, num_pairs + 1) != 0 ||
+        read_string(fd, &args->keys[num_pairs]) != 0 ||
+        read_string(fd, &args->scratch) != 1 ||
+        parse_number(&args->scratch, &args->deltas[num_pairs])) {
+      cleanup(fd);
+      return 0;
+    }
+    num_pairs++;
+
+    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+      cleanup(fd);
+      return 0;
+    }
+
+    if (ch == ']') {
+      break;
+    }
+  }
+
+  if (num_pairs == max_pairs) {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (fd == STDIN_FILENO) {
+    if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+      cleanup(fd);
+      return 0;
+    }
+  }
+
+  return num_pairs;
+}
+
+size_t parse_incr(int fd, CommandArgs *args, size_t max_pairs) {
+  return parse_key_numbers(fd, args, max_pairs);
+}
+
+size_t parse_expire(int fd, CommandArgs *args, size_t max_pairs) {
+  size_t num_pairs = parse_key_numbers(fd, args, max_pairs);
+  for (size_t i = 0; i < num_pairs; i++) {
+    if (args->deltas[i] < 0) {
+      return 0;
+    }
+    args->ttls[i] = (unsigned long)args->deltas[i];
+  }
+  return num_pairs;
+}
+
+size_t parse_load(int fd, CommandArgs *args) {
+  if (reserve_args(args, 1) != 0) {
+    cleanup(fd);
+    return 0;
+  }
+
+  KvsString *path = &args->keys[0];
+  path->len = 0;
+  char ch;
+  while (read(fd, &ch, 1) == 1 && ch != '\n') {
+    if (grow_string(path) != 0) {
+      cleanup(fd);
+      return 0;
+    }
+    path->data[path->len++] = ch;
+  }
+  if (path->len == 0) {
+    return 0;
+  }
+  path->data[path->len] = '\0';
+  return 1;
+}
 
 int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
   char ch;
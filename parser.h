@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include "constants.h"
+#include "kvs.h"
 
 enum Command {
   CMD_WRITE,
@@ -11,33 +12,98 @@ enum Command {
   CMD_SHOW,
   CMD_WAIT,
   CMD_BACKUP,
+  CMD_CAS,
+  CMD_INCR,
+  CMD_EXPIRE,
+  CMD_LOAD,
   CMD_HELP,
   CMD_EMPTY,
   CMD_INVALID,
   EOC  // End of commands
 };
 
+/// Receives the messages the parser prints about invalid commands.
+/// @param message Message, printed to stdout when no hook is set.
+/// @param context Context given to parser_set_diagnostics.
+typedef void (*ParserDiagnostic)(const char *message, void *context);
+
+/// Routes the parser messages of the calling thread to a hook.
+/// @param hook Hook to call, NULL to print the messages to stdout again.
+/// @param context Passed to the hook.
+void parser_set_diagnostics(ParserDiagnostic hook, void *context);
+
+/// Prints a parser message, through the hook of the calling thread if any.
+/// @param message Message to print.
+void parser_diagnostic(const char *message);
+
 /// Reads a line and returns the corresponding command.
 /// @param fd File descriptor to read from.
 /// @return The command read.
 enum Command get_next(int fd);
 
-/// Parses a WRITE command.
+/// Argument buffers of a command. Slots and their strings grow on demand and
+/// are reused by the following commands of the same job.
+typedef struct CommandArgs {
+  KvsString *keys;
+  KvsString *values;
+  unsigned long *versions;
+  long *deltas;
+  unsigned long *ttls;     // per pair TTL in ms of WRITE and EXPIRE, 0 if none
+  KvsString scratch;       // numeric fields are read here before conversion
+  size_t capacity;
+} CommandArgs;
+
+/// Releases every buffer held by the command arguments.
+/// @param args Arguments to be freed.
+void free_command_args(CommandArgs *args);
+
+/// Copies the first pairs of arguments into buffers of their own.
+/// @param dst Arguments to copy to, grown as needed.
+/// @param src Arguments to copy from.
+/// @param count Number of pairs to copy.
+/// @return 0 on success, -1 on allocation failure.
+int copy_command_args(CommandArgs *dst, const CommandArgs *src, size_t count);
+
+/// Parses a WRITE command. Each pair may carry a TTL: (key,value,ttl_ms).
 /// @param fd File descriptor to read from.
-/// @param keys Array of keys to be written.
-/// @param values Array of values to be written.
+/// @param args Buffers to store the keys, values and TTLs in.
 /// @param max_pairs number of pairs to be written.
-/// @param max_string_size maximum size for keys and values.
-/// @return 0 if the command was parsed successfully, 1 otherwise.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
+/// @return Number of pairs parsed. 0 on failure.
+size_t parse_write(int fd, CommandArgs *args, size_t max_pairs);
 
 /// Parses a READ or DELETE command.
 /// @param fd File descriptor to read from.
-/// @param keys Array of keys to be written.
+/// @param args Buffers to store the keys in.
 /// @param max_keys number of keys to be iread or deleted.
-/// @param max_string_size maximum size for keys and values.
 /// @return Number of keys read or deleted. 0 on failure.
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size);
+size_t parse_read_delete(int fd, CommandArgs *args, size_t max_keys);
+
+/// Parses a CAS command.
+/// @param fd File descriptor to read from.
+/// @param args Buffers to store the keys, expected versions and values in.
+/// @param max_triples number of triples to be swapped.
+/// @return Number of triples parsed. 0 on failure.
+size_t parse_cas(int fd, CommandArgs *args, size_t max_triples);
+
+/// Parses an INCR command.
+/// @param fd File descriptor to read from.
+/// @param args Buffers to store the keys and deltas in.
+/// @param max_pairs number of pairs to be incremented.
+/// @return Number of pairs parsed. 0 on failure.
+size_t parse_incr(int fd, CommandArgs *args, size_t max_pairs);
+
+/// Parses an EXPIRE command.
+/// @param fd File descriptor to read from.
+/// @param args Buffers to store the keys and TTLs in.
+/// @param max_pairs number of keys to be expired.
+/// @return Number of pairs parsed. 0 on failure.
+size_t parse_expire(int fd, CommandArgs *args, size_t max_pairs);
+
+/// Parses a LOAD command: the rest of the line is the path of the file.
+/// @param fd File descriptor to read from.
+/// @param args Buffers to store the path in, as the first key.
+/// @return 1 if a path was read, 0 on failure.
+size_t parse_load(int fd, CommandArgs *args);
 
 /// Parses a WAIT command.
 /// @param fd File descriptor to read from.
@@ -0,0 +1,135 @@
+#define _GNU_SOURCE // sched_setaffinity, syscall
+#include "placement.h"
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "constants.h"
+#include "logger.h"
+
+static const char *page_names[] = {"small", "thp", "explicit"};
+static const char *numa_names[] = {"off", "interleave", "partition"};
+
+static pthread_once_t nodes_once = PTHREAD_ONCE_INIT;
+static size_t node_total = 1;
+static unsigned long node_mask = 1;   // nodes online, bit n for node n
+
+/// Reads a sysfs list like "0-3,8,10-11", marking the items below max.
+/// @return Number of items marked, 0 if the file could not be read.
+static size_t read_list(const char *path, unsigned char *marks, size_t max) {
+    char text[4096];
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return 0;
+    size_t length = fread(text, 1, sizeof(text) - 1, file);
+    fclose(file);
+    text[length] = '\0';
+
+    size_t marked = 0;
+    char *cursor = text;
+    while (*cursor >= '0' && *cursor <= '9') {
+        unsigned long first = strtoul(cursor, &cursor, 10);
+        unsigned long last = first;
+        if (*cursor == '-') {
+            last = strtoul(cursor + 1, &cursor, 10);
+        }
+        for (unsigned long item = first; item <= last && item < max; item++) {
+            if (!marks[item]) marked++;
+            marks[item] = 1;
+        }
+        if (*cursor == ',') cursor++;
+    }
+    return marked;
+}
+
+static void find_nodes(void) {
+    unsigned char online[PLACEMENT_MAX_NODES] = {0};
+    size_t count = read_list("/sys/devices/system/node/online", online, PLACEMENT_MAX_NODES);
+    if (count == 0) return;
+
+    node_total = count;
+    node_mask = 0;
+    for (size_t node = 0; node < PLACEMENT_MAX_NODES; node++) {
+        if (online[node]) node_mask |= 1UL << node;
+    }
+}
+
+int placement_parse_pages(const char *name, PageMode *pages) {
+    for (size_t i = 0; i < sizeof(page_names) / sizeof(page_names[0]); i++) {
+        if (strcmp(name, page_names[i]) == 0) {
+            *pages = (PageMode)i;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int placement_parse_numa(const char *name, NumaMode *numa) {
+    for (size_t i = 0; i < sizeof(numa_names) / sizeof(numa_names[0]); i++) {
+        if (strcmp(name, numa_names[i]) == 0) {
+            *numa = (NumaMode)i;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+size_t placement_nodes(void) {
+    pthread_once(&nodes_once, find_nodes);
+    return node_total;
+}
+
+int placement_node_of(NumaMode numa, size_t index) {
+    switch (numa) {
+        case NUMA_INTERLEAVE:
+            return PLACEMENT_INTERLEAVE;
+        case NUMA_PARTITION: {
+            // The n-th online node, which need not be node n
+            size_t nth = index % placement_nodes();
+            for (int node = 0; node < PLACEMENT_MAX_NODES; node++) {
+                if ((node_mask >> node & 1) && nth-- == 0) return node;
+            }
+            return PLACEMENT_ANY_NODE;
+        }
+        case NUMA_OFF:
+            break;
+    }
+    return PLACEMENT_ANY_NODE;
+}
+
+int placement_bind(void *memory, size_t length, int node) {
+    if (placement_nodes() < 2 || node == PLACEMENT_ANY_NODE) return 0;
+
+    // Preferred rather than bound: a full node spills over instead of failing
+    unsigned long mask = node == PLACEMENT_INTERLEAVE ? node_mask : 1UL << node;
+    int mode = node == PLACEMENT_INTERLEAVE ? MPOL_INTERLEAVE : MPOL_PREFERRED;
+    if (syscall(SYS_mbind, memory, length, mode, &mask, sizeof(mask) * 8 + 1, 0) != 0) {
+        log_warn("Failed to set the NUMA policy of a table: %m\n");
+        return 1;
+    }
+    return 0;
+}
+
+int placement_pin(int node) {
+    if (placement_nodes() < 2 || node < 0) return 0;
+
+    char path[64];
+    unsigned char cpus[CPU_SETSIZE] = {0};
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if (read_list(path, cpus, CPU_SETSIZE) == 0) return 1;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (cpus[cpu]) CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        log_error("Failed to pin thread to node %d: %m\n", node);
+        return 1;
+    }
+    return 0;
+}
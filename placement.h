@@ -0,0 +1,59 @@
+#ifndef KVS_PLACEMENT_H
+#define KVS_PLACEMENT_H
+
+#include <stddef.h>
+
+// Where the memory of a table comes from: the size of the pages backing it,
+// which sets how much of it the TLB covers, and the NUMA nodes it lives on.
+// On a machine with a single node, or a kernel without NUMA support, the
+// node policies do nothing.
+
+typedef enum {
+    PAGES_SMALL,        // the kernel's default pages
+    PAGES_TRANSPARENT,  // transparent huge pages, asked for with MADV_HUGEPAGE
+    PAGES_EXPLICIT,     // huge pages of the pool reserved by vm.nr_hugepages
+} PageMode;
+
+typedef enum {
+    NUMA_OFF,
+    NUMA_INTERLEAVE,    // every table spread page by page over all the nodes
+    NUMA_PARTITION,     // each shard's table and thread on a node of their own
+} NumaMode;
+
+#define PLACEMENT_ANY_NODE -1       // no policy, the node of the first touch
+#define PLACEMENT_INTERLEAVE -2     // pages spread over every node
+
+/// Reads a page mode name: small, thp or explicit.
+/// @param name Name to read.
+/// @param pages Set to the mode named.
+/// @return 0 on success, 1 if the name is not a page mode.
+int placement_parse_pages(const char *name, PageMode *pages);
+
+/// Reads a NUMA mode name: off, interleave or partition.
+/// @param name Name to read.
+/// @param numa Set to the mode named.
+/// @return 0 on success, 1 if the name is not a NUMA mode.
+int placement_parse_numa(const char *name, NumaMode *numa);
+
+/// Number of NUMA nodes online, 1 when it cannot be told.
+size_t placement_nodes(void);
+
+/// Node for the memory of one of several tables.
+/// @param numa NUMA mode of the tables.
+/// @param index Index of the table, from 0.
+/// @return A node, PLACEMENT_INTERLEAVE or PLACEMENT_ANY_NODE.
+int placement_node_of(NumaMode numa, size_t index);
+
+/// Sets the NUMA policy of memory not touched yet.
+/// @param memory Start of the memory, page aligned.
+/// @param length Bytes of memory.
+/// @param node Node to place it on, PLACEMENT_INTERLEAVE or PLACEMENT_ANY_NODE.
+/// @return 0 on success or when there is nothing to do, 1 otherwise.
+int placement_bind(void *memory, size_t length, int node);
+
+/// Restricts the calling thread to the CPUs of a node.
+/// @param node Node to run on, anything else leaves the thread as it is.
+/// @return 0 on success or when there is nothing to do, 1 otherwise.
+int placement_pin(int node);
+
+#endif  // KVS_PLACEMENT_H
@@ -0,0 +1,97 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include "logger.h"
+
+typedef struct PoolItem {
+    PoolTask task;
+    void *context;
+    struct PoolItem *next;
+} PoolItem;
+
+static pthread_t *workers = NULL;
+static size_t worker_count = 0;
+static PoolItem *head = NULL;
+static PoolItem *tail = NULL;
+static int stopping = 0;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+static void *pool_mission(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&pool_mutex);
+    while (1) {
+        while (head == NULL && !stopping) {
+            pthread_cond_wait(&pool_cond, &pool_mutex);
+        }
+        if (head == NULL) break;
+
+        PoolItem *item = head;
+        head = item->next;
+        if (head == NULL) tail = NULL;
+        pthread_mutex_unlock(&pool_mutex);
+
+        item->task(item->context);
+        free(item);
+
+        pthread_mutex_lock(&pool_mutex);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return NULL;
+}
+
+int pool_start(size_t count) {
+    workers = calloc(count, sizeof(pthread_t));
+    if (!workers) {
+        log_error("Failed to allocate the worker pool: %m\n");
+        return 1;
+    }
+
+    stopping = 0;
+    for (worker_count = 0; worker_count < count; worker_count++) {
+        if (pthread_create(&workers[worker_count], NULL, pool_mission, NULL) != 0) {
+            log_error("Failed to create worker thread: %m\n");
+            pool_stop();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void pool_stop(void) {
+    pthread_mutex_lock(&pool_mutex);
+    stopping = 1;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+
+    for (size_t i = 0; i < worker_count; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+}
+
+size_t pool_size(void) {
+    return worker_count;
+}
+
+int pool_submit(PoolTask task, void *context) {
+    PoolItem *item = malloc(sizeof(PoolItem));
+    if (!item) return 1;
+    item->task = task;
+    item->context = context;
+    item->next = NULL;
+
+    pthread_mutex_lock(&pool_mutex);
+    if (tail != NULL) {
+        tail->next = item;
+    } else {
+        head = item;
+    }
+    tail = item;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef KVS_POOL_H
+#define KVS_POOL_H
+
+#include <stddef.h>
+
+/// Work run by a pool worker.
+/// @param context Context given to pool_submit.
+typedef void (*PoolTask)(void *context);
+
+/// Starts the worker threads shared by every job to run independent commands
+/// of a job concurrently.
+/// @param count Number of worker threads.
+/// @return 0 on success, 1 otherwise.
+int pool_start(size_t count);
+
+/// Waits for the queued tasks to run and stops the worker threads.
+void pool_stop(void);
+
+/// Number of running workers, 0 when the pool is off.
+size_t pool_size(void);
+
+/// Queues a task for the workers, tasks start in submission order.
+/// @param task Work to run.
+/// @param context Passed to the task.
+/// @return 0 on success, 1 if the task could not be queued (and was not run).
+int pool_submit(PoolTask task, void *context);
+
+#endif  // KVS_POOL_H
@@ -0,0 +1,495 @@
+#define _GNU_SOURCE // MAP_FIXED_NOREPLACE, MAP_NORESERVE, MAP_HUGETLB, mremap, copy_file_range
+#include "region.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "constants.h"
+#include "logger.h"
+
+#define REGION_MAGIC "KVSREGN1"
+#define REGION_VERSION 1
+#define REGION_HEADER_SIZE 4096
+#define REGION_SMALL_CLASSES 64     // 16 to 1024 bytes, in steps of 16
+#define REGION_CLASSES (REGION_SMALL_CLASSES + 34) // then powers of two from 2 KiB
+
+enum { REGION_CLEAN = 1, REGION_DIRTY = 2 };
+
+// First page of the file.
+typedef struct RegionHeader {
+    char magic[8];
+    uint64_t version;
+    uint64_t layout;            // fingerprint given by the owner of the region
+    uint64_t base;              // address the region was built at
+    uint64_t state;
+    uint64_t size;              // bytes of the file
+    uint64_t used;              // end of the last block handed out
+    uint64_t root;              // offset of the root object, 0 for none
+    uint64_t closed_mono_ms;    // clocks when it was last closed or checkpointed
+    uint64_t closed_real_ms;
+    uint64_t free_lists[REGION_CLASSES]; // offset of the first free block of each class
+} RegionHeader;
+
+// Precedes every block.
+typedef struct RegionBlock {
+    uint64_t size_class;
+    uint64_t next;              // offset of the next free block of the class
+} RegionBlock;
+
+struct Region {
+    char *path;                 // NULL in anonymous memory
+    int fd;                     // -1 in anonymous memory
+    char *base;
+    RegionHeader *header;       // at base
+    PageMode pages;             // anonymous memory only
+    int node;
+};
+
+static atomic_int explicit_warned;
+
+static unsigned long long clock_ms(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (unsigned long long)ts.tv_sec * 1000ULL + (unsigned long long)ts.tv_nsec / 1000000ULL;
+}
+
+static size_t class_of(size_t size) {
+    if (size <= REGION_SMALL_CLASSES * 16) {
+        return size == 0 ? 0 : (size - 1) / 16;
+    }
+    size_t size_class = REGION_SMALL_CLASSES;
+    size_t payload = REGION_SMALL_CLASSES * 16 * 2;
+    while (payload < size) {
+        payload *= 2;
+        size_class++;
+    }
+    return size_class;
+}
+
+static size_t class_size(size_t size_class) {
+    if (size_class < REGION_SMALL_CLASSES) {
+        return (size_class + 1) * 16;
+    }
+    return (size_t)REGION_SMALL_CLASSES * 16 * 2 << (size_class - REGION_SMALL_CLASSES);
+}
+
+/// Path of a file next to the region, NULL if it could not be allocated.
+static char *sibling_path(const char *path, const char *suffix) {
+    size_t length = strlen(path) + strlen(suffix) + 1;
+    char *sibling = malloc(length);
+    if (sibling != NULL) {
+        snprintf(sibling, length, "%s%s", path, suffix);
+    }
+    return sibling;
+}
+
+/// Copies a whole file, sharing its blocks when the file system can.
+/// @param reflink_only Fail rather than copy the blocks, which takes as long
+///                     as the file is big.
+static int clone_file(int to, int from, int reflink_only) {
+    if (ioctl(to, FICLONE, from) == 0) return 0;
+    if (reflink_only) return 1;
+
+    struct stat st;
+    if (fstat(from, &st) != 0 || ftruncate(to, st.st_size) != 0) return 1;
+    off_t in = 0, out = 0;
+    while (in < st.st_size) {
+        ssize_t copied = copy_file_range(from, &in, to, &out, (size_t)(st.st_size - in), 0);
+        if (copied < 0 && errno == EINTR) continue;
+        if (copied <= 0) return 1;
+    }
+    return 0;
+}
+
+/// Clones a file to another path atomically, through a temporary file.
+/// @return Read-write descriptor of the copy, -1 on failure.
+static int clone_to(int from, const char *path, int reflink_only) {
+    char *temporary = sibling_path(path, ".tmp");
+    if (temporary == NULL) return -1;
+
+    int fd = open(temporary, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || clone_file(fd, from, reflink_only) != 0 || fsync(fd) != 0 || rename(temporary, path) != 0) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(temporary);
+        }
+        free(temporary);
+        return -1;
+    }
+    free(temporary);
+    return fd;
+}
+
+/// Reads and checks the header of an existing region file.
+static int read_header(int fd, uint64_t layout, RegionHeader *header) {
+    struct stat st;
+    if (pread(fd, header, sizeof(*header), 0) != (ssize_t)sizeof(*header) || fstat(fd, &st) != 0) {
+        log_error("Region file is too short\n");
+        return 1;
+    }
+    if (memcmp(header->magic, REGION_MAGIC, sizeof(header->magic)) != 0 || header->version != REGION_VERSION) {
+        log_error("Not a region file\n");
+        return 1;
+    }
+    if (header->layout != layout || header->base != REGION_BASE_ADDRESS) {
+        log_error("Region file was written by another build\n");
+        return 1;
+    }
+    if (header->size != (uint64_t)st.st_size || header->used > header->size || header->size > REGION_RESERVE_SIZE) {
+        log_error("Region file is truncated or corrupted\n");
+        return 1;
+    }
+    return 0;
+}
+
+/// Opens the region file, replacing a dirty one by its checkpoint, and
+/// checkpoints a clean one before the run changes it.
+/// @return The descriptor, -1 on failure.
+static int open_file(const char *path, uint64_t layout, int *created) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        log_error("Failed to open region: %m\n");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    *created = st.st_size == 0;
+    if (*created) {
+        RegionHeader header = {0};
+        memcpy(header.magic, REGION_MAGIC, sizeof(header.magic));
+        header.version = REGION_VERSION;
+        header.layout = layout;
+        header.base = REGION_BASE_ADDRESS;
+        header.state = REGION_CLEAN;
+        header.size = REGION_GROW_SIZE;
+        header.used = REGION_HEADER_SIZE;
+        if (ftruncate(fd, REGION_GROW_SIZE) != 0 || pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+            log_error("Failed to create region: %m\n");
+            close(fd);
+            return -1;
+        }
+    }
+
+    RegionHeader header;
+    if (!*created && read_header(fd, layout, &header) != 0) {
+        close(fd);
+        return -1;
+    }
+    char *checkpoint_path = sibling_path(path, ".ckpt");
+    if (*created || header.state == REGION_CLEAN) {
+        // A crash of this run then goes back to the state it started from
+        int checkpoint = checkpoint_path != NULL ? clone_to(fd, checkpoint_path, 0) : -1;
+        free(checkpoint_path);
+        if (checkpoint < 0) {
+            log_error("Failed to checkpoint region %s: %m\n", path);
+            close(fd);
+            return -1;
+        }
+        close(checkpoint);
+        return fd;
+    }
+
+    // Left dirty: whatever changed since the last checkpoint is lost
+    close(fd);
+    int checkpoint = checkpoint_path != NULL ? open(checkpoint_path, O_RDONLY) : -1;
+    free(checkpoint_path);
+    if (checkpoint < 0) {
+        log_error("Region %s was not closed cleanly and has no checkpoint, remove it to start empty\n", path);
+        return -1;
+    }
+    log_warn("Region %s was not closed cleanly, restoring its last checkpoint\n", path);
+    fd = clone_to(checkpoint, path, 0);
+    close(checkpoint);
+    if (fd < 0 || read_header(fd, layout, &header) != 0 || header.state != REGION_CLEAN) {
+        log_error("Failed to restore the checkpoint of %s\n", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/// Flushes the header page alone.
+static int sync_header(Region *region) {
+    return msync(region->base, REGION_HEADER_SIZE, MS_SYNC);
+}
+
+Region *region_open(const char *path, uint64_t layout, int *created) {
+    Region *region = calloc(1, sizeof(Region));
+    if (!region) return NULL;
+    region->path = strdup(path);
+    region->fd = region->path != NULL ? open_file(path, layout, created) : -1;
+    if (region->fd < 0) {
+        free(region->path);
+        free(region);
+        return NULL;
+    }
+
+    // Keep the whole range the region may grow into, then map the file over its start
+    region->base = (char *)REGION_BASE_ADDRESS;
+    void *reserved = mmap(region->base, REGION_RESERVE_SIZE, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    if (reserved != region->base) {
+        log_error("Failed to reserve the region address range: %m\n");
+        if (reserved != MAP_FAILED) munmap(reserved, REGION_RESERVE_SIZE);
+        close(region->fd);
+        free(region->path);
+        free(region);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(region->fd, &st) != 0 ||
+        mmap(region->base, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, region->fd, 0) ==
+            MAP_FAILED) {
+        log_error("Failed to map region: %m\n");
+        munmap(region->base, REGION_RESERVE_SIZE);
+        close(region->fd);
+        free(region->path);
+        free(region);
+        return NULL;
+    }
+    region->header = (RegionHeader *)region->base;
+
+    region->header->state = REGION_DIRTY;
+    if (sync_header(region) != 0) {
+        log_error("Failed to mark region dirty: %m\n");
+    }
+    return region;
+}
+
+/// Maps fresh memory, with the pages and NUMA policy of the region, over
+/// part of the range reserved for a region in anonymous memory.
+static int commit(Region *region, uint64_t offset, uint64_t length) {
+    char *start = region->base + offset;
+    if (region->pages == PAGES_EXPLICIT) {
+        // Mapped anywhere and then moved over the reserve, as a MAP_FIXED
+        // mapping that fails for want of huge pages may leave a hole in it
+        void *huge = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (huge != MAP_FAILED && mremap(huge, length, length, MREMAP_MAYMOVE | MREMAP_FIXED, start) != MAP_FAILED) {
+            placement_bind(start, length, region->node);
+            return 0;
+        }
+        if (huge != MAP_FAILED) munmap(huge, length);
+        if (!atomic_exchange(&explicit_warned, 1)) {
+            log_warn("No explicit huge pages left (see vm.nr_hugepages), using transparent ones\n");
+        }
+        region->pages = PAGES_TRANSPARENT;
+    }
+
+    if (mmap(start, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        return 1;
+    }
+    if (region->pages == PAGES_TRANSPARENT) {
+        madvise(start, length, MADV_HUGEPAGE); // small pages if the kernel has none
+    }
+    placement_bind(start, length, region->node);
+    return 0;
+}
+
+Region *region_create(PageMode pages, int node) {
+    Region *region = calloc(1, sizeof(Region));
+    if (!region) return NULL;
+    region->fd = -1;
+    region->pages = pages;
+    region->node = node;
+
+    // Keep the whole range the region may grow into, one huge page longer
+    // to align its start on one
+    size_t length = REGION_RESERVE_SIZE + REGION_HUGE_PAGE_SIZE;
+    char *reserved = mmap(NULL, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED) {
+        log_error("Failed to reserve the region address range: %m\n");
+        free(region);
+        return NULL;
+    }
+    region->base = (char *)(((uintptr_t)reserved + REGION_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(REGION_HUGE_PAGE_SIZE - 1));
+    if (region->base > reserved) munmap(reserved, (size_t)(region->base - reserved));
+    munmap(region->base + REGION_RESERVE_SIZE, (size_t)(reserved + length - region->base) - REGION_RESERVE_SIZE);
+
+    if (commit(region, 0, REGION_GROW_SIZE) != 0) {
+        log_error("Failed to map region: %m\n");
+        munmap(region->base, REGION_RESERVE_SIZE);
+        free(region);
+        return NULL;
+    }
+    region->header = (RegionHeader *)region->base;
+    region->header->size = REGION_GROW_SIZE;
+    region->header->used = REGION_HEADER_SIZE;
+    return region;
+}
+
+void *region_root(const Region *region) {
+    return region->header->root != 0 ? region->base + region->header->root : NULL;
+}
+
+void region_set_root(Region *region, void *root) {
+    region->header->root = root != NULL ? (uint64_t)((char *)root - region->base) : 0;
+}
+
+long long region_clock_shift(const Region *region, unsigned long long now) {
+    const RegionHeader *header = region->header;
+    if (header->closed_mono_ms == 0) return 0;
+
+    unsigned long long real_now = clock_ms(CLOCK_REALTIME);
+    long long elapsed = real_now > header->closed_real_ms ? (long long)(real_now - header->closed_real_ms) : 0;
+    return (long long)now - (long long)header->closed_mono_ms - elapsed;
+}
+
+/// Extends the file and its mapping, or the anonymous memory, to at least
+/// end bytes.
+static int grow(Region *region, uint64_t end) {
+    RegionHeader *header = region->header;
+    uint64_t size = header->size * 2;
+    if (size < end) {
+        size = (end + REGION_GROW_SIZE - 1) / REGION_GROW_SIZE * REGION_GROW_SIZE;
+    }
+    if (size > REGION_RESERVE_SIZE) size = REGION_RESERVE_SIZE;
+    if (size < end) return 1;
+
+    int failed;
+    if (region->fd < 0) {
+        failed = commit(region, header->size, size - header->size) != 0;
+    } else {
+        failed = ftruncate(region->fd, (off_t)size) != 0 ||
+                 mmap(region->base + header->size, size - header->size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED, region->fd, (off_t)header->size) == MAP_FAILED;
+    }
+    if (failed) {
+        log_error("Failed to grow region: %m\n");
+        return 1;
+    }
+    header->size = size;
+    return 0;
+}
+
+/// Takes a block of the class of size, reusing a freed one when there is.
+/// @param fresh Set to 1 if the block was never used, so still zeroed.
+static void *take_block(Region *region, size_t size, int *fresh) {
+    RegionHeader *header = region->header;
+    size_t size_class = class_of(size);
+    if (size_class >= REGION_CLASSES) return NULL;
+
+    uint64_t offset = header->free_lists[size_class];
+    if (offset != 0) {
+        RegionBlock *block = (RegionBlock *)(region->base + offset);
+        header->free_lists[size_class] = block->next;
+        *fresh = 0;
+        return block + 1;
+    }
+
+    uint64_t end = header->used + sizeof(RegionBlock) + class_size(size_class);
+    if (end > header->size && grow(region, end) != 0) return NULL;
+    RegionBlock *block = (RegionBlock *)(region->base + header->used);
+    block->size_class = size_class;
+    block->next = 0;
+    header->used = end;
+    *fresh = 1;
+    return block + 1;
+}
+
+void *region_malloc(Region *region, size_t size) {
+    if (region == NULL) return malloc(size);
+    int fresh;
+    return take_block(region, size, &fresh);
+}
+
+void *region_calloc(Region *region, size_t count, size_t size) {
+    if (region == NULL) return calloc(count, size);
+    if (size != 0 && count > SIZE_MAX / size) return NULL;
+
+    int fresh;
+    void *memory = take_block(region, count * size, &fresh);
+    if (memory != NULL && !fresh) {
+        memset(memory, 0, count * size);
+    }
+    return memory;
+}
+
+void region_free(Region *region, void *ptr) {
+    if (region == NULL) {
+        free(ptr);
+        return;
+    }
+    if (ptr == NULL) return;
+
+    RegionBlock *block = (RegionBlock *)ptr - 1;
+    block->next = region->header->free_lists[block->size_class];
+    region->header->free_lists[block->size_class] = (uint64_t)((char *)block - region->base);
+}
+
+int region_checkpoint(Region *region) {
+    RegionHeader *header = region->header;
+    if (region->fd < 0) return -1;
+    if (msync(region->base, header->size, MS_SYNC) != 0) {
+        log_error("Failed to write out region: %m\n");
+        return -1;
+    }
+
+    // Called with the table locked, so only where cloning does not copy the file
+    char *checkpoint_path = sibling_path(region->path, ".ckpt");
+    int fd = checkpoint_path != NULL ? clone_to(region->fd, checkpoint_path, 1) : -1;
+    free(checkpoint_path);
+    if (fd < 0) {
+        log_error("Failed to clone region into a checkpoint, which needs a file system with reflinks: %m\n");
+        return -1;
+    }
+
+    // The copy is consistent, unlike the file it was cloned from
+    RegionHeader clean = *header;
+    clean.state = REGION_CLEAN;
+    clean.closed_mono_ms = clock_ms(CLOCK_MONOTONIC);
+    clean.closed_real_ms = clock_ms(CLOCK_REALTIME);
+    if (pwrite(fd, &clean, sizeof(clean), 0) != (ssize_t)sizeof(clean) || fsync(fd) != 0) {
+        log_error("Failed to checkpoint region: %m\n");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int region_map_checkpoint(Region *region, int fd) {
+    // Sized from the checkpoint, the live header may already have grown
+    struct stat st;
+    void *mapped = MAP_FAILED;
+    if (fstat(fd, &st) == 0) {
+        mapped = mmap(region->base, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    }
+    close(fd);
+    return mapped == MAP_FAILED;
+}
+
+int region_close(Region *region) {
+    RegionHeader *header = region->header;
+    if (region->fd < 0) {
+        munmap(region->base, REGION_RESERVE_SIZE);
+        free(region);
+        return 0;
+    }
+
+    int failed = msync(region->base, header->size, MS_SYNC) != 0;
+    if (!failed) {
+        header->closed_mono_ms = clock_ms(CLOCK_MONOTONIC);
+        header->closed_real_ms = clock_ms(CLOCK_REALTIME);
+        header->state = REGION_CLEAN;
+        failed = sync_header(region) != 0;
+    }
+    if (failed) {
+        log_error("Failed to write out region: %m\n");
+    }
+
+    munmap(region->base, REGION_RESERVE_SIZE);
+    close(region->fd);
+    free(region->path);
+    free(region);
+    return failed;
+}
@@ -0,0 +1,106 @@
+#ifndef KVS_REGION_H
+#define KVS_REGION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "placement.h"
+
+// File backed memory for a table that outlives the process. The file is
+// mapped at the same fixed address by every run, so the pointers the table
+// keeps in it are valid again after a restart. Free blocks are chained by
+// their offset in the file.
+//
+// Crash safety comes from ordering the flushes: a clean region is cloned
+// into a checkpoint at "<path>.ckpt", then its header is marked dirty, and
+// flushed, when it is opened, and marked clean again only once everything
+// else was flushed on close. A region left dirty by a crash is replaced by
+// its last checkpoint when it is opened again, which loses what changed
+// since it was opened or since the last region_checkpoint. The clone only
+// shares the blocks of the file on file systems with reflinks, elsewhere it
+// copies them.
+//
+// A region can also live in private anonymous memory, for a table that is
+// not kept but wants its own pages: huge ones, or ones on given NUMA nodes.
+// Such a region is mapped wherever the kernel finds room, aligned on a huge
+// page, and a forked child gets a copy of it like of the heap.
+typedef struct Region Region;
+
+/// Opens a region, creating it if the file does not exist. A region left
+/// dirty is first restored from its checkpoint, a clean one checkpointed.
+/// @param path File of the region.
+/// @param layout Fingerprint of the structures kept in it, a region written
+///               with another one is refused.
+/// @param created Set to 1 if the region is new and empty, 0 otherwise.
+/// @return The region, NULL if it could not be opened.
+Region *region_open(const char *path, uint64_t layout, int *created);
+
+/// Creates a region in anonymous memory, gone when it is closed.
+/// Explicit huge pages are taken while the pool has some, transparent ones
+/// afterwards. A forked child may lose the explicit huge pages the parent
+/// rewrites once the pool is empty, the kernel keeps them for the parent, so
+/// such a region must not be read by a child.
+/// @param pages Pages backing the region.
+/// @param node NUMA node for its memory, PLACEMENT_INTERLEAVE or
+///             PLACEMENT_ANY_NODE (see placement.h).
+/// @return The region, NULL if it could not be mapped.
+Region *region_create(PageMode pages, int node);
+
+/// Object the region was opened for, set by region_set_root.
+/// @param region Region to read.
+/// @return The root, NULL in a new region.
+void *region_root(const Region *region);
+
+/// Records the object to be found again by region_root after a restart.
+/// @param region Region to change.
+/// @param root Object allocated in the region.
+void region_set_root(Region *region, void *root);
+
+/// Milliseconds to add to monotonic clock deadlines stored before the
+/// region was last closed so that they fall due after as much wall clock
+/// time as they had left.
+/// @param region Region just opened.
+/// @param now Current time of the monotonic clock in milliseconds.
+/// @return The shift, 0 for a new region.
+long long region_clock_shift(const Region *region, unsigned long long now);
+
+/// Allocates memory in a region.
+/// @param region Region to allocate in, NULL for the heap.
+/// @param size Bytes wanted.
+/// @return The memory, NULL on failure.
+void *region_malloc(Region *region, size_t size);
+
+/// Allocates zeroed memory in a region.
+/// @param region Region to allocate in, NULL for the heap.
+/// @param count Number of elements.
+/// @param size Bytes per element.
+/// @return The memory, NULL on failure.
+void *region_calloc(Region *region, size_t count, size_t size);
+
+/// Frees memory allocated by region_malloc or region_calloc.
+/// @param region Region it was allocated in, NULL for the heap.
+/// @param ptr Memory to free, may be NULL.
+void region_free(Region *region, void *ptr);
+
+/// Writes the region out and clones the file, which must not change
+/// meanwhile, into a clean copy at "<path>.ckpt". Fails rather than copy the
+/// file where the file system has no reflinks, so that the caller never
+/// keeps the table locked for as long as a copy takes.
+/// @param region Region to checkpoint.
+/// @return A read-only descriptor of the checkpoint, -1 on failure or for a
+///         region in anonymous memory.
+int region_checkpoint(Region *region);
+
+/// Replaces the mapping of a region by a private one of its checkpoint, so
+/// that a forked child reads a snapshot the parent no longer changes.
+/// @param region Region inherited from the parent.
+/// @param fd Descriptor returned by region_checkpoint, closed by the call.
+/// @return 0 on success, 1 otherwise.
+int region_map_checkpoint(Region *region, int fd);
+
+/// Writes the region out, marks it clean and unmaps it. A region in
+/// anonymous memory is only unmapped.
+/// @param region Region to close, freed by the call.
+/// @return 0 on success, 1 if it could not be written out.
+int region_close(Region *region);
+
+#endif  // KVS_REGION_H
@@ -0,0 +1,611 @@
+#include "replica.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "constants.h"
+#include "logger.h"
+#include "operations.h"
+#include "trace.h"
+
+#define VARINT_MAX_SIZE 10
+
+// Records logged and not shipped yet, or being shipped
+typedef struct LogBuffer {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+    uint32_t records;
+    uint64_t oldest_ns;     // when its first record was logged
+} LogBuffer;
+
+typedef enum { ROLE_NONE, ROLE_PRIMARY, ROLE_REPLICA } Role;
+
+static Role role = ROLE_NONE;
+
+// Primary: the log and the connections of the replicas
+static atomic_int logging;
+static int *replica_fds = NULL;
+static size_t replica_total = 0;
+static LogBuffer pending;   // filled by the writers under log_mutex
+static LogBuffer sending;   // owned by the sender thread between frames
+static int stopping = 0;
+static int broken = 0;      // a record was lost, the replicas are cut off
+static pthread_t sender_thread;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sender_cond = PTHREAD_COND_INITIALIZER;
+static size_t shipped_frames = 0, shipped_records = 0, shipped_bytes = 0;
+static size_t replicas_left = 0; // replicas that got the whole stream
+
+// Replica: the connection to the primary and what was applied from it
+static int primary_fd = -1;
+static uint64_t staleness_ns = 0;
+static pthread_t apply_thread;
+static uint64_t applied_ns = 0; // sent time of the last frame applied, UINT64_MAX once the stream ended
+static int leaving = 0;
+static pthread_mutex_t fresh_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fresh_cond = PTHREAD_COND_INITIALIZER;
+static size_t applied_frames = 0, applied_records = 0, applied_bytes = 0, stale_reads = 0;
+static uint64_t apply_total_ns = 0, lag_total_ns = 0, lag_max_ns = 0;
+static size_t lag_frames = 0;
+
+static void store_le(unsigned char *data, uint64_t value, int size) {
+    for (int i = 0; i < size; i++) {
+        data[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static uint64_t load_le(const unsigned char *data, int size) {
+    uint64_t value = 0;
+    for (int i = 0; i < size; i++) {
+        value |= (uint64_t)data[i] << (8 * i);
+    }
+    return value;
+}
+
+static int make_address(const char *path, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        log_error("Socket path is too long: %s\n", path);
+        return 1;
+    }
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+/// Sends everything, failing once the deadline passed. Each send returns
+/// after REPLICA_SEND_TIMEOUT_MS on a socket that stopped draining.
+static int send_all(int fd, const unsigned char *data, size_t length, uint64_t deadline_ns) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR && trace_clock_ns() < deadline_ns) continue;
+        if (sent <= 0 || (length > (size_t)sent && trace_clock_ns() >= deadline_ns)) return 1;
+        data += sent;
+        length -= (size_t)sent;
+    }
+    return 0;
+}
+
+static int read_all(int fd, unsigned char *data, size_t length) {
+    while (length > 0) {
+        ssize_t got = read(fd, data, length);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return 1;
+        data += got;
+        length -= (size_t)got;
+    }
+    return 0;
+}
+
+// ---- Primary ----
+
+static int reserve(LogBuffer *buffer, size_t length) {
+    if (buffer->len + length <= buffer->cap) return 0;
+    size_t cap = buffer->cap ? buffer->cap : REPLICA_FRAME_SIZE;
+    while (buffer->len + length > cap) {
+        cap *= 2;
+    }
+    unsigned char *grown = realloc(buffer->data, cap);
+    if (!grown) return 1;
+    buffer->data = grown;
+    buffer->cap = cap;
+    return 0;
+}
+
+static void put_varint(LogBuffer *buffer, uint64_t value) {
+    while (value >= 0x80) {
+        buffer->data[buffer->len++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    buffer->data[buffer->len++] = (unsigned char)value;
+}
+
+static void put_string(LogBuffer *buffer, const char *data, size_t length) {
+    put_varint(buffer, length);
+    memcpy(buffer->data + buffer->len, data, length);
+    buffer->len += length;
+    buffer->data[buffer->len++] = '\0';
+}
+
+/// Appends a record to the log. Called under the lock of the table, so it
+/// never waits for the sender: the replicas are cut off instead once it is
+/// REPLICA_MAX_PENDING bytes behind.
+static void append_record(ReplicaOp op, const KvsString *key, const char *value, size_t value_len,
+                          unsigned long writes, unsigned long long expires_at) {
+    pthread_mutex_lock(&log_mutex);
+    if (broken) {
+        pthread_mutex_unlock(&log_mutex);
+        return;
+    }
+    if (pending.len >= REPLICA_MAX_PENDING) {
+        log_error("The replicas fell %d bytes behind, cutting them off\n", REPLICA_MAX_PENDING);
+        broken = 1;
+        atomic_store(&logging, 0);
+        pthread_cond_signal(&sender_cond);
+        pthread_mutex_unlock(&log_mutex);
+        return;
+    }
+    if (reserve(&pending, 1 + key->len + value_len + 2 + 4 * VARINT_MAX_SIZE) != 0) {
+        log_error("Failed to log a change for the replicas: %m\n");
+        broken = 1;
+        atomic_store(&logging, 0);
+        pthread_cond_signal(&sender_cond);
+        pthread_mutex_unlock(&log_mutex);
+        return;
+    }
+
+    if (pending.records == 0) {
+        pending.oldest_ns = trace_clock_ns();
+    }
+    pending.data[pending.len++] = (unsigned char)op;
+    put_string(&pending, key->data, key->len);
+    switch (op) {
+        case REPLICA_PUT:
+            put_string(&pending, value, value_len);
+            put_varint(&pending, writes);
+            put_varint(&pending, expires_at);
+            break;
+        case REPLICA_EXPIRE:
+            put_varint(&pending, expires_at);
+            break;
+        case REPLICA_DELETE:
+            break;
+    }
+    pending.records++;
+
+    if (pending.len >= REPLICA_FRAME_SIZE) {
+        pthread_cond_signal(&sender_cond);
+    }
+    pthread_mutex_unlock(&log_mutex);
+}
+
+int replica_logging(void) {
+    return atomic_load_explicit(&logging, memory_order_relaxed);
+}
+
+void replica_log_put(const KvsString *key, const char *value, size_t value_len, unsigned long writes,
+                     unsigned long long expires_at) {
+    if (!replica_logging()) return;
+    append_record(REPLICA_PUT, key, value, value_len, writes, expires_at);
+}
+
+void replica_log_delete(const KvsString *key) {
+    if (!replica_logging()) return;
+    append_record(REPLICA_DELETE, key, NULL, 0, 0, 0);
+}
+
+void replica_log_expire(const KvsString *key, unsigned long long expires_at) {
+    if (!replica_logging()) return;
+    append_record(REPLICA_EXPIRE, key, NULL, 0, 0, expires_at);
+}
+
+/// Sends a frame to every replica still connected, dropping the ones that
+/// went away or did not take it within REPLICA_SEND_TIMEOUT_MS.
+static void ship_frame(ReplicaFrameType type, const LogBuffer *frame, uint64_t sent_ns) {
+    unsigned char header[REPLICA_FRAME_HEADER_SIZE];
+    header[0] = (unsigned char)type;
+    store_le(header + 1, frame->records, 4);
+    store_le(header + 5, frame->len, 4);
+    store_le(header + 9, sent_ns, 8);
+    store_le(header + 17, frame->records > 0 ? frame->oldest_ns : 0, 8);
+
+    for (size_t i = 0; i < replica_total; i++) {
+        if (replica_fds[i] == -1) continue;
+        uint64_t deadline_ns = trace_clock_ns() + REPLICA_SEND_TIMEOUT_MS * 1000000ULL;
+        if (send_all(replica_fds[i], header, sizeof(header), deadline_ns) != 0 ||
+            send_all(replica_fds[i], frame->data, frame->len, deadline_ns) != 0) {
+            log_warn("Replica %zu disconnected or stalled, dropping it\n", i + 1);
+            close(replica_fds[i]);
+            replica_fds[i] = -1;
+        }
+    }
+    shipped_frames++;
+    shipped_records += frame->records;
+    shipped_bytes += sizeof(header) + frame->len;
+}
+
+static void *sender_mission(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&log_mutex);
+    for (;;) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += REPLICA_FLUSH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!stopping && !broken && pending.len < REPLICA_FRAME_SIZE) {
+            if (pthread_cond_timedwait(&sender_cond, &log_mutex, &deadline) == ETIMEDOUT) break;
+        }
+
+        // Every change committed before sent_ns is in the frame
+        LogBuffer frame = pending;
+        pending = sending;
+        pending.len = 0;
+        pending.records = 0;
+        uint64_t sent_ns = trace_clock_ns();
+        int last = stopping || broken, cut_off = broken;
+        pthread_mutex_unlock(&log_mutex);
+
+        ship_frame(REPLICA_FRAME_RECORDS, &frame, sent_ns);
+        if (last) {
+            // A replica that lost records must see the stream break, not end
+            if (!cut_off) {
+                LogBuffer end = {0};
+                ship_frame(REPLICA_FRAME_END, &end, trace_clock_ns());
+            }
+            for (size_t i = 0; i < replica_total; i++) {
+                if (replica_fds[i] == -1) continue;
+                if (!cut_off) replicas_left++;
+                close(replica_fds[i]);
+                replica_fds[i] = -1;
+            }
+            pthread_mutex_lock(&log_mutex);
+            sending = frame;
+            break;
+        }
+
+        pthread_mutex_lock(&log_mutex);
+        sending = frame; // its buffer is reused for the next frame
+    }
+    pthread_mutex_unlock(&log_mutex);
+    return NULL;
+}
+
+int replica_serve(const char *path, size_t replicas) {
+    struct sockaddr_un address;
+    if (make_address(path, &address) != 0) {
+        return 1;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        log_error("Failed to create the replication socket: %m\n");
+        return 1;
+    }
+    unlink(path); // left over by an earlier run
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listen_fd, (int)replicas) != 0) {
+        log_error("Failed to listen on %s: %m\n", path);
+        close(listen_fd);
+        return 1;
+    }
+
+    replica_fds = calloc(replicas, sizeof(int));
+    if (!replica_fds) {
+        log_error("Failed to allocate the replicas: %m\n");
+        close(listen_fd);
+        unlink(path);
+        return 1;
+    }
+
+    // Replicas only join before the first change, which they all receive
+    log_info("Waiting for %zu replicas on %s\n", replicas, path);
+    unsigned char header[REPLICA_HEADER_SIZE];
+    memcpy(header, REPLICA_MAGIC, 4);
+    store_le(header + 4, REPLICA_VERSION, 4);
+    int failed = 0;
+    for (replica_total = 0; replica_total < replicas && !failed;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR) continue;
+            log_error("Failed to accept a replica: %m\n");
+            failed = 1;
+            break;
+        }
+        replica_fds[replica_total++] = fd;
+        struct timeval timeout = {REPLICA_SEND_TIMEOUT_MS / 1000, (REPLICA_SEND_TIMEOUT_MS % 1000) * 1000};
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0 ||
+            send_all(fd, header, sizeof(header), trace_clock_ns() + REPLICA_SEND_TIMEOUT_MS * 1000000ULL) != 0) {
+            log_error("Failed to greet a replica: %m\n");
+            failed = 1;
+        }
+    }
+    close(listen_fd);
+    unlink(path);
+
+    stopping = 0;
+    broken = 0;
+    if (!failed && pthread_create(&sender_thread, NULL, sender_mission, NULL) != 0) {
+        log_error("Failed to create the replication thread: %m\n");
+        failed = 1;
+    }
+    if (failed) {
+        for (size_t i = 0; i < replica_total; i++) {
+            close(replica_fds[i]);
+        }
+        free(replica_fds);
+        replica_fds = NULL;
+        replica_total = 0;
+        return 1;
+    }
+
+    role = ROLE_PRIMARY;
+    atomic_store(&logging, 1);
+    return 0;
+}
+
+// ---- Replica ----
+
+static int get_varint(unsigned char **cursor, const unsigned char *end, uint64_t *value) {
+    uint64_t result = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7) {
+        if (*cursor == end) return 1;
+        unsigned char byte = *(*cursor)++;
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            *value = result;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int get_string(unsigned char **cursor, const unsigned char *end, KvsString *string) {
+    uint64_t length;
+    if (get_varint(cursor, end, &length) != 0) return 1;
+    if ((uint64_t)(end - *cursor) <= length || (*cursor)[length] != '\0') return 1;
+    string->data = (char *)*cursor;
+    string->len = (size_t)length;
+    string->cap = 0; // the frame owns the bytes
+    *cursor += length + 1;
+    return 0;
+}
+
+/// Decodes the records of a frame, which keep pointing into it.
+static int decode_frame(unsigned char *data, size_t length, ReplicaRecord records[], size_t count) {
+    unsigned char *cursor = data;
+    const unsigned char *end = data + length;
+    for (size_t i = 0; i < count; i++) {
+        ReplicaRecord *record = &records[i];
+        if (cursor == end) return 1;
+        unsigned char op = *cursor++;
+        if (get_string(&cursor, end, &record->key) != 0) return 1;
+
+        uint64_t writes = 0, expires_at = 0;
+        switch (op) {
+            case REPLICA_PUT:
+                if (get_string(&cursor, end, &record->value) != 0 || get_varint(&cursor, end, &writes) != 0 ||
+                    get_varint(&cursor, end, &expires_at) != 0 || writes == 0) {
+                    return 1;
+                }
+                break;
+            case REPLICA_EXPIRE:
+                if (get_varint(&cursor, end, &expires_at) != 0) return 1;
+                break;
+            case REPLICA_DELETE:
+                break;
+            default:
+                return 1;
+        }
+        record->op = (ReplicaOp)op;
+        record->writes = (unsigned long)writes;
+        record->expires_at = expires_at;
+    }
+    return cursor == end ? 0 : 1;
+}
+
+static void *apply_mission(void *arg) {
+    (void)arg;
+    unsigned char *payload = NULL;
+    size_t payload_cap = 0;
+    ReplicaRecord *records = NULL;
+    size_t records_cap = 0;
+    int ended = 0;
+
+    unsigned char header[REPLICA_FRAME_HEADER_SIZE];
+    while (read_all(primary_fd, header, sizeof(header)) == 0) {
+        if (header[0] == REPLICA_FRAME_END) {
+            ended = 1;
+            break;
+        }
+        size_t count = (size_t)load_le(header + 1, 4), bytes = (size_t)load_le(header + 5, 4);
+        uint64_t sent_ns = load_le(header + 9, 8), oldest_ns = load_le(header + 17, 8);
+
+        if (bytes > payload_cap) {
+            unsigned char *grown = realloc(payload, bytes);
+            if (!grown) {
+                log_error("Failed to allocate a frame of the primary: %m\n");
+                break;
+            }
+            payload = grown;
+            payload_cap = bytes;
+        }
+        if (count > records_cap) {
+            ReplicaRecord *grown = realloc(records, count * sizeof(ReplicaRecord));
+            if (!grown) {
+                log_error("Failed to allocate a frame of the primary: %m\n");
+                break;
+            }
+            records = grown;
+            records_cap = count;
+        }
+        if (read_all(primary_fd, payload, bytes) != 0) break;
+        if (header[0] != REPLICA_FRAME_RECORDS || decode_frame(payload, bytes, records, count) != 0) {
+            log_error("Invalid frame from the primary\n");
+            break;
+        }
+
+        uint64_t start_ns = trace_clock_ns();
+        if (count > 0 && kvs_replicate(records, count) != 0) {
+            log_error("Failed to apply the changes of the primary\n");
+            break;
+        }
+        uint64_t done_ns = trace_clock_ns();
+
+        pthread_mutex_lock(&fresh_mutex);
+        applied_frames++;
+        applied_records += count;
+        applied_bytes += sizeof(header) + bytes;
+        apply_total_ns += done_ns - start_ns;
+        if (count > 0) {
+            uint64_t lag = done_ns > oldest_ns ? done_ns - oldest_ns : 0;
+            lag_total_ns += lag;
+            if (lag > lag_max_ns) lag_max_ns = lag;
+            lag_frames++;
+        }
+        applied_ns = sent_ns;
+        pthread_cond_broadcast(&fresh_cond);
+        pthread_mutex_unlock(&fresh_mutex);
+    }
+
+    // Nothing more will come, readers stop waiting for it
+    pthread_mutex_lock(&fresh_mutex);
+    if (!ended && !leaving) {
+        log_warn("Lost the primary, reads see the changes applied so far\n");
+    }
+    applied_ns = UINT64_MAX;
+    pthread_cond_broadcast(&fresh_cond);
+    pthread_mutex_unlock(&fresh_mutex);
+
+    free(payload);
+    free(records);
+    return NULL;
+}
+
+int replica_follow(const char *path, unsigned long max_staleness_ms) {
+    struct sockaddr_un address;
+    if (make_address(path, &address) != 0) {
+        return 1;
+    }
+
+    // The primary may not be listening yet
+    uint64_t give_up_ns = trace_clock_ns() + REPLICA_CONNECT_TIMEOUT_MS * 1000000ULL;
+    for (;;) {
+        primary_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (primary_fd == -1) {
+            log_error("Failed to create the replication socket: %m\n");
+            return 1;
+        }
+        if (connect(primary_fd, (struct sockaddr *)&address, sizeof(address)) == 0) break;
+
+        int error = errno;
+        close(primary_fd);
+        primary_fd = -1;
+        if ((error != ENOENT && error != ECONNREFUSED) || trace_clock_ns() >= give_up_ns) {
+            errno = error;
+            log_error("Failed to connect to the primary on %s: %m\n", path);
+            return 1;
+        }
+        struct timespec retry = {0, REPLICA_CONNECT_RETRY_MS * 1000000L};
+        nanosleep(&retry, NULL);
+    }
+
+    unsigned char header[REPLICA_HEADER_SIZE];
+    if (read_all(primary_fd, header, sizeof(header)) != 0 || memcmp(header, REPLICA_MAGIC, 4) != 0 ||
+        load_le(header + 4, 4) != REPLICA_VERSION) {
+        log_error("Not a primary on %s\n", path);
+        close(primary_fd);
+        primary_fd = -1;
+        return 1;
+    }
+
+    staleness_ns = (uint64_t)max_staleness_ms * 1000000ULL;
+    applied_ns = 0;
+    leaving = 0;
+    role = ROLE_REPLICA;
+    if (pthread_create(&apply_thread, NULL, apply_mission, NULL) != 0) {
+        log_error("Failed to create the replication thread: %m\n");
+        role = ROLE_NONE;
+        close(primary_fd);
+        primary_fd = -1;
+        return 1;
+    }
+    return 0;
+}
+
+int replica_following(void) {
+    return role == ROLE_REPLICA;
+}
+
+void replica_wait_fresh(void) {
+    if (role != ROLE_REPLICA) return;
+
+    uint64_t now = trace_clock_ns();
+    uint64_t target = now > staleness_ns ? now - staleness_ns : 0;
+    pthread_mutex_lock(&fresh_mutex);
+    if (applied_ns < target) {
+        stale_reads++;
+        while (applied_ns < target) {
+            pthread_cond_wait(&fresh_cond, &fresh_mutex);
+        }
+    }
+    pthread_mutex_unlock(&fresh_mutex);
+}
+
+void replica_stop(void) {
+    if (role == ROLE_PRIMARY) {
+        pthread_mutex_lock(&log_mutex);
+        stopping = 1;
+        pthread_cond_signal(&sender_cond);
+        pthread_mutex_unlock(&log_mutex);
+        pthread_join(sender_thread, NULL);
+        atomic_store(&logging, 0);
+
+        free(replica_fds);
+        replica_fds = NULL;
+        free(pending.data);
+        free(sending.data);
+        pending = (LogBuffer){0};
+        sending = (LogBuffer){0};
+    } else if (role == ROLE_REPLICA) {
+        pthread_mutex_lock(&fresh_mutex);
+        leaving = 1;
+        pthread_mutex_unlock(&fresh_mutex);
+        shutdown(primary_fd, SHUT_RDWR); // wakes the apply thread
+        pthread_join(apply_thread, NULL);
+        close(primary_fd);
+        primary_fd = -1;
+    }
+}
+
+void replica_report_metrics(int fd) {
+    if (role == ROLE_PRIMARY) {
+        dprintf(fd, "replication_replicas %zu\n", replicas_left);
+        dprintf(fd, "replication_frames %zu\n", shipped_frames);
+        dprintf(fd, "replication_records %zu\n", shipped_records);
+        dprintf(fd, "replication_bytes %zu\n", shipped_bytes);
+    } else if (role == ROLE_REPLICA) {
+        pthread_mutex_lock(&fresh_mutex);
+        dprintf(fd, "replica_frames %zu\n", applied_frames);
+        dprintf(fd, "replica_records %zu\n", applied_records);
+        dprintf(fd, "replica_bytes %zu\n", applied_bytes);
+        dprintf(fd, "replica_apply_records_per_sec %.0f\n",
+                apply_total_ns > 0 ? (double)applied_records * 1e9 / (double)apply_total_ns : 0.0);
+        dprintf(fd, "replica_lag_avg_us %llu\n",
+                lag_frames > 0 ? (unsigned long long)(lag_total_ns / lag_frames / 1000) : 0ULL);
+        dprintf(fd, "replica_lag_max_us %llu\n", (unsigned long long)(lag_max_ns / 1000));
+        dprintf(fd, "replica_stale_reads %zu\n", stale_reads);
+        pthread_mutex_unlock(&fresh_mutex);
+    }
+}
@@ -0,0 +1,106 @@
+#ifndef KVS_REPLICA_H
+#define KVS_REPLICA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kvs.h"
+
+// Read replicas fed by the log of a primary over a Unix socket. The primary
+// appends what each change left in its table to the log, under the lock of
+// the table, and a sender thread ships the log to every replica as a frame
+// every REPLICA_FLUSH_INTERVAL_MS, empty frames included:
+//
+//   header  "KVSR" | u32 version
+//   frame   u8 type | u32 records | u32 bytes | u64 sent ns | u64 oldest ns |
+//           records
+//   record  u8 op | key | PUT: value, writes, expires at; EXPIRE: expires at
+//
+// Strings are a varint length, the bytes and a NUL, numbers are LEB128
+// varints and the rest little endian. Times are CLOCK_MONOTONIC, which the
+// processes of one machine share: a frame sent at t holds every change
+// committed before t, and TTL deadlines are absolute milliseconds. A replica
+// applies each frame as one batch and serves reads no staler than its bound.
+// Writers never wait for the replicas: one that does not take a frame within
+// REPLICA_SEND_TIMEOUT_MS is dropped.
+
+#define REPLICA_MAGIC "KVSR"
+#define REPLICA_VERSION 1
+#define REPLICA_HEADER_SIZE 8
+#define REPLICA_FRAME_HEADER_SIZE 25
+
+typedef enum {
+    REPLICA_FRAME_RECORDS,
+    REPLICA_FRAME_END,     // the primary stopped, nothing follows
+} ReplicaFrameType;
+
+typedef enum {
+    REPLICA_PUT,           // the key holds a value, bumped by writes versions
+    REPLICA_DELETE,
+    REPLICA_EXPIRE,        // the key's TTL changed
+} ReplicaOp;
+
+/// Change of one key, decoded from a frame.
+typedef struct ReplicaRecord {
+    ReplicaOp op;
+    KvsString key;         // points into the frame
+    KvsString value;       // PUT
+    unsigned long writes;  // PUT
+    unsigned long long expires_at; // PUT and EXPIRE: deadline in ms, 0 for none
+} ReplicaRecord;
+
+/// Listens on a Unix socket and waits for replicas to connect, then starts
+/// shipping the changes made to the KVS.
+/// @param path Path of the socket, replaced if it exists.
+/// @param replicas Number of replicas to wait for.
+/// @return 0 on success, 1 otherwise.
+int replica_serve(const char *path, size_t replicas);
+
+/// Checks whether changes are being shipped, for callers that would
+/// otherwise build records for nothing.
+int replica_logging(void);
+
+/// Logs that a key holds a value.
+/// @param key Key written.
+/// @param value Value stored.
+/// @param value_len Length of the value.
+/// @param writes Versions the write bumped, the version of a new key.
+/// @param expires_at Deadline of its TTL in ms, 0 for none.
+void replica_log_put(const KvsString *key, const char *value, size_t value_len, unsigned long writes,
+                     unsigned long long expires_at);
+
+/// Logs that a key was deleted.
+/// @param key Key deleted.
+void replica_log_delete(const KvsString *key);
+
+/// Logs that the TTL of a key changed.
+/// @param key Key expired.
+/// @param expires_at New deadline in ms, 0 for none.
+void replica_log_expire(const KvsString *key, unsigned long long expires_at);
+
+/// Connects to a primary and applies its changes to the KVS on a thread of
+/// its own, retrying the connection for REPLICA_CONNECT_TIMEOUT_MS. The KVS
+/// becomes read only.
+/// @param path Path of the primary's socket.
+/// @param max_staleness_ms Age of the newest change reads may miss.
+/// @return 0 on success, 1 otherwise.
+int replica_follow(const char *path, unsigned long max_staleness_ms);
+
+/// Checks whether the KVS follows a primary.
+int replica_following(void);
+
+/// Waits until every change the primary committed more than the staleness
+/// bound ago is applied. Returns at once on a primary, and once the primary
+/// stopped or was lost.
+void replica_wait_fresh(void);
+
+/// Ships the changes logged so far, ends the stream and closes the replicas
+/// on a primary; stops following on a replica.
+void replica_stop(void);
+
+/// Writes the records shipped, or the records applied with the replication
+/// lag and apply rate, as "name value" lines. Writes nothing unless serving
+/// or following.
+/// @param fd File descriptor to write to.
+void replica_report_metrics(int fd);
+
+#endif  // KVS_REPLICA_H
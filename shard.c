@@ -0,0 +1,482 @@
+#define _GNU_SOURCE // sched_setaffinity
+#include "shard.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "constants.h"
+#include "logger.h"
+
+typedef struct ShardMessage {
+    ShardTask task;
+    void *context;
+    const size_t *indices;      // keys of the batch owned by the shard
+    size_t count;
+    atomic_size_t *pending;     // shards still working on the batch
+} ShardMessage;
+
+// Single producer single consumer ring from one worker thread to one shard
+typedef struct Ring {
+    _Alignas(64) atomic_size_t head; // next slot to consume
+    _Alignas(64) atomic_size_t tail; // next slot to produce
+    ShardMessage slots[SHARD_RING_SIZE];
+} Ring;
+
+typedef struct Shard {
+    pthread_t thread;
+    size_t id;
+    int node;                   // NUMA node its thread runs on, -1 for any
+    atomic_int sleeping;
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeup;
+} Shard;
+
+static Shard *shards = NULL;
+static HashTable **tables = NULL;
+static size_t shard_total = 0;
+static int pin_threads = 0;
+static atomic_int running;
+
+// rings[p][s] carries the messages of producer p to shard s. Row 0 is shared
+// by the threads that found no row free, one batch at a time; the others
+// belong to one thread each until it exits.
+static Ring *rings[SHARD_MAX_PRODUCERS];
+static int row_taken[SHARD_MAX_PRODUCERS];
+static atomic_size_t producer_total;
+static pthread_mutex_t producer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t shared_row_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t producer_key;
+static pthread_once_t producer_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local Ring *my_rings = NULL;
+
+// Stop-the-world pause used by SHOW, BACKUP and metrics
+static pthread_mutex_t pause_owner = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pause_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pause_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int pause_requested;
+static size_t paused = 0;
+// Batches being dispatched, which a pause lets finish so that it never sees
+// part of one. No batch starts while dispatch_closed is set.
+static atomic_size_t dispatching;
+static atomic_int dispatch_closed;
+
+/// Shard owning a key: FNV-1a over the whole key, independent of the
+/// first-letter bucket hash used inside each table.
+static size_t shard_of(const KvsString *key) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < key->len; i++) {
+        h ^= (unsigned char)key->data[i];
+        h *= 1099511628211ULL;
+    }
+    return (size_t)(h % shard_total);
+}
+
+static int ring_pop(Ring *ring, ShardMessage *message) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&ring->tail, memory_order_acquire)) {
+        return 0;
+    }
+    *message = ring->slots[head & (SHARD_RING_SIZE - 1)];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 1;
+}
+
+static void ring_push(Ring *ring, const ShardMessage *message) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == SHARD_RING_SIZE) {
+        sched_yield(); // full, the shard is behind
+    }
+    ring->slots[tail & (SHARD_RING_SIZE - 1)] = *message;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+static int has_work(const Shard *shard) {
+    size_t producers = atomic_load_explicit(&producer_total, memory_order_acquire);
+    for (size_t p = 0; p < producers; p++) {
+        Ring *ring = &rings[p][shard->id];
+        if (atomic_load_explicit(&ring->head, memory_order_relaxed) !=
+            atomic_load_explicit(&ring->tail, memory_order_acquire)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/// Runs every message waiting in the shard's rings.
+/// @return 1 if any work was done, 0 otherwise.
+static int drain(Shard *shard) {
+    HashTable *table = tables[shard->id];
+    size_t producers = atomic_load_explicit(&producer_total, memory_order_acquire);
+    int worked = 0;
+
+    for (size_t p = 0; p < producers; p++) {
+        ShardMessage message;
+        while (ring_pop(&rings[p][shard->id], &message)) {
+            for (size_t i = 0; i < message.count; i++) {
+                message.task(table, message.context, message.indices[i]);
+            }
+            atomic_fetch_sub_explicit(message.pending, 1, memory_order_release);
+            worked = 1;
+        }
+    }
+    return worked;
+}
+
+static void park(void) {
+    pthread_mutex_lock(&pause_mutex);
+    paused++;
+    pthread_cond_broadcast(&pause_cond);
+    while (atomic_load(&pause_requested)) {
+        pthread_cond_wait(&pause_cond, &pause_mutex);
+    }
+    paused--;
+    pthread_mutex_unlock(&pause_mutex);
+}
+
+static void wake(Shard *shard) {
+    pthread_mutex_lock(&shard->mutex);
+    pthread_cond_signal(&shard->wakeup);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+// Sleeps until a producer signals or the reaping interval elapses.
+static void sleep_until_work(Shard *shard) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += REAPER_INTERVAL_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&shard->mutex);
+    atomic_store(&shard->sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!has_work(shard) && !atomic_load(&pause_requested) && atomic_load(&running)) {
+        pthread_cond_timedwait(&shard->wakeup, &shard->mutex, &deadline);
+    }
+    atomic_store(&shard->sleeping, 0);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+static void *shard_mission(void *arg) {
+    Shard *shard = arg;
+
+    if (shard->node >= 0) {
+        placement_pin(shard->node);
+    } else if (pin_threads) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET((size_t)shard->id % (size_t)(cpus > 0 ? cpus : 1), &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            log_error("Failed to pin shard thread: %m\n");
+        }
+    }
+
+    int idle = 0;
+    while (atomic_load(&running)) {
+        if (atomic_load(&pause_requested)) {
+            park();
+            continue;
+        }
+
+        if (drain(shard)) {
+            idle = 0;
+            continue;
+        }
+
+        if (++idle < SHARD_IDLE_SPINS) {
+            sched_yield();
+            continue;
+        }
+
+        // Idle: expire keys and finish a resize of the index in small
+        // batches, then sleep
+        if (reap_expired(tables[shard->id], REAPER_BATCH_SIZE) == 0 &&
+            migrate_index(tables[shard->id], INDEX_IDLE_STEP) == 0) {
+            sleep_until_work(shard);
+        }
+    }
+    return NULL;
+}
+
+static Ring *new_row(void) {
+    Ring *row = aligned_alloc(_Alignof(Ring), shard_total * sizeof(Ring));
+    if (!row) return NULL;
+    for (size_t s = 0; s < shard_total; s++) {
+        atomic_init(&row[s].head, 0);
+        atomic_init(&row[s].tail, 0);
+    }
+    return row;
+}
+
+int shards_start(size_t count, int pin, PageMode pages, NumaMode numa) {
+    shards = calloc(count, sizeof(Shard));
+    tables = calloc(count, sizeof(HashTable *));
+    if (!shards || !tables) {
+        free(shards);
+        free(tables);
+        return 1;
+    }
+
+    shard_total = count;
+    rings[0] = new_row();
+    if (rings[0] == NULL) {
+        free(shards);
+        free(tables);
+        shards = NULL;
+        tables = NULL;
+        shard_total = 0;
+        return 1;
+    }
+    atomic_store(&producer_total, 1);
+    pin_threads = pin;
+    atomic_store(&running, 1);
+    for (size_t i = 0; i < count; i++) {
+        shards[i].node = placement_node_of(numa, i);
+        tables[i] = pages != PAGES_SMALL || numa != NUMA_OFF ? create_placed_table(pages, shards[i].node)
+                                                             : create_hash_table();
+        if (shards[i].node < 0 || placement_nodes() < 2) shards[i].node = PLACEMENT_ANY_NODE;
+        if (tables[i] == NULL) {
+            while (i-- > 0) {
+                free_table(tables[i]);
+            }
+            free(rings[0]);
+            rings[0] = NULL;
+            atomic_store(&producer_total, 0);
+            free(shards);
+            free(tables);
+            shards = NULL;
+            tables = NULL;
+            shard_total = 0;
+            return 1;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        shards[i].id = i;
+        pthread_mutex_init(&shards[i].mutex, NULL);
+        pthread_cond_init(&shards[i].wakeup, NULL);
+        if (pthread_create(&shards[i].thread, NULL, shard_mission, &shards[i]) != 0) {
+            log_error("Failed to create shard thread: %m\n");
+            for (size_t j = i; j < count; j++) {
+                free_table(tables[j]);
+                tables[j] = NULL;
+            }
+            shard_total = i;
+            shards_stop();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void shards_stop(void) {
+    atomic_store(&running, 0);
+    for (size_t i = 0; i < shard_total; i++) {
+        wake(&shards[i]);
+        pthread_join(shards[i].thread, NULL);
+        pthread_mutex_destroy(&shards[i].mutex);
+        pthread_cond_destroy(&shards[i].wakeup);
+    }
+    for (size_t i = 0; tables != NULL && i < shard_total; i++) {
+        if (tables[i] != NULL) {
+            free_table(tables[i]);
+        }
+    }
+
+    size_t producers = atomic_load(&producer_total);
+    pthread_mutex_lock(&producer_mutex);
+    for (size_t p = 0; p < producers; p++) {
+        free(rings[p]);
+        rings[p] = NULL;
+        row_taken[p] = 0;
+    }
+    pthread_mutex_unlock(&producer_mutex);
+    atomic_store(&producer_total, 0);
+
+    free(shards);
+    free(tables);
+    shards = NULL;
+    tables = NULL;
+    shard_total = 0;
+}
+
+size_t shards_count(void) {
+    return shard_total;
+}
+
+// Frees the row of an exiting thread for the next one. Its rings are empty:
+// shards_run only returns once the shards consumed its messages.
+static void release_producer(void *row) {
+    pthread_mutex_lock(&producer_mutex);
+    size_t producers = atomic_load(&producer_total);
+    for (size_t p = 1; p < producers; p++) {
+        if (rings[p] == row) row_taken[p] = 0;
+    }
+    pthread_mutex_unlock(&producer_mutex);
+}
+
+static void create_producer_key(void) {
+    pthread_key_create(&producer_key, release_producer);
+}
+
+// Gives the calling thread its own row of rings, one per shard, reusing the
+// row of a thread that exited when there is one.
+static int register_producer(void) {
+    pthread_once(&producer_key_once, create_producer_key);
+
+    pthread_mutex_lock(&producer_mutex);
+    size_t producers = atomic_load(&producer_total);
+    size_t id = 1;
+    while (id < producers && row_taken[id]) id++;
+    if (id == SHARD_MAX_PRODUCERS) {
+        pthread_mutex_unlock(&producer_mutex);
+        return 1;
+    }
+
+    if (id == producers) {
+        rings[id] = new_row();
+        if (rings[id] == NULL) {
+            pthread_mutex_unlock(&producer_mutex);
+            return 1;
+        }
+        atomic_store_explicit(&producer_total, id + 1, memory_order_release);
+    }
+    row_taken[id] = 1;
+    my_rings = rings[id];
+    pthread_setspecific(producer_key, my_rings);
+    pthread_mutex_unlock(&producer_mutex);
+    return 0;
+}
+
+/// Counts the calling thread in the batches being dispatched, after waiting
+/// out a pause.
+static void enter_dispatch(void) {
+    for (;;) {
+        atomic_fetch_add(&dispatching, 1);
+        if (!atomic_load(&dispatch_closed)) return;
+
+        atomic_fetch_sub(&dispatching, 1);
+        pthread_mutex_lock(&pause_mutex);
+        while (atomic_load(&dispatch_closed)) {
+            pthread_cond_wait(&pause_cond, &pause_mutex);
+        }
+        pthread_mutex_unlock(&pause_mutex);
+    }
+}
+
+static void leave_dispatch(void) {
+    atomic_fetch_sub_explicit(&dispatching, 1, memory_order_release);
+}
+
+int shards_run(ShardTask task, void *context, const KvsString *keys, size_t count) {
+    enter_dispatch();
+
+    // Without a row of its own the thread takes turns on the shared one
+    if (my_rings == NULL) {
+        register_producer();
+    }
+    int shared = my_rings == NULL;
+    Ring *row = shared ? rings[0] : my_rings;
+    if (shared) {
+        pthread_mutex_lock(&shared_row_mutex);
+    }
+
+    // Counting sort of the key positions by owning shard
+    size_t *owners = malloc(count * sizeof(size_t));
+    size_t *indices = malloc(count * sizeof(size_t));
+    size_t *starts = calloc(shard_total + 1, sizeof(size_t));
+    size_t *cursors = malloc(shard_total * sizeof(size_t));
+    if (!owners || !indices || !starts || !cursors) {
+        free(owners);
+        free(indices);
+        free(starts);
+        free(cursors);
+        if (shared) pthread_mutex_unlock(&shared_row_mutex);
+        leave_dispatch();
+        return 1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        owners[i] = shard_of(&keys[i]);
+        starts[owners[i] + 1]++;
+    }
+    for (size_t s = 0; s < shard_total; s++) {
+        starts[s + 1] += starts[s];
+        cursors[s] = starts[s];
+    }
+    for (size_t i = 0; i < count; i++) {
+        indices[cursors[owners[i]]++] = i;
+    }
+
+    atomic_size_t pending;
+    size_t busy = 0;
+    for (size_t s = 0; s < shard_total; s++) {
+        busy += starts[s + 1] > starts[s];
+    }
+    atomic_init(&pending, busy);
+
+    for (size_t s = 0; s < shard_total; s++) {
+        if (starts[s + 1] == starts[s]) continue;
+        ShardMessage message = {task, context, indices + starts[s], starts[s + 1] - starts[s], &pending};
+        ring_push(&row[s], &message);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load(&shards[s].sleeping)) {
+            wake(&shards[s]);
+        }
+    }
+
+    // Gather: each shard wrote its results before decrementing pending
+    while (atomic_load_explicit(&pending, memory_order_acquire) > 0) {
+        sched_yield();
+    }
+    if (shared) pthread_mutex_unlock(&shared_row_mutex);
+    leave_dispatch();
+
+    free(owners);
+    free(indices);
+    free(starts);
+    free(cursors);
+    return 0;
+}
+
+HashTable **shards_pause(size_t *count) {
+    pthread_mutex_lock(&pause_owner);
+
+    // Batches already dispatched run to the end on every shard they span
+    atomic_store(&dispatch_closed, 1);
+    while (atomic_load_explicit(&dispatching, memory_order_acquire) > 0) {
+        sched_yield();
+    }
+
+    atomic_store(&pause_requested, 1);
+    for (size_t i = 0; i < shard_total; i++) {
+        wake(&shards[i]);
+    }
+
+    pthread_mutex_lock(&pause_mutex);
+    while (paused < shard_total) {
+        pthread_cond_wait(&pause_cond, &pause_mutex);
+    }
+    pthread_mutex_unlock(&pause_mutex);
+
+    *count = shard_total;
+    return tables;
+}
+
+void shards_resume(void) {
+    pthread_mutex_lock(&pause_mutex);
+    atomic_store(&pause_requested, 0);
+    atomic_store(&dispatch_closed, 0);
+    pthread_cond_broadcast(&pause_cond);
+    pthread_mutex_unlock(&pause_mutex);
+
+    pthread_mutex_unlock(&pause_owner);
+}
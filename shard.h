@@ -0,0 +1,52 @@
+#ifndef KVS_SHARD_H
+#define KVS_SHARD_H
+
+#include <stddef.h>
+#include "kvs.h"
+
+/// Work run by a shard thread on its own table for one key of a batch.
+/// @param table Table owned by the shard.
+/// @param context Batch the key belongs to.
+/// @param index Position of the key in the batch.
+typedef void (*ShardTask)(HashTable *table, void *context, size_t index);
+
+/// Starts the shard threads, each owning a private table. Keys are
+/// hash-partitioned across them and only the owner ever touches a table.
+/// @param shards Number of shards.
+/// @param pin Whether to pin shard i to CPU i (modulo the CPU count).
+/// @param pages Pages backing the tables.
+/// @param numa NUMA placement of the tables. Partitioned, shard i keeps its
+///             table on the i-th node (modulo the node count) and runs on
+///             its CPUs, whatever pin says, when there are several nodes.
+/// @return 0 on success, 1 otherwise.
+int shards_start(size_t shards, int pin, PageMode pages, NumaMode numa);
+
+/// Stops the shard threads and frees their tables.
+void shards_stop(void);
+
+/// Number of running shards, 0 when sharding is off.
+size_t shards_count(void);
+
+/// Runs task(table, context, i) for every key i of a batch on the shard that
+/// owns keys[i], sending each shard its sub-batch over the SPSC ring of the
+/// calling thread, and waits until every shard is done. A thread's rings are
+/// freed for another when it exits; past SHARD_MAX_PRODUCERS threads the
+/// newcomers take turns on a shared row.
+/// @param task Work to run for each key.
+/// @param context Passed to the task.
+/// @param keys Keys of the batch.
+/// @param count Number of keys.
+/// @return 0 on success, 1 otherwise.
+int shards_run(ShardTask task, void *context, const KvsString *keys, size_t count);
+
+/// Parks every shard thread so their tables can be read consistently (SHOW,
+/// BACKUP, metrics), once the batches already dispatched completed on every
+/// shard. New batches wait for shards_resume, which must follow.
+/// @param count Set to the number of tables.
+/// @return Tables of the shards, in shard order.
+HashTable **shards_pause(size_t *count);
+
+/// Lets the shard threads run again after shards_pause.
+void shards_resume(void);
+
+#endif  // KVS_SHARD_H
@@ -1,11 +1,14 @@
 #!/bin/bash
 
-# Get binary path from command line arguments
+# Get binary path from command line arguments, the rest are kvs options
 if [ -z "$1" ]; then
-    echo "Usage: $0 <executable>"
+    echo "Usage: $0 <executable> [kvs options...]"
     exit
 fi
 kvs_binary=$1
+shift
+kvs_options="$*"
+failed=0
 
 test_dir="tests-public/jobs"
 results_dir="tests-public/results"
@@ -18,8 +21,12 @@ run_test() {
     temp_dir=$(mktemp -d)
 
     cp "$file" "$temp_dir"
+    # data a job loads lies next to it
+    if [ -f "${file%.job}.load" ]; then
+        cp "${file%.job}.load" "$temp_dir"
+    fi
 
-    local cmd="$kvs_binary $temp_dir 1 1" #single threaded
+    local cmd="$kvs_binary $temp_dir 1 1 $kvs_options" #single threaded
 
     eval "./$cmd" &> /dev/null
 
@@ -36,9 +43,11 @@ run_test() {
         else
             echo -e "\e[31mFiles $test_dir/$filename.out and $result_file differ\e[0m"
             echo -e "\e[31mTest failed for $filename\e[0m"
+            failed=1
         fi
     else
         echo -e "\e[31mOutput file $output_file not found\e[0m"
+        failed=1
     fi
 
     cp "$temp_dir"/"$filename".out "$test_dir"/"$filename".out
@@ -46,7 +55,7 @@ run_test() {
 }
 
 export -f run_test
-export test_dir results_dir ems_binary ems_args
+export test_dir results_dir kvs_binary kvs_options
 
 # Loop through each .job file in the tests directory and run tests in parallel
 for file in "$test_dir"/*.job; do
@@ -55,3 +64,4 @@ done
 
 # Wait for all background processes to complete
 wait
+exit $failed
@@ -1,17 +1,20 @@
-# Executable path
+# Executable path, the rest are kvs options
 if [ -z "$1" ]; then
-    echo "Usage: $0 <executable>"
+    echo "Usage: $0 <executable> [kvs options...]"
     exit 1
 fi
 executable=$1
+shift
+kvs_options=("$@")
+failed=0
 
 test_dir="tests-public/jobs2"
 results_dir="tests-public/results2"
 
 # Run executable and check results
 for job_folder in "$test_dir"/*/; do
-    echo -e "\e[34mRunning executable: $executable $job_folder 1 2 \e[0m"
-    if ! ./"$executable" "$job_folder" 1 2; then
+    echo -e "\e[34mRunning executable: $executable $job_folder 1 2 ${kvs_options[*]}\e[0m"
+    if ! ./"$executable" "$job_folder" 1 2 "${kvs_options[@]}"; then
         echo -e "\e[31mExecutable failed\e[0m"
         exit 1
     fi
@@ -29,6 +32,7 @@ for job_folder in "$test_dir"/*/; do
                 echo -e "\e[32mTest passed for $filename in $job_folder\e[0m"
             else
                 echo -e "\e[31mTest failed for $filename in $job_folder\e[0m"
+                failed=1
             fi
         else
             echo -e "\e[33mResult file not found for $filename in $job_folder\e[0m"
@@ -47,9 +51,11 @@ for job_folder in "$test_dir"/*/; do
                 echo -e "\e[32mTest passed for $filename in $job_folder\e[0m"
             else
                 echo -e "\e[31mTest failed for $filename in $job_folder\e[0m"
+                failed=1
             fi
         else
             echo -e "\e[33mResult file not found for $filename in $job_folder\e[0m"
         fi
     done
 done
+exit $failed
@@ -0,0 +1,52 @@
+#!/bin/bash
+
+# Restarts a KVS kept with --persist, once after a clean exit and once after
+# it was killed, and checks what each run reads back
+
+if [ -z "$1" ]; then
+    echo "Usage: $0 <executable>"
+    exit
+fi
+kvs_binary=$1
+failed=0
+
+temp_dir=$(mktemp -d)
+table="$temp_dir/table"
+
+# Runs one job against the table, in the background if asked to
+run_job() {
+    local job=$1
+    rm -f "$temp_dir"/*.job "$temp_dir"/*.out
+    printf '%b' "$job" > "$temp_dir/run.job"
+    "./$kvs_binary" "$temp_dir" 1 1 --persist "$table" &> /dev/null
+}
+
+# Compares the output of the last job with what it should have read
+check() {
+    local name=$1 expected=$2
+    if [ "$(cat "$temp_dir/run.out" 2>/dev/null)" == "$expected" ]; then
+        echo -e "\e[32mTest passed for $name\e[0m"
+    else
+        echo -e "\e[31mTest failed for $name\e[0m"
+        failed=1
+    fi
+}
+
+run_job "WRITE [(a,1)(b,2)(ccc,3)]\n"
+
+# Killed mid-job: its changes are lost, those of the first run are not
+rm -f "$temp_dir"/*.job
+printf 'WRITE [(a,9)(d,4)]\nWAIT 10000\n' > "$temp_dir/run.job"
+"./$kvs_binary" "$temp_dir" 1 1 --persist "$table" &> /dev/null &
+sleep 1
+kill -9 $! 2> /dev/null
+wait $! 2> /dev/null
+
+run_job "READ [a,b,ccc,d]\nWRITE [(e,5)]\n"
+check "restart after a crash" "[(a,1)(b,2)(ccc,3)(d,KVSERROR)]"
+
+run_job "READ [a,e]\n"
+check "restart after a clean exit" "[(a,1)(e,5)]"
+
+rm -rf "$temp_dir"
+exit $failed
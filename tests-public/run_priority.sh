@@ -0,0 +1,61 @@
+#!/bin/bash
+
+# Runs jobs of every priority class on one job thread and checks, through
+# what each read of the jobs before it, the order the queue gave them
+
+if [ -z "$1" ]; then
+    echo "Usage: $0 <executable>"
+    exit
+fi
+kvs_binary=$1
+failed=0
+
+# Compares the output of a job with what it should have read
+check() {
+    local name=$1 output=$2 expected=$3
+    if [ "$(cat "$output" 2>/dev/null)" == "$expected" ]; then
+        echo -e "\e[32mTest passed for $name\e[0m"
+    else
+        echo -e "\e[31mTest failed for $name\e[0m"
+        failed=1
+    fi
+}
+
+# Classes from a name tag and a header: interactive, then normal, then bulk,
+# whatever the order of the names
+temp_dir=$(mktemp -d)
+printf 'READ [last]\nWRITE [(last,a)]\n' > "$temp_dir/a.bulk.job"
+printf '# priority interactive\nREAD [last]\nWRITE [(last,b)]\n' > "$temp_dir/b.job"
+printf 'READ [last]\nWRITE [(last,c)]\n' > "$temp_dir/c.job"
+"./$kvs_binary" "$temp_dir" 1 1 &> /dev/null
+check "priority header" "$temp_dir/b.out" "[(last,KVSERROR)]"
+check "normal job" "$temp_dir/c.out" "[(last,b)]"
+check "bulk name tag" "$temp_dir/a.bulk.out" "[(last,c)]"
+rm -rf "$temp_dir"
+
+# Aging: of two big bulk jobs, the one left behind by the share of its
+# class still runs once it waited JOBQ_AGING_MS at the head of the class,
+# not after every interactive job
+temp_dir=$(mktemp -d)
+for name in a b; do
+    {
+        for _ in $(seq 64); do
+            echo "# a big job uses up the share of its class for a long time"
+        done
+        echo "SHOW"
+    } > "$temp_dir/$name.bulk.job"
+done
+for i in $(seq -w 20); do
+    printf '# priority interactive\nWRITE [(i%s,1)]\nWAIT 100\n' "$i" > "$temp_dir/i$i.job"
+done
+"./$kvs_binary" "$temp_dir" 1 1 &> /dev/null
+shown=$(cat "$temp_dir"/a.bulk.out "$temp_dir"/b.bulk.out 2>/dev/null | wc -l)
+if [ -f "$temp_dir/a.bulk.out" ] && [ -f "$temp_dir/b.bulk.out" ] && [ "$shown" -lt 15 ]; then
+    echo -e "\e[32mTest passed for aging\e[0m"
+else
+    echo -e "\e[31mTest failed for aging\e[0m"
+    failed=1
+fi
+rm -rf "$temp_dir"
+
+exit $failed
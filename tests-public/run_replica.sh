@@ -0,0 +1,60 @@
+#!/bin/bash
+
+# Runs a primary and its replicas on this machine: a replica reads what the
+# primary wrote, and a replica that stops reading does not hold the primary
+
+if [ -z "$1" ]; then
+    echo "Usage: $0 <executable>"
+    exit
+fi
+kvs_binary=$1
+failed=0
+
+# Compares the output of a job with what it should have read
+check() {
+    local name=$1 output=$2 expected=$3
+    if [ "$(cat "$output" 2>/dev/null)" == "$expected" ]; then
+        echo -e "\e[32mTest passed for $name\e[0m"
+    else
+        echo -e "\e[31mTest failed for $name\e[0m"
+        failed=1
+    fi
+}
+
+temp_dir=$(mktemp -d)
+mkdir "$temp_dir/primary" "$temp_dir/replica"
+socket="$temp_dir/socket"
+
+printf 'WRITE [(a,1)(b,2)(c,3)]\nDELETE [c]\n' > "$temp_dir/primary/write.job"
+printf 'WAIT 500\nREAD [a,b,c]\n' > "$temp_dir/replica/read.job"
+"./$kvs_binary" "$temp_dir/primary" 1 1 --replicate "$socket" &> /dev/null &
+primary=$!
+"./$kvs_binary" "$temp_dir/replica" 1 1 --replica-of "$socket" &> /dev/null
+wait $primary
+check "replica reads" "$temp_dir/replica/read.out" $'waited for 500 ms\n[(a,1)(b,2)(c,KVSERROR)]'
+
+# A replica stopped before the primary writes more than its socket buffers
+rm -f "$temp_dir"/primary/* "$temp_dir"/replica/*
+value=$(printf 'v%.0s' $(seq 200))
+for i in $(seq 4000); do
+    echo "WRITE [(k$i,$value)]"
+done > "$temp_dir/primary/write.job"
+echo "READ [k4000]" >> "$temp_dir/primary/write.job"
+printf 'WAIT 100000\n' > "$temp_dir/replica/wait.job"
+"./$kvs_binary" "$temp_dir/replica" 1 1 --replica-of "$socket" &> /dev/null &
+replica=$!
+# the replica only connects once the primary listens, then it stops reading
+(sleep 0.5; kill -STOP $replica) &
+timeout 20 "./$kvs_binary" "$temp_dir/primary" 1 1 --replicate "$socket" &> /dev/null
+status=$?
+kill -9 $replica 2> /dev/null
+wait $replica 2> /dev/null
+if [ $status -eq 0 ] && [ "$(cat "$temp_dir/primary/write.out" 2>/dev/null)" == "[(k4000,$value)]" ]; then
+    echo -e "\e[32mTest passed for stalled replica\e[0m"
+else
+    echo -e "\e[31mTest failed for stalled replica\e[0m"
+    failed=1
+fi
+
+rm -rf "$temp_dir"
+exit $failed
@@ -0,0 +1,226 @@
+#include "trace.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "constants.h"
+#include "logger.h"
+
+// Records of one thread, written to the file when they pass TRACE_FLUSH_SIZE
+typedef struct ThreadTrace {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+    uint32_t id;
+    int failed;
+    struct ThreadTrace *next;
+} ThreadTrace;
+
+static atomic_int tracing;
+static atomic_uint_fast64_t next_sequence;
+static uint64_t trace_start_ns = 0;
+static int trace_fd = -1;
+static atomic_int trace_failed;
+static uint32_t thread_total = 0;
+static ThreadTrace *threads = NULL;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local ThreadTrace *my_trace = NULL;
+
+static const char *op_names[TRACE_OPS] = {"write", "read", "delete", "cas", "incr", "expire", "show", "backup"};
+
+const char *trace_op_name(TraceOp op) {
+    return op < TRACE_OPS ? op_names[op] : "?";
+}
+
+uint64_t trace_clock_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+// Writes all the bytes to the trace file, the caller holds trace_mutex.
+static int write_locked(const unsigned char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(trace_fd, data, length);
+        if (written <= 0) return 1;
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+int trace_open(const char *path) {
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_fd == -1) {
+        log_error("Failed to open trace file: %m\n");
+        return 1;
+    }
+
+    unsigned char header[TRACE_HEADER_SIZE];
+    memcpy(header, TRACE_MAGIC, 4);
+    for (int i = 0; i < 4; i++) {
+        header[4 + i] = (unsigned char)(TRACE_VERSION >> (8 * i));
+    }
+    if (write_locked(header, sizeof(header)) != 0) {
+        log_error("Failed to write trace file: %m\n");
+        close(trace_fd);
+        trace_fd = -1;
+        return 1;
+    }
+
+    trace_start_ns = trace_clock_ns();
+    atomic_store(&next_sequence, 0);
+    atomic_store(&tracing, 1);
+    return 0;
+}
+
+int trace_close(void) {
+    if (trace_fd == -1) return 0;
+    atomic_store(&tracing, 0);
+
+    pthread_mutex_lock(&trace_mutex);
+    int failed = atomic_load(&trace_failed);
+    while (threads != NULL) {
+        ThreadTrace *thread = threads;
+        threads = thread->next;
+        failed |= thread->failed || write_locked(thread->data, thread->len);
+        free(thread->data);
+        free(thread);
+    }
+    if (close(trace_fd) != 0) failed = 1;
+    trace_fd = -1;
+    pthread_mutex_unlock(&trace_mutex);
+
+    if (failed) {
+        log_error("Failed to write trace file\n");
+    }
+    return failed;
+}
+
+TraceTicket trace_begin(void) {
+    TraceTicket ticket = {0, 0, 0, 0};
+    if (atomic_load_explicit(&tracing, memory_order_relaxed)) {
+        ticket.start_ns = trace_clock_ns();
+        ticket.active = 1;
+    }
+    return ticket;
+}
+
+void trace_commit(TraceTicket *ticket) {
+    if (ticket->active && !ticket->committed) {
+        ticket->sequence = atomic_fetch_add_explicit(&next_sequence, 1, memory_order_relaxed);
+        ticket->committed = 1;
+    }
+}
+
+static void put_bytes(ThreadTrace *thread, const void *data, size_t length) {
+    if (thread->len + length > thread->cap) {
+        size_t cap = thread->cap ? thread->cap : TRACE_FLUSH_SIZE * 2;
+        while (thread->len + length > cap) {
+            cap *= 2;
+        }
+        unsigned char *grown = realloc(thread->data, cap);
+        if (!grown) {
+            thread->failed = 1;
+            return;
+        }
+        thread->data = grown;
+        thread->cap = cap;
+    }
+    memcpy(thread->data + thread->len, data, length);
+    thread->len += length;
+}
+
+static void put_u32(ThreadTrace *thread, uint32_t value) {
+    unsigned char bytes[4];
+    for (int i = 0; i < 4; i++) {
+        bytes[i] = (unsigned char)(value >> (8 * i));
+    }
+    put_bytes(thread, bytes, sizeof(bytes));
+}
+
+static void put_u64(ThreadTrace *thread, uint64_t value) {
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = (unsigned char)(value >> (8 * i));
+    }
+    put_bytes(thread, bytes, sizeof(bytes));
+}
+
+static void put_string(ThreadTrace *thread, const KvsString *string) {
+    put_u32(thread, (uint32_t)string->len);
+    put_bytes(thread, string->data, string->len);
+    put_bytes(thread, "", 1);
+}
+
+// Buffer of the calling thread, registered on its first record.
+static ThreadTrace *thread_trace(void) {
+    if (my_trace != NULL) return my_trace;
+
+    ThreadTrace *thread = calloc(1, sizeof(ThreadTrace));
+    if (!thread) return NULL;
+    pthread_mutex_lock(&trace_mutex);
+    thread->id = thread_total++;
+    thread->next = threads;
+    threads = thread;
+    pthread_mutex_unlock(&trace_mutex);
+
+    my_trace = thread;
+    return thread;
+}
+
+void trace_end(const TraceTicket *ticket, TraceOp op, size_t count, const KvsString keys[],
+               const KvsString values[], const unsigned long numbers[]) {
+    if (!ticket->active) return;
+    uint64_t end_ns = trace_clock_ns();
+
+    ThreadTrace *thread = thread_trace();
+    if (thread == NULL) {
+        atomic_store(&trace_failed, 1);
+        return;
+    }
+
+    unsigned char kind = (unsigned char)op;
+    put_bytes(thread, &kind, 1);
+    put_u32(thread, thread->id);
+    put_u64(thread, ticket->sequence);
+    put_u64(thread, ticket->start_ns - trace_start_ns);
+    put_u64(thread, end_ns - ticket->start_ns);
+    put_u32(thread, (uint32_t)count);
+    for (size_t i = 0; i < count; i++) {
+        put_string(thread, &keys[i]);
+        switch (op) {
+            case TRACE_WRITE:
+                put_string(thread, &values[i]);
+                put_u64(thread, numbers != NULL ? numbers[i] : 0);
+                break;
+            case TRACE_CAS:
+                put_u64(thread, numbers[i]);
+                put_string(thread, &values[i]);
+                break;
+            case TRACE_INCR:
+            case TRACE_EXPIRE:
+                put_u64(thread, numbers[i]);
+                break;
+            case TRACE_READ:
+            case TRACE_DELETE:
+            case TRACE_SHOW:
+            case TRACE_BACKUP:
+            case TRACE_OPS:
+                break;
+        }
+    }
+
+    if (thread->len >= TRACE_FLUSH_SIZE) {
+        pthread_mutex_lock(&trace_mutex);
+        if (trace_fd != -1 && write_locked(thread->data, thread->len) != 0) {
+            thread->failed = 1;
+        }
+        pthread_mutex_unlock(&trace_mutex);
+        thread->len = 0;
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef KVS_TRACE_H
+#define KVS_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kvs.h"
+
+// Trace of the operations that reached the KVS, replayed by kvs-replay:
+//
+//   header  "KVST" | u32 version
+//   record  u8 op | u32 thread | u64 sequence | u64 start ns | u64 duration ns |
+//           u32 count | arguments
+//
+// Sequence numbers order the operations by the time they committed across
+// all threads, taken while they hold the tables they run on (see
+// trace_commit); start times are relative to trace_open. Arguments follow the
+// operation: WRITE key, value, u64 TTL; READ/DELETE key; CAS key, u64
+// version, value; INCR key, i64 delta; EXPIRE key, u64 TTL. Strings are a
+// u32 length, the bytes and a NUL. All integers are little endian and records
+// of different threads may be stored out of sequence order.
+#define TRACE_MAGIC "KVST"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 8
+#define TRACE_RECORD_HEADER_SIZE 33
+
+typedef enum {
+    TRACE_WRITE,
+    TRACE_READ,
+    TRACE_DELETE,
+    TRACE_CAS,
+    TRACE_INCR,
+    TRACE_EXPIRE,
+    TRACE_SHOW,
+    TRACE_BACKUP,
+    TRACE_OPS,
+} TraceOp;
+
+/// Start of a traced operation.
+typedef struct TraceTicket {
+    uint64_t sequence;
+    uint64_t start_ns;
+    int active;            // 0 when tracing is off
+    int committed;         // sequence taken
+} TraceTicket;
+
+/// Starts recording every KVS operation into a trace file.
+/// @param path Path of the trace file, truncated.
+/// @return 0 on success, 1 otherwise.
+int trace_open(const char *path);
+
+/// Writes the records of every thread and closes the trace. The threads that
+/// recorded must have stopped.
+/// @return 0 on success, 1 otherwise.
+int trace_close(void);
+
+/// Marks the start of an operation.
+/// @return The ticket to pass to trace_commit and trace_end.
+TraceTicket trace_begin(void);
+
+/// Gives an operation its sequence number. Called while the operation holds
+/// the tables it runs on, under the lock of the shared table or on the shard
+/// applying its first key, so that conflicting operations are numbered in
+/// the order they took effect. Only the first call for a ticket counts and
+/// calls for one ticket must not race.
+/// @param ticket Ticket returned by trace_begin.
+void trace_commit(TraceTicket *ticket);
+
+/// Records an operation started with trace_begin.
+/// @param ticket Ticket returned by trace_begin.
+/// @param op Operation.
+/// @param count Number of keys.
+/// @param keys Keys of the operation.
+/// @param values Values of WRITE and CAS, NULL otherwise.
+/// @param numbers TTLs, versions or deltas (as unsigned) of the keys, may be NULL.
+void trace_end(const TraceTicket *ticket, TraceOp op, size_t count, const KvsString keys[],
+               const KvsString values[], const unsigned long numbers[]);
+
+/// Name of an operation, for reports.
+const char *trace_op_name(TraceOp op);
+
+/// Current time of the monotonic clock in nanoseconds.
+uint64_t trace_clock_ns(void);
+
+#endif  // KVS_TRACE_H
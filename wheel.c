@@ -0,0 +1,154 @@
+#include "wheel.h"
+
+#include <time.h>
+
+unsigned long long wheel_clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000ULL + (unsigned long long)ts.tv_nsec / 1000000ULL;
+}
+
+static void list_init(TimerEntry *head) {
+    head->prev = head;
+    head->next = head;
+}
+
+static void list_push(TimerEntry *head, TimerEntry *entry) {
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+static void list_remove(TimerEntry *entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+// Moves every entry of src to the end of dst.
+static void list_splice(TimerEntry *dst, TimerEntry *src) {
+    if (src->next == src) return;
+    src->next->prev = dst->prev;
+    dst->prev->next = src->next;
+    src->prev->next = dst;
+    dst->prev = src->prev;
+    list_init(src);
+}
+
+void wheel_init(TimerWheel *wheel, unsigned long long now) {
+    wheel->now = now;
+    wheel->count = 0;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+    list_init(&wheel->pending);
+}
+
+// Files an entry in the level whose span covers its distance from base,
+// the first tick that has not been processed yet.
+static void place(TimerWheel *wheel, TimerEntry *entry, unsigned long long base) {
+    unsigned long long deadline = entry->expires_at;
+    if (deadline < base) {
+        deadline = base;
+    }
+
+    unsigned long long span = 1ULL << (WHEEL_SLOT_BITS * WHEEL_LEVELS);
+    if (deadline - base >= span) {
+        deadline = base + span - 1; // re-filed once the last level cascades
+    }
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+           deadline - base >= 1ULL << (WHEEL_SLOT_BITS * (level + 1))) {
+        level++;
+    }
+
+    size_t slot = (size_t)(deadline >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOTS - 1);
+    list_push(&wheel->slots[level][slot], entry);
+}
+
+void wheel_schedule(TimerWheel *wheel, TimerEntry *entry) {
+    place(wheel, entry, wheel->now + 1);
+    wheel->count++;
+}
+
+void wheel_cancel(TimerWheel *wheel, TimerEntry *entry) {
+    if (entry->next == NULL) return;
+    list_remove(entry);
+    wheel->count--;
+}
+
+static unsigned long long shifted(unsigned long long deadline, long long shift) {
+    if (shift < 0 && deadline < (unsigned long long)-shift) return 0;
+    return deadline + (unsigned long long)shift;
+}
+
+void wheel_rebase(TimerWheel *wheel, long long shift, unsigned long long now) {
+    TimerEntry moved;
+    list_init(&moved);
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            list_splice(&moved, &wheel->slots[level][slot]);
+        }
+    }
+    for (TimerEntry *entry = wheel->pending.next; entry != &wheel->pending; entry = entry->next) {
+        entry->expires_at = shifted(entry->expires_at, shift);
+    }
+
+    wheel->now = now;
+    while (moved.next != &moved) {
+        TimerEntry *entry = moved.next;
+        list_remove(entry);
+        entry->expires_at = shifted(entry->expires_at, shift);
+        place(wheel, entry, now + 1);
+    }
+}
+
+// Processes one tick: cascades the upper levels, then expires level 0.
+static void tick(TimerWheel *wheel) {
+    unsigned long long t = wheel->now + 1;
+
+    for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+        unsigned long long mask = (1ULL << (WHEEL_SLOT_BITS * level)) - 1;
+        if ((t & mask) != 0) continue;
+
+        size_t slot = (size_t)(t >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOTS - 1);
+        TimerEntry moved;
+        list_init(&moved);
+        list_splice(&moved, &wheel->slots[level][slot]);
+
+        while (moved.next != &moved) {
+            TimerEntry *entry = moved.next;
+            list_remove(entry);
+            place(wheel, entry, t);
+        }
+    }
+
+    list_splice(&wheel->pending, &wheel->slots[0][t & (WHEEL_SLOTS - 1)]);
+    wheel->now = t;
+}
+
+size_t wheel_expire(TimerWheel *wheel, unsigned long long now, TimerEntry **expired, size_t max) {
+    size_t found = 0;
+    while (found < max) {
+        if (wheel->pending.next != &wheel->pending) {
+            TimerEntry *entry = wheel->pending.next;
+            list_remove(entry);
+            wheel->count--;
+            expired[found++] = entry;
+            continue;
+        }
+
+        if (wheel->now >= now) break;
+        if (wheel->count == 0) {
+            wheel->now = now; // nothing to cascade, skip the idle ticks
+            break;
+        }
+        tick(wheel);
+    }
+    return found;
+}
@@ -0,0 +1,59 @@
+#ifndef KVS_WHEEL_H
+#define KVS_WHEEL_H
+
+#include <stddef.h>
+
+// 4 levels of 64 slots with 1 ms ticks cover deadlines up to ~4.6 hours away;
+// later deadlines are parked in the last level and re-filed when it cascades.
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+
+typedef struct TimerEntry {
+    struct TimerEntry *prev;
+    struct TimerEntry *next;
+    unsigned long long expires_at; // ms on the monotonic clock
+    void *owner;                   // object the timer belongs to
+} TimerEntry;
+
+typedef struct TimerWheel {
+    unsigned long long now;        // last tick that was processed
+    size_t count;                  // scheduled entries, pending ones included
+    TimerEntry slots[WHEEL_LEVELS][WHEEL_SLOTS]; // list heads
+    TimerEntry pending;            // expired entries not handed out yet
+} TimerWheel;
+
+/// Current time of the monotonic clock in milliseconds.
+unsigned long long wheel_clock_ms(void);
+
+/// Initializes an empty wheel.
+/// @param wheel Wheel to be initialized.
+/// @param now Current time in milliseconds.
+void wheel_init(TimerWheel *wheel, unsigned long long now);
+
+/// Schedules an unlinked entry. Deadlines in the past expire on the next tick.
+/// @param wheel Wheel to schedule in.
+/// @param entry Entry to be scheduled, its expires_at must be set.
+void wheel_schedule(TimerWheel *wheel, TimerEntry *entry);
+
+/// Removes a scheduled or pending entry from the wheel.
+/// @param wheel Wheel the entry belongs to.
+/// @param entry Entry to be removed.
+void wheel_cancel(TimerWheel *wheel, TimerEntry *entry);
+
+/// Moves every deadline by the same amount and restarts the wheel at now,
+/// for a wheel whose clock was replaced by another one.
+/// @param wheel Wheel to rebase.
+/// @param shift Milliseconds to add to the deadlines, may be negative.
+/// @param now Current time of the new clock in milliseconds.
+void wheel_rebase(TimerWheel *wheel, long long shift, unsigned long long now);
+
+/// Advances the wheel up to now and hands out expired entries.
+/// @param wheel Wheel to advance.
+/// @param now Current time in milliseconds.
+/// @param expired Array to store up to max expired (now unlinked) entries in.
+/// @param max Size of the expired array.
+/// @return Number of entries stored in expired.
+size_t wheel_expire(TimerWheel *wheel, unsigned long long now, TimerEntry **expired, size_t max);
+
+#endif  // KVS_WHEEL_H